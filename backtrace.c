@@ -2,44 +2,294 @@
 
 #include "backtrace.h"
 
+#include "cfi.h"
 #include "log.h"
+#include "modmap.h"
+#include "probes.h"
+#include "symbolize.h"
+#include "unwind_cache.h"
 
-#include <dlfcn.h>
+#include <link.h>
+#include <stddef.h>
 #include <stdlib.h>
-#include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
-#include <link.h>   // required for __ELF_NATIVE_CLASS
+#include <pthread.h>
 
-#if __ELF_NATIVE_CLASS == 32
-# define WORD_WIDTH 8
-#else
-// We assume 64bits.
-# define WORD_WIDTH 16
+#if defined(__x86_64__) || defined(__aarch64__)
+# define HAVE_FP_UNWIND 1
+#endif
+
+// uClibc pretends to be glibc, but doesn't necessarily ship backtrace()
+#if defined(__GLIBC__) && !defined(__UCLIBC__)
+# define HAVE_EXECINFO 1
+# include <execinfo.h>
 #endif
 
 #define ABS(s) ((s) < 0 ? -(s) : (s))
 
+// DWARF number of $sp, what MIPS32 frames are cached relative to
+#define MIPS32_REG_SP 29
+
+// how far to scan backward from $ra before giving up, in instructions
+#define MIPS32_MAX_SCAN 65536
+
+// Initial estimate of a backtrace_symbols() line
+#define SYMBOLS_LINE 128
+
+/*
+    Registers of the frame of the function this is expanded in, so that
+    cfi_unwind() starts with the caller of that function.
+*/
+#if defined(__x86_64__)
+# define CURRENT_REGS(regs) __asm__ __volatile__ ( \
+        "lea 0(%%rip), %0\n" \
+        "mov %%rsp, %1\n" \
+        "mov %%rbp, %2\n" \
+        : "=r"((regs).pc), "=r"((regs).sp), "=r"((regs).fp)); \
+    (regs).lr = 0
+#elif defined(__aarch64__)
+# define CURRENT_REGS(regs) __asm__ __volatile__ ( \
+        "adr %0, .\n" \
+        "mov %1, sp\n" \
+        "mov %2, x29\n" \
+        "mov %3, x30\n" \
+        : "=r"((regs).pc), "=r"((regs).sp), "=r"((regs).fp), "=r"((regs).lr))
+#endif
+
+struct stack_range {
+    uintptr_t lo;
+    uintptr_t hi;
+};
+
+// Output of backtrace_format_r(), 'pos' counts what didn't fit too
+struct cursor {
+    char *buf;
+    size_t len;
+    size_t pos;
+};
+
+static int unwinder = BACKTRACE_UNWINDER_AUTO;
+
+#if defined(__mips__)
+// Counter of unloaded modules when backtrace_mips32() last checked it. Rows
+// it caches are keyed by return address, and an unloaded module's addresses
+// may be reused by another one.
+static unsigned long long mips32_subs;
+#endif
+
+#ifdef HAVE_FP_UNWIND
+static int stack_bounds(uintptr_t *lo, uintptr_t *hi);
+static int unwind_fp(uintptr_t fp, uintptr_t lo, uintptr_t hi, void **buffer,
+  int size);
+static int read_stack(void *arg, uintptr_t addr, uintptr_t *value);
+#endif
+
+#if defined(__mips__)
+static void mips32_check_modules();
+static int read_subs(struct dl_phdr_info *info, size_t size, void *arg);
+#endif
+
+static int drop_frames(void **buffer, int nptrs, int count);
+static void put_char(struct cursor *cursor, char c);
+static void put_str(struct cursor *cursor, const char *s);
+static void put_dec(struct cursor *cursor, unsigned long value, int width);
+static void put_hex(struct cursor *cursor, uintptr_t value);
+
+// public
+
 void print_stack_trace(int log_level) {
     void *buffer[64];
-    int nptrs = backtrace_mips32(buffer, 64);
+    int nptrs = backtrace_capture(buffer, 64);
     LOG(log_level, "Stack trace: %d frames (most recent call first)", nptrs);
 
-    char **strings = backtrace_symbols(buffer, nptrs);
+    print_stack_frames(log_level, buffer, nptrs);
+}
+
+void print_stack_frames(int log_level, void *const *buffer, int size) {
+    char line[256];
+    struct dwarfline_frame frames[8];
+    for (int i = 0; i < size; ++i) {
+        symbolize_format(buffer[i], line, sizeof(line));
+        LOG(log_level, "\t#%02d %s", i, line);
+
+        int inlined = symbolize_inlined(buffer[i], frames, 8) - 1;
+        for (int j = 0; j < inlined; ++j) {
+            LOG(log_level, "\t    inlined %s at %s:%u",
+              frames[j].function ? frames[j].function : "??",
+              frames[j].file ? frames[j].file : "??", frames[j].line);
+        }
+    }
+}
+
+void print_stack_trace_raw(int log_level) {
+    void *buffer[64];
+    int nptrs = backtrace_capture(buffer, 64);
+
+    int map = modmap_log(log_level, 0);
+    LOG(log_level, "Raw stack trace: %d frames (module map %d)", nptrs, map);
+
+    for (int i = 0; i < nptrs; ++i) {
+        LOG(log_level, "\t#%02d %p", i, buffer[i]);
+    }
+}
+
+void backtrace_set_unwinder(backtrace_unwinder_t value) {
+    __atomic_store_n(&unwinder, value, __ATOMIC_RELAXED);
+}
+
+__attribute__((noinline))
+int backtrace_capture(void **buffer, int size) {
+    if (size <= 0 || !buffer) {
+        return 0;
+    }
+
+    int nptrs = 0;
+    int selected = __atomic_load_n(&unwinder, __ATOMIC_RELAXED);
+
+    if (selected == BACKTRACE_UNWINDER_AUTO) {
+#if defined(__mips__)
+        selected = BACKTRACE_UNWINDER_MIPS32;
+#elif defined(HAVE_FP_UNWIND)
+        selected = BACKTRACE_UNWINDER_CFI;
+#else
+        selected = BACKTRACE_UNWINDER_GLIBC;
+#endif
+    }
+
+    switch (selected) {
+#if defined(__mips__)
+    case BACKTRACE_UNWINDER_MIPS32:
+        nptrs = drop_frames(buffer, backtrace_mips32(buffer, size), 1);
+        break;
+#endif
+
+#ifdef HAVE_FP_UNWIND
+    case BACKTRACE_UNWINDER_FP: {
+        struct stack_range stack;
+        if (!stack_bounds(&stack.lo, &stack.hi)) {
+            nptrs = unwind_fp((uintptr_t) __builtin_frame_address(0),
+              stack.lo, stack.hi, buffer, size);
+        }
+        break;
+    }
+
+    case BACKTRACE_UNWINDER_CFI: {
+        struct stack_range stack;
+        if (!stack_bounds(&stack.lo, &stack.hi)) {
+            struct cfi_regs regs;
+            CURRENT_REGS(regs);
+            nptrs = cfi_unwind(&regs, read_stack, &stack, buffer, size);
+        }
+        break;
+    }
+#endif
+
+    default:
+        break;
+    }
+
+#ifdef HAVE_EXECINFO
+    if (!nptrs) {
+        nptrs = drop_frames(buffer, backtrace(buffer, size), 1);
+    }
+#endif
+
+    PROBE2(dm, backtrace_capture, buffer, nptrs);
+    return nptrs;
+}
+
+int backtrace_stop_resolve(const void *function, struct backtrace_stop *stop) {
+    if (symbolize_function(function, &stop->start, &stop->end)) {
+        stop->start = stop->end = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+__attribute__((noinline))
+int backtrace_capture_until(void **buffer, int size, int skip,
+  const struct backtrace_stop *stop) {
+    if (size <= 0 || !buffer) {
+        return 0;
+    }
+    if (skip < 0) {
+        skip = 0;
+    } else if (skip > BACKTRACE_MAX_SKIP) {
+        skip = BACKTRACE_MAX_SKIP;
+    }
+    if (size > BACKTRACE_MAX_DEPTH) {
+        size = BACKTRACE_MAX_DEPTH;
+    }
+
+    // frames[0] is in backtrace_capture_until() itself
+    void *frames[1 + BACKTRACE_MAX_SKIP + BACKTRACE_MAX_DEPTH];
+    int nptrs = drop_frames(frames, backtrace_capture(frames, 1 + skip + size),
+      1 + skip);
+    if (nptrs > size) {
+        nptrs = size;
+    }
+
     for (int i = 0; i < nptrs; ++i) {
-        if (!strings) {
-            LOG(log_level, "\t#%02d %p", i, buffer[i]);
-        } else {
-            LOG(log_level, "\t#%02d %s", i, strings[i]);
+        buffer[i] = frames[i];
+
+        // return address, the call is right before it
+        uintptr_t pc = (uintptr_t) frames[i] - 1;
+        if (stop && pc >= stop->start && pc < stop->end) {
+            return i + 1;
         }
     }
 
-    if (strings) {
-        free(strings);
+    return nptrs;
+}
+
+__attribute__((noinline))
+int backtrace_fp(void **buffer, int size) {
+    if (size <= 0 || !buffer) {
+        return 0;
+    }
+
+#ifdef HAVE_FP_UNWIND
+    uintptr_t lo, hi;
+    if (stack_bounds(&lo, &hi)) {
+        return 0;
     }
+
+    return unwind_fp((uintptr_t) __builtin_frame_address(0), lo, hi, buffer,
+      size);
+#else
+    return 0;
+#endif
+}
+
+__attribute__((noinline))
+int backtrace_cfi(void **buffer, int size) {
+    if (size <= 0 || !buffer) {
+        return 0;
+    }
+
+#ifdef HAVE_FP_UNWIND
+    struct stack_range stack;
+    if (stack_bounds(&stack.lo, &stack.hi)) {
+        return 0;
+    }
+
+    struct cfi_regs regs;
+    CURRENT_REGS(regs);
+    return cfi_unwind(&regs, read_stack, &stack, buffer, size);
+#else
+    return 0;
+#endif
 }
 
 int backtrace_mips32(void **buffer, int size) {
+#if !defined(__mips__)
+    (void) buffer;
+    (void) size;
+    return 0;
+#else
     if (size <= 0 || !buffer) {
         return 0;
     }
@@ -66,95 +316,349 @@ int backtrace_mips32(void **buffer, int size) {
 
     sp = (unsigned long *) ((unsigned long) sp + stack_size);
 
-    // repeat backward scanning
-    size_t ra_offset;
+    mips32_check_modules();
+
+    // repeat backward scanning, unless the call site was seen already
     int depth;
     for (depth = 0; depth < size && ra; ++depth) {
         buffer[depth] = ra;
 
-        ra_offset = 0;
-        stack_size = 0;
-
-        for (addr = ra; !ra_offset || !stack_size; --addr) {
-            switch (*addr & 0xffff0000) {
-            case 0x27bd0000:
-                stack_size = ABS((short) (*addr & 0xffff));
-                break;
+        struct cfi_row row;
+        int found;
+        if (unwind_cache_get((uintptr_t) ra, &row, &found)) {
+            int frame_size, ra_offset;
+            int rv = backtrace_mips32_decode((const uint32_t *) ra,
+              MIPS32_MAX_SCAN, &frame_size, &ra_offset);
 
-            case 0xafbf0000:
-                ra_offset = (short) (*addr & 0xffff);
-                break;
-
-            case 0x3c1c0000:
-                return depth + 1;
+            found = rv == 0;
+            row.cfa_reg = MIPS32_REG_SP;
+            row.cfa_offset = frame_size;
+            row.ra_rule = CFI_RULE_OFFSET;
+            row.ra_offset = ra_offset - frame_size;
+            row.fp_rule = CFI_RULE_SAME;
+            row.fp_offset = 0;
+            unwind_cache_put((uintptr_t) ra, found ? &row : NULL);
+        }
 
-            default:
-                break;
-            }
+        if (!found) {
+            return depth + 1;
         }
 
-        ra = *(unsigned long **) ((unsigned long) sp + ra_offset);
-        sp = (unsigned long *) ((unsigned long) sp + stack_size);
+        // CFA is caller's $sp
+        sp = (unsigned long *) ((unsigned long) sp + row.cfa_offset);
+        ra = *(unsigned long **) ((unsigned long) sp + row.ra_offset);
     }
 
     return depth;
+#endif
 }
 
+int backtrace_mips32_decode(const uint32_t *ra, size_t max_scan,
+  int *frame_size, int *ra_offset) {
+    int have_frame_size = 0;
+    int have_ra_offset = 0;
+
+    const uint32_t *addr = ra;
+    for (size_t i = 0; i < max_scan; ++i, --addr) {
+        switch (*addr & 0xffff0000) {
+        case 0x27bd0000:    // addiu sp, sp, -N
+            *frame_size = ABS((short) (*addr & 0xffff));
+            have_frame_size = 1;
+            break;
+
+        case 0xafbf0000:    // sw ra, N(sp)
+            *ra_offset = (short) (*addr & 0xffff);
+            have_ra_offset = 1;
+            break;
+
+        case 0x3c1c0000:    // lui gp, N - beginning of the function
+            return 1;
+
+        default:
+            break;
+        }
+
+        if (have_frame_size && have_ra_offset) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
 
 char **backtrace_symbols(void *const *array, int size) {
-    Dl_info info[size];
-    int status[size];
-    int cnt;
-    size_t total = 0;
-    char **result;
-
-    /* Fill in the information we can get from `dladdr'.  */
-    for (cnt = 0; cnt < size; ++cnt) {
-        status[cnt] = dladdr (array[cnt], &info[cnt]);
-        if (status[cnt] && info[cnt].dli_fname && info[cnt].dli_fname[0] != '\0')
-        /*
-         * We have some info, compute the length of the string which will be
-         * "<file-name>(<sym-name>) [+offset].
-         */
-        total += (strlen (info[cnt].dli_fname ?: "") +
-                  (info[cnt].dli_sname ?
-                  strlen (info[cnt].dli_sname) + 3 + WORD_WIDTH + 3 : 1)
-                  + WORD_WIDTH + 5);
-        else
-            total += 5 + WORD_WIDTH;
-    }
-
-    /* Allocate memory for the result.  */
-    result = (char **) malloc (size * sizeof (char *) + total);
-    if (result != NULL) {
-        char *last = (char *) (result + size);
-        for (cnt = 0; cnt < size; ++cnt) {
-            result[cnt] = last;
-
-            if (status[cnt] && info[cnt].dli_fname
-                && info[cnt].dli_fname[0] != '\0') {
-
-                char buf[20];
-
-                if (array[cnt] >= (void *) info[cnt].dli_saddr)
-                    sprintf (buf, "+%#lx",
-                            (unsigned long)(array[cnt] - info[cnt].dli_saddr));
-                else
-                    sprintf (buf, "-%#lx",
-                    (unsigned long)(info[cnt].dli_saddr - array[cnt]));
-
-                last += 1 + sprintf (last, "%s%s%s%s%s[%p]",
-                info[cnt].dli_fname ?: "",
-                info[cnt].dli_sname ? "(" : "",
-                info[cnt].dli_sname ?: "",
-                info[cnt].dli_sname ? buf : "",
-                info[cnt].dli_sname ? ") " : " ",
-                array[cnt]);
-            } else
-                last += 1 + sprintf (last, "[%p]", array[cnt]);
-        }
-        assert (last <= (char *) result + size * sizeof (char *) + total);
+    if (size < 0) {
+        size = 0;
+    }
+
+    // Pointers and strings share one block, which grows whenever a string
+    // doesn't fit. Offsets are stored instead of pointers until the block
+    // stops moving.
+    size_t capacity = size * sizeof(char *) + (size + 1) * SYMBOLS_LINE;
+    size_t used = size * sizeof(char *);
+    char *block = malloc(capacity);
+    if (!block) {
+        return NULL;
+    }
+
+    for (int i = 0; i < size; ) {
+        int n = symbolize_format(array[i], block + used, capacity - used);
+        if (n < 0) {
+            n = 0;
+            block[used] = '\0';
+        }
+
+        if (used + n < capacity) {
+            ((uintptr_t *) block)[i++] = used;
+            used += n + 1;
+            continue;
+        }
+
+        // format again into a bigger block
+        size_t bigger = capacity * 2 > used + n + 1 ? capacity * 2
+                                                    : used + n + 1;
+        char *moved = realloc(block, bigger);
+        if (!moved) {
+            free(block);
+            return NULL;
+        }
+        block = moved;
+        capacity = bigger;
+    }
+
+    char **result = (char **) block;
+    for (int i = 0; i < size; ++i) {
+        result[i] = block + ((uintptr_t *) block)[i];
     }
 
     return result;
 }
+
+int backtrace_format_r(void *const *pcs, int size, char *buf, size_t len) {
+    struct cursor cursor = {buf, len, 0};
+
+    for (int i = 0; i < size; ++i) {
+        uintptr_t pc = (uintptr_t) pcs[i];
+
+        put_char(&cursor, '#');
+        put_dec(&cursor, i, 2);
+        put_char(&cursor, ' ');
+
+        struct symbol symbol;
+        if (symbolize_cached(pcs[i], &symbol) || !symbol.module[0]) {
+            put_char(&cursor, '[');
+            put_hex(&cursor, pc);
+            put_str(&cursor, "]\n");
+            continue;
+        }
+
+        put_str(&cursor, symbol.module);
+        if (symbol.name) {
+            put_char(&cursor, '(');
+            put_str(&cursor, symbol.name);
+            put_char(&cursor, pc >= symbol.address ? '+' : '-');
+            put_hex(&cursor, pc >= symbol.address ? pc - symbol.address
+                                                  : symbol.address - pc);
+            put_char(&cursor, ')');
+        }
+        put_str(&cursor, " [");
+        put_hex(&cursor, pc);
+        put_char(&cursor, ']');
+
+        if (symbol.file) {
+            put_char(&cursor, ' ');
+            put_str(&cursor, symbol.file);
+            put_char(&cursor, ':');
+            put_dec(&cursor, symbol.line, 0);
+        }
+        put_char(&cursor, '\n');
+    }
+
+    if (len) {
+        buf[cursor.pos < len ? cursor.pos : len - 1] = '\0';
+    }
+
+    return cursor.pos;
+}
+
+// private
+
+#ifdef HAVE_FP_UNWIND
+
+/*
+    Bounds of the calling thread's stack. pthread_getattr_np() is slow (for the
+    main thread it parses /proc/self/maps), so result is cached per thread.
+*/
+static
+int stack_bounds(uintptr_t *lo, uintptr_t *hi) {
+    static __thread uintptr_t cached_lo, cached_hi;
+
+    if (!cached_hi) {
+        pthread_attr_t attr;
+        if (pthread_getattr_np(pthread_self(), &attr)) {
+            return -1;
+        }
+
+        void *addr;
+        size_t size;
+        int rv = pthread_attr_getstack(&attr, &addr, &size);
+        pthread_attr_destroy(&attr);
+        if (rv) {
+            return -1;
+        }
+
+        cached_lo = (uintptr_t) addr;
+        cached_hi = (uintptr_t) addr + size;
+    }
+
+    *lo = cached_lo;
+    *hi = cached_hi;
+    return 0;
+}
+
+/*
+    Frame record layout is the same on x86-64 and AArch64: saved frame pointer
+    of the caller followed by return address.
+*/
+static
+int unwind_fp(uintptr_t fp, uintptr_t lo, uintptr_t hi, void **buffer,
+  int size) {
+    int depth = 0;
+
+    while (depth < size) {
+        if (fp < lo || fp > hi - 2 * sizeof(uintptr_t)
+            || fp % sizeof(uintptr_t)) {
+            break;
+        }
+
+        const uintptr_t *frame = (const uintptr_t *) fp;
+        if (!frame[1]) {
+            break;
+        }
+
+        buffer[depth++] = (void *) frame[1];
+
+        // stack grows down, so caller's frame must be above ours
+        if (frame[0] <= fp) {
+            break;
+        }
+
+        fp = frame[0];
+    }
+
+    return depth;
+}
+
+/*
+    Stack reader for cfi_unwind(): refuses to read outside of the stack, so
+    that garbage in a frame can't make us fault.
+*/
+static
+int read_stack(void *arg, uintptr_t addr, uintptr_t *value) {
+    const struct stack_range *stack = arg;
+    if (addr < stack->lo || addr > stack->hi - sizeof(uintptr_t)
+        || addr % sizeof(uintptr_t)) {
+        return -1;
+    }
+
+    *value = *(const uintptr_t *) addr;
+    return 0;
+}
+
+#endif // HAVE_FP_UNWIND
+
+#if defined(__mips__)
+/*
+    Drop rows cached by backtrace_mips32() if a module was unloaded since the
+    last check, as cfi.c does for its rows when it rescans modules.
+*/
+static
+void mips32_check_modules() {
+    unsigned long long subs = 0;
+    dl_iterate_phdr(read_subs, &subs);
+
+    if (__atomic_exchange_n(&mips32_subs, subs, __ATOMIC_RELAXED) != subs) {
+        unwind_cache_clear();
+    }
+}
+
+/*
+    dl_iterate_phdr() callback: counter of unloaded modules, the same in every
+    module's info.
+*/
+static
+int read_subs(struct dl_phdr_info *info, size_t size, void *arg) {
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs)
+        + sizeof(info->dlpi_subs)) {
+        *(unsigned long long *) arg = info->dlpi_subs;
+    }
+    return 1;
+}
+#endif
+
+/*
+    Remove 'count' innermost frames from 'buffer' holding 'nptrs' frames.
+    Returns number of frames left.
+*/
+static __attribute__((unused))
+int drop_frames(void **buffer, int nptrs, int count) {
+    if (nptrs <= count) {
+        return 0;
+    }
+
+    memmove(buffer, buffer + count, (nptrs - count) * sizeof(void *));
+    return nptrs - count;
+}
+
+static
+void put_char(struct cursor *cursor, char c) {
+    // the last byte is kept for terminating null byte
+    if (cursor->pos + 1 < cursor->len) {
+        cursor->buf[cursor->pos] = c;
+    }
+    ++cursor->pos;
+}
+
+static
+void put_str(struct cursor *cursor, const char *s) {
+    while (*s) {
+        put_char(cursor, *s++);
+    }
+}
+
+/*
+    Print 'value' in decimal, padded with zeros to 'width' digits.
+*/
+static
+void put_dec(struct cursor *cursor, unsigned long value, int width) {
+    char digits[24];
+    int count = 0;
+
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    while (count < width && count < (int) sizeof(digits)) {
+        digits[count++] = '0';
+    }
+    while (count) {
+        put_char(cursor, digits[--count]);
+    }
+}
+
+static
+void put_hex(struct cursor *cursor, uintptr_t value) {
+    char digits[2 * sizeof(value)];
+    int count = 0;
+
+    do {
+        digits[count++] = "0123456789abcdef"[value & 0xf];
+        value >>= 4;
+    } while (value);
+
+    put_str(cursor, "0x");
+    while (count) {
+        put_char(cursor, digits[--count]);
+    }
+}
@@ -1,27 +1,158 @@
 #ifndef BACKTRACE_H_INCLUDED
 #define BACKTRACE_H_INCLUDED
 
+#include <stddef.h>
+#include <stdint.h>
+
 /*
-    Prints stack trace to log. Read comments on backtrace_mips32() for
+    Prints stack trace to log. Read comments on backtrace_capture() for
     implications of backtracing.
 */
 void print_stack_trace(int log_level);
 
+/*
+    Prints 'size' frames of a stack trace captured earlier (e.g. with
+    backtrace_capture()) to log, the way print_stack_trace() does, without
+    the header line.
+*/
+void print_stack_frames(int log_level, void *const *buffer, int size);
+
+/*
+    Prints stack trace to log as raw addresses, to be symbolized offline with
+    tools/symbolize. Costs only unwinding, so it suits hosts where binaries
+    are stripped or symbolization is too expensive. Module map, which the
+    addresses refer to, is logged before the first trace and again whenever
+    it changes (see modmap.h):
+
+    Raw stack trace: 3 frames (module map 1)
+        #00 0x55c0b4a01d84
+        #01 0x55c0b4a01400
+        #02 0x7f2c1e22924a
+*/
+void print_stack_trace_raw(int log_level);
+
+typedef enum {
+    BACKTRACE_UNWINDER_AUTO,
+    BACKTRACE_UNWINDER_MIPS32,
+    BACKTRACE_UNWINDER_FP,
+    BACKTRACE_UNWINDER_CFI,
+    BACKTRACE_UNWINDER_GLIBC,
+} backtrace_unwinder_t;
+
+/*
+    Select unwinder used by backtrace_capture() and print_stack_trace().
+    BACKTRACE_UNWINDER_AUTO (default) picks one that suits target architecture:
+    * MIPS: backtrace_mips32(), i.e. scanning of function prologues;
+    * x86-64 and AArch64: backtrace_cfi(), i.e. interpreting .eh_frame;
+    * anything else: glibc's backtrace(), if available.
+    Unwinders that don't exist on target architecture find nothing. Whenever
+    selected unwinder finds no frames at all, glibc's backtrace() is tried.
+
+    backtrace_fp() is the cheapest one on x86-64 and AArch64, so select it if
+    you capture stacks very often (e.g. in a profiler) and build everything with
+    frame pointers.
+*/
+void backtrace_set_unwinder(backtrace_unwinder_t unwinder);
+
+/*
+    Capture stack trace of the calling thread to 'buffer' using unwinder
+    selected with backtrace_set_unwinder().
+
+    buffer[0] is the return address into the caller of backtrace_capture().
+
+    Returns number of captured frames, at most 'size'. On MIPS at most
+    'size - 1' frames are returned, since frame of backtrace_capture() itself
+    is dropped.
+*/
+int backtrace_capture(void **buffer, int size);
+
+/*
+    Bounds of a function that backtrace_capture_until() stops at.
+*/
+struct backtrace_stop {
+    uintptr_t start;
+    uintptr_t end;      // address next to the last byte of the function
+};
+
+/*
+    Look up bounds of 'function' (e.g. a thread's entry point or an event loop)
+    for backtrace_capture_until(). This loads symbols of its module, so do it
+    once, e.g. at startup, and pass the result to every capture.
+
+    Returns 0 on success and -1 if bounds are unknown. 'stop' is emptied then,
+    so that it stops no trace.
+*/
+int backtrace_stop_resolve(const void *function, struct backtrace_stop *stop);
+
+/*
+    Capture stack trace like backtrace_capture() does, but drop 'skip'
+    innermost frames (e.g. of error reporting helpers, at most
+    BACKTRACE_MAX_SKIP) and stop after the first frame that is in function
+    'stop' (whatever is above it is the same for every trace), unless 'stop'
+    is NULL. Frames are only compared with bounds in 'stop', nothing is looked
+    up or allocated.
+
+    buffer[0] is the return address into the caller of
+    backtrace_capture_until(), unless it's skipped.
+
+    Returns number of captured frames, at most 'size' and
+    BACKTRACE_MAX_DEPTH.
+*/
+#define BACKTRACE_MAX_SKIP 16
+#define BACKTRACE_MAX_DEPTH 64
+
+int backtrace_capture_until(void **buffer, int size, int skip,
+  const struct backtrace_stop *stop);
+
+/*
+    Format 'size' frames of a stack trace to 'buf' of 'len' bytes, a line per
+    frame like print_stack_frames() logs (but without inlined functions):
+
+    #00 ./server(handle_request+0x1c) [0x4005d3] server.c:1022
+    #01 ...
+
+    Unlike backtrace_symbols(), this doesn't allocate memory, take locks nor
+    use stdio, so it's fine for low memory conditions, high rates and signal
+    handlers. That's because frames are only looked up in the cache of
+    symbolize.h (see symbolize_cached()): frames that weren't symbolized
+    before are formatted as "[0x4005d3]", and strings of cached entries are
+    never freed (demangled names are interned). Symbolize stacks of interest
+    beforehand to warm the cache up, e.g. with print_stack_frames() or
+    backtrace_symbols(). Output is always null-terminated unless 'len' is 0.
+
+    Returns number of characters (excluding terminating null byte) that would
+    have been written if 'buf' was large enough, just as snprintf() does.
+*/
+int backtrace_format_r(void *const *pcs, int size, char *buf, size_t len);
+
 /*
     Notes on building project for reliable extraction of stack traces.
 
     When debugging with stack traces, you probably want to add
     'CFLAGS += -fno-optimize-sibling-calls' to your makefile as it prevents
     compiler from omitting stack frames for sibling / tail recursive calls.
-    You also probably want to add 'CFLAGS += -rdynamic' as it allows to have
-    some more symbolic data (i.e. function names in stack trace).
-    If you want to use addr2line on your developer machine, you should add
-    'CFLAGS += -g' as it will allow addr2line to show you, what specific line
-    of code corresponds to the address. After modifying your makefile make sure
+    On x86-64 and AArch64 backtrace_fp() needs 'CFLAGS += -fno-omit-frame-pointer'
+    as frame pointers is what it walks: every function compiled without them
+    hides its caller from stack trace. Default unwinder, backtrace_cfi(), only
+    needs .eh_frame, which is there unless you build with
+    -fno-asynchronous-unwind-tables.
+    Function names are read from .symtab of the binary (see symbolize.h), so
+    there is no need for 'CFLAGS += -rdynamic' unless you strip your binaries:
+    then only exported symbols are known, and -rdynamic exports all of them.
+    If you add 'CFLAGS += -g', stack trace will show source file and line of
+    each frame (and functions inlined into it), see dwarfline.h. Debug info
+    may be moved to a separate file found by build-id, so that deployed binary
+    stays small:
+    * objcopy --only-keep-debug driver_manager driver_manager.debug
+    * strip -g driver_manager
+    * put driver_manager.debug to /usr/lib/debug/.build-id/ab/cdef....debug
+      ('readelf -n driver_manager' shows the build-id)
+    You can still use addr2line as described below. After modifying your makefile make sure
     to run 'make clean' and rebuild your project.
     
     When using this library you will receive log output like this (if symbols
-    are available):
+    are available, and with ' driver_manager.c:1022' at the end of every line
+    if debug info is available too):
     Stack trace: 7 frames (most recent call first)
            #00 ./driver_manager(print_stack_trace+0x3c) [0x44afcc]
            #01 ./driver_manager(sendMsgToVoip+0x7c) [0x446b38]
@@ -60,8 +191,10 @@ void print_stack_trace(int log_level);
     Implementation of backtrace_mips32() was taken from
     http://elinux.org/images/6/68/ELC2008_-_Back-tracing_in_MIPS-based_Linux_Systems.pdf
 
-    Implementation of backtrace_symbols() was taken from
+    Output format of backtrace_symbols() was taken from
     https://github.com/hwoarang/uClibc/tree/master-metag/libubacktrace
+    Symbols are resolved through the cache in symbolize.h, so every distinct
+    address is passed to dladdr() only once.
 */
 
 /*
@@ -72,6 +205,45 @@ void print_stack_trace(int log_level);
 */
 int backtrace_mips32(void **buffer, int size);
 
+/*
+    Decode MIPS32 function prologue the way backtrace_mips32() does: scan
+    instructions backward starting at 'ra' (at most 'max_scan' of them) looking
+    for 'addiu sp, sp, -N' (frame size) and 'sw ra, N(sp)' (offset of saved
+    return address). Results of decoding are kept in unwind_cache.h, so each
+    call site is scanned once.
+
+    This only reads the instructions, so it works on any architecture and can
+    be fed with a synthetic buffer: pass pointer to its last instruction and
+    its length as 'max_scan'.
+
+    Returns 0 if both values were found, 1 if 'lui gp, N' (beginning of
+    the function, i.e. the outermost frame) was met before that, and -1 if
+    nothing was found within 'max_scan' instructions.
+*/
+int backtrace_mips32_decode(const uint32_t *ra, size_t max_scan,
+  int *frame_size, int *ra_offset);
+
+/*
+    Walk chain of frame pointers ($rbp on x86-64, x29 on AArch64) starting at
+    the frame of this function. Every frame is checked against bounds of the
+    calling thread's stack (obtained once per thread and cached), so walking
+    stops at the first corrupt or missing frame pointer rather than crashing.
+    Capturing costs a couple of memory reads per frame.
+
+    Always returns 0 on other architectures.
+*/
+int backtrace_fp(void **buffer, int size);
+
+/*
+    Unwind using DWARF call frame information from .eh_frame of loaded modules,
+    which works for code built with -fomit-frame-pointer. Frames that have no
+    usable CFI are walked using frame pointers. See cfi.h for details. Stack
+    memory is read only within bounds of the calling thread's stack.
+
+    Always returns 0 on architectures other than x86-64 and AArch64.
+*/
+int backtrace_cfi(void **buffer, int size);
+
 char **backtrace_symbols(void *const *array,  int size);
 
 #endif // BACKTRACE_H_INCLUDED
@@ -0,0 +1,1129 @@
+#define _GNU_SOURCE
+
+#include "cfi.h"
+
+#include "unwind_cache.h"
+
+#include <fcntl.h>
+#include <link.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_MODULES 128
+#define MAX_ASYNC_RETRIES 1000
+#define STATE_STACK_DEPTH 8
+
+// pointer encodings, see LSB "Exception Frames"
+enum {
+    DW_EH_PE_absptr  = 0x00,
+    DW_EH_PE_uleb128 = 0x01,
+    DW_EH_PE_udata2  = 0x02,
+    DW_EH_PE_udata4  = 0x03,
+    DW_EH_PE_udata8  = 0x04,
+    DW_EH_PE_sleb128 = 0x09,
+    DW_EH_PE_sdata2  = 0x0a,
+    DW_EH_PE_sdata4  = 0x0b,
+    DW_EH_PE_sdata8  = 0x0c,
+
+    DW_EH_PE_pcrel   = 0x10,
+    DW_EH_PE_datarel = 0x30,
+
+    DW_EH_PE_indirect = 0x80,
+    DW_EH_PE_omit     = 0xff,
+};
+
+// call frame instructions, see DWARF 4 section 6.4.2
+enum {
+    DW_CFA_advance_loc        = 0x40,
+    DW_CFA_offset             = 0x80,
+    DW_CFA_restore            = 0xc0,
+    DW_CFA_nop                = 0x00,
+    DW_CFA_set_loc            = 0x01,
+    DW_CFA_advance_loc1       = 0x02,
+    DW_CFA_advance_loc2       = 0x03,
+    DW_CFA_advance_loc4       = 0x04,
+    DW_CFA_offset_extended    = 0x05,
+    DW_CFA_restore_extended   = 0x06,
+    DW_CFA_undefined          = 0x07,
+    DW_CFA_same_value         = 0x08,
+    DW_CFA_register           = 0x09,
+    DW_CFA_remember_state     = 0x0a,
+    DW_CFA_restore_state      = 0x0b,
+    DW_CFA_def_cfa            = 0x0c,
+    DW_CFA_def_cfa_register   = 0x0d,
+    DW_CFA_def_cfa_offset     = 0x0e,
+    DW_CFA_def_cfa_expression = 0x0f,
+    DW_CFA_expression         = 0x10,
+    DW_CFA_offset_extended_sf = 0x11,
+    DW_CFA_def_cfa_sf         = 0x12,
+    DW_CFA_def_cfa_offset_sf  = 0x13,
+    DW_CFA_val_offset         = 0x14,
+    DW_CFA_val_offset_sf      = 0x15,
+    DW_CFA_val_expression     = 0x16,
+    DW_CFA_AARCH64_negate_ra_state = 0x2d,
+    DW_CFA_GNU_args_size      = 0x2e,
+    DW_CFA_GNU_negative_offset_extended = 0x2f,
+};
+
+struct module {
+    uintptr_t lo;
+    uintptr_t hi;
+    uintptr_t hdr;          // address of .eh_frame_hdr, base for datarel
+    const int32_t *table;   // pairs of (initial location, FDE address)
+    uint32_t fde_count;
+};
+
+// Module is in local addresses, and 'shift' is what has to be added to an
+// address of the target process to get the local one
+struct cfi_image {
+    struct module module;
+    uintptr_t shift;
+    void *map;
+    size_t map_size;
+};
+
+struct cie {
+    uint64_t code_align;
+    int64_t data_align;
+    uint64_t ra_reg;
+    uint8_t fde_encoding;
+    int has_augmentation_data;
+    const uint8_t *insns;
+    const uint8_t *end;
+};
+
+// Modules are replaced under 'modules_mtx', but are read without locking:
+// readers retry if 'modules_seq' changed (or was odd) while they were reading.
+static struct module modules[MAX_MODULES];
+static int modules_count;
+static unsigned modules_seq;
+static unsigned long long modules_adds = -1, modules_subs = -1;
+static pthread_mutex_t modules_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int find_row(uintptr_t pc, struct cfi_row *row, int async);
+static int find_module(uintptr_t pc, struct module *module, int async);
+static int find_row_uncached(uintptr_t pc, struct cfi_row *row, int async);
+static int find_row_in(const struct module *module, uintptr_t pc,
+  struct cfi_row *row);
+static int parse_hdr(struct module *module);
+
+// public
+
+int cfi_find_row(uintptr_t pc, struct cfi_row *row) {
+    return find_row(pc, row, 0);
+}
+
+#ifdef CFI_REG_SP
+
+static int find_loaded(void *arg, uintptr_t pc, struct cfi_row *row);
+static int find_loaded_async(void *arg, uintptr_t pc, struct cfi_row *row);
+static int unwind(struct cfi_regs *regs, cfi_find_t find, void *find_arg,
+  cfi_read_t read, void *arg, void **buffer, int size);
+static int cfi_step(struct cfi_regs *regs, int exact_pc, cfi_find_t find,
+  void *find_arg, cfi_read_t read, void *arg);
+static int fp_step(struct cfi_regs *regs, cfi_read_t read, void *arg);
+
+int cfi_unwind(struct cfi_regs *regs, cfi_read_t read, void *arg,
+  void **buffer, int size) {
+    return unwind(regs, find_loaded, NULL, read, arg, buffer, size);
+}
+
+int cfi_unwind_async(struct cfi_regs *regs, cfi_read_t read, void *arg,
+  void **buffer, int size) {
+    return unwind(regs, find_loaded_async, NULL, read, arg, buffer, size);
+}
+
+int cfi_unwind_with(struct cfi_regs *regs, cfi_find_t find, void *find_arg,
+  cfi_read_t read, void *arg, void **buffer, int size) {
+    return unwind(regs, find, find_arg, read, arg, buffer, size);
+}
+
+#else
+
+int cfi_unwind(struct cfi_regs *regs, cfi_read_t read, void *arg,
+  void **buffer, int size) {
+    (void) regs;
+    (void) read;
+    (void) arg;
+    (void) buffer;
+    (void) size;
+    return 0;
+}
+
+int cfi_unwind_async(struct cfi_regs *regs, cfi_read_t read, void *arg,
+  void **buffer, int size) {
+    return cfi_unwind(regs, read, arg, buffer, size);
+}
+
+int cfi_unwind_with(struct cfi_regs *regs, cfi_find_t find, void *find_arg,
+  cfi_read_t read, void *arg, void **buffer, int size) {
+    (void) find;
+    (void) find_arg;
+    return cfi_unwind(regs, read, arg, buffer, size);
+}
+
+#endif // CFI_REG_SP
+
+struct cfi_image *cfi_image_open(const char *path, uintptr_t bias) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t) st.st_size < sizeof(ElfW(Ehdr))) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const ElfW(Ehdr) *ehdr = map;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG)
+        || ehdr->e_ident[EI_CLASS] != __ELF_NATIVE_CLASS / 32
+        || ehdr->e_phentsize != sizeof(ElfW(Phdr))
+        || ehdr->e_phoff + ehdr->e_phnum * sizeof(ElfW(Phdr))
+           > (size_t) st.st_size) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    // .eh_frame is in the same segment as .eh_frame_hdr, so their distance
+    // in the file is the same as in memory
+    struct module module;
+    memset(&module, 0, sizeof(module));
+    module.lo = (uintptr_t) -1;
+    uintptr_t hdr_address = 0;
+
+    const ElfW(Phdr) *phdrs = (const ElfW(Phdr) *) ((const char *) map
+                                                    + ehdr->e_phoff);
+    for (int i = 0; i < ehdr->e_phnum; ++i) {
+        const ElfW(Phdr) *phdr = &phdrs[i];
+        uintptr_t start = bias + phdr->p_vaddr;
+
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X)) {
+            if (start < module.lo) {
+                module.lo = start;
+            }
+            if (start + phdr->p_memsz > module.hi) {
+                module.hi = start + phdr->p_memsz;
+            }
+        } else if (phdr->p_type == PT_GNU_EH_FRAME
+                   && phdr->p_offset + phdr->p_filesz <= (size_t) st.st_size) {
+            module.hdr = (uintptr_t) map + phdr->p_offset;
+            hdr_address = start;
+        }
+    }
+
+    struct cfi_image *image = NULL;
+    if (module.hdr && module.lo < module.hi && !parse_hdr(&module)) {
+        image = malloc(sizeof(struct cfi_image));
+    }
+
+    if (!image) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    image->shift = module.hdr - hdr_address;
+    image->module = module;
+    image->module.lo += image->shift;
+    image->module.hi += image->shift;
+    image->map = map;
+    image->map_size = st.st_size;
+
+    return image;
+}
+
+void cfi_image_close(struct cfi_image *image) {
+    if (!image) {
+        return;
+    }
+
+    munmap(image->map, image->map_size);
+    free(image);
+}
+
+int cfi_image_find_row(const struct cfi_image *image, uintptr_t pc,
+  struct cfi_row *row) {
+    pc += image->shift;
+    if (pc < image->module.lo || pc >= image->module.hi) {
+        return -1;
+    }
+
+    return find_row_in(&image->module, pc, row);
+}
+
+void cfi_refresh_modules() {
+    // Drop generation, so that find_module() doesn't consider modules fresh.
+    pthread_mutex_lock(&modules_mtx);
+    modules_adds = -1;
+    pthread_mutex_unlock(&modules_mtx);
+
+    struct module module;
+    find_module(0, &module, 0);
+}
+
+// private
+
+#ifdef CFI_REG_SP
+
+static
+int find_loaded(void *arg, uintptr_t pc, struct cfi_row *row) {
+    (void) arg;
+    return find_row(pc, row, 0);
+}
+
+static
+int find_loaded_async(void *arg, uintptr_t pc, struct cfi_row *row) {
+    (void) arg;
+    return find_row(pc, row, 1);
+}
+
+static
+int unwind(struct cfi_regs *regs, cfi_find_t find, void *find_arg,
+  cfi_read_t read, void *arg, void **buffer, int size) {
+    int depth = 0;
+    int exact_pc = 1;
+
+    while (depth < size) {
+        uintptr_t prev_sp = regs->sp;
+
+        int rv = cfi_step(regs, exact_pc, find, find_arg, read, arg);
+        if (rv < 0) {
+            rv = fp_step(regs, read, arg);
+        }
+
+        if (rv || !regs->pc || regs->sp <= prev_sp) {
+            break;
+        }
+
+        buffer[depth++] = (void *) regs->pc;
+        exact_pc = 0;
+    }
+
+    return depth;
+}
+
+#endif // CFI_REG_SP
+
+/*
+    Find row through unwind_cache. In 'async' mode, failures are not cached:
+    they may be caused by a module that wasn't scanned yet.
+*/
+static
+int find_row(uintptr_t pc, struct cfi_row *row, int async) {
+    int found;
+    if (!unwind_cache_get(pc, row, &found)) {
+        return found ? 0 : -1;
+    }
+
+    if (find_row_uncached(pc, row, async)) {
+        if (!async) {
+            unwind_cache_put(pc, NULL);
+        }
+        return -1;
+    }
+
+    unwind_cache_put(pc, row);
+    return 0;
+}
+
+static
+uint64_t read_uleb(const uint8_t **p, const uint8_t *end) {
+    uint64_t result = 0;
+    unsigned shift = 0;
+
+    while (*p < end) {
+        uint8_t byte = *(*p)++;
+        if (shift < 64) {
+            result |= (uint64_t) (byte & 0x7f) << shift;
+        }
+        shift += 7;
+
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+
+    return result;
+}
+
+static
+int64_t read_sleb(const uint8_t **p, const uint8_t *end) {
+    int64_t result = 0;
+    unsigned shift = 0;
+    uint8_t byte = 0;
+
+    while (*p < end) {
+        byte = *(*p)++;
+        if (shift < 64) {
+            result |= (int64_t) (byte & 0x7f) << shift;
+        }
+        shift += 7;
+
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+
+    if (shift < 64 && (byte & 0x40)) {
+        result |= -((int64_t) 1 << shift);
+    }
+
+    return result;
+}
+
+/*
+    Decode pointer in 'encoding' at *p and advance *p. 'datarel' is the base
+    for DW_EH_PE_datarel. Indirect pointers are not dereferenced, since
+    nothing of what we need is encoded that way. Returns -1 on unsupported
+    encoding or truncated data.
+*/
+static
+int read_encoded(const uint8_t **p, const uint8_t *end, uint8_t encoding,
+  uintptr_t datarel, uintptr_t *value) {
+    if (encoding == DW_EH_PE_omit) {
+        *value = 0;
+        return 0;
+    }
+
+    const uint8_t *start = *p;
+    uintptr_t result;
+    size_t size;
+
+    switch (encoding & 0x0f) {
+    case DW_EH_PE_absptr: size = sizeof(uintptr_t); break;
+    case DW_EH_PE_udata2:
+    case DW_EH_PE_sdata2: size = 2; break;
+    case DW_EH_PE_udata4:
+    case DW_EH_PE_sdata4: size = 4; break;
+    case DW_EH_PE_udata8:
+    case DW_EH_PE_sdata8: size = 8; break;
+    case DW_EH_PE_uleb128:
+        result = read_uleb(p, end);
+        size = 0;
+        break;
+    case DW_EH_PE_sleb128:
+        result = read_sleb(p, end);
+        size = 0;
+        break;
+    default:
+        return -1;
+    }
+
+    if (size) {
+        if ((size_t) (end - start) < size) {
+            return -1;
+        }
+
+        switch (encoding & 0x0f) {
+        case DW_EH_PE_absptr: { uintptr_t v; memcpy(&v, start, size); result = v; break; }
+        case DW_EH_PE_udata2: { uint16_t v; memcpy(&v, start, size); result = v; break; }
+        case DW_EH_PE_sdata2: { int16_t v;  memcpy(&v, start, size); result = v; break; }
+        case DW_EH_PE_udata4: { uint32_t v; memcpy(&v, start, size); result = v; break; }
+        case DW_EH_PE_sdata4: { int32_t v;  memcpy(&v, start, size); result = v; break; }
+        case DW_EH_PE_udata8: { uint64_t v; memcpy(&v, start, size); result = v; break; }
+        default:              { int64_t v;  memcpy(&v, start, size); result = v; break; }
+        }
+
+        *p += size;
+    }
+
+    switch (encoding & 0x70) {
+    case 0: break;
+    case DW_EH_PE_pcrel: result += (uintptr_t) start; break;
+    case DW_EH_PE_datarel: result += datarel; break;
+    default: return -1;
+    }
+
+    *value = result;
+    return 0;
+}
+
+/*
+    Read length of a CIE / FDE at *p, advance *p past it and set *end to the
+    end of the entry. Returns -1 on terminator or malformed length.
+*/
+static
+int read_entry_length(const uint8_t **p, const uint8_t **end) {
+    uint32_t length;
+    memcpy(&length, *p, 4);
+    *p += 4;
+
+    if (!length) {
+        return -1;
+    }
+
+    if (length == 0xffffffff) {
+        uint64_t length64;
+        memcpy(&length64, *p, 8);
+        *p += 8;
+        *end = *p + length64;
+    } else {
+        *end = *p + length;
+    }
+
+    return 0;
+}
+
+static
+int parse_cie(const uint8_t *p, struct cie *cie) {
+    const uint8_t *end;
+    if (read_entry_length(&p, &end)) {
+        return -1;
+    }
+
+    uint32_t id;
+    memcpy(&id, p, 4);
+    p += 4;
+    if (id != 0) {
+        return -1;
+    }
+
+    uint8_t version = *p++;
+    const char *augmentation = (const char *) p;
+    p += strlen(augmentation) + 1;
+
+    if (augmentation[0] && augmentation[0] != 'z') {
+        return -1;  // can't skip unknown augmentation data without 'z'
+    }
+
+    if (strstr(augmentation, "eh")) {
+        p += sizeof(uintptr_t);
+    }
+
+    cie->code_align = read_uleb(&p, end);
+    cie->data_align = read_sleb(&p, end);
+    cie->ra_reg = version == 1 ? *p++ : read_uleb(&p, end);
+    cie->fde_encoding = DW_EH_PE_absptr;
+    cie->has_augmentation_data = augmentation[0] == 'z';
+
+    if (cie->has_augmentation_data) {
+        uint64_t length = read_uleb(&p, end);
+        const uint8_t *data_end = p + length;
+
+        for (const char *a = augmentation + 1; *a && p < data_end; ++a) {
+            uintptr_t ignored;
+
+            switch (*a) {
+            case 'R':
+                cie->fde_encoding = *p++;
+                break;
+            case 'L':
+                ++p;
+                break;
+            case 'P': {
+                uint8_t encoding = *p++;
+                if (read_encoded(&p, data_end, encoding & ~DW_EH_PE_indirect,
+                      0, &ignored)) {
+                    return -1;
+                }
+                break;
+            }
+            default:
+                break;
+            }
+        }
+
+        p = data_end;
+    }
+
+    cie->insns = p;
+    cie->end = end;
+    return 0;
+}
+
+struct cfa_state {
+    struct cfi_row row;
+    struct cfi_row initial;
+    struct cfi_row stack[STATE_STACK_DEPTH];
+    int stack_depth;
+};
+
+static
+void set_rule(struct cfa_state *state, uint64_t reg, uint64_t ra_reg,
+  uint8_t rule, int64_t offset) {
+    if (reg == ra_reg) {
+        state->row.ra_rule = rule;
+        state->row.ra_offset = offset;
+    }
+
+#ifdef CFI_REG_FP
+    if (reg == CFI_REG_FP) {
+        state->row.fp_rule = rule;
+        state->row.fp_offset = offset;
+    }
+#endif
+}
+
+static
+void restore_rule(struct cfa_state *state, uint64_t reg, uint64_t ra_reg) {
+    if (reg == ra_reg) {
+        state->row.ra_rule = state->initial.ra_rule;
+        state->row.ra_offset = state->initial.ra_offset;
+    }
+
+#ifdef CFI_REG_FP
+    if (reg == CFI_REG_FP) {
+        state->row.fp_rule = state->initial.fp_rule;
+        state->row.fp_offset = state->initial.fp_offset;
+    }
+#endif
+}
+
+/*
+    Execute CFA program from 'p' to 'end', starting at location 'loc', and
+    stop as soon as location gets past 'pc'. Returns -1 on instructions that
+    make row unusable for us.
+*/
+static
+int execute(const struct cie *cie, const uint8_t *p, const uint8_t *end,
+  uintptr_t loc, uintptr_t pc, struct cfa_state *state) {
+    while (p < end) {
+        uint8_t op = *p++;
+        uint8_t low = op & 0x3f;
+        uint64_t reg, delta = 0;
+        int64_t offset;
+        int advance = 0;
+
+        switch (op & 0xc0) {
+        case DW_CFA_advance_loc:
+            delta = low * cie->code_align;
+            advance = 1;
+            break;
+
+        case DW_CFA_offset:
+            offset = read_uleb(&p, end) * cie->data_align;
+            set_rule(state, low, cie->ra_reg, CFI_RULE_OFFSET, offset);
+            continue;
+
+        case DW_CFA_restore:
+            restore_rule(state, low, cie->ra_reg);
+            continue;
+
+        default:
+            break;
+        }
+
+        if (!advance) {
+            switch (op) {
+            case DW_CFA_nop:
+                break;
+
+            case DW_CFA_set_loc: {
+                uintptr_t new_loc;
+                if (read_encoded(&p, end, cie->fde_encoding, 0, &new_loc)) {
+                    return -1;
+                }
+                if (new_loc > pc) {
+                    return 0;
+                }
+                loc = new_loc;
+                break;
+            }
+
+            case DW_CFA_advance_loc1:
+                delta = *p * cie->code_align;
+                advance = 1;
+                p += 1;
+                break;
+
+            case DW_CFA_advance_loc2: {
+                uint16_t v;
+                memcpy(&v, p, 2);
+                p += 2;
+                delta = v * cie->code_align;
+                advance = 1;
+                break;
+            }
+
+            case DW_CFA_advance_loc4: {
+                uint32_t v;
+                memcpy(&v, p, 4);
+                p += 4;
+                delta = v * cie->code_align;
+                advance = 1;
+                break;
+            }
+
+            case DW_CFA_offset_extended:
+                reg = read_uleb(&p, end);
+                offset = read_uleb(&p, end) * cie->data_align;
+                set_rule(state, reg, cie->ra_reg, CFI_RULE_OFFSET, offset);
+                break;
+
+            case DW_CFA_offset_extended_sf:
+                reg = read_uleb(&p, end);
+                offset = read_sleb(&p, end) * cie->data_align;
+                set_rule(state, reg, cie->ra_reg, CFI_RULE_OFFSET, offset);
+                break;
+
+            case DW_CFA_GNU_negative_offset_extended:
+                reg = read_uleb(&p, end);
+                offset = -(int64_t) read_uleb(&p, end) * cie->data_align;
+                set_rule(state, reg, cie->ra_reg, CFI_RULE_OFFSET, offset);
+                break;
+
+            case DW_CFA_restore_extended:
+                restore_rule(state, read_uleb(&p, end), cie->ra_reg);
+                break;
+
+            case DW_CFA_undefined:
+                set_rule(state, read_uleb(&p, end), cie->ra_reg,
+                  CFI_RULE_UNDEFINED, 0);
+                break;
+
+            case DW_CFA_same_value:
+                set_rule(state, read_uleb(&p, end), cie->ra_reg,
+                  CFI_RULE_SAME, 0);
+                break;
+
+            case DW_CFA_register:
+            case DW_CFA_val_offset:
+            case DW_CFA_val_offset_sf:
+                reg = read_uleb(&p, end);
+                read_uleb(&p, end);
+                if (reg == cie->ra_reg) {
+                    return -1;
+                }
+#ifdef CFI_REG_FP
+                if (reg == CFI_REG_FP) {
+                    return -1;
+                }
+#endif
+                break;
+
+            case DW_CFA_remember_state:
+                if (state->stack_depth == STATE_STACK_DEPTH) {
+                    return -1;
+                }
+                state->stack[state->stack_depth++] = state->row;
+                break;
+
+            case DW_CFA_restore_state:
+                if (!state->stack_depth) {
+                    return -1;
+                }
+                state->row = state->stack[--state->stack_depth];
+                break;
+
+            case DW_CFA_def_cfa:
+                state->row.cfa_reg = read_uleb(&p, end);
+                state->row.cfa_offset = read_uleb(&p, end);
+                break;
+
+            case DW_CFA_def_cfa_sf:
+                state->row.cfa_reg = read_uleb(&p, end);
+                state->row.cfa_offset = read_sleb(&p, end) * cie->data_align;
+                break;
+
+            case DW_CFA_def_cfa_register:
+                state->row.cfa_reg = read_uleb(&p, end);
+                break;
+
+            case DW_CFA_def_cfa_offset:
+                state->row.cfa_offset = read_uleb(&p, end);
+                break;
+
+            case DW_CFA_def_cfa_offset_sf:
+                state->row.cfa_offset = read_sleb(&p, end) * cie->data_align;
+                break;
+
+            case DW_CFA_def_cfa_expression:
+                return -1;
+
+            case DW_CFA_expression:
+            case DW_CFA_val_expression: {
+                reg = read_uleb(&p, end);
+                uint64_t length = read_uleb(&p, end);
+                p += length;
+                if (reg == cie->ra_reg) {
+                    return -1;
+                }
+#ifdef CFI_REG_FP
+                if (reg == CFI_REG_FP) {
+                    return -1;
+                }
+#endif
+                break;
+            }
+
+            case DW_CFA_GNU_args_size:
+                read_uleb(&p, end);
+                break;
+
+            case DW_CFA_AARCH64_negate_ra_state:
+                break;
+
+            default:
+                return -1;
+            }
+        }
+
+        if (advance) {
+            if (loc + delta > pc) {
+                return 0;
+            }
+            loc += delta;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Binary search for FDE with the greatest initial location <= 'pc'. Table
+    entries are datarel sdata4 pairs, which is the only encoding GNU ld and
+    lld emit for the table.
+*/
+static
+const uint8_t *lookup_fde(const struct module *module, uintptr_t pc) {
+    const int32_t *table = module->table;
+    uint32_t lo = 0, hi = module->fde_count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (module->hdr + table[2 * mid] <= pc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (!lo) {
+        return NULL;
+    }
+
+    return (const uint8_t *) (module->hdr + table[2 * (lo - 1) + 1]);
+}
+
+static
+int find_row_uncached(uintptr_t pc, struct cfi_row *row, int async) {
+    struct module module;
+    if (find_module(pc, &module, async)) {
+        return -1;
+    }
+
+    return find_row_in(&module, pc, row);
+}
+
+static
+int find_row_in(const struct module *module, uintptr_t pc,
+  struct cfi_row *row) {
+    const uint8_t *fde = lookup_fde(module, pc);
+    if (!fde) {
+        return -1;
+    }
+
+    const uint8_t *p = fde;
+    const uint8_t *end;
+    if (read_entry_length(&p, &end)) {
+        return -1;
+    }
+
+    int32_t cie_offset;
+    memcpy(&cie_offset, p, 4);
+    if (!cie_offset) {
+        return -1;
+    }
+
+    struct cie cie;
+    if (parse_cie(p - cie_offset, &cie)) {
+        return -1;
+    }
+    p += 4;
+
+    uintptr_t pc_begin, pc_range;
+    if (read_encoded(&p, end, cie.fde_encoding, module->hdr, &pc_begin)
+        || read_encoded(&p, end, cie.fde_encoding & 0x0f, 0, &pc_range)) {
+        return -1;
+    }
+
+    if (pc < pc_begin || pc >= pc_begin + pc_range) {
+        return -1;
+    }
+
+    if (cie.has_augmentation_data) {
+        uint64_t length = read_uleb(&p, end);
+        p += length;
+    }
+
+    struct cfa_state state;
+    memset(&state, 0, sizeof(state));
+    state.row.ra_rule = CFI_RULE_SAME;
+    state.row.fp_rule = CFI_RULE_SAME;
+
+    if (execute(&cie, cie.insns, cie.end, 0, (uintptr_t) -1, &state)) {
+        return -1;
+    }
+
+    state.initial = state.row;
+
+    if (execute(&cie, p, end, pc_begin, pc, &state)) {
+        return -1;
+    }
+
+    *row = state.row;
+    return 0;
+}
+
+static
+int module_lookup(uintptr_t pc, struct module *module) {
+    for (int i = 0; i < modules_count; ++i) {
+        if (pc >= modules[i].lo && pc < modules[i].hi) {
+            *module = modules[i];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+    Lock-free lookup in 'modules'. Returns 1 if modules are being updated right
+    now, so lookup has to be repeated.
+*/
+static
+int module_lookup_consistent(uintptr_t pc, struct module *module, int *found) {
+    unsigned seq = __atomic_load_n(&modules_seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+        return 1;
+    }
+
+    *found = !module_lookup(pc, module);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&modules_seq, __ATOMIC_RELAXED) != seq;
+}
+
+struct scan {
+    struct module modules[MAX_MODULES];
+    int count;
+    unsigned long long adds;
+    unsigned long long subs;
+    int generation_only;
+};
+
+static
+int scan_module(struct dl_phdr_info *info, size_t size, void *data) {
+    struct scan *scan = data;
+
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs)
+        + sizeof(info->dlpi_subs)) {
+        scan->adds = info->dlpi_adds;
+        scan->subs = info->dlpi_subs;
+    }
+
+    if (scan->generation_only) {
+        return 1;
+    }
+
+    if (scan->count == MAX_MODULES) {
+        return 1;
+    }
+
+    struct module module;
+    memset(&module, 0, sizeof(module));
+    module.lo = (uintptr_t) -1;
+
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X)) {
+            if (start < module.lo) {
+                module.lo = start;
+            }
+            if (start + phdr->p_memsz > module.hi) {
+                module.hi = start + phdr->p_memsz;
+            }
+        } else if (phdr->p_type == PT_GNU_EH_FRAME) {
+            module.hdr = start;
+        }
+    }
+
+    if (!module.hdr || module.lo >= module.hi || parse_hdr(&module)) {
+        return 0;
+    }
+
+    scan->modules[scan->count++] = module;
+
+    return 0;
+}
+
+/*
+    Find FDE table in .eh_frame_hdr at module->hdr. Returns -1 if the table is
+    missing or its encoding isn't supported by lookup_fde().
+*/
+static
+int parse_hdr(struct module *module) {
+    // .eh_frame_hdr: version, eh_frame_ptr_enc, fde_count_enc, table_enc
+    const uint8_t *hdr = (const uint8_t *) module->hdr;
+    if (hdr[0] != 1 || hdr[3] != (DW_EH_PE_datarel | DW_EH_PE_sdata4)) {
+        return -1;
+    }
+
+    const uint8_t *p = hdr + 4;
+    const uint8_t *end = p + 2 * sizeof(uint64_t);
+    uintptr_t eh_frame, fde_count;
+    if (read_encoded(&p, end, hdr[1], module->hdr, &eh_frame)
+        || read_encoded(&p, end, hdr[2], module->hdr, &fde_count)) {
+        return -1;
+    }
+
+    module->table = (const int32_t *) p;
+    module->fde_count = fde_count;
+    return 0;
+}
+
+/*
+    Find module containing 'pc'. If it isn't among known modules and set of
+    loaded modules changed since last scan, modules are rescanned.
+
+    In 'async' mode modules are never rescanned, and lookup gives up if
+    modules are being updated: it may be the interrupted thread that updates
+    them.
+*/
+static
+int find_module(uintptr_t pc, struct module *module, int async) {
+    int found = 0;
+    int retries = 0;
+    while (module_lookup_consistent(pc, module, &found)) {
+        // modules are being updated
+        if (async && ++retries == MAX_ASYNC_RETRIES) {
+            return -1;
+        }
+    }
+
+    if (found || async) {
+        return found ? 0 : -1;
+    }
+
+    static struct scan scan;
+
+    pthread_mutex_lock(&modules_mtx);
+
+    scan.generation_only = 1;
+    scan.adds = 0;
+    scan.subs = 0;
+    dl_iterate_phdr(scan_module, &scan);
+
+    if (scan.adds != modules_adds || scan.subs != modules_subs
+        || (!scan.adds && !scan.subs)) {
+        scan.generation_only = 0;
+        scan.count = 0;
+        dl_iterate_phdr(scan_module, &scan);
+
+        // unloaded module's addresses may be reused by another one
+        if (scan.subs != modules_subs) {
+            unwind_cache_clear();
+        }
+
+        __atomic_fetch_add(&modules_seq, 1, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        memcpy(modules, scan.modules, scan.count * sizeof(struct module));
+        modules_count = scan.count;
+        modules_adds = scan.adds;
+        modules_subs = scan.subs;
+        __atomic_fetch_add(&modules_seq, 1, __ATOMIC_RELEASE);
+
+        found = !module_lookup(pc, module);
+    }
+
+    pthread_mutex_unlock(&modules_mtx);
+
+    return found ? 0 : -1;
+}
+
+#ifdef CFI_REG_SP
+
+/*
+    Returns 0 if frame was unwound, 1 if 'regs' describe the outermost frame,
+    and -1 if there is no usable CFI for regs->pc.
+*/
+static
+int cfi_step(struct cfi_regs *regs, int exact_pc, cfi_find_t find,
+  void *find_arg, cfi_read_t read, void *arg) {
+    struct cfi_row row;
+
+    // Return address may point past the end of a function that ends with
+    // a call to noreturn function, so look up the call instruction itself.
+    if (find(find_arg, exact_pc ? regs->pc : regs->pc - 1, &row)) {
+        return -1;
+    }
+
+    uintptr_t cfa;
+    if (row.cfa_reg == CFI_REG_SP) {
+        cfa = regs->sp + row.cfa_offset;
+    } else if (row.cfa_reg == CFI_REG_FP) {
+        cfa = regs->fp + row.cfa_offset;
+    } else {
+        return -1;
+    }
+
+    uintptr_t ra, fp = regs->fp;
+
+    switch (row.ra_rule) {
+    case CFI_RULE_OFFSET:
+        if (read(arg, cfa + row.ra_offset, &ra)) {
+            return -1;
+        }
+        break;
+
+#ifdef CFI_REG_LR
+    case CFI_RULE_SAME:
+        ra = regs->lr;
+        break;
+#endif
+
+    case CFI_RULE_UNDEFINED:
+        return 1;
+
+    default:
+        return -1;
+    }
+
+    if (row.fp_rule == CFI_RULE_OFFSET
+        && read(arg, cfa + row.fp_offset, &fp)) {
+        return -1;
+    }
+
+    regs->pc = ra;
+    regs->sp = cfa;
+    regs->fp = fp;
+    regs->lr = ra;
+
+    return 0;
+}
+
+/*
+    Fallback for frames without usable CFI: frame record at frame pointer
+    holds caller's frame pointer and return address.
+*/
+static
+int fp_step(struct cfi_regs *regs, cfi_read_t read, void *arg) {
+    uintptr_t fp, ra;
+    if (read(arg, regs->fp, &fp)
+        || read(arg, regs->fp + sizeof(uintptr_t), &ra)) {
+        return -1;
+    }
+
+    regs->pc = ra;
+    regs->sp = regs->fp + 2 * sizeof(uintptr_t);
+    regs->fp = fp;
+    regs->lr = ra;
+
+    return 0;
+}
+
+#endif // CFI_REG_SP
@@ -0,0 +1,152 @@
+#ifndef CFI_H_INCLUDED
+#define CFI_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+    In-process unwinder driven by DWARF call frame information (CFI), i.e. by
+    the .eh_frame section that compilers emit for every function, even with
+    -fomit-frame-pointer (it is what C++ exceptions are unwound with).
+
+    Modules are found with dl_iterate_phdr(). Every module's .eh_frame_hdr
+    already contains a table of FDEs sorted by address, so an FDE is found by
+    binary search. The FDE's CFA program is then executed up to the PC, and
+    the resulting row (where CFA is and where return address and frame pointer
+    are saved relative to it) is stored in unwind_cache.h, keyed by PC.
+    Repeated unwinds through the same call sites hence cost one cache lookup
+    per frame.
+
+    Only rules that describe ordinary function frames are supported: CFA based
+    on stack or frame pointer and registers saved at an offset from CFA. Frames
+    described by DWARF expressions (PLT stubs, signal trampolines) are walked
+    using frame pointers instead, if they are there.
+
+    CFI of another process's modules can be loaded from their files with
+    cfi_image_open() and used to unwind a copy of that process's stack with
+    cfi_unwind_with(), see tools/sampler.c.
+
+    Supported architectures are x86-64 and AArch64.
+*/
+
+#if defined(__x86_64__)
+# define CFI_REG_FP 6
+# define CFI_REG_SP 7
+#elif defined(__aarch64__)
+# define CFI_REG_FP 29
+# define CFI_REG_LR 30
+# define CFI_REG_SP 31
+#endif
+
+/*
+    Registers that are needed to unwind a frame. 'lr' is used only on AArch64,
+    where leaf functions keep return address in register.
+*/
+struct cfi_regs {
+    uintptr_t pc;
+    uintptr_t sp;
+    uintptr_t fp;
+    uintptr_t lr;
+};
+
+enum {
+    CFI_RULE_UNDEFINED,
+    CFI_RULE_SAME,
+    CFI_RULE_OFFSET,
+};
+
+/*
+    Unwinding rules for a single PC: CFA = reg(cfa_reg) + cfa_offset, return
+    address and frame pointer are either saved at CFA + *_offset, unchanged or
+    (for return address) undefined, which marks the outermost frame.
+*/
+struct cfi_row {
+    int32_t cfa_reg;
+    int32_t cfa_offset;
+    int32_t ra_offset;
+    int32_t fp_offset;
+    uint8_t ra_rule;
+    uint8_t fp_rule;
+};
+
+/*
+    Reads a word at 'addr' to 'value'. Returns 0 on success and -1 if 'addr'
+    may not be read.
+*/
+typedef int (*cfi_read_t)(void *arg, uintptr_t addr, uintptr_t *value);
+
+/*
+    Finds unwinding rules for 'pc' like cfi_find_row() does. Returns 0 on
+    success and -1 if there is no CFI for 'pc'.
+*/
+typedef int (*cfi_find_t)(void *arg, uintptr_t pc, struct cfi_row *row);
+
+struct cfi_image;
+
+/*
+    Find unwinding rules for 'pc' of a loaded module.
+
+    Returns 0 on success and -1 if there is no CFI for 'pc' or it can't be
+    interpreted.
+*/
+int cfi_find_row(uintptr_t pc, struct cfi_row *row);
+
+/*
+    Unwind stack starting from the frame described by 'regs'. regs->pc must be
+    an exact PC (e.g. of a faulting instruction), not a return address. Stack
+    memory is accessed only through 'read'.
+
+    Stores return addresses of callers to 'buffer' (frame of 'regs' itself is
+    not stored). 'regs' are updated to describe the last unwound frame.
+
+    Returns number of stored frames, at most 'size'.
+*/
+int cfi_unwind(struct cfi_regs *regs, cfi_read_t read, void *arg,
+  void **buffer, int size);
+
+/*
+    Same as cfi_unwind(), but async-signal-safe: takes no locks and never
+    rescans loaded modules, so frames of modules loaded after the last scan
+    are walked with frame pointers only. Call cfi_refresh_modules() in advance
+    (e.g. when installing a signal handler) to make sure modules are known.
+*/
+int cfi_unwind_async(struct cfi_regs *regs, cfi_read_t read, void *arg,
+  void **buffer, int size);
+
+/*
+    Same as cfi_unwind(), but rows are found by 'find' (called with
+    'find_arg') instead of in modules loaded to this process. Rows are not
+    cached.
+*/
+int cfi_unwind_with(struct cfi_regs *regs, cfi_find_t find, void *find_arg,
+  cfi_read_t read, void *arg, void **buffer, int size);
+
+/*
+    Load CFI of ELF file at 'path', which another process has loaded with
+    load 'bias' (see modmap.h). The file is mmap()ed for as long as the image
+    is open.
+
+    Returns an image or NULL if file can't be read or has no .eh_frame_hdr.
+*/
+struct cfi_image *cfi_image_open(const char *path, uintptr_t bias);
+
+/*
+    Close an image. 'image' may be NULL.
+*/
+void cfi_image_close(struct cfi_image *image);
+
+/*
+    Find unwinding rules for 'pc', an address in the process that has loaded
+    the image.
+
+    Returns 0 on success and -1 if 'pc' isn't in code of the image or there is
+    no CFI for it.
+*/
+int cfi_image_find_row(const struct cfi_image *image, uintptr_t pc, struct cfi_row *row);
+
+/*
+    Rescan loaded modules. Usually there is no need to call it: modules are
+    rescanned automatically when a PC can't be found in any of known modules.
+*/
+void cfi_refresh_modules();
+
+#endif // CFI_H_INCLUDED
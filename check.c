@@ -0,0 +1,85 @@
+#include "check.h"
+
+#include "backtrace.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+static check_policy_t policy = CHECK_POLICY_ABORT;
+static unsigned log_interval_ms = 1000;
+
+static int claim_log(struct check_site *site, unsigned long *suppressed);
+
+// public
+
+void check_set_policy(check_policy_t new_policy) {
+    __atomic_store_n(&policy, new_policy, __ATOMIC_RELAXED);
+}
+
+void check_set_log_interval(unsigned interval_ms) {
+    __atomic_store_n(&log_interval_ms, interval_ms, __ATOMIC_RELAXED);
+}
+
+__attribute__((cold, noinline))
+void check_fail(struct check_site *site, const char *expr, const char *file,
+  int line, const char *func) {
+    int abort_after = __atomic_load_n(&policy, __ATOMIC_RELAXED)
+                      == CHECK_POLICY_ABORT;
+
+    __atomic_fetch_add(&site->failures, 1, __ATOMIC_RELAXED);
+
+    unsigned long suppressed = 0;
+    if (abort_after || claim_log(site, &suppressed)) {
+        if (suppressed) {
+            log_log(LOG_LEVEL_ERROR, file, line,
+              "Check failed: %s (in %s()), %lu more failures since last report",
+              expr, func, suppressed);
+        } else {
+            log_log(LOG_LEVEL_ERROR, file, line, "Check failed: %s (in %s())",
+              expr, func);
+        }
+        print_stack_trace(LOG_LEVEL_ERROR);
+    }
+
+    if (abort_after) {
+        abort();
+    }
+}
+
+// private
+
+/*
+    Decide if this failure of 'site' is logged: the first one always is, the
+    rest only when the interval since the last logged one has passed. Of
+    threads that fail concurrently only one wins. Stores number of failures
+    that weren't logged since the last logged one to 'suppressed'.
+*/
+static
+int claim_log(struct check_site *site, unsigned long *suppressed) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t now_ns = now.tv_sec * 1000000000ull + now.tv_nsec;
+
+    uint64_t logged_ns = __atomic_load_n(&site->logged_ns, __ATOMIC_RELAXED);
+    uint64_t interval_ns = __atomic_load_n(&log_interval_ms, __ATOMIC_RELAXED)
+                           * 1000000ull;
+
+    if (logged_ns && now_ns - logged_ns < interval_ns) {
+        return 0;
+    }
+
+    if (!__atomic_compare_exchange_n(&site->logged_ns, &logged_ns, now_ns, 0,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    unsigned long failures = __atomic_load_n(&site->failures,
+                                             __ATOMIC_RELAXED);
+    unsigned long reported = __atomic_exchange_n(&site->reported, failures,
+                                                 __ATOMIC_RELAXED);
+
+    // this failure is the one being logged
+    *suppressed = failures - reported - 1;
+    return 1;
+}
@@ -0,0 +1,102 @@
+#ifndef CHECK_H_INCLUDED
+#define CHECK_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+    Assertions that log what failed, where and how it got there, instead of
+    just aborting like assert() does.
+
+    DBG_ASSERT(expr) is meant for cheap checks that may stay in hot paths,
+    DBG_CHECK(expr) for expensive ones, e.g. validation of a whole data
+    structure. Which of them are compiled is selected by defining
+    DBG_CHECK_LEVEL (for the whole build or before including this header):
+
+    DBG_CHECK_OFF       - none, default if NDEBUG is defined
+    DBG_CHECK_CHEAP     - DBG_ASSERT() only, default otherwise
+    DBG_CHECK_EXPENSIVE - both
+
+    Checks that are compiled out don't evaluate the expression (it is still
+    compiled, so it can't rot and its variables don't become unused). Enabled
+    checks cost a predicted-not-taken branch; the failure path is kept out of
+    line.
+
+    A failed check logs with LOG_LEVEL_ERROR, attributed to file and line of
+    the check:
+
+    Check failed: queue->count <= queue->capacity (in queue_push())
+
+    followed by the stack trace, and then aborts the program. With
+    CHECK_POLICY_CONTINUE the program goes on instead, and failures of every
+    check are logged at most once per interval set by check_set_log_interval()
+    (1 second by default), along with the number of failures since the last
+    logged one, so that a check failing in a loop doesn't flood the log.
+*/
+
+#define DBG_CHECK_OFF       0
+#define DBG_CHECK_CHEAP     1
+#define DBG_CHECK_EXPENSIVE 2
+
+#ifndef DBG_CHECK_LEVEL
+# ifdef NDEBUG
+#  define DBG_CHECK_LEVEL DBG_CHECK_OFF
+# else
+#  define DBG_CHECK_LEVEL DBG_CHECK_CHEAP
+# endif
+#endif
+
+typedef enum {
+    CHECK_POLICY_ABORT,
+    CHECK_POLICY_CONTINUE,
+} check_policy_t;
+
+/*
+    State of a single check, for rate limiting. Private to check.c.
+*/
+struct check_site {
+    unsigned long failures;
+    unsigned long reported;     // 'failures' when it was logged last time
+    uint64_t logged_ns;
+};
+
+#define CHECK_IMPL(expr) \
+    do { \
+        if (__builtin_expect(!(expr), 0)) { \
+            static struct check_site check_site_; \
+            check_fail(&check_site_, #expr, __FILE__, __LINE__, __func__); \
+        } \
+    } while (0)
+
+#define CHECK_NONE(expr) ((void) sizeof(!(expr)))
+
+#if DBG_CHECK_LEVEL >= DBG_CHECK_CHEAP
+# define DBG_ASSERT(expr) CHECK_IMPL(expr)
+#else
+# define DBG_ASSERT(expr) CHECK_NONE(expr)
+#endif
+
+#if DBG_CHECK_LEVEL >= DBG_CHECK_EXPENSIVE
+# define DBG_CHECK(expr) CHECK_IMPL(expr)
+#else
+# define DBG_CHECK(expr) CHECK_NONE(expr)
+#endif
+
+/*
+    Set what happens after a failed check is logged. Default is
+    CHECK_POLICY_ABORT.
+*/
+void check_set_policy(check_policy_t policy);
+
+/*
+    Set minimal interval between logged failures of the same check with
+    CHECK_POLICY_CONTINUE. 0 logs every failure.
+*/
+void check_set_log_interval(unsigned interval_ms);
+
+/*
+    Failure path of the macros above.
+*/
+void check_fail(struct check_site *site, const char *expr, const char *file,
+  int line, const char *func);
+
+#endif // CHECK_H_INCLUDED
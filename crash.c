@@ -0,0 +1,401 @@
+#define _GNU_SOURCE
+
+#include "crash.h"
+
+#include "cfi.h"
+#include "log.h"
+#include "minidump.h"
+#include "modmap.h"
+#include "sigsafe.h"
+#include "threads.h"
+#include "tracectx.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#define ALT_STACK_SIZE (64 * 1024)
+#define MAX_FRAMES 64
+
+static const struct {
+    int sig;
+    const char *name;
+} signals[] = {
+    {SIGSEGV, "SIGSEGV"},
+    {SIGBUS,  "SIGBUS"},
+    {SIGFPE,  "SIGFPE"},
+    {SIGILL,  "SIGILL"},
+    {SIGABRT, "SIGABRT"},
+};
+
+#define SIGNALS_COUNT (sizeof(signals) / sizeof(signals[0]))
+
+static struct sigaction old_actions[SIGNALS_COUNT];
+static int installed;
+static int output_fd = -1;
+static char minidump_path[PATH_MAX];
+static pthread_mutex_t install_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t stack_key;
+static pthread_once_t stack_key_once = PTHREAD_ONCE_INIT;
+
+// Everything the handler needs is preallocated. Only one crash is handled
+// at a time: 'crashing_tid' is the thread that handles it.
+static pid_t crashing_tid;
+static char output[4096];
+static void *frames[MAX_FRAMES];
+
+static void handle(int sig, siginfo_t *info, void *context);
+static void create_stack_key();
+static void free_stack(void *stack);
+
+// public
+
+int crash_handler_install(int fd) {
+    if (crash_handler_thread_init()) {
+        return -1;
+    }
+
+    // modules are never rescanned in the handler
+    cfi_refresh_modules();
+
+    pthread_mutex_lock(&install_mtx);
+
+    output_fd = fd;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handle;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+
+    for (size_t i = 0; i < SIGNALS_COUNT; ++i) {
+        struct sigaction *old = installed ? NULL : &old_actions[i];
+        if (sigaction(signals[i].sig, &action, old)) {
+            LOGE("%s(): sigaction(%s) failed: %m", __func__, signals[i].name);
+
+            while (i--) {
+                sigaction(signals[i].sig, &old_actions[i], NULL);
+            }
+
+            pthread_mutex_unlock(&install_mtx);
+            return -1;
+        }
+    }
+
+    installed = 1;
+
+    pthread_mutex_unlock(&install_mtx);
+
+    return 0;
+}
+
+int crash_handler_set_minidump(const char *path, int stop_sig) {
+    if (path && strlen(path) >= sizeof(minidump_path)) {
+        LOGE("%s(): path is too long", __func__);
+        return -1;
+    }
+
+    if (path && threads_init(stop_sig)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&install_mtx);
+    strcpy(minidump_path, path ? path : "");
+    pthread_mutex_unlock(&install_mtx);
+
+    return 0;
+}
+
+void crash_handler_uninstall() {
+    pthread_mutex_lock(&install_mtx);
+
+    if (installed) {
+        for (size_t i = 0; i < SIGNALS_COUNT; ++i) {
+            sigaction(signals[i].sig, &old_actions[i], NULL);
+        }
+        installed = 0;
+    }
+
+    pthread_mutex_unlock(&install_mtx);
+}
+
+int crash_handler_thread_init() {
+    pthread_once(&stack_key_once, create_stack_key);
+
+    stack_t current;
+    if (!sigaltstack(NULL, &current) && !(current.ss_flags & SS_DISABLE)) {
+        return 0;
+    }
+
+    void *stack = mmap(NULL, ALT_STACK_SIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stack == MAP_FAILED) {
+        LOGE("%s(): mmap() failed: %m", __func__);
+        return -1;
+    }
+
+    stack_t ss;
+    ss.ss_sp = stack;
+    ss.ss_size = ALT_STACK_SIZE;
+    ss.ss_flags = 0;
+    if (sigaltstack(&ss, NULL)) {
+        LOGE("%s(): sigaltstack() failed: %m", __func__);
+        munmap(stack, ALT_STACK_SIZE);
+        return -1;
+    }
+
+    pthread_setspecific(stack_key, stack);
+
+    return 0;
+}
+
+// private
+
+static
+void create_stack_key() {
+    pthread_key_create(&stack_key, free_stack);
+}
+
+static
+void free_stack(void *stack) {
+    stack_t ss;
+    memset(&ss, 0, sizeof(ss));
+    ss.ss_flags = SS_DISABLE;
+    sigaltstack(&ss, NULL);
+
+    munmap(stack, ALT_STACK_SIZE);
+}
+
+/*
+    Restore default action of 'sig' and raise it again. Signal stays blocked
+    until the handler returns, and then terminates the process.
+*/
+static
+void reraise(int sig) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigemptyset(&action.sa_mask);
+    sigaction(sig, &action, NULL);
+
+    raise(sig);
+}
+
+#if defined(__x86_64__)
+
+static const struct {
+    const char *name;
+    int index;
+} registers[] = {
+    {"rip", REG_RIP}, {"rsp", REG_RSP}, {"rbp", REG_RBP},
+    {"rax", REG_RAX}, {"rbx", REG_RBX}, {"rcx", REG_RCX},
+    {"rdx", REG_RDX}, {"rsi", REG_RSI}, {"rdi", REG_RDI},
+    {"r8 ", REG_R8 }, {"r9 ", REG_R9 }, {"r10", REG_R10},
+    {"r11", REG_R11}, {"r12", REG_R12}, {"r13", REG_R13},
+    {"r14", REG_R14}, {"r15", REG_R15}, {"efl", REG_EFL},
+};
+
+static
+void write_registers(struct sigsafe_buf *out, const ucontext_t *uc) {
+    size_t count = sizeof(registers) / sizeof(registers[0]);
+    for (size_t i = 0; i < count; ++i) {
+        sigsafe_puts(out, i % 3 ? "  " : "\t");
+        sigsafe_puts(out, registers[i].name);
+        sigsafe_putc(out, ' ');
+        sigsafe_hex(out, uc->uc_mcontext.gregs[registers[i].index], 16);
+        if (i % 3 == 2 || i == count - 1) {
+            sigsafe_putc(out, '\n');
+        }
+    }
+}
+
+static
+void context_regs(const ucontext_t *uc, struct cfi_regs *regs) {
+    regs->pc = uc->uc_mcontext.gregs[REG_RIP];
+    regs->sp = uc->uc_mcontext.gregs[REG_RSP];
+    regs->fp = uc->uc_mcontext.gregs[REG_RBP];
+    regs->lr = 0;
+}
+
+/*
+    Step out of a frame that has just been entered by a call through a bad
+    pointer: return address is still on top of the stack.
+*/
+static
+int call_step(struct cfi_regs *regs) {
+    if (sigsafe_read_word(NULL, regs->sp, &regs->pc)) {
+        return -1;
+    }
+    regs->sp += sizeof(uintptr_t);
+    return 0;
+}
+
+#elif defined(__aarch64__)
+
+static
+void write_registers(struct sigsafe_buf *out, const ucontext_t *uc) {
+    for (int i = 0; i < 31; ++i) {
+        sigsafe_puts(out, i % 3 ? "  " : "\t");
+        sigsafe_putc(out, 'x');
+        sigsafe_dec(out, i);
+        sigsafe_puts(out, i < 10 ? "  " : " ");
+        sigsafe_hex(out, uc->uc_mcontext.regs[i], 16);
+        if (i % 3 == 2) {
+            sigsafe_putc(out, '\n');
+        }
+    }
+
+    sigsafe_puts(out, "  sp  ");
+    sigsafe_hex(out, uc->uc_mcontext.sp, 16);
+    sigsafe_puts(out, "  pc  ");
+    sigsafe_hex(out, uc->uc_mcontext.pc, 16);
+    sigsafe_puts(out, "\n\tpstate ");
+    sigsafe_hex(out, uc->uc_mcontext.pstate, 16);
+    sigsafe_putc(out, '\n');
+}
+
+static
+void context_regs(const ucontext_t *uc, struct cfi_regs *regs) {
+    regs->pc = uc->uc_mcontext.pc;
+    regs->sp = uc->uc_mcontext.sp;
+    regs->fp = uc->uc_mcontext.regs[29];
+    regs->lr = uc->uc_mcontext.regs[30];
+}
+
+/*
+    Step out of a frame that has just been entered by a call through a bad
+    pointer: return address is still in link register.
+*/
+static
+int call_step(struct cfi_regs *regs) {
+    regs->pc = regs->lr;
+    return 0;
+}
+
+#endif
+
+/*
+    Unwind stack of the interrupted code. Frame #00 is the faulting PC.
+*/
+static
+int unwind_context(const ucontext_t *uc, void **buffer, int size) {
+#ifdef CFI_REG_SP
+    struct cfi_regs regs;
+    context_regs(uc, &regs);
+
+    int depth = 0;
+    buffer[depth++] = (void *) regs.pc;
+
+    // A jump to an unmapped address leaves nothing to unwind from
+    char insn;
+    if (sigsafe_read(regs.pc, &insn, 1)) {
+        if (call_step(&regs)) {
+            return depth;
+        }
+        buffer[depth++] = (void *) regs.pc;
+    }
+
+    return depth + cfi_unwind_async(&regs, sigsafe_read_word, NULL, buffer + depth,
+      size - depth);
+#else
+    (void) uc;
+    (void) buffer;
+    (void) size;
+    return 0;
+#endif
+}
+
+static
+void handle(int sig, siginfo_t *info, void *context) {
+    pid_t tid = syscall(SYS_gettid);
+
+    pid_t expected = 0;
+    if (!__atomic_compare_exchange_n(&crashing_tid, &expected, tid, 0,
+          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        if (expected == tid) {
+            // crashed while handling a crash
+            reraise(sig);
+            return;
+        }
+
+        // another thread is reporting, it will terminate the process
+        for (;;) {
+            pause();
+        }
+    }
+
+    const char *name = "?";
+    for (size_t i = 0; i < SIGNALS_COUNT; ++i) {
+        if (signals[i].sig == sig) {
+            name = signals[i].name;
+        }
+    }
+
+    struct sigsafe_buf out;
+    sigsafe_init(&out, output_fd, output, sizeof(output));
+
+    sigsafe_puts(&out, "*** Crash: signal ");
+    sigsafe_dec(&out, sig);
+    sigsafe_puts(&out, " (");
+    sigsafe_puts(&out, name);
+    sigsafe_puts(&out, "), code ");
+    sigsafe_dec(&out, info->si_code);
+    sigsafe_puts(&out, ", fault address ");
+    sigsafe_hex(&out, (uintptr_t) info->si_addr, 0);
+    sigsafe_puts(&out, "\npid ");
+    sigsafe_dec(&out, getpid());
+    sigsafe_puts(&out, ", tid ");
+    sigsafe_dec(&out, tid);
+
+    struct tracectx ctx;
+    tracectx_get(&ctx);
+    if (ctx.trace_id) {
+        sigsafe_puts(&out, ", trace ");
+        sigsafe_hex(&out, ctx.trace_id, 16);
+        sigsafe_puts(&out, ", span ");
+        sigsafe_hex(&out, ctx.span_id, 16);
+    }
+    sigsafe_putc(&out, '\n');
+
+#ifdef CFI_REG_SP
+    sigsafe_puts(&out, "Registers:\n");
+    write_registers(&out, context);
+#endif
+
+    // Map goes first, so that symbolize tool knows it when it reads the trace
+    modmap_write_async(&out, 0);
+
+    int depth = unwind_context(context, frames, MAX_FRAMES);
+    sigsafe_puts(&out, "Raw stack trace: ");
+    sigsafe_dec(&out, depth);
+    sigsafe_puts(&out, " frames (module map 0)\n");
+
+    for (int i = 0; i < depth; ++i) {
+        sigsafe_puts(&out, i < 10 ? "\t#0" : "\t#");
+        sigsafe_dec(&out, i);
+        sigsafe_putc(&out, ' ');
+        sigsafe_hex(&out, (uintptr_t) frames[i], 0);
+        // symbolize tool looks it up as is, not as a return address
+        sigsafe_puts(&out, i ? "\n" : " (exact pc)\n");
+    }
+
+    sigsafe_flush(&out);
+
+    if (minidump_path[0]) {
+        int fd = open(minidump_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+          0600);
+        if (fd >= 0) {
+            minidump_write(fd, sig, info, context);
+            close(fd);
+        }
+    }
+
+    reraise(sig);
+}
@@ -0,0 +1,76 @@
+#ifndef CRASH_H_INCLUDED
+#define CRASH_H_INCLUDED
+
+/*
+    Crash handler for SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT. On a crash
+    it writes signal, fault address, registers, stack trace and module map
+    to a file descriptor, then restores default action and re-raises the
+    signal, so that the process terminates (and dumps core) as it would
+    without the handler:
+
+    *** Crash: signal 11 (SIGSEGV), code 1, fault address 0x0
+    pid 1234, tid 1236, trace 0x3f1c9e0d27b64a85, span 0x9a07c1e2f3b4d5a6
+    Registers:
+        rip 0x000055c0b4a01d84  rsp 0x00007ffd2d8e1a30  rbp 0x00007ffd2d8e1a50
+        ...
+    Module map 0: from /proc/self/maps
+        0x55c0b4a00000-0x55c0b4a05018 bias 0x55c0b4a00000 id 3fd2...a1 /usr/bin/driver_manager
+        ...
+    Raw stack trace: 5 frames (module map 0)
+        #00 0x55c0b4a01d84 (exact pc)
+        ...
+
+    Addresses are not symbolized in the handler: pass the output to
+    tools/symbolize. Frame #00 is the faulting instruction itself, which is
+    marked "(exact pc)", since other frames are return addresses. Trace and
+    span are there if the thread had a trace context (see tracectx.h). For more
+    than that, enable minidumps with crash_handler_set_minidump().
+
+    The handler is async-signal-safe: it doesn't allocate memory or take
+    locks, output is formatted to a preallocated buffer and written with raw
+    write(). It runs on an alternate signal stack, so stack overflows are
+    reported too, and unwinds from the context of the interrupted code rather
+    than from its own frame (see cfi_unwind_async()). Stack trace is available
+    on x86-64 and AArch64 only.
+
+    Alternate signal stack is per thread: crash_handler_install() sets it up
+    for the calling thread, other threads have to call
+    crash_handler_thread_init(). Without it, a thread's crash is still
+    reported unless it's a stack overflow.
+
+    If several threads crash at once, only the first one is reported, the
+    others wait for the process to be terminated.
+*/
+
+/*
+    Install crash handler that writes reports to 'fd' (e.g. STDERR_FILENO or
+    a file opened in advance).
+
+    Returns 0 on success and -1 on error.
+*/
+int crash_handler_install(int fd);
+
+/*
+    Also write a minidump (see minidump.h) to file at 'path' on a crash, or
+    stop doing so if 'path' is NULL. Other threads are stopped with signal
+    'stop_sig' (e.g. SIGRTMIN + 1) to capture their registers, see threads.h;
+    it must not be used for anything else.
+
+    Returns 0 on success and -1 on error.
+*/
+int crash_handler_set_minidump(const char *path, int stop_sig);
+
+/*
+    Restore signal actions that were there before crash_handler_install().
+*/
+void crash_handler_uninstall();
+
+/*
+    Set up alternate signal stack for the calling thread. It is freed when
+    the thread exits. Calling it again in the same thread does nothing.
+
+    Returns 0 on success and -1 on error.
+*/
+int crash_handler_thread_init();
+
+#endif // CRASH_H_INCLUDED
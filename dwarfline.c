@@ -0,0 +1,1647 @@
+#define _GNU_SOURCE
+
+#include "dwarfline.h"
+
+#include "log.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_INLINE_DEPTH 32
+#define MAX_ORIGIN_HOPS 4
+
+enum {
+    DW_TAG_inlined_subroutine = 0x1d,
+    DW_TAG_subprogram = 0x2e,
+};
+
+enum {
+    DW_AT_name = 0x03,
+    DW_AT_stmt_list = 0x10,
+    DW_AT_low_pc = 0x11,
+    DW_AT_high_pc = 0x12,
+    DW_AT_abstract_origin = 0x31,
+    DW_AT_specification = 0x47,
+    DW_AT_ranges = 0x55,
+    DW_AT_call_file = 0x58,
+    DW_AT_call_line = 0x59,
+    DW_AT_linkage_name = 0x6e,
+    DW_AT_str_offsets_base = 0x72,
+    DW_AT_addr_base = 0x73,
+    DW_AT_rnglists_base = 0x74,
+    DW_AT_MIPS_linkage_name = 0x2007,
+};
+
+enum {
+    DW_FORM_addr = 0x01,
+    DW_FORM_block2 = 0x03,
+    DW_FORM_block4 = 0x04,
+    DW_FORM_data2 = 0x05,
+    DW_FORM_data4 = 0x06,
+    DW_FORM_data8 = 0x07,
+    DW_FORM_string = 0x08,
+    DW_FORM_block = 0x09,
+    DW_FORM_block1 = 0x0a,
+    DW_FORM_data1 = 0x0b,
+    DW_FORM_flag = 0x0c,
+    DW_FORM_sdata = 0x0d,
+    DW_FORM_strp = 0x0e,
+    DW_FORM_udata = 0x0f,
+    DW_FORM_ref_addr = 0x10,
+    DW_FORM_ref1 = 0x11,
+    DW_FORM_ref2 = 0x12,
+    DW_FORM_ref4 = 0x13,
+    DW_FORM_ref8 = 0x14,
+    DW_FORM_ref_udata = 0x15,
+    DW_FORM_indirect = 0x16,
+    DW_FORM_sec_offset = 0x17,
+    DW_FORM_exprloc = 0x18,
+    DW_FORM_flag_present = 0x19,
+    DW_FORM_strx = 0x1a,
+    DW_FORM_addrx = 0x1b,
+    DW_FORM_ref_sup4 = 0x1c,
+    DW_FORM_strp_sup = 0x1d,
+    DW_FORM_data16 = 0x1e,
+    DW_FORM_line_strp = 0x1f,
+    DW_FORM_ref_sig8 = 0x20,
+    DW_FORM_implicit_const = 0x21,
+    DW_FORM_loclistx = 0x22,
+    DW_FORM_rnglistx = 0x23,
+    DW_FORM_ref_sup8 = 0x24,
+    DW_FORM_strx1 = 0x25,
+    DW_FORM_strx2 = 0x26,
+    DW_FORM_strx3 = 0x27,
+    DW_FORM_strx4 = 0x28,
+    DW_FORM_addrx1 = 0x29,
+    DW_FORM_addrx2 = 0x2a,
+    DW_FORM_addrx3 = 0x2b,
+    DW_FORM_addrx4 = 0x2c,
+    DW_FORM_GNU_addr_index = 0x1f01,
+    DW_FORM_GNU_str_index = 0x1f02,
+    DW_FORM_GNU_ref_alt = 0x1f20,
+    DW_FORM_GNU_strp_alt = 0x1f21,
+};
+
+enum {
+    DW_UT_compile = 0x01,
+    DW_UT_partial = 0x03,
+    DW_UT_skeleton = 0x04,
+    DW_UT_split_compile = 0x05,
+};
+
+enum {
+    DW_RLE_end_of_list = 0x00,
+    DW_RLE_base_addressx = 0x01,
+    DW_RLE_startx_endx = 0x02,
+    DW_RLE_startx_length = 0x03,
+    DW_RLE_offset_pair = 0x04,
+    DW_RLE_base_address = 0x05,
+    DW_RLE_start_end = 0x06,
+    DW_RLE_start_length = 0x07,
+};
+
+enum {
+    DW_LNS_copy = 0x01,
+    DW_LNS_advance_pc = 0x02,
+    DW_LNS_advance_line = 0x03,
+    DW_LNS_set_file = 0x04,
+    DW_LNS_const_add_pc = 0x08,
+    DW_LNS_fixed_advance_pc = 0x09,
+    DW_LNE_end_sequence = 0x01,
+    DW_LNE_set_address = 0x02,
+    DW_LNCT_path = 0x01,
+};
+
+enum {
+    SEC_INFO,
+    SEC_ABBREV,
+    SEC_LINE,
+    SEC_STR,
+    SEC_LINE_STR,
+    SEC_RANGES,
+    SEC_RNGLISTS,
+    SEC_ADDR,
+    SEC_STR_OFFSETS,
+    SEC_COUNT
+};
+
+static const char *section_names[SEC_COUNT] = {
+    ".debug_info", ".debug_abbrev", ".debug_line", ".debug_str",
+    ".debug_line_str", ".debug_ranges", ".debug_rnglists", ".debug_addr",
+    ".debug_str_offsets",
+};
+
+// attributes we are interested in, index into 'struct die'
+enum {
+    A_NAME,
+    A_LINKAGE_NAME,
+    A_LOW_PC,
+    A_HIGH_PC,
+    A_RANGES,
+    A_ABSTRACT_ORIGIN,
+    A_SPECIFICATION,
+    A_CALL_FILE,
+    A_CALL_LINE,
+    A_STMT_LIST,
+    A_STR_OFFSETS_BASE,
+    A_ADDR_BASE,
+    A_RNGLISTS_BASE,
+    A_COUNT
+};
+
+struct section {
+    const uint8_t *data;
+    size_t size;
+};
+
+struct cursor {
+    const uint8_t *p;
+    const uint8_t *end;
+};
+
+struct attr {
+    uint64_t form;
+    uint64_t value;         // constant, offset, index or address
+    const uint8_t *ptr;     // DW_FORM_string
+};
+
+struct abbrev {
+    uint64_t code;
+    uint64_t tag;
+    int children;
+    const uint8_t *specs;   // (name, form[, implicit const]) pairs
+    const uint8_t *specs_end;
+};
+
+struct die {
+    uint64_t tag;
+    int children;
+    uint32_t present;       // bitmask of A_*
+    struct attr attrs[A_COUNT];
+};
+
+struct row {
+    uint64_t addr;
+    uint32_t file;
+    uint32_t line;
+    uint32_t order;
+    uint32_t end_sequence;
+};
+
+struct func {
+    uint64_t lo;
+    uint64_t hi;
+    const char *name;
+    uint32_t call_file;
+    uint32_t call_line;
+    uint32_t depth;
+    uint32_t inlined;
+};
+
+struct unit {
+    const uint8_t *start;   // unit header, base of DW_FORM_ref*
+    const uint8_t *dies;
+    const uint8_t *end;
+    uint16_t version;
+    uint8_t addr_size;
+    uint8_t offset_size;
+    struct abbrev *abbrevs;
+    size_t abbrevs_count;
+    uint64_t str_offsets_base;
+    uint64_t addr_base;
+    uint64_t rnglists_base;
+    uint64_t low_pc;
+    uint64_t stmt_list;
+    int has_stmt_list;
+
+    // parsed on first lookup
+    int parsed;
+    struct row *rows;
+    size_t rows_count;
+    const char **files;
+    size_t files_count;
+    struct func *funcs;
+    size_t funcs_count;
+};
+
+struct range {
+    uint64_t lo;
+    uint64_t hi;
+    size_t unit;
+};
+
+struct dwarfline {
+    void *map;
+    size_t map_size;
+    struct section sections[SEC_COUNT];
+    struct unit *units;
+    size_t units_count;
+    struct range *ranges;
+    size_t ranges_count;
+    pthread_mutex_t mtx;
+};
+
+// growable array of 'size'-byte elements
+struct vec {
+    void *data;
+    size_t count;
+    size_t capacity;
+};
+
+static char debug_dir[PATH_MAX] = "/usr/lib/debug";
+static pthread_mutex_t debug_dir_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int map_file(struct dwarfline *lines, const char *path);
+static int index_units(struct dwarfline *lines);
+static int parse_unit(struct dwarfline *lines, struct unit *unit);
+static void free_unit(struct unit *unit);
+
+// public
+
+void dwarfline_set_debug_dir(const char *dir) {
+    pthread_mutex_lock(&debug_dir_mtx);
+    snprintf(debug_dir, sizeof(debug_dir), "%s", dir);
+    pthread_mutex_unlock(&debug_dir_mtx);
+}
+
+struct dwarfline *dwarfline_open(const char *path) {
+    struct dwarfline *lines = calloc(1, sizeof(struct dwarfline));
+    if (!lines) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&lines->mtx, NULL);
+
+    if (map_file(lines, path) || index_units(lines) || !lines->ranges_count) {
+        dwarfline_close(lines);
+        return NULL;
+    }
+
+    return lines;
+}
+
+void dwarfline_close(struct dwarfline *lines) {
+    if (!lines) {
+        return;
+    }
+
+    for (size_t i = 0; i < lines->units_count; ++i) {
+        free_unit(&lines->units[i]);
+    }
+
+    free(lines->units);
+    free(lines->ranges);
+    if (lines->map) {
+        munmap(lines->map, lines->map_size);
+    }
+    pthread_mutex_destroy(&lines->mtx);
+    free(lines);
+}
+
+static const struct range *find_range(const struct dwarfline *lines,
+  uint64_t addr);
+static const struct row *find_row(const struct unit *unit, uint64_t addr);
+static const char *file_name(const struct unit *unit, uint32_t index);
+static int func_depth_cmp(const void *a, const void *b);
+
+int dwarfline_lookup(struct dwarfline *lines, uintptr_t addr,
+  struct dwarfline_frame *frames, int max) {
+    if (max <= 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&lines->mtx);
+
+    const struct range *range = find_range(lines, addr);
+    struct unit *unit = range ? &lines->units[range->unit] : NULL;
+    if (!unit || parse_unit(lines, unit)) {
+        pthread_mutex_unlock(&lines->mtx);
+        return 0;
+    }
+
+    const struct row *row = find_row(unit, addr);
+
+    // functions containing 'addr', up to the innermost real subprogram
+    const struct func *chain[MAX_INLINE_DEPTH];
+    int chain_length = 0;
+    for (size_t i = 0; i < unit->funcs_count; ++i) {
+        const struct func *func = &unit->funcs[i];
+        if (addr >= func->lo && addr < func->hi
+            && chain_length < MAX_INLINE_DEPTH) {
+            chain[chain_length++] = func;
+        }
+    }
+
+    qsort(chain, chain_length, sizeof(chain[0]), func_depth_cmp);
+    for (int i = 0; i < chain_length; ++i) {
+        if (!chain[i]->inlined) {
+            chain_length = i + 1;
+            break;
+        }
+    }
+
+    int count = 0;
+    frames[count].function = chain_length ? chain[0]->name : NULL;
+    frames[count].file = row ? file_name(unit, row->file) : NULL;
+    frames[count].line = row ? row->line : 0;
+    ++count;
+
+    for (int i = 1; i < chain_length && count < max; ++i) {
+        frames[count].function = chain[i]->name;
+        frames[count].file = file_name(unit, chain[i - 1]->call_file);
+        frames[count].line = chain[i - 1]->call_line;
+        ++count;
+    }
+
+    pthread_mutex_unlock(&lines->mtx);
+
+    if (!row && !chain_length) {
+        return 0;
+    }
+
+    return count;
+}
+
+// private
+
+static
+int vec_push(struct vec *vec, const void *element, size_t size) {
+    if (vec->count == vec->capacity) {
+        size_t capacity = vec->capacity ? vec->capacity * 2 : 64;
+        void *data = realloc(vec->data, capacity * size);
+        if (!data) {
+            return -1;
+        }
+
+        vec->data = data;
+        vec->capacity = capacity;
+    }
+
+    memcpy((char *) vec->data + vec->count * size, element, size);
+    ++vec->count;
+    return 0;
+}
+
+static
+int cursor_init(struct cursor *c, const struct section *section,
+  uint64_t offset) {
+    if (!section->data || offset >= section->size) {
+        c->p = c->end = NULL;
+        return -1;
+    }
+
+    c->p = section->data + offset;
+    c->end = section->data + section->size;
+    return 0;
+}
+
+static
+uint64_t read_fixed(struct cursor *c, size_t size) {
+    if ((size_t) (c->end - c->p) < size) {
+        c->p = c->end;
+        return 0;
+    }
+
+    uint64_t value = 0;
+    switch (size) {
+    case 1: value = *c->p; break;
+    case 2: { uint16_t v; memcpy(&v, c->p, 2); value = v; break; }
+    case 4: { uint32_t v; memcpy(&v, c->p, 4); value = v; break; }
+    case 8: { uint64_t v; memcpy(&v, c->p, 8); value = v; break; }
+    default:
+        for (size_t i = 0; i < size; ++i) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            value = (value << 8) | c->p[i];
+#else
+            value |= (uint64_t) c->p[i] << (8 * i);
+#endif
+        }
+        break;
+    }
+
+    c->p += size;
+    return value;
+}
+
+static
+uint64_t read_uleb(struct cursor *c) {
+    uint64_t result = 0;
+    unsigned shift = 0;
+
+    while (c->p < c->end) {
+        uint8_t byte = *c->p++;
+        if (shift < 64) {
+            result |= (uint64_t) (byte & 0x7f) << shift;
+        }
+        shift += 7;
+
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+
+    return result;
+}
+
+static
+int64_t read_sleb(struct cursor *c) {
+    int64_t result = 0;
+    unsigned shift = 0;
+    uint8_t byte = 0;
+
+    while (c->p < c->end) {
+        byte = *c->p++;
+        if (shift < 64) {
+            result |= (int64_t) (byte & 0x7f) << shift;
+        }
+        shift += 7;
+
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+
+    if (shift < 64 && (byte & 0x40)) {
+        result |= -((int64_t) 1 << shift);
+    }
+
+    return result;
+}
+
+static
+const char *read_cstr(struct cursor *c) {
+    const uint8_t *start = c->p;
+    const uint8_t *nul = memchr(start, 0, c->end - start);
+    if (!nul) {
+        c->p = c->end;
+        return NULL;
+    }
+
+    c->p = nul + 1;
+    return (const char *) start;
+}
+
+/*
+    Read unit length and set 'end' to the end of the unit. Returns offset size:
+    4 for 32-bit DWARF, 8 for 64-bit one, 0 on malformed length.
+*/
+static
+int read_unit_length(struct cursor *c, const uint8_t **end) {
+    int offset_size = 4;
+    uint64_t length = read_fixed(c, 4);
+    if (length == 0xffffffff) {
+        offset_size = 8;
+        length = read_fixed(c, 8);
+    }
+
+    if (!length || length > (uint64_t) (c->end - c->p)) {
+        return 0;
+    }
+
+    *end = c->p + length;
+    return offset_size;
+}
+
+/*
+    Read value of attribute in 'form'. Values that need unit's bases (string
+    and address indices) are only read here and resolved with attr_string() /
+    attr_address(), since the bases may come later in the same DIE.
+*/
+static
+int read_form(const struct unit *unit, struct cursor *c, uint64_t form,
+  int64_t implicit_const, struct attr *attr) {
+    attr->form = form;
+    attr->value = 0;
+    attr->ptr = NULL;
+
+    switch (form) {
+    case DW_FORM_addr:
+        attr->value = read_fixed(c, unit->addr_size);
+        break;
+
+    case DW_FORM_data1:
+    case DW_FORM_ref1:
+    case DW_FORM_flag:
+    case DW_FORM_strx1:
+    case DW_FORM_addrx1:
+        attr->value = read_fixed(c, 1);
+        break;
+
+    case DW_FORM_data2:
+    case DW_FORM_ref2:
+    case DW_FORM_strx2:
+    case DW_FORM_addrx2:
+        attr->value = read_fixed(c, 2);
+        break;
+
+    case DW_FORM_strx3:
+    case DW_FORM_addrx3:
+        attr->value = read_fixed(c, 3);
+        break;
+
+    case DW_FORM_data4:
+    case DW_FORM_ref4:
+    case DW_FORM_ref_sup4:
+    case DW_FORM_strx4:
+    case DW_FORM_addrx4:
+        attr->value = read_fixed(c, 4);
+        break;
+
+    case DW_FORM_data8:
+    case DW_FORM_ref8:
+    case DW_FORM_ref_sig8:
+    case DW_FORM_ref_sup8:
+        attr->value = read_fixed(c, 8);
+        break;
+
+    case DW_FORM_data16:
+        read_fixed(c, 8);
+        read_fixed(c, 8);
+        break;
+
+    case DW_FORM_sdata:
+        attr->value = read_sleb(c);
+        break;
+
+    case DW_FORM_udata:
+    case DW_FORM_ref_udata:
+    case DW_FORM_strx:
+    case DW_FORM_addrx:
+    case DW_FORM_loclistx:
+    case DW_FORM_rnglistx:
+    case DW_FORM_GNU_addr_index:
+    case DW_FORM_GNU_str_index:
+        attr->value = read_uleb(c);
+        break;
+
+    case DW_FORM_strp:
+    case DW_FORM_line_strp:
+    case DW_FORM_sec_offset:
+    case DW_FORM_strp_sup:
+    case DW_FORM_GNU_ref_alt:
+    case DW_FORM_GNU_strp_alt:
+        attr->value = read_fixed(c, unit->offset_size);
+        break;
+
+    case DW_FORM_ref_addr:
+        attr->value = read_fixed(c, unit->version <= 2 ? unit->addr_size
+                                                       : unit->offset_size);
+        break;
+
+    case DW_FORM_string:
+        attr->ptr = c->p;
+        read_cstr(c);
+        break;
+
+    case DW_FORM_block1:
+        c->p += read_fixed(c, 1);
+        break;
+
+    case DW_FORM_block2:
+        c->p += read_fixed(c, 2);
+        break;
+
+    case DW_FORM_block4:
+        c->p += read_fixed(c, 4);
+        break;
+
+    case DW_FORM_block:
+    case DW_FORM_exprloc:
+        c->p += read_uleb(c);
+        break;
+
+    case DW_FORM_flag_present:
+        attr->value = 1;
+        break;
+
+    case DW_FORM_implicit_const:
+        attr->value = implicit_const;
+        break;
+
+    case DW_FORM_indirect:
+        return read_form(unit, c, read_uleb(c), 0, attr);
+
+    default:
+        return -1;
+    }
+
+    if (c->p > c->end) {
+        c->p = c->end;
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+const char *attr_string(const struct dwarfline *lines, const struct unit *unit,
+  const struct attr *attr) {
+    const struct section *str = &lines->sections[SEC_STR];
+    uint64_t offset;
+
+    switch (attr->form) {
+    case DW_FORM_string:
+        return (const char *) attr->ptr;
+
+    case DW_FORM_strp:
+        offset = attr->value;
+        break;
+
+    case DW_FORM_line_strp:
+        str = &lines->sections[SEC_LINE_STR];
+        offset = attr->value;
+        break;
+
+    case DW_FORM_strx:
+    case DW_FORM_strx1:
+    case DW_FORM_strx2:
+    case DW_FORM_strx3:
+    case DW_FORM_strx4:
+    case DW_FORM_GNU_str_index: {
+        struct cursor c;
+        if (cursor_init(&c, &lines->sections[SEC_STR_OFFSETS],
+              unit->str_offsets_base + attr->value * unit->offset_size)) {
+            return NULL;
+        }
+        offset = read_fixed(&c, unit->offset_size);
+        break;
+    }
+
+    default:
+        return NULL;
+    }
+
+    if (!str->data || offset >= str->size
+        || !memchr(str->data + offset, 0, str->size - offset)) {
+        return NULL;
+    }
+
+    return (const char *) str->data + offset;
+}
+
+static
+uint64_t attr_address(const struct dwarfline *lines, const struct unit *unit,
+  const struct attr *attr) {
+    switch (attr->form) {
+    case DW_FORM_addrx:
+    case DW_FORM_addrx1:
+    case DW_FORM_addrx2:
+    case DW_FORM_addrx3:
+    case DW_FORM_addrx4:
+    case DW_FORM_GNU_addr_index: {
+        struct cursor c;
+        if (cursor_init(&c, &lines->sections[SEC_ADDR],
+              unit->addr_base + attr->value * unit->addr_size)) {
+            return 0;
+        }
+        return read_fixed(&c, unit->addr_size);
+    }
+
+    default:
+        return attr->value;
+    }
+}
+
+static
+int attr_slot(uint64_t name) {
+    switch (name) {
+    case DW_AT_name: return A_NAME;
+    case DW_AT_linkage_name:
+    case DW_AT_MIPS_linkage_name: return A_LINKAGE_NAME;
+    case DW_AT_low_pc: return A_LOW_PC;
+    case DW_AT_high_pc: return A_HIGH_PC;
+    case DW_AT_ranges: return A_RANGES;
+    case DW_AT_abstract_origin: return A_ABSTRACT_ORIGIN;
+    case DW_AT_specification: return A_SPECIFICATION;
+    case DW_AT_call_file: return A_CALL_FILE;
+    case DW_AT_call_line: return A_CALL_LINE;
+    case DW_AT_stmt_list: return A_STMT_LIST;
+    case DW_AT_str_offsets_base: return A_STR_OFFSETS_BASE;
+    case DW_AT_addr_base: return A_ADDR_BASE;
+    case DW_AT_rnglists_base: return A_RNGLISTS_BASE;
+    default: return -1;
+    }
+}
+
+static
+int parse_abbrevs(struct dwarfline *lines, struct unit *unit,
+  uint64_t offset) {
+    struct cursor c;
+    if (cursor_init(&c, &lines->sections[SEC_ABBREV], offset)) {
+        return -1;
+    }
+
+    struct vec abbrevs = { 0 };
+    while (c.p < c.end) {
+        struct abbrev abbrev;
+        abbrev.code = read_uleb(&c);
+        if (!abbrev.code) {
+            break;
+        }
+
+        abbrev.tag = read_uleb(&c);
+        abbrev.children = read_fixed(&c, 1);
+        abbrev.specs = c.p;
+
+        for (;;) {
+            uint64_t name = read_uleb(&c);
+            uint64_t form = read_uleb(&c);
+            if (form == DW_FORM_implicit_const) {
+                read_sleb(&c);
+            }
+            if ((!name && !form) || c.p >= c.end) {
+                break;
+            }
+        }
+        abbrev.specs_end = c.p;
+
+        if (vec_push(&abbrevs, &abbrev, sizeof(abbrev))) {
+            free(abbrevs.data);
+            return -1;
+        }
+    }
+
+    unit->abbrevs = abbrevs.data;
+    unit->abbrevs_count = abbrevs.count;
+    return 0;
+}
+
+static
+const struct abbrev *find_abbrev(const struct unit *unit, uint64_t code) {
+    // codes are almost always assigned sequentially starting with 1
+    if (code - 1 < unit->abbrevs_count
+        && unit->abbrevs[code - 1].code == code) {
+        return &unit->abbrevs[code - 1];
+    }
+
+    for (size_t i = 0; i < unit->abbrevs_count; ++i) {
+        if (unit->abbrevs[i].code == code) {
+            return &unit->abbrevs[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+    Read DIE at cursor. Returns 1 for null entry (end of siblings), 0 for
+    a DIE and -1 on malformed data.
+*/
+static
+int read_die(const struct unit *unit, struct cursor *c, struct die *die) {
+    uint64_t code = read_uleb(c);
+    if (!code) {
+        return 1;
+    }
+
+    const struct abbrev *abbrev = find_abbrev(unit, code);
+    if (!abbrev) {
+        return -1;
+    }
+
+    die->tag = abbrev->tag;
+    die->children = abbrev->children;
+    die->present = 0;
+
+    struct cursor specs = { abbrev->specs, abbrev->specs_end };
+    for (;;) {
+        uint64_t name = read_uleb(&specs);
+        uint64_t form = read_uleb(&specs);
+        int64_t implicit_const = 0;
+        if (form == DW_FORM_implicit_const) {
+            implicit_const = read_sleb(&specs);
+        }
+
+        if ((!name && !form) || specs.p > specs.end) {
+            break;
+        }
+
+        struct attr attr;
+        if (read_form(unit, c, form, implicit_const, &attr)) {
+            return -1;
+        }
+
+        int slot = attr_slot(name);
+        if (slot >= 0) {
+            die->attrs[slot] = attr;
+            die->present |= 1u << slot;
+        }
+    }
+
+    return 0;
+}
+
+static
+int has_attr(const struct die *die, int slot) {
+    return die->present & (1u << slot);
+}
+
+typedef int (*range_fn)(void *arg, uint64_t lo, uint64_t hi);
+
+static
+int for_each_range(const struct dwarfline *lines, const struct unit *unit,
+  const struct die *die, range_fn fn, void *arg) {
+    if (has_attr(die, A_LOW_PC) && has_attr(die, A_HIGH_PC)) {
+        uint64_t lo = attr_address(lines, unit, &die->attrs[A_LOW_PC]);
+        const struct attr *high = &die->attrs[A_HIGH_PC];
+        uint64_t hi = high->form == DW_FORM_addr
+                   || (high->form >= DW_FORM_addrx1
+                       && high->form <= DW_FORM_addrx4)
+                   || high->form == DW_FORM_addrx
+                    ? attr_address(lines, unit, high)
+                    : lo + high->value;
+
+        return lo < hi ? fn(arg, lo, hi) : 0;
+    }
+
+    if (!has_attr(die, A_RANGES)) {
+        return 0;
+    }
+
+    const struct attr *ranges = &die->attrs[A_RANGES];
+    uint64_t base = unit->low_pc;
+    struct cursor c;
+
+    if (unit->version < 5) {
+        if (cursor_init(&c, &lines->sections[SEC_RANGES], ranges->value)) {
+            return 0;
+        }
+
+        uint64_t max = unit->addr_size == 8 ? (uint64_t) -1
+                                            : ((uint64_t) 1 << (8 * unit->addr_size)) - 1;
+        while (c.p < c.end) {
+            uint64_t begin = read_fixed(&c, unit->addr_size);
+            uint64_t end = read_fixed(&c, unit->addr_size);
+            if (!begin && !end) {
+                break;
+            }
+
+            if (begin == max) {
+                base = end;
+            } else if (begin < end && fn(arg, base + begin, base + end)) {
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+
+    uint64_t offset = ranges->value;
+    if (ranges->form == DW_FORM_rnglistx) {
+        if (cursor_init(&c, &lines->sections[SEC_RNGLISTS],
+              unit->rnglists_base + offset * unit->offset_size)) {
+            return 0;
+        }
+        offset = unit->rnglists_base + read_fixed(&c, unit->offset_size);
+    }
+
+    if (cursor_init(&c, &lines->sections[SEC_RNGLISTS], offset)) {
+        return 0;
+    }
+
+    while (c.p < c.end) {
+        uint8_t kind = read_fixed(&c, 1);
+        uint64_t begin = 0, end = 0;
+        struct attr index = { DW_FORM_addrx, 0, NULL };
+
+        switch (kind) {
+        case DW_RLE_end_of_list:
+            return 0;
+
+        case DW_RLE_base_addressx:
+            index.value = read_uleb(&c);
+            base = attr_address(lines, unit, &index);
+            continue;
+
+        case DW_RLE_startx_endx:
+            index.value = read_uleb(&c);
+            begin = attr_address(lines, unit, &index);
+            index.value = read_uleb(&c);
+            end = attr_address(lines, unit, &index);
+            break;
+
+        case DW_RLE_startx_length:
+            index.value = read_uleb(&c);
+            begin = attr_address(lines, unit, &index);
+            end = begin + read_uleb(&c);
+            break;
+
+        case DW_RLE_offset_pair:
+            begin = base + read_uleb(&c);
+            end = base + read_uleb(&c);
+            break;
+
+        case DW_RLE_base_address:
+            base = read_fixed(&c, unit->addr_size);
+            continue;
+
+        case DW_RLE_start_end:
+            begin = read_fixed(&c, unit->addr_size);
+            end = read_fixed(&c, unit->addr_size);
+            break;
+
+        case DW_RLE_start_length:
+            begin = read_fixed(&c, unit->addr_size);
+            end = begin + read_uleb(&c);
+            break;
+
+        default:
+            return 0;
+        }
+
+        if (begin < end && fn(arg, begin, end)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+struct index_ctx {
+    struct vec *ranges;
+    size_t unit;
+};
+
+static
+int add_unit_range(void *arg, uint64_t lo, uint64_t hi) {
+    struct index_ctx *ctx = arg;
+    struct range range = { lo, hi, ctx->unit };
+    return vec_push(ctx->ranges, &range, sizeof(range));
+}
+
+static
+int range_cmp(const void *a, const void *b) {
+    const struct range *x = a, *y = b;
+    return x->lo < y->lo ? -1 : x->lo > y->lo;
+}
+
+/*
+    Read headers and top DIEs of all compilation units and build sorted index
+    of their address ranges. DIEs below the top one are not touched here.
+*/
+static
+int index_units(struct dwarfline *lines) {
+    struct cursor c;
+    if (cursor_init(&c, &lines->sections[SEC_INFO], 0)) {
+        return -1;
+    }
+
+    struct vec units = { 0 };
+    struct vec ranges = { 0 };
+
+    while (c.p < c.end) {
+        struct unit unit;
+        memset(&unit, 0, sizeof(unit));
+        unit.start = c.p;
+
+        const uint8_t *end;
+        unit.offset_size = read_unit_length(&c, &end);
+        if (!unit.offset_size) {
+            break;
+        }
+        unit.end = end;
+
+        unit.version = read_fixed(&c, 2);
+        uint8_t unit_type = DW_UT_compile;
+        uint64_t abbrev_offset;
+
+        if (unit.version >= 5) {
+            unit_type = read_fixed(&c, 1);
+            unit.addr_size = read_fixed(&c, 1);
+            abbrev_offset = read_fixed(&c, unit.offset_size);
+            if (unit_type == DW_UT_skeleton || unit_type == DW_UT_split_compile) {
+                read_fixed(&c, 8);  // dwo id
+            }
+        } else {
+            abbrev_offset = read_fixed(&c, unit.offset_size);
+            unit.addr_size = read_fixed(&c, 1);
+        }
+
+        unit.dies = c.p;
+        c.p = end;
+
+        if (unit.version < 2 || unit.version > 5
+            || (unit_type != DW_UT_compile && unit_type != DW_UT_partial)
+            || (unit.addr_size != 4 && unit.addr_size != 8)) {
+            continue;
+        }
+
+        if (parse_abbrevs(lines, &unit, abbrev_offset)) {
+            continue;
+        }
+
+        struct cursor dies = { unit.dies, unit.end };
+        struct die die;
+        if (read_die(&unit, &dies, &die)) {
+            free(unit.abbrevs);
+            continue;
+        }
+
+        if (has_attr(&die, A_STR_OFFSETS_BASE)) {
+            unit.str_offsets_base = die.attrs[A_STR_OFFSETS_BASE].value;
+        }
+        if (has_attr(&die, A_ADDR_BASE)) {
+            unit.addr_base = die.attrs[A_ADDR_BASE].value;
+        }
+        if (has_attr(&die, A_RNGLISTS_BASE)) {
+            unit.rnglists_base = die.attrs[A_RNGLISTS_BASE].value;
+        }
+        if (has_attr(&die, A_LOW_PC)) {
+            unit.low_pc = attr_address(lines, &unit, &die.attrs[A_LOW_PC]);
+        }
+        if (has_attr(&die, A_STMT_LIST)) {
+            unit.stmt_list = die.attrs[A_STMT_LIST].value;
+            unit.has_stmt_list = 1;
+        }
+
+        struct index_ctx ctx = { &ranges, units.count };
+        if (vec_push(&units, &unit, sizeof(unit))
+            || for_each_range(lines, &unit, &die, add_unit_range, &ctx)) {
+            free(unit.abbrevs);
+            break;
+        }
+    }
+
+    lines->units = units.data;
+    lines->units_count = units.count;
+    lines->ranges = ranges.data;
+    lines->ranges_count = ranges.count;
+
+    qsort(lines->ranges, lines->ranges_count, sizeof(struct range), range_cmp);
+    return 0;
+}
+
+static
+int row_cmp(const void *a, const void *b) {
+    const struct row *x = a, *y = b;
+    if (x->addr != y->addr) {
+        return x->addr < y->addr ? -1 : 1;
+    }
+
+    // end of one sequence goes before start of the next one at the same address
+    if (x->end_sequence != y->end_sequence) {
+        return x->end_sequence ? -1 : 1;
+    }
+
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/*
+    Read file name entries of DWARF 5 line table header.
+*/
+static
+int read_entries_v5(struct dwarfline *lines, const struct unit *unit,
+  struct cursor *c, struct vec *files) {
+    uint8_t format_count = read_fixed(c, 1);
+    uint64_t formats[2 * 16];
+    if (format_count > 16) {
+        return -1;
+    }
+
+    for (int i = 0; i < format_count; ++i) {
+        formats[2 * i] = read_uleb(c);
+        formats[2 * i + 1] = read_uleb(c);
+    }
+
+    uint64_t count = read_uleb(c);
+    for (uint64_t i = 0; i < count && c->p < c->end; ++i) {
+        const char *path = NULL;
+
+        for (int j = 0; j < format_count; ++j) {
+            struct attr attr;
+            if (read_form(unit, c, formats[2 * j + 1], 0, &attr)) {
+                return -1;
+            }
+
+            if (formats[2 * j] == DW_LNCT_path) {
+                path = attr_string(lines, unit, &attr);
+            }
+        }
+
+        if (files && vec_push(files, &path, sizeof(path))) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static
+int parse_line_program(struct dwarfline *lines, struct unit *unit) {
+    struct cursor c;
+    if (!unit->has_stmt_list
+        || cursor_init(&c, &lines->sections[SEC_LINE], unit->stmt_list)) {
+        return -1;
+    }
+
+    const uint8_t *end;
+    int offset_size = read_unit_length(&c, &end);
+    if (!offset_size) {
+        return -1;
+    }
+    c.end = end;
+
+    // line table may have its own address size, but never differs in practice
+    struct unit header_unit = *unit;
+    header_unit.offset_size = offset_size;
+
+    uint16_t version = read_fixed(&c, 2);
+    if (version < 2 || version > 5) {
+        return -1;
+    }
+
+    if (version >= 5) {
+        header_unit.addr_size = read_fixed(&c, 1);
+        read_fixed(&c, 1);  // segment selector size
+    }
+
+    uint64_t header_length = read_fixed(&c, offset_size);
+    const uint8_t *program = c.p + header_length;
+    uint8_t min_inst_length = read_fixed(&c, 1);
+    if (version >= 4) {
+        read_fixed(&c, 1);  // maximum operations per instruction
+    }
+    read_fixed(&c, 1);      // default_is_stmt
+    int8_t line_base = read_fixed(&c, 1);
+    uint8_t line_range = read_fixed(&c, 1);
+    uint8_t opcode_base = read_fixed(&c, 1);
+    const uint8_t *opcode_lengths = c.p;
+    c.p += opcode_base > 0 ? opcode_base - 1 : 0;
+
+    if (!line_range || program > end || c.p > end) {
+        return -1;
+    }
+
+    struct vec files = { 0 };
+    if (version >= 5) {
+        if (read_entries_v5(lines, &header_unit, &c, NULL)
+            || read_entries_v5(lines, &header_unit, &c, &files)) {
+            free(files.data);
+            return -1;
+        }
+    } else {
+        while (c.p < c.end && *c.p) {   // include directories
+            read_cstr(&c);
+        }
+        ++c.p;
+
+        const char *none = NULL;        // file numbers start with 1
+        vec_push(&files, &none, sizeof(none));
+        while (c.p < c.end && *c.p) {
+            const char *path = read_cstr(&c);
+            read_uleb(&c);
+            read_uleb(&c);
+            read_uleb(&c);
+            if (vec_push(&files, &path, sizeof(path))) {
+                free(files.data);
+                return -1;
+            }
+        }
+    }
+
+    struct vec rows = { 0 };
+    struct row state = { 0, 1, 1, 0, 0 };
+    int failed = 0;
+
+    c.p = program;
+    while (c.p < c.end && !failed) {
+        uint8_t op = read_fixed(&c, 1);
+        int emit = 0;
+
+        if (op >= opcode_base) {
+            uint8_t adjusted = op - opcode_base;
+            state.addr += (adjusted / line_range) * min_inst_length;
+            state.line += line_base + adjusted % line_range;
+            emit = 1;
+        } else if (op == 0) {
+            uint64_t length = read_uleb(&c);
+            const uint8_t *next = c.p + length;
+            uint8_t sub = length ? read_fixed(&c, 1) : 0;
+
+            if (sub == DW_LNE_end_sequence) {
+                state.end_sequence = 1;
+                emit = 1;
+            } else if (sub == DW_LNE_set_address) {
+                state.addr = read_fixed(&c, length - 1);
+            }
+
+            c.p = next;
+        } else {
+            switch (op) {
+            case DW_LNS_copy:
+                emit = 1;
+                break;
+            case DW_LNS_advance_pc:
+                state.addr += read_uleb(&c) * min_inst_length;
+                break;
+            case DW_LNS_advance_line:
+                state.line += read_sleb(&c);
+                break;
+            case DW_LNS_set_file:
+                state.file = read_uleb(&c);
+                break;
+            case DW_LNS_const_add_pc:
+                state.addr += ((255 - opcode_base) / line_range)
+                            * min_inst_length;
+                break;
+            case DW_LNS_fixed_advance_pc:
+                state.addr += read_fixed(&c, 2);
+                break;
+            default:
+                for (int i = 0; i < opcode_lengths[op - 1]; ++i) {
+                    read_uleb(&c);
+                }
+                break;
+            }
+        }
+
+        if (emit) {
+            state.order = rows.count;
+            failed = vec_push(&rows, &state, sizeof(state));
+
+            if (state.end_sequence) {
+                state.addr = 0;
+                state.file = 1;
+                state.line = 1;
+                state.end_sequence = 0;
+            }
+        }
+    }
+
+    if (failed) {
+        free(rows.data);
+        free(files.data);
+        return -1;
+    }
+
+    qsort(rows.data, rows.count, sizeof(struct row), row_cmp);
+
+    unit->rows = rows.data;
+    unit->rows_count = rows.count;
+    unit->files = files.data;
+    unit->files_count = files.count;
+    return 0;
+}
+
+static
+const struct unit *unit_at(const struct dwarfline *lines, const uint8_t *p) {
+    for (size_t i = 0; i < lines->units_count; ++i) {
+        if (p >= lines->units[i].dies && p < lines->units[i].end) {
+            return &lines->units[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+    Name of a function DIE, following abstract origin (for inlined and
+    out-of-line instances) and specification (for C++ methods).
+*/
+static
+const char *die_name(const struct dwarfline *lines, const struct unit *unit,
+  const struct die *die, int hops) {
+    if (has_attr(die, A_LINKAGE_NAME)) {
+        return attr_string(lines, unit, &die->attrs[A_LINKAGE_NAME]);
+    }
+
+    if (has_attr(die, A_NAME)) {
+        return attr_string(lines, unit, &die->attrs[A_NAME]);
+    }
+
+    const struct attr *ref = has_attr(die, A_ABSTRACT_ORIGIN)
+                           ? &die->attrs[A_ABSTRACT_ORIGIN]
+                           : has_attr(die, A_SPECIFICATION)
+                           ? &die->attrs[A_SPECIFICATION]
+                           : NULL;
+    if (!ref || hops >= MAX_ORIGIN_HOPS) {
+        return NULL;
+    }
+
+    const uint8_t *target;
+    switch (ref->form) {
+    case DW_FORM_ref1:
+    case DW_FORM_ref2:
+    case DW_FORM_ref4:
+    case DW_FORM_ref8:
+    case DW_FORM_ref_udata:
+        target = unit->start + ref->value;
+        break;
+
+    case DW_FORM_ref_addr:
+        target = lines->sections[SEC_INFO].data + ref->value;
+        unit = unit_at(lines, target);
+        if (!unit) {
+            return NULL;
+        }
+        break;
+
+    default:
+        return NULL;
+    }
+
+    if (target < unit->dies || target >= unit->end) {
+        return NULL;
+    }
+
+    struct cursor c = { target, unit->end };
+    struct die origin;
+    if (read_die(unit, &c, &origin)) {
+        return NULL;
+    }
+
+    return die_name(lines, unit, &origin, hops + 1);
+}
+
+struct func_ctx {
+    struct vec *funcs;
+    struct func func;
+};
+
+static
+int add_func_range(void *arg, uint64_t lo, uint64_t hi) {
+    struct func_ctx *ctx = arg;
+    ctx->func.lo = lo;
+    ctx->func.hi = hi;
+    return vec_push(ctx->funcs, &ctx->func, sizeof(ctx->func));
+}
+
+static
+int parse_funcs(struct dwarfline *lines, struct unit *unit) {
+    struct cursor c = { unit->dies, unit->end };
+    struct vec funcs = { 0 };
+    int depth = 0;
+
+    while (c.p < c.end) {
+        struct die die;
+        int rv = read_die(unit, &c, &die);
+        if (rv < 0) {
+            break;
+        }
+
+        if (rv == 1) {
+            if (--depth <= 0) {
+                break;
+            }
+            continue;
+        }
+
+        if (die.tag == DW_TAG_subprogram
+            || die.tag == DW_TAG_inlined_subroutine) {
+            struct func_ctx ctx;
+            memset(&ctx, 0, sizeof(ctx));
+            ctx.funcs = &funcs;
+            ctx.func.name = die_name(lines, unit, &die, 0);
+            ctx.func.depth = depth;
+            ctx.func.inlined = die.tag == DW_TAG_inlined_subroutine;
+            if (has_attr(&die, A_CALL_FILE)) {
+                ctx.func.call_file = die.attrs[A_CALL_FILE].value;
+            }
+            if (has_attr(&die, A_CALL_LINE)) {
+                ctx.func.call_line = die.attrs[A_CALL_LINE].value;
+            }
+
+            if (for_each_range(lines, unit, &die, add_func_range, &ctx)) {
+                free(funcs.data);
+                return -1;
+            }
+        }
+
+        if (die.children) {
+            ++depth;
+        }
+    }
+
+    unit->funcs = funcs.data;
+    unit->funcs_count = funcs.count;
+    return 0;
+}
+
+static
+int parse_unit(struct dwarfline *lines, struct unit *unit) {
+    if (!unit->parsed) {
+        unit->parsed = 1;
+
+        // a unit without line table still may tell function names
+        parse_line_program(lines, unit);
+        parse_funcs(lines, unit);
+    }
+
+    return unit->rows_count || unit->funcs_count ? 0 : -1;
+}
+
+static
+void free_unit(struct unit *unit) {
+    free(unit->abbrevs);
+    free(unit->rows);
+    free(unit->files);
+    free(unit->funcs);
+}
+
+static
+const struct range *find_range(const struct dwarfline *lines, uint64_t addr) {
+    size_t lo = 0, hi = lines->ranges_count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (lines->ranges[mid].lo <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (!lo || addr >= lines->ranges[lo - 1].hi) {
+        return NULL;
+    }
+
+    return &lines->ranges[lo - 1];
+}
+
+static
+const struct row *find_row(const struct unit *unit, uint64_t addr) {
+    size_t lo = 0, hi = unit->rows_count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (unit->rows[mid].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (!lo || unit->rows[lo - 1].end_sequence) {
+        return NULL;
+    }
+
+    return &unit->rows[lo - 1];
+}
+
+static
+const char *file_name(const struct unit *unit, uint32_t index) {
+    return index < unit->files_count ? unit->files[index] : NULL;
+}
+
+/*
+    Innermost (deepest) function first.
+*/
+static
+int func_depth_cmp(const void *a, const void *b) {
+    const struct func *x = *(const struct func * const *) a;
+    const struct func *y = *(const struct func * const *) b;
+    return x->depth > y->depth ? -1 : x->depth < y->depth;
+}
+
+/*
+    Find build-id note and return path of separate debug file for it.
+*/
+static
+int debug_file_path(const void *map, size_t map_size, char *path,
+  size_t len) {
+    const ElfW(Ehdr) *ehdr = map;
+    const ElfW(Shdr) *shdrs = (const ElfW(Shdr) *) ((const char *) map
+                                                    + ehdr->e_shoff);
+
+    for (int i = 0; i < ehdr->e_shnum; ++i) {
+        if (shdrs[i].sh_type != SHT_NOTE
+            || shdrs[i].sh_offset + shdrs[i].sh_size > map_size) {
+            continue;
+        }
+
+        const uint8_t *p = (const uint8_t *) map + shdrs[i].sh_offset;
+        const uint8_t *end = p + shdrs[i].sh_size;
+
+        while (p + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr) *note = (const ElfW(Nhdr) *) p;
+            const uint8_t *name = p + sizeof(ElfW(Nhdr));
+            const uint8_t *desc = name + ((note->n_namesz + 3) & ~3u);
+            p = desc + ((note->n_descsz + 3) & ~3u);
+            if (p > end) {
+                break;
+            }
+
+            if (note->n_type != NT_GNU_BUILD_ID || note->n_namesz != 4
+                || memcmp(name, "GNU", 4) || note->n_descsz < 2) {
+                continue;
+            }
+
+            pthread_mutex_lock(&debug_dir_mtx);
+            int n = snprintf(path, len, "%s/.build-id/%02x/", debug_dir,
+              desc[0]);
+            pthread_mutex_unlock(&debug_dir_mtx);
+
+            for (unsigned j = 1; j < note->n_descsz && n > 0
+                 && (size_t) n + 3 < len; ++j) {
+                n += snprintf(path + n, len - n, "%02x", desc[j]);
+            }
+
+            if (n <= 0 || (size_t) n + sizeof(".debug") > len) {
+                return -1;
+            }
+
+            strcpy(path + n, ".debug");
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+    Map ELF file and find debug sections in it. Returns -1 if there is no
+    .debug_info, with the file still mapped for build-id lookup.
+*/
+static
+int map_sections(struct dwarfline *lines, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -2;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t) st.st_size < sizeof(ElfW(Ehdr))) {
+        close(fd);
+        return -2;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -2;
+    }
+
+    const ElfW(Ehdr) *ehdr = map;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG)
+        || ehdr->e_ident[EI_CLASS] != __ELF_NATIVE_CLASS / 32
+        || !ehdr->e_shoff || ehdr->e_shentsize != sizeof(ElfW(Shdr))
+        || ehdr->e_shstrndx >= ehdr->e_shnum
+        || ehdr->e_shoff + ehdr->e_shnum * sizeof(ElfW(Shdr))
+           > (size_t) st.st_size) {
+        munmap(map, st.st_size);
+        return -2;
+    }
+
+    lines->map = map;
+    lines->map_size = st.st_size;
+    memset(lines->sections, 0, sizeof(lines->sections));
+
+    const ElfW(Shdr) *shdrs = (const ElfW(Shdr) *) ((const char *) map
+                                                    + ehdr->e_shoff);
+    const ElfW(Shdr) *shstrtab = &shdrs[ehdr->e_shstrndx];
+
+    for (int i = 0; i < ehdr->e_shnum; ++i) {
+        const ElfW(Shdr) *shdr = &shdrs[i];
+        if (shdr->sh_type == SHT_NOBITS || (shdr->sh_flags & SHF_COMPRESSED)
+            || shdr->sh_offset + shdr->sh_size > (size_t) st.st_size
+            || shdr->sh_name >= shstrtab->sh_size) {
+            continue;
+        }
+
+        const char *name = (const char *) map + shstrtab->sh_offset
+                         + shdr->sh_name;
+        for (int j = 0; j < SEC_COUNT; ++j) {
+            if (!strcmp(name, section_names[j])) {
+                lines->sections[j].data = (const uint8_t *) map
+                                        + shdr->sh_offset;
+                lines->sections[j].size = shdr->sh_size;
+            }
+        }
+    }
+
+    return lines->sections[SEC_INFO].data ? 0 : -1;
+}
+
+static
+int map_file(struct dwarfline *lines, const char *path) {
+    int rv = map_sections(lines, path);
+    if (rv != -1) {
+        return rv ? -1 : 0;
+    }
+
+    char debug_path[PATH_MAX];
+    rv = debug_file_path(lines->map, lines->map_size, debug_path,
+      sizeof(debug_path));
+
+    munmap(lines->map, lines->map_size);
+    lines->map = NULL;
+
+    if (rv || map_sections(lines, debug_path)) {
+        if (lines->map) {
+            munmap(lines->map, lines->map_size);
+            lines->map = NULL;
+        }
+        return -1;
+    }
+
+    LOGD("%s(): using debug info of %s from %s", __func__, path, debug_path);
+    return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef DWARFLINE_H_INCLUDED
+#define DWARFLINE_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+    In-process replacement for 'addr2line -if': resolves an address to source
+    file and line using .debug_line, and to chain of inlined functions using
+    .debug_info. Binary has to be built with -g (or have a separate debug file,
+    see below). DWARF versions 2 to 5 are supported, compressed debug sections
+    are not.
+
+    Opening a file only builds a sorted index of address ranges of compilation
+    units. Line table and function DIEs of a unit are parsed on first lookup
+    in that unit and are kept until the file is closed, so repeated lookups
+    cost two binary searches.
+
+    If the file itself has no .debug_info, a separate debug file is looked up
+    by build-id as <debug dir>/.build-id/ab/cdef...debug, which is where
+    distributions (and 'objcopy --only-keep-debug' based workflows) put them.
+
+    All returned strings point into mapped debug sections and are valid until
+    dwarfline_close(). File names are returned as they are recorded in line
+    table, usually without directory.
+
+    Addresses here are link-time virtual addresses of the file, i.e. run-time
+    address minus load bias of the module.
+*/
+
+struct dwarfline;
+
+/*
+    One level of inlining. For the innermost frame 'file' and 'line' are where
+    the address is, for others - where the next inner function was inlined.
+*/
+struct dwarfline_frame {
+    const char *function;   // NULL if unknown
+    const char *file;       // NULL if unknown
+    unsigned line;
+};
+
+/*
+    Set directory where separate debug files are looked up. Default is
+    /usr/lib/debug. Affects files opened afterwards.
+*/
+void dwarfline_set_debug_dir(const char *dir);
+
+/*
+    Load debug info of ELF file at 'path' or of its separate debug file.
+
+    Returns NULL if there is no usable debug info.
+*/
+struct dwarfline *dwarfline_open(const char *path);
+
+/*
+    Free debug info. 'lines' may be NULL.
+*/
+void dwarfline_close(struct dwarfline *lines);
+
+/*
+    Resolve 'addr' to at most 'max' frames, innermost (most deeply inlined)
+    first; the last one is the function that actually contains the code.
+    Thread-safe.
+
+    Returns number of frames or 0 if there is no debug info for 'addr'.
+*/
+int dwarfline_lookup(struct dwarfline *lines, uintptr_t addr,
+  struct dwarfline_frame *frames, int max);
+
+#endif // DWARFLINE_H_INCLUDED
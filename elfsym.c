@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+
+#include "elfsym.h"
+
+#include "log.h"
+
+#include <fcntl.h>
+#include <link.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct entry {
+    uintptr_t addr;
+    uintptr_t size;
+    const char *name;
+};
+
+struct elfsym {
+    void *map;
+    size_t map_size;
+    struct entry *entries;
+    size_t count;
+};
+
+static int load_section(struct elfsym *symtab, const ElfW(Shdr) *shdrs,
+  int shnum, int index, size_t *capacity);
+static int entry_cmp(const void *a, const void *b);
+
+// public
+
+struct elfsym *elfsym_open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t) st.st_size < sizeof(ElfW(Ehdr))) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const ElfW(Ehdr) *ehdr = map;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG)
+        || ehdr->e_ident[EI_CLASS] != __ELF_NATIVE_CLASS / 32
+        || !ehdr->e_shoff
+        || ehdr->e_shentsize != sizeof(ElfW(Shdr))
+        || ehdr->e_shoff + ehdr->e_shnum * sizeof(ElfW(Shdr))
+           > (size_t) st.st_size) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    struct elfsym *symtab = calloc(1, sizeof(struct elfsym));
+    if (!symtab) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    symtab->map = map;
+    symtab->map_size = st.st_size;
+
+    const ElfW(Shdr) *shdrs = (const ElfW(Shdr) *) ((const char *) map
+                                                    + ehdr->e_shoff);
+    size_t capacity = 0;
+    for (int i = 0; i < ehdr->e_shnum; ++i) {
+        if (shdrs[i].sh_type == SHT_SYMTAB || shdrs[i].sh_type == SHT_DYNSYM) {
+            if (load_section(symtab, shdrs, ehdr->e_shnum, i, &capacity)) {
+                LOGW("%s(): out of memory loading symbols of %s", __func__,
+                  path);
+                break;
+            }
+        }
+    }
+
+    if (!symtab->count) {
+        elfsym_close(symtab);
+        return NULL;
+    }
+
+    qsort(symtab->entries, symtab->count, sizeof(struct entry), entry_cmp);
+
+    // .symtab and .dynsym overlap, drop duplicates
+    size_t unique = 1;
+    for (size_t i = 1; i < symtab->count; ++i) {
+        if (symtab->entries[i].addr != symtab->entries[unique - 1].addr) {
+            symtab->entries[unique++] = symtab->entries[i];
+        }
+    }
+    symtab->count = unique;
+
+    return symtab;
+}
+
+void elfsym_close(struct elfsym *symtab) {
+    if (!symtab) {
+        return;
+    }
+
+    munmap(symtab->map, symtab->map_size);
+    free(symtab->entries);
+    free(symtab);
+}
+
+const char *elfsym_lookup(const struct elfsym *symtab, uintptr_t addr,
+  uintptr_t *sym_addr) {
+    uintptr_t sym_end;
+    return elfsym_lookup_range(symtab, addr, sym_addr, &sym_end);
+}
+
+const char *elfsym_lookup_range(const struct elfsym *symtab, uintptr_t addr,
+  uintptr_t *sym_addr, uintptr_t *sym_end) {
+    size_t lo = 0, hi = symtab->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (symtab->entries[mid].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (!lo) {
+        return NULL;
+    }
+
+    const struct entry *entry = &symtab->entries[lo - 1];
+    if (entry->size && addr >= entry->addr + entry->size) {
+        return NULL;
+    }
+
+    *sym_addr = entry->addr;
+    if (entry->size) {
+        *sym_end = entry->addr + entry->size;
+    } else {
+        *sym_end = lo < symtab->count ? symtab->entries[lo].addr : UINTPTR_MAX;
+    }
+    return entry->name;
+}
+
+// private
+
+static
+int load_section(struct elfsym *symtab, const ElfW(Shdr) *shdrs, int shnum,
+  int index, size_t *capacity) {
+    const ElfW(Shdr) *shdr = &shdrs[index];
+    if (shdr->sh_link >= (unsigned) shnum
+        || shdr->sh_entsize != sizeof(ElfW(Sym))
+        || shdr->sh_offset + shdr->sh_size > symtab->map_size) {
+        return 0;
+    }
+
+    const ElfW(Shdr) *strtab = &shdrs[shdr->sh_link];
+    if (strtab->sh_offset + strtab->sh_size > symtab->map_size) {
+        return 0;
+    }
+
+    const char *base = symtab->map;
+    const ElfW(Sym) *syms = (const ElfW(Sym) *) (base + shdr->sh_offset);
+    const char *strings = base + strtab->sh_offset;
+    size_t nsyms = shdr->sh_size / sizeof(ElfW(Sym));
+
+    for (size_t i = 0; i < nsyms; ++i) {
+        const ElfW(Sym) *sym = &syms[i];
+        int type = ELF64_ST_TYPE(sym->st_info);
+
+        if ((type != STT_FUNC && type != STT_GNU_IFUNC)
+            || sym->st_shndx == SHN_UNDEF || !sym->st_value
+            || sym->st_name >= strtab->sh_size) {
+            continue;
+        }
+
+        if (symtab->count == *capacity) {
+            size_t new_capacity = *capacity ? *capacity * 2 : 256;
+            struct entry *entries = realloc(symtab->entries,
+              new_capacity * sizeof(struct entry));
+            if (!entries) {
+                return -1;
+            }
+
+            symtab->entries = entries;
+            *capacity = new_capacity;
+        }
+
+        struct entry *entry = &symtab->entries[symtab->count++];
+        entry->addr = sym->st_value;
+        entry->size = sym->st_size;
+        entry->name = strings + sym->st_name;
+    }
+
+    return 0;
+}
+
+/*
+    Sort by address, symbols with size go first, so that they win when
+    duplicates are dropped.
+*/
+static
+int entry_cmp(const void *a, const void *b) {
+    const struct entry *x = a, *y = b;
+    if (x->addr != y->addr) {
+        return x->addr < y->addr ? -1 : 1;
+    }
+
+    return (y->size != 0) - (x->size != 0);
+}
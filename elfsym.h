@@ -0,0 +1,54 @@
+#ifndef ELFSYM_H_INCLUDED
+#define ELFSYM_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+    Reader of ELF symbol tables. Unlike dladdr(), which only sees exported
+    symbols of .dynsym, it also loads .symtab, so static and hidden functions
+    get their names without building with -rdynamic (as long as the binary is
+    not stripped).
+
+    A file is mmap()ed, function symbols of .symtab and .dynsym are copied to
+    an array sorted by address, and names are pointed to right in the mapping.
+    Lookup is a binary search. The mapping is kept open for as long as the
+    table is, so returned names are valid until elfsym_close().
+
+    Addresses here are link-time virtual addresses of the file, i.e. run-time
+    address minus load bias of the module.
+*/
+
+struct elfsym;
+
+/*
+    Load symbols of ELF file at 'path'.
+
+    Returns a table or NULL if file can't be read, is not an ELF file of native
+    class or has no function symbols at all.
+*/
+struct elfsym *elfsym_open(const char *path);
+
+/*
+    Free a table. 'symtab' may be NULL.
+*/
+void elfsym_close(struct elfsym *symtab);
+
+/*
+    Find function that contains 'addr'. If symbol has no size, the nearest
+    symbol below 'addr' is taken.
+
+    Returns name of the function and stores its address to 'sym_addr', or
+    returns NULL if there is no such function.
+*/
+const char *elfsym_lookup(const struct elfsym *symtab, uintptr_t addr,
+  uintptr_t *sym_addr);
+
+/*
+    Like elfsym_lookup(), but also store end of the function (address next to
+    its last byte) to 'sym_end': its address plus size, or address of the next
+    symbol if it has no size (or the end of address space for the last one).
+*/
+const char *elfsym_lookup_range(const struct elfsym *symtab, uintptr_t addr,
+  uintptr_t *sym_addr, uintptr_t *sym_end);
+
+#endif // ELFSYM_H_INCLUDED
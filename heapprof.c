@@ -0,0 +1,337 @@
+#include "heapprof.h"
+
+#include "backtrace.h"
+#include "log.h"
+#include "stackdb.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_STACKS 16384
+#define AVG_DEPTH 24
+
+// Sampled objects live at most in one bucket, so no tombstones are needed and
+// a lookup touches one cache line of keys
+#define BUCKETS (1 << 14)
+#define BUCKET_SLOTS 8
+
+// Frames of sample() and heapprof_record_alloc(), and of the interposed
+// malloc() (or friend) that called it (see heapprof_malloc.c)
+#ifdef HEAPPROF_MALLOC_HOOKS
+# define SKIP_FRAMES 3
+#else
+# define SKIP_FRAMES 2
+#endif
+
+// Keys of slots: 0 is empty, BUSY is being filled, anything else a pointer
+#define BUSY ((uintptr_t) 1)
+
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+
+struct object {
+    uint32_t stack;
+    uint64_t size;
+    uint64_t weight;
+};
+
+struct bucket {
+    uintptr_t keys[BUCKET_SLOTS];
+    struct object objects[BUCKET_SLOTS];
+} __attribute__((aligned(64)));
+
+// Estimated bytes and objects in use per stack id
+struct usage {
+    uint64_t bytes;
+    uint64_t objects;
+};
+
+struct ranked {
+    uint32_t id;
+    uint64_t key;
+};
+
+// Zero when sampling is stopped
+static size_t sample_interval;
+
+static struct stackdb *stacks;
+static struct bucket *live;
+// Number of objects per bucket. The table is too big to stay in cache, while
+// free() of an object that isn't sampled mostly needs to look only here.
+static uint8_t occupancy[BUCKETS];
+static struct usage *usage;
+static uint64_t dropped_objects;
+
+static TLS int64_t bytes_until_sample;
+static TLS uint64_t random_state;
+static TLS int thread_busy;
+
+static void sample(void *ptr, size_t size, size_t interval);
+static int64_t next_interval(size_t interval);
+static struct bucket *bucket_of(uintptr_t key);
+static int ranked_cmp(const void *a, const void *b);
+
+// public
+
+int heapprof_start(size_t interval) {
+    if (!interval) {
+        interval = HEAPPROF_DEFAULT_INTERVAL;
+    }
+
+    static int initialized;
+    if (!initialized) {
+        stacks = stackdb_create(MAX_STACKS, AVG_DEPTH);
+        if (!stacks) {
+            return -1;
+        }
+
+        usage = calloc(stackdb_id_limit(stacks), sizeof(*usage));
+        struct bucket *buckets;
+        if (!usage || posix_memalign((void **) &buckets, 64,
+                        BUCKETS * sizeof(*buckets))) {
+            LOGE("%s(): out of memory", __func__);
+            free(usage);
+            stackdb_destroy(stacks);
+            return -1;
+        }
+        memset(buckets, 0, BUCKETS * sizeof(*buckets));
+        __atomic_store_n(&live, buckets, __ATOMIC_RELEASE);
+
+        initialized = 1;
+    }
+
+    __atomic_store_n(&sample_interval, interval, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void heapprof_stop() {
+    __atomic_store_n(&sample_interval, 0, __ATOMIC_RELAXED);
+}
+
+void heapprof_record_alloc(void *ptr, size_t size) {
+    size_t interval = __atomic_load_n(&sample_interval, __ATOMIC_ACQUIRE);
+    if (!interval) {
+        return;
+    }
+
+    bytes_until_sample -= size;
+    if (__builtin_expect(bytes_until_sample > 0, 1)) {
+        return;
+    }
+
+    // allocations of the profiler itself (e.g. by unwinder) aren't sampled
+    if (thread_busy) {
+        return;
+    }
+    thread_busy = 1;
+
+    // The first allocation of a thread only starts the countdown
+    if (!random_state) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        random_state = ((uintptr_t) &random_state ^ now.tv_nsec) | 1;
+    } else if (ptr) {
+        sample(ptr, size, interval);
+    }
+
+    bytes_until_sample = next_interval(interval);
+    thread_busy = 0;
+}
+
+void heapprof_record_free(void *ptr) {
+    struct bucket *buckets = __atomic_load_n(&live, __ATOMIC_ACQUIRE);
+    if (!buckets || !ptr) {
+        return;
+    }
+
+    uintptr_t key = (uintptr_t) ptr;
+    struct bucket *bucket = bucket_of(key);
+    if (!__atomic_load_n(&occupancy[bucket - buckets], __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    for (int i = 0; i < BUCKET_SLOTS; ++i) {
+        if (__atomic_load_n(&bucket->keys[i], __ATOMIC_ACQUIRE) != key) {
+            continue;
+        }
+
+        struct object object = bucket->objects[i];
+        if (!__atomic_compare_exchange_n(&bucket->keys[i], &key, 0, 0,
+              __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return;     // double free
+        }
+        __atomic_sub_fetch(&occupancy[bucket - buckets], 1, __ATOMIC_RELAXED);
+
+        struct usage *entry = &usage[object.stack];
+        __atomic_sub_fetch(&entry->bytes, object.weight, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&entry->objects, object.weight / object.size,
+          __ATOMIC_RELAXED);
+        return;
+    }
+}
+
+void heapprof_report(int log_level, int top_n) {
+    if (!__atomic_load_n(&live, __ATOMIC_ACQUIRE)) {
+        LOGE("%s(): profiler was never started", __func__);
+        return;
+    }
+
+    // Allocations of the report itself aren't sampled
+    thread_busy = 1;
+
+    uint32_t limit = stackdb_id_limit(stacks);
+    struct ranked *ranked = malloc(limit * sizeof(*ranked));
+    if (!ranked) {
+        thread_busy = 0;
+        LOGE("%s(): out of memory", __func__);
+        return;
+    }
+
+    // id 0 collects objects of stacks that didn't fit to stackdb
+    uint64_t in_use = __atomic_load_n(&usage[0].bytes, __ATOMIC_RELAXED);
+    uint64_t objects = __atomic_load_n(&usage[0].objects, __ATOMIC_RELAXED);
+    uint64_t allocated = 0;
+    size_t count = 0;
+
+    for (uint32_t id = 1; id < limit; ++id) {
+        uint64_t weight;
+        if (stackdb_get(stacks, id, NULL, NULL, NULL, &weight)) {
+            continue;
+        }
+
+        uint64_t bytes = __atomic_load_n(&usage[id].bytes, __ATOMIC_RELAXED);
+        in_use += bytes;
+        objects += __atomic_load_n(&usage[id].objects, __ATOMIC_RELAXED);
+        allocated += weight;
+
+        ranked[count].id = id;
+        ranked[count].key = bytes;
+        ++count;
+    }
+
+    qsort(ranked, count, sizeof(*ranked), ranked_cmp);
+
+    LOG(log_level, "Heap profile: %llu bytes in %llu objects in use, "
+      "%llu bytes allocated, %llu objects untracked; top %d stacks by bytes "
+      "in use", (unsigned long long) in_use, (unsigned long long) objects,
+      (unsigned long long) allocated,
+      (unsigned long long) __atomic_load_n(&dropped_objects, __ATOMIC_RELAXED),
+      top_n);
+
+    for (size_t i = 0; i < count && (int) i < top_n; ++i) {
+        uint32_t id = ranked[i].id;
+        void *const *frames;
+        int depth;
+        uint64_t hits, weight;
+        stackdb_get(stacks, id, &frames, &depth, &hits, &weight);
+
+        LOG(log_level, "Stack %u: %llu bytes in %llu objects in use, "
+          "%llu bytes allocated in %llu samples", id,
+          (unsigned long long) ranked[i].key,
+          (unsigned long long) __atomic_load_n(&usage[id].objects,
+                                 __ATOMIC_RELAXED),
+          (unsigned long long) weight, (unsigned long long) hits);
+        print_stack_frames(log_level, frames, depth);
+    }
+
+    free(ranked);
+    thread_busy = 0;
+}
+
+// private
+
+/*
+    Record a sampled allocation. A sample stands for size / P(sampled) bytes,
+    where P(sampled) = 1 - exp(-size / interval) is the probability that
+    'size' bytes cross a sampling point.
+*/
+__attribute__((noinline))
+static
+void sample(void *ptr, size_t size, size_t interval) {
+    if (!size) {
+        size = 1;
+    }
+
+    double scale = -expm1(-(double) size / interval);
+    uint64_t weight = scale > 0 ? size / scale : interval;
+    if (weight < size) {
+        weight = size;
+    }
+
+    uint32_t id = stackdb_capture(stacks, SKIP_FRAMES, weight);
+
+    uintptr_t key = (uintptr_t) ptr;
+    struct bucket *bucket = bucket_of(key);
+
+    for (int i = 0; i < BUCKET_SLOTS; ++i) {
+        uintptr_t expected = 0;
+        if (!__atomic_compare_exchange_n(&bucket->keys[i], &expected, BUSY, 0,
+              __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;
+        }
+
+        bucket->objects[i].stack = id;
+        bucket->objects[i].size = size;
+        bucket->objects[i].weight = weight;
+
+        // counted before publishing, so that free() never makes it negative
+        struct usage *entry = &usage[id];
+        __atomic_add_fetch(&entry->bytes, weight, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&entry->objects, weight / size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&occupancy[bucket - live], 1, __ATOMIC_RELAXED);
+
+        __atomic_store_n(&bucket->keys[i], key, __ATOMIC_RELEASE);
+        return;
+    }
+
+    __atomic_add_fetch(&dropped_objects, 1, __ATOMIC_RELAXED);
+}
+
+/*
+    Draw bytes until the next sample from exponential distribution with mean
+    'interval', so that sampling points form a Poisson process over bytes
+    allocated.
+*/
+static
+int64_t next_interval(size_t interval) {
+    // xorshift64*
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    uint64_t bits = random_state * 0x2545f4914f6cdd1dull;
+
+    // uniform in (0, 1]
+    double u = ((bits >> 11) + 1) * 0x1.0p-53;
+    double value = -log(u) * interval;
+
+    if (value < 1) {
+        return 1;
+    }
+    if (value > (double) INT64_MAX / 2) {
+        return INT64_MAX / 2;
+    }
+
+    return (int64_t) value;
+}
+
+static
+struct bucket *bucket_of(uintptr_t key) {
+    // low bits of malloc() pointers are zero, high ones are mostly the same
+    uint64_t hash = (key >> 4) * 0x9e3779b97f4a7c15ull;
+
+    return &live[hash >> (64 - __builtin_ctz(BUCKETS))];
+}
+
+static
+int ranked_cmp(const void *a, const void *b) {
+    const struct ranked *x = a;
+    const struct ranked *y = b;
+
+    if (x->key != y->key) {
+        return x->key > y->key ? -1 : 1;
+    }
+
+    return x->id < y->id ? -1 : x->id > y->id;
+}
@@ -0,0 +1,69 @@
+#ifndef HEAPPROF_H_INCLUDED
+#define HEAPPROF_H_INCLUDED
+
+#include <stddef.h>
+
+/*
+    Sampling heap profiler, cheap enough to run in production to chase memory
+    growth.
+
+    Allocations are sampled by distance in bytes: every thread counts down
+    bytes allocated, and when the counter crosses zero the allocation is
+    sampled and the counter is reset to an exponentially distributed random
+    value with mean 'sample_interval'. So a sample is taken about once per
+    'sample_interval' bytes, large allocations are sampled more likely than
+    small ones, and periodic allocation patterns can't hide from sampling.
+    Each sample is weighted by the number of bytes it stands for, which makes
+    estimates unbiased.
+
+    Stack of a sampled allocation is interned in stackdb.h, and the object is
+    tracked in a hash table keyed by pointer until it is freed. The report
+    shows, per stack, estimated bytes in use and bytes allocated in total.
+
+    Profiler learns about allocations from heapprof_record_alloc() and
+    heapprof_record_free(). Call them from your allocator wrappers, or build
+    the library with -DHEAPPROF_MALLOC_HOOKS: then malloc() and friends are
+    interposed to call them (see heapprof_malloc.c), and the frame that calls
+    heapprof_record_alloc() is dropped from stacks as one of the interposed
+    functions.
+
+    Cost of an allocation that is not sampled is a decrement of a thread-local
+    counter; of a free() mostly a load from a small occupancy map, and a scan
+    of one cache line of the table if the pointer may be sampled.
+*/
+
+#define HEAPPROF_DEFAULT_INTERVAL (512 * 1024)
+
+/*
+    Start sampling, once every 'sample_interval' bytes on average (0 for
+    HEAPPROF_DEFAULT_INTERVAL). Memory the profiler needs is allocated on the
+    first start and is never freed; samples collected before are kept.
+
+    Returns 0 on success and -1 on error.
+*/
+int heapprof_start(size_t sample_interval);
+
+/*
+    Stop sampling new allocations. Sampled objects are still tracked until
+    they are freed.
+*/
+void heapprof_stop();
+
+/*
+    Report allocation of 'size' bytes at 'ptr'.
+*/
+void heapprof_record_alloc(void *ptr, size_t size);
+
+/*
+    Report that 'ptr' is freed. Has to be called before memory is actually
+    freed, since it may be allocated again right after.
+*/
+void heapprof_record_free(void *ptr);
+
+/*
+    Log 'top_n' stacks with most bytes in use, with estimated bytes and
+    objects in use and bytes allocated since start.
+*/
+void heapprof_report(int log_level, int top_n);
+
+#endif // HEAPPROF_H_INCLUDED
@@ -0,0 +1,108 @@
+/*
+    Interposition of malloc() and friends for heapprof.h, built only with
+    -DHEAPPROF_MALLOC_HOOKS. glibc dropped __malloc_hook, so the functions are
+    replaced by definitions in the executable, which forward to glibc's own
+    __libc_*() entry points.
+*/
+
+#ifdef HEAPPROF_MALLOC_HOOKS
+
+#include "heapprof.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static void *aligned(size_t alignment, size_t size);
+
+// public
+
+void *malloc(size_t size) {
+    void *ptr = __libc_malloc(size);
+    if (ptr) {
+        heapprof_record_alloc(ptr, size);
+    }
+
+    return ptr;
+}
+
+void *calloc(size_t count, size_t size) {
+    void *ptr = __libc_calloc(count, size);
+    if (ptr) {
+        heapprof_record_alloc(ptr, count * size);
+    }
+
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    // Once the block is moved, its old address may be allocated by another
+    // thread, so it is forgotten first. If realloc() fails, it stays
+    // untracked.
+    heapprof_record_free(ptr);
+
+    void *result = __libc_realloc(ptr, size);
+    if (result) {
+        heapprof_record_alloc(result, size);
+    }
+
+    return result;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    return aligned(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return aligned(alignment, size);
+}
+
+int posix_memalign(void **result, size_t alignment, size_t size) {
+    if (!alignment || (alignment & (alignment - 1))
+        || alignment % sizeof(void *)) {
+        return EINVAL;
+    }
+
+    void *ptr = aligned(alignment, size);
+    if (!ptr) {
+        return ENOMEM;
+    }
+
+    *result = ptr;
+    return 0;
+}
+
+void *valloc(size_t size) {
+    return aligned(sysconf(_SC_PAGESIZE), size);
+}
+
+void free(void *ptr) {
+    heapprof_record_free(ptr);
+    __libc_free(ptr);
+}
+
+// private
+
+/*
+    Inlined into every interposed function, so that heapprof_record_alloc() is
+    always called exactly one frame below the application's code: heapprof.c
+    skips that frame.
+*/
+static inline __attribute__((always_inline))
+void *aligned(size_t alignment, size_t size) {
+    void *ptr = __libc_memalign(alignment, size);
+    if (ptr) {
+        heapprof_record_alloc(ptr, size);
+    }
+
+    return ptr;
+}
+
+#endif // HEAPPROF_MALLOC_HOOKS
@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+
+#include "lockprof.h"
+
+#include "backtrace.h"
+#include "log.h"
+#include "stackdb.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_STACKS 4096
+#define AVG_DEPTH 24
+
+// Must be a power of two
+#define MAX_SITES 8192
+
+// Stacks logged per lock
+#define STACKS_PER_LOCK 5
+
+enum {
+    SITE_EMPTY,
+    SITE_BUSY,      // being filled by the thread that claimed it
+    SITE_READY,
+};
+
+// Waits for one lock from one stack
+struct site {
+    uint32_t state;
+    uint32_t stack;
+    uintptr_t lock;
+    uint64_t count;
+    uint64_t wait_ns;
+    uint64_t max_ns;
+    uint64_t histogram[LOCKPROF_HISTOGRAM_BUCKETS];
+};
+
+struct summary {
+    uintptr_t lock;
+    const struct site *first;   // sites of the lock, most waited first
+    int sites;
+    uint64_t count;
+    uint64_t wait_ns;
+    uint64_t max_ns;
+    uint64_t histogram[LOCKPROF_HISTOGRAM_BUCKETS];
+};
+
+typedef int (*mutex_lock_t)(pthread_mutex_t *mutex);
+
+static int enabled;
+static struct stackdb *stacks;
+static struct site *sites;
+static uint64_t dropped;
+
+static mutex_lock_t mutex_lock_next;
+
+// Set while the thread is in the profiler. Capturing a stack takes mutexes
+// (of unwinder, symbolizer, log), and if the profiler profiled waits for them
+// too, it would recurse into itself for as long as they are busy.
+static __thread int inside;
+
+static mutex_lock_t get_mutex_lock();
+static uint64_t now_ns();
+static void record(uintptr_t lock, uint32_t stack, uint64_t wait_ns);
+static struct site *find_site(uintptr_t lock, uint32_t stack);
+static int site_cmp(const void *a, const void *b);
+static int summary_cmp(const void *a, const void *b);
+static void log_histogram(int log_level, const uint64_t *histogram);
+
+// public
+
+int lockprof_start() {
+    if (!get_mutex_lock()) {
+        LOGE("%s(): can't find pthread_mutex_lock()", __func__);
+        return -1;
+    }
+
+    if (!__atomic_load_n(&sites, __ATOMIC_ACQUIRE)) {
+        struct stackdb *db = stackdb_create(MAX_STACKS, AVG_DEPTH);
+        struct site *table = calloc(MAX_SITES, sizeof(*table));
+        if (!db || !table) {
+            LOGE("%s(): out of memory", __func__);
+            stackdb_destroy(db);
+            free(table);
+            return -1;
+        }
+
+        stacks = db;
+        __atomic_store_n(&sites, table, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void lockprof_stop() {
+    __atomic_store_n(&enabled, 0, __ATOMIC_RELAXED);
+}
+
+__attribute__((noinline))
+int lockprof_mutex_lock(pthread_mutex_t *mutex) {
+    int err = pthread_mutex_trylock(mutex);
+    if (__builtin_expect(err != EBUSY, 1)) {
+        return err;
+    }
+
+    mutex_lock_t lock = get_mutex_lock();
+    if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE) || inside) {
+        return lock(mutex);
+    }
+
+    inside = 1;
+
+    // Stack is captured before waiting rather than after, so that critical
+    // section of a contended lock isn't made longer
+    uint32_t stack = stackdb_capture(stacks, 1, 0);
+
+    uint64_t start = now_ns();
+    err = lock(mutex);
+    record((uintptr_t) mutex, stack, now_ns() - start);
+
+    inside = 0;
+
+    return err;
+}
+
+__attribute__((noinline))
+void lockprof_record(const void *lock, uint64_t wait_ns, int skip) {
+    if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE) || inside) {
+        return;
+    }
+
+    inside = 1;
+    uint32_t stack = stackdb_capture(stacks, skip + 1, 0);
+    record((uintptr_t) lock, stack, wait_ns);
+    inside = 0;
+}
+
+void lockprof_report(int log_level, int top_n) {
+    struct site *table = __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+    if (!table) {
+        LOGE("%s(): profiler was never started", __func__);
+        return;
+    }
+
+    // Snapshot is sorted by lock, so that sites of a lock are adjacent
+    struct site *snapshot = malloc(MAX_SITES * sizeof(*snapshot));
+    struct summary *summaries = malloc(MAX_SITES * sizeof(*summaries));
+    if (!snapshot || !summaries) {
+        LOGE("%s(): out of memory", __func__);
+        free(snapshot);
+        free(summaries);
+        return;
+    }
+
+    int count = 0;
+    for (int i = 0; i < MAX_SITES; ++i) {
+        if (__atomic_load_n(&table[i].state, __ATOMIC_ACQUIRE) == SITE_READY
+            && __atomic_load_n(&table[i].count, __ATOMIC_ACQUIRE)) {
+            snapshot[count++] = table[i];
+        }
+    }
+
+    qsort(snapshot, count, sizeof(*snapshot), site_cmp);
+
+    int locks = 0;
+    uint64_t total_count = 0, total_ns = 0;
+    for (int i = 0; i < count; ++i) {
+        const struct site *site = &snapshot[i];
+        struct summary *summary;
+
+        if (!i || site->lock != snapshot[i - 1].lock) {
+            summary = &summaries[locks++];
+            memset(summary, 0, sizeof(*summary));
+            summary->lock = site->lock;
+            summary->first = site;
+        } else {
+            summary = &summaries[locks - 1];
+        }
+
+        ++summary->sites;
+        summary->count += site->count;
+        summary->wait_ns += site->wait_ns;
+        if (site->max_ns > summary->max_ns) {
+            summary->max_ns = site->max_ns;
+        }
+        for (int j = 0; j < LOCKPROF_HISTOGRAM_BUCKETS; ++j) {
+            summary->histogram[j] += site->histogram[j];
+        }
+
+        total_count += site->count;
+        total_ns += site->wait_ns;
+    }
+
+    qsort(summaries, locks, sizeof(*summaries), summary_cmp);
+
+    LOG(log_level, "Lock contention: %d locks, %llu contentions, %llu us "
+      "waited, %llu dropped; top %d locks", locks,
+      (unsigned long long) total_count, (unsigned long long) total_ns / 1000,
+      (unsigned long long) __atomic_load_n(&dropped, __ATOMIC_RELAXED), top_n);
+
+    for (int i = 0; i < locks && i < top_n; ++i) {
+        const struct summary *summary = &summaries[i];
+
+        LOG(log_level, "Lock %#lx: %llu contentions, %llu us waited, "
+          "max %llu us", (unsigned long) summary->lock,
+          (unsigned long long) summary->count,
+          (unsigned long long) summary->wait_ns / 1000,
+          (unsigned long long) summary->max_ns / 1000);
+        log_histogram(log_level, summary->histogram);
+
+        for (int j = 0; j < summary->sites && j < STACKS_PER_LOCK; ++j) {
+            const struct site *site = &summary->first[j];
+
+            LOG(log_level, "\tStack %u: %llu contentions, %llu us waited",
+              site->stack, (unsigned long long) site->count,
+              (unsigned long long) site->wait_ns / 1000);
+
+            void *const *frames;
+            int depth;
+            if (!stackdb_get(stacks, site->stack, &frames, &depth, NULL,
+                  NULL)) {
+                print_stack_frames(log_level, frames, depth);
+            }
+        }
+    }
+
+    free(snapshot);
+    free(summaries);
+}
+
+void lockprof_reset() {
+    struct site *table = __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+    if (!table) {
+        return;
+    }
+
+    // Sites are kept, like stacks of stackdb, only counters are zeroed
+    for (int i = 0; i < MAX_SITES; ++i) {
+        struct site *site = &table[i];
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->wait_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->max_ns, 0, __ATOMIC_RELAXED);
+        for (int j = 0; j < LOCKPROF_HISTOGRAM_BUCKETS; ++j) {
+            __atomic_store_n(&site->histogram[j], 0, __ATOMIC_RELAXED);
+        }
+    }
+
+    stackdb_reset(stacks);
+    __atomic_store_n(&dropped, 0, __ATOMIC_RELAXED);
+}
+
+// private
+
+/*
+    With hooks, pthread_mutex_lock() of the program is the hook itself, so the
+    real one is looked up in the libraries loaded after it.
+*/
+static
+mutex_lock_t get_mutex_lock() {
+    mutex_lock_t lock = __atomic_load_n(&mutex_lock_next, __ATOMIC_RELAXED);
+    if (lock) {
+        return lock;
+    }
+
+#ifdef LOCKPROF_MUTEX_HOOKS
+    lock = (mutex_lock_t) dlsym(RTLD_NEXT, "pthread_mutex_lock");
+#else
+    lock = pthread_mutex_lock;
+#endif
+
+    __atomic_store_n(&mutex_lock_next, lock, __ATOMIC_RELAXED);
+    return lock;
+}
+
+static
+uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static
+void record(uintptr_t lock, uint32_t stack, uint64_t wait_ns) {
+    struct site *site = find_site(lock, stack);
+    if (!site) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // Bucket i counts waits shorter than 2^(i + 1) us, the last one the rest
+    uint64_t us = wait_ns / 1000;
+    int bucket = us ? 63 - __builtin_clzll(us) : 0;
+    if (bucket >= LOCKPROF_HISTOGRAM_BUCKETS) {
+        bucket = LOCKPROF_HISTOGRAM_BUCKETS - 1;
+    }
+
+    // Count goes last, so that a report that sees it sees the wait too
+    __atomic_add_fetch(&site->histogram[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->wait_ns, wait_ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->count, 1, __ATOMIC_RELEASE);
+
+    uint64_t max = __atomic_load_n(&site->max_ns, __ATOMIC_RELAXED);
+    while (wait_ns > max && !__atomic_compare_exchange_n(&site->max_ns, &max,
+             wait_ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/*
+    Find or add site of 'lock' and 'stack'.
+
+    Returns NULL if the table is full.
+*/
+static
+struct site *find_site(uintptr_t lock, uint32_t stack) {
+    uint64_t hash = (lock >> 3) * 0x9e3779b97f4a7c15ull;
+    hash = (hash ^ stack) * 0xff51afd7ed558ccdull;
+    hash ^= hash >> 32;
+
+    for (int probe = 0; probe < MAX_SITES; ++probe) {
+        struct site *site = &sites[(hash + probe) & (MAX_SITES - 1)];
+        uint32_t state = __atomic_load_n(&site->state, __ATOMIC_ACQUIRE);
+
+        if (state == SITE_EMPTY) {
+            if (__atomic_compare_exchange_n(&site->state, &state, SITE_BUSY, 0,
+                  __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                site->lock = lock;
+                site->stack = stack;
+                __atomic_store_n(&site->state, SITE_READY, __ATOMIC_RELEASE);
+                return site;
+            }
+        }
+
+        // Filling a site is a couple of stores, so it's not worth yielding
+        while (state == SITE_BUSY) {
+            state = __atomic_load_n(&site->state, __ATOMIC_ACQUIRE);
+        }
+
+        if (site->lock == lock && site->stack == stack) {
+            return site;
+        }
+    }
+
+    return NULL;
+}
+
+static
+int site_cmp(const void *a, const void *b) {
+    const struct site *x = a;
+    const struct site *y = b;
+
+    if (x->lock != y->lock) {
+        return x->lock < y->lock ? -1 : 1;
+    }
+    if (x->wait_ns != y->wait_ns) {
+        return x->wait_ns > y->wait_ns ? -1 : 1;
+    }
+
+    return x->stack < y->stack ? -1 : x->stack > y->stack;
+}
+
+static
+int summary_cmp(const void *a, const void *b) {
+    const struct summary *x = a;
+    const struct summary *y = b;
+
+    if (x->wait_ns != y->wait_ns) {
+        return x->wait_ns > y->wait_ns ? -1 : 1;
+    }
+
+    return x->lock < y->lock ? -1 : x->lock > y->lock;
+}
+
+static
+void log_histogram(int log_level, const uint64_t *histogram) {
+    // Empty if a reset raced with the snapshot
+    char line[512] = "";
+    int len = 0;
+
+    for (int i = 0; i < LOCKPROF_HISTOGRAM_BUCKETS
+         && len < (int) sizeof(line); ++i) {
+        if (!histogram[i]) {
+            continue;
+        }
+
+        const char *separator = len ? ", " : "";
+        unsigned long long bound = 1ull << (i + 1);
+        if (i < LOCKPROF_HISTOGRAM_BUCKETS - 1) {
+            len += snprintf(line + len, sizeof(line) - len, "%s<%lluus %llu",
+              separator, bound, (unsigned long long) histogram[i]);
+        } else {
+            len += snprintf(line + len, sizeof(line) - len, "%s>=%lluus %llu",
+              separator, bound / 2, (unsigned long long) histogram[i]);
+        }
+    }
+
+    LOG(log_level, "\twait histogram: %s", line);
+}
@@ -0,0 +1,72 @@
+#ifndef LOCKPROF_H_INCLUDED
+#define LOCKPROF_H_INCLUDED
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+    Lock contention profiler. Tells which locks threads wait for, from where
+    and for how long.
+
+    Uncontended acquisitions cost one pthread_mutex_trylock(), so the profiler
+    may be left on in production. Only when a lock is busy, stack of the
+    waiting thread is captured (see stackdb.h) and the wait is timed. Waits
+    are aggregated per (lock address, acquiring stack): count, total and max
+    wait, and a histogram of wait times with power-of-two buckets from 2 us.
+
+    Mutexes are profiled if they are locked with lockprof_mutex_lock(), or if
+    the library is built with -DLOCKPROF_MUTEX_HOOKS: then pthread_mutex_lock()
+    itself is interposed (see lockprof_mutex.c), which covers every mutex of
+    the program, but not those locked by glibc internally. Other kinds of
+    locks may report their waits with lockprof_record(). Waits of the
+    profiler itself (for locks that capturing a stack takes) are not
+    profiled.
+
+    Report looks like this:
+
+    Lock contention: 3 locks, 1200 contentions, 48210 us waited; top 2 locks
+    Lock 0x55d0c8e3c040: 1100 contentions, 47000 us waited, max 812 us
+        wait histogram: <2us 300, <4us 500, <8us 200, <1024us 100
+        Stack 7: 1000 contentions, 46000 us waited
+            #00 ./server(queue_push+0x1c) [0x55d0c8a3b1e2] queue.c:40
+            ...
+*/
+
+#define LOCKPROF_HISTOGRAM_BUCKETS 16
+
+/*
+    Allocate tables on the first call and start profiling.
+
+    Returns 0 on success and -1 on error.
+*/
+int lockprof_start();
+
+/*
+    Stop profiling. Collected data is kept.
+*/
+void lockprof_stop();
+
+/*
+    Lock 'mutex' like pthread_mutex_lock() does, profiling the wait if it is
+    locked by another thread.
+*/
+int lockprof_mutex_lock(pthread_mutex_t *mutex);
+
+/*
+    Record that the calling thread waited 'wait_ns' nanoseconds for 'lock',
+    skipping 'skip' innermost frames of the caller (e.g. of lock wrappers).
+*/
+void lockprof_record(const void *lock, uint64_t wait_ns, int skip);
+
+/*
+    Log 'top_n' locks with most time waited, with their histograms and
+    acquiring stacks.
+*/
+void lockprof_report(int log_level, int top_n);
+
+/*
+    Forget collected data.
+*/
+void lockprof_reset();
+
+#endif // LOCKPROF_H_INCLUDED
@@ -0,0 +1,20 @@
+/*
+    Interposition of pthread_mutex_lock() for lockprof.h, built only with
+    -DLOCKPROF_MUTEX_HOOKS. Definition in the executable takes precedence over
+    the one of libc for the program and all of its libraries; lockprof.c finds
+    the real one with dlsym(RTLD_NEXT).
+*/
+
+#ifdef LOCKPROF_MUTEX_HOOKS
+
+#include "lockprof.h"
+
+#include <pthread.h>
+
+// public
+
+int pthread_mutex_lock(pthread_mutex_t *mutex) {
+    return lockprof_mutex_lock(mutex);
+}
+
+#endif // LOCKPROF_MUTEX_HOOKS
@@ -1,5 +1,10 @@
 #include "log.h"
 
+#include "metrics.h"
+#include "probes.h"
+#include "tracebuf.h"
+#include "tracectx.h"
+
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,6 +27,9 @@ static const char *level_labels[] = {
 
 static pthread_mutex_t cfg_mtx = PTHREAD_MUTEX_INITIALIZER;
 
+// metrics.h counter of dropped messages, -1 until log_register_metrics()
+static int dropped_metric = -1;
+
 static void lock();
 static void unlock();
 
@@ -82,21 +90,38 @@ void log_set_ident(const char *ident) {
     unlock();
 }
 
+void log_register_metrics() {
+    int id = metrics_counter("log_dropped_total",
+      "Log messages lost because no sink or file was set");
+    __atomic_store_n(&dropped_metric, id, __ATOMIC_RELAXED);
+}
+
 void log_log(int level, const char *file, int line, const char *fmt, ...) {
+    PROBE3(dm, log_entry, level, file, line);
+
+    // Tracer records whatever log level and sink are
+    tracebuf_record(TRACEBUF_LOG, (uint64_t) level << 32 | (uint32_t) line,
+      (uintptr_t) fmt);
+
     lock();
 
-    if (Config.sink == LOG_SINK_UNSPECIFIED
-        || Config.level_mask == LOG_DISABLED
-        || !(Config.level_mask & level)) {
+    if (Config.level_mask == LOG_DISABLED || !(Config.level_mask & level)) {
         unlock();
+        PROBE4(dm, log_drop, level, file, line, fmt);
         return;
     }
 
-    if (Config.sink == LOG_SINK_FILE && !Config.file) {
+    // Messages that pass the filter, but have nowhere to go, are lost
+    if (Config.sink == LOG_SINK_UNSPECIFIED
+        || (Config.sink == LOG_SINK_FILE && !Config.file)) {
         unlock();
+        PROBE4(dm, log_drop, level, file, line, fmt);
+        metrics_add(__atomic_load_n(&dropped_metric, __ATOMIC_RELAXED), 1);
         return;
     }
 
+    PROBE4(dm, log_emit, level, file, line, fmt);
+
     va_list args;
     va_start(args, fmt);
 
@@ -154,8 +179,12 @@ void log_to_syslog(int level, const char *file, int line, const char *fmt,
                  : level == LOG_LEVEL_ERROR ? LOG_ERR
                                             : LOG_DEBUG;
 
-    char prefix[64];
-    snprintf(prefix, sizeof(prefix), "%s:%d", file, line);
+    char ctx[40];
+    tracectx_format(ctx, sizeof(ctx));
+
+    char prefix[112];
+    snprintf(prefix, sizeof(prefix), ctx[0] ? "%s:%d [%s]" : "%s:%d", file,
+      line, ctx);
 
     char msg[256];
     vsnprintf(msg, sizeof(msg), fmt, ap);
@@ -169,8 +198,14 @@ void log_to_file(int level, const char *file, int line, const char *fmt,
     char time_str[32];
     get_time(time_str, sizeof(time_str));
 
-    fprintf(Config.file, "%s [%-5s] [%s] %s:%d: ",
-    time_str, get_level_label(level), Config.ident, file, line);
+    char ctx[40];
+    if (tracectx_format(ctx, sizeof(ctx))) {
+        fprintf(Config.file, "%s [%-5s] [%s] [%s] %s:%d: ",
+        time_str, get_level_label(level), Config.ident, ctx, file, line);
+    } else {
+        fprintf(Config.file, "%s [%-5s] [%s] %s:%d: ",
+        time_str, get_level_label(level), Config.ident, file, line);
+    }
 
     vfprintf(Config.file, fmt, ap);
     fprintf(Config.file, "\n");
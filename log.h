@@ -94,6 +94,14 @@ void log_get_sink(log_sink_t *sink, FILE **file);
 */
 int log_get_level();
 
+/*
+    Register log_dropped_total counter in metrics.h, which counts messages
+    that pass the level mask but are lost because no sink (or no file) is set.
+    Messages filtered out by the level mask aren't counted. Until this is
+    called, nothing is counted. metrics_http_start() calls it.
+*/
+void log_register_metrics();
+
 /*
     Low-level logging call.
 */
@@ -1,6 +1,9 @@
 #include "measure.h"
 
 #include "log.h"
+#include "probes.h"
+#include "tracebuf.h"
+#include "tracectx.h"
 
 #include <errno.h>
 #include <stdio.h>
@@ -10,6 +13,9 @@
 static struct timespec start[ARRAY_SIZE];
 static int start_ptr = 0;
 
+// Trace context to restore when span opened by measure_start() is closed
+static struct tracectx parent[ARRAY_SIZE];
+
 static int is_log_available();
 
 // public
@@ -33,9 +39,17 @@ void measure_start() {
         return;
     }
 
+    tracectx_span_begin(&parent[start_ptr]);
+
     if (clock_gettime(CLOCK_MONOTONIC, &start[start_ptr++])) {
         perror("DM: measure_start(): clock_gettime()");
     }
+
+    struct tracectx span;
+    tracectx_get(&span);
+
+    PROBE1(dm, measure_start, start_ptr);
+    tracebuf_record(TRACEBUF_REGION_BEGIN, start_ptr, span.span_id);
 }
 
 struct timespec *measure_get(struct timespec *diff) {
@@ -46,19 +60,38 @@ struct timespec *measure_get(struct timespec *diff) {
 
     if(--start_ptr < 0) {
         start_ptr = 0;
+    } else {
+        tracectx_span_end(&parent[start_ptr]);
     }
 
-    return measure_diff(&start[start_ptr], diff, diff);
+    measure_diff(&start[start_ptr], diff, diff);
+    PROBE3(dm, measure_get, start_ptr, diff->tv_sec, diff->tv_nsec);
+    tracebuf_record(TRACEBUF_REGION_END, start_ptr,
+      diff->tv_sec * 1000000000ull + diff->tv_nsec);
+
+    return diff;
 }
 
 void measure_print(const char *comment) {
+    // Span that measure_get() closes
+    struct tracectx span;
+    tracectx_get(&span);
+
     struct timespec diff;
     measure_get(&diff);
 
+    char span_str[32] = "";
+    if (span.trace_id) {
+        snprintf(span_str, sizeof(span_str), " (span %016llx)",
+          (unsigned long long) span.span_id);
+    }
+
     if (is_log_available()) {
-        LOGD("%s took %ld.%09ld seconds", comment, diff.tv_sec, diff.tv_nsec);
+        LOGD("%s took %ld.%09ld seconds%s", comment, diff.tv_sec, diff.tv_nsec,
+          span_str);
     } else {
-        printf("DM: %s took %ld.%09ld seconds\n", comment, diff.tv_sec, diff.tv_nsec);
+        printf("DM: %s took %ld.%09ld seconds%s\n", comment, diff.tv_sec,
+          diff.tv_nsec, span_str);
     }
 }
 
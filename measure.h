@@ -100,7 +100,8 @@ struct timespec *measure_diff(const struct timespec *start,
 /*
     Store current time to internal stack. Note that stack used by this module is
     limited to 16 values, i.e. you can store only 16 starting points using
-    measure_start(). If stack is already full, does nothing.
+    measure_start(). If stack is already full, does nothing. If the calling
+    thread has a trace context, a child span is opened (see tracectx.h).
 */
 void measure_start();
 
@@ -112,6 +113,8 @@ void measure_start();
     will be printed to stdout. 'comment' must not be NULL. 'comment' is used as
     a part of message to be printed. Resulting message is something like this:
     $comment took 1.092398 seconds
+    and, if a span was opened by measure_start():
+    $comment took 1.092398 seconds (span 9a07c1e2f3b4d5a6)
 */
 void measure_print(const char *comment);
 
@@ -119,7 +122,8 @@ void measure_print(const char *comment);
     Get difference between time stored at the top of internal stack and current
     moment. Pops value from stack. If stack is empty, previous top of the stack
     is used. 'diff' must not be NULL. Result will be stored to the struct
-    pointed to by 'diff'. Returns 'diff'.
+    pointed to by 'diff'. Closes span opened by measure_start(), if any.
+    Returns 'diff'.
 */
 struct timespec *measure_get(struct timespec *diff);
 
@@ -0,0 +1,393 @@
+#define _GNU_SOURCE
+
+#include "metrics.h"
+
+#include "log.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+
+// Slots of a shard, shared by counters (one each) and histograms (buckets,
+// then sum)
+#define MAX_SLOTS 2048
+#define CACHE_LINE 64
+
+#define HISTOGRAM_SLOTS (METRICS_HISTOGRAM_BUCKETS + 1)
+
+struct metric {
+    char *name;
+    char *help;
+    metrics_type_t type;
+    int slot;
+    int64_t gauge;
+};
+
+// Only the owning thread writes its slots. Shards are linked and unlinked
+// under 'shards_mtx', which readers hold, so a shard is never read after it's
+// freed.
+struct shard {
+    uint64_t slots[MAX_SLOTS];
+    struct shard *next;
+    struct shard *prev;
+};
+
+// Registered metrics are never changed, 'metrics_total' is published after
+// the metric is complete
+static struct metric metrics[METRICS_MAX];
+static int metrics_total;
+static int slots_used;
+static pthread_mutex_t metrics_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static struct shard *shards;
+static pthread_mutex_t shards_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shard_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static int key_error;
+
+// Counts of exited threads, and of threads that couldn't get a shard
+static uint64_t retired[MAX_SLOTS];
+
+static TLS struct shard *own_shard;
+
+static int add_metric(const char *name, const char *help,
+  metrics_type_t type);
+static void add_to_slot(int slot, uint64_t n);
+static struct shard *create_shard();
+static void create_key();
+static void retire_shard(void *arg);
+static uint64_t read_slot(int slot);
+static const struct metric *get_metric(int id, metrics_type_t type);
+static void log_histogram(int log_level, const struct metrics_value *value);
+static size_t format_bound(char *buf, size_t len, const char *label, int i);
+
+// public
+
+int metrics_counter(const char *name, const char *help) {
+    return add_metric(name, help, METRICS_COUNTER);
+}
+
+int metrics_gauge(const char *name, const char *help) {
+    return add_metric(name, help, METRICS_GAUGE);
+}
+
+int metrics_histogram(const char *name, const char *help) {
+    return add_metric(name, help, METRICS_HISTOGRAM);
+}
+
+void metrics_add(int counter, uint64_t n) {
+    const struct metric *metric = get_metric(counter, METRICS_COUNTER);
+    if (metric) {
+        add_to_slot(metric->slot, n);
+    }
+}
+
+void metrics_gauge_set(int gauge, int64_t value) {
+    struct metric *metric = (struct metric *) get_metric(gauge, METRICS_GAUGE);
+    if (metric) {
+        __atomic_store_n(&metric->gauge, value, __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_gauge_add(int gauge, int64_t delta) {
+    struct metric *metric = (struct metric *) get_metric(gauge, METRICS_GAUGE);
+    if (metric) {
+        __atomic_fetch_add(&metric->gauge, delta, __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_observe(int histogram, uint64_t value) {
+    const struct metric *metric = get_metric(histogram, METRICS_HISTOGRAM);
+    if (!metric) {
+        return;
+    }
+
+    int bucket = value <= 1 ? 0 : 64 - __builtin_clzll(value - 1);
+    if (bucket >= METRICS_HISTOGRAM_BUCKETS) {
+        bucket = METRICS_HISTOGRAM_BUCKETS - 1;
+    }
+
+    add_to_slot(metric->slot + bucket, 1);
+    add_to_slot(metric->slot + METRICS_HISTOGRAM_BUCKETS, value);
+}
+
+uint64_t metrics_bucket_bound(int i) {
+    return i < METRICS_HISTOGRAM_BUCKETS - 1 ? (uint64_t) 1 << i : UINT64_MAX;
+}
+
+int metrics_count() {
+    return __atomic_load_n(&metrics_total, __ATOMIC_ACQUIRE);
+}
+
+int metrics_read(int id, struct metrics_value *value) {
+    if (id < 0 || id >= metrics_count()) {
+        return -1;
+    }
+
+    const struct metric *metric = &metrics[id];
+    memset(value, 0, sizeof(*value));
+    value->name = metric->name;
+    value->help = metric->help;
+    value->type = metric->type;
+
+    pthread_mutex_lock(&shards_mtx);
+
+    switch (metric->type) {
+    case METRICS_COUNTER:
+        value->value = read_slot(metric->slot);
+        break;
+
+    case METRICS_GAUGE:
+        value->value = __atomic_load_n(&metric->gauge, __ATOMIC_RELAXED);
+        break;
+
+    case METRICS_HISTOGRAM:
+        for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; ++i) {
+            value->buckets[i] = read_slot(metric->slot + i);
+            value->count += value->buckets[i];
+        }
+        value->value = read_slot(metric->slot + METRICS_HISTOGRAM_BUCKETS);
+        break;
+    }
+
+    pthread_mutex_unlock(&shards_mtx);
+    return 0;
+}
+
+void metrics_report(int log_level) {
+    int count = metrics_count();
+    LOG(log_level, "Metrics: %d", count);
+
+    for (int id = 0; id < count; ++id) {
+        struct metrics_value value;
+        metrics_read(id, &value);
+
+        switch (value.type) {
+        case METRICS_COUNTER:
+            LOG(log_level, "\t%s counter %llu", value.name,
+              (unsigned long long) value.value);
+            break;
+
+        case METRICS_GAUGE:
+            LOG(log_level, "\t%s gauge %lld", value.name,
+              (long long) value.value);
+            break;
+
+        case METRICS_HISTOGRAM:
+            log_histogram(log_level, &value);
+            break;
+        }
+    }
+}
+
+// private
+
+static
+int add_metric(const char *name, const char *help, metrics_type_t type) {
+    int slots = type == METRICS_COUNTER ? 1
+                : type == METRICS_HISTOGRAM ? HISTOGRAM_SLOTS : 0;
+
+    pthread_mutex_lock(&metrics_mtx);
+
+    int id = -1;
+    for (int i = 0; i < metrics_total; ++i) {
+        if (!strcmp(metrics[i].name, name)) {
+            id = metrics[i].type == type ? i : -1;
+            if (id < 0) {
+                LOGE("%s(): %s is registered with another type", __func__,
+                  name);
+            }
+            pthread_mutex_unlock(&metrics_mtx);
+            return id;
+        }
+    }
+
+    if (metrics_total == METRICS_MAX || slots_used + slots > MAX_SLOTS) {
+        pthread_mutex_unlock(&metrics_mtx);
+        LOGE("%s(): too many metrics", __func__);
+        return -1;
+    }
+
+    struct metric *metric = &metrics[metrics_total];
+    metric->name = strdup(name);
+    metric->help = help ? strdup(help) : NULL;
+    if (!metric->name || (help && !metric->help)) {
+        free(metric->name);
+        free(metric->help);
+        pthread_mutex_unlock(&metrics_mtx);
+        LOGE("%s(): out of memory", __func__);
+        return -1;
+    }
+
+    metric->type = type;
+    metric->slot = slots_used;
+    metric->gauge = 0;
+    slots_used += slots;
+
+    id = metrics_total;
+    __atomic_store_n(&metrics_total, metrics_total + 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&metrics_mtx);
+    return id;
+}
+
+static
+const struct metric *get_metric(int id, metrics_type_t type) {
+    if (__builtin_expect((unsigned) id >= (unsigned) metrics_count(), 0)
+        || __builtin_expect(metrics[id].type != type, 0)) {
+        return NULL;
+    }
+
+    return &metrics[id];
+}
+
+/*
+    Thread's own slot is only written by the thread, so it's updated with a
+    plain add; the store is atomic only for readers not to see it torn.
+*/
+static
+void add_to_slot(int slot, uint64_t n) {
+    struct shard *shard = own_shard;
+    if (__builtin_expect(!shard, 0)) {
+        shard = create_shard();
+        if (!shard) {
+            __atomic_fetch_add(&retired[slot], n, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    uint64_t *value = &shard->slots[slot];
+    __atomic_store_n(value, *value + n, __ATOMIC_RELAXED);
+}
+
+static
+struct shard *create_shard() {
+    pthread_once(&key_once, create_key);
+    if (key_error) {
+        return NULL;
+    }
+
+    size_t size = (sizeof(struct shard) + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+    struct shard *shard = aligned_alloc(CACHE_LINE, size);
+    if (!shard) {
+        return NULL;
+    }
+    memset(shard, 0, sizeof(*shard));
+
+    pthread_mutex_lock(&shards_mtx);
+    shard->next = shards;
+    if (shards) {
+        shards->prev = shard;
+    }
+    shards = shard;
+    pthread_mutex_unlock(&shards_mtx);
+
+    pthread_setspecific(shard_key, shard);
+    own_shard = shard;
+    return shard;
+}
+
+static
+void create_key() {
+    key_error = pthread_key_create(&shard_key, retire_shard);
+}
+
+/*
+    Key destructor: move counts of exiting thread to 'retired'.
+*/
+static
+void retire_shard(void *arg) {
+    struct shard *shard = arg;
+
+    pthread_mutex_lock(&shards_mtx);
+
+    for (int i = 0; i < MAX_SLOTS; ++i) {
+        if (shard->slots[i]) {
+            __atomic_fetch_add(&retired[i], shard->slots[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    if (shard->prev) {
+        shard->prev->next = shard->next;
+    } else {
+        shards = shard->next;
+    }
+    if (shard->next) {
+        shard->next->prev = shard->prev;
+    }
+
+    pthread_mutex_unlock(&shards_mtx);
+
+    // Destructors of other keys may still update metrics, they'd get a new
+    // shard
+    own_shard = NULL;
+    free(shard);
+}
+
+/*
+    Sum 'slot' of all shards. Must be called with 'shards_mtx' held.
+*/
+static
+uint64_t read_slot(int slot) {
+    uint64_t sum = __atomic_load_n(&retired[slot], __ATOMIC_RELAXED);
+    for (const struct shard *shard = shards; shard; shard = shard->next) {
+        sum += __atomic_load_n(&shard->slots[slot], __ATOMIC_RELAXED);
+    }
+
+    return sum;
+}
+
+/*
+    Log count, sum and upper bounds of percentiles, which are known only up
+    to a bucket.
+*/
+static
+void log_histogram(int log_level, const struct metrics_value *value) {
+    static const int percents[] = {50, 90, 99};
+    char quantiles[128] = "";
+    size_t len = 0;
+
+    uint64_t seen = 0;
+    int p = 0;
+    int max = -1;
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; ++i) {
+        if (!value->buckets[i]) {
+            continue;
+        }
+
+        seen += value->buckets[i];
+        max = i;
+        while (p < 3 && seen * 100 >= value->count * percents[p]) {
+            char label[8];
+            snprintf(label, sizeof(label), "p%d", percents[p]);
+            len += format_bound(quantiles + len, sizeof(quantiles) - len,
+                                label, i);
+            ++p;
+        }
+    }
+
+    if (max >= 0) {
+        format_bound(quantiles + len, sizeof(quantiles) - len, "max", max);
+    }
+
+    LOG(log_level, "\t%s histogram count %llu sum %llu%s", value->name,
+      (unsigned long long) value->count, (unsigned long long) value->value,
+      quantiles);
+}
+
+/*
+    Format ", 'label' <= bound" of bucket 'i', or "> bound" of the previous
+    one for the last bucket, which has no bound.
+*/
+static
+size_t format_bound(char *buf, size_t len, const char *label, int i) {
+    if (i == METRICS_HISTOGRAM_BUCKETS - 1) {
+        return snprintf(buf, len, ", %s > %llu", label,
+                        (unsigned long long) metrics_bucket_bound(i - 1));
+    }
+
+    return snprintf(buf, len, ", %s <= %llu", label,
+                    (unsigned long long) metrics_bucket_bound(i));
+}
@@ -0,0 +1,111 @@
+#ifndef METRICS_H_INCLUDED
+#define METRICS_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+    Counters, gauges and histograms, cheap enough for hot paths.
+
+    Counters and histograms are sharded per thread: every thread that updates
+    a metric gets its own cache-aligned block of slots, one per counter and
+    METRICS_HISTOGRAM_BUCKETS + 1 per histogram, and an update is a plain
+    load, add and store to the calling thread's slot, with no atomic
+    read-modify-write and no cache line shared with other threads. Reads sum
+    slots of all threads, plus what threads that have exited had counted.
+    Gauges are set rather than added to, so they are single atomic values.
+
+    Metrics are registered once by name, which returns an id for updates:
+
+    <code>
+        static int requests;
+        requests = metrics_counter("requests_total", "Requests handled");
+        ...
+        metrics_add(requests, 1);
+    </code>
+
+    Histograms have power-of-two buckets: bucket i counts values in
+    (2^(i-1), 2^i], bucket 0 values of 0 and 1, and the last bucket all values
+    above. Values are in whatever unit the caller chooses (e.g. us, bytes).
+
+    metrics_report() logs all metrics:
+
+    Metrics: 3
+        requests_total counter 1234
+        queue_depth gauge 17
+        latency_us histogram count 100 sum 5230, p50 <= 64, p99 <= 512, max <= 1024
+
+    metrics_read() gives them to other exporters.
+*/
+
+#define METRICS_MAX 256
+#define METRICS_HISTOGRAM_BUCKETS 32
+
+typedef enum {
+    METRICS_COUNTER,
+    METRICS_GAUGE,
+    METRICS_HISTOGRAM,
+} metrics_type_t;
+
+struct metrics_value {
+    const char *name;
+    const char *help;
+    metrics_type_t type;
+    int64_t value;          // of counter or gauge; sum of histogram
+    uint64_t count;         // number of observations of histogram
+    uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+};
+
+/*
+    Register a counter, gauge or histogram named 'name' with description
+    'help' (may be NULL). Registering an existing name returns the existing
+    metric if its type matches.
+
+    Returns id of the metric, or -1 if type doesn't match or there are too
+    many metrics.
+*/
+int metrics_counter(const char *name, const char *help);
+int metrics_gauge(const char *name, const char *help);
+int metrics_histogram(const char *name, const char *help);
+
+/*
+    Add 'n' to a counter.
+*/
+void metrics_add(int counter, uint64_t n);
+
+/*
+    Set a gauge to 'value' or add 'delta' to it.
+*/
+void metrics_gauge_set(int gauge, int64_t value);
+void metrics_gauge_add(int gauge, int64_t delta);
+
+/*
+    Record 'value' in a histogram.
+*/
+void metrics_observe(int histogram, uint64_t value);
+
+/*
+    Upper bound of histogram bucket 'i', UINT64_MAX for the last one.
+*/
+uint64_t metrics_bucket_bound(int i);
+
+/*
+    Number of registered metrics. Ids are 0 to count - 1, in order of
+    registration.
+*/
+int metrics_count();
+
+/*
+    Read current value of metric 'id'. Updates made by other threads
+    concurrently may or may not be seen, and values of different metrics (or
+    buckets of a histogram) aren't read at the same instant.
+
+    Returns 0 on success and -1 if there is no such metric.
+*/
+int metrics_read(int id, struct metrics_value *value);
+
+/*
+    Log values of all metrics.
+*/
+void metrics_report(int log_level);
+
+#endif // METRICS_H_INCLUDED
@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+
+#include "metrics_http.h"
+
+#include "log.h"
+#include "metrics.h"
+#include "timer.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define INITIAL_BUFFER (64 * 1024)
+#define MAX_REQUEST 4096
+#define RECV_TIMEOUT_MS 1000
+
+#define CONTENT_TYPE "text/plain; version=0.0.4; charset=utf-8"
+
+struct cursor {
+    char *buf;
+    size_t len;
+    size_t pos;
+};
+
+static int listen_fd = -1;
+static pthread_t server;
+
+// Render buffer, reused by all scrapes
+static char *body;
+static size_t body_size;
+
+static int open_socket(const char *address);
+static void *server_thread(void *arg);
+static void serve(int fd);
+static int read_request(int fd, char *request, size_t size);
+static int render_body();
+static void respond(int fd, const char *status, const char *body, size_t len);
+static int write_all(int fd, const char *buf, size_t len);
+static void put(struct cursor *cursor, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+static void put_help(struct cursor *cursor, const char *name,
+  const char *help);
+
+// public
+
+int metrics_http_start(const char *address) {
+    if (listen_fd >= 0) {
+        LOGE("%s(): already started", __func__);
+        return -1;
+    }
+
+    body = malloc(INITIAL_BUFFER);
+    if (!body) {
+        LOGE("%s(): out of memory", __func__);
+        return -1;
+    }
+    body_size = INITIAL_BUFFER;
+
+    log_register_metrics();
+    timer_register_metrics();
+
+    listen_fd = open_socket(address);
+    if (listen_fd < 0) {
+        free(body);
+        body = NULL;
+        return -1;
+    }
+
+    int err = pthread_create(&server, NULL, server_thread, NULL);
+    if (err) {
+        LOGE("%s(): pthread_create() failed: %s", __func__, strerror(err));
+        close(listen_fd);
+        listen_fd = -1;
+        free(body);
+        body = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void metrics_http_stop() {
+    if (listen_fd < 0) {
+        return;
+    }
+
+    // Wakes up accept() of the server thread
+    shutdown(listen_fd, SHUT_RDWR);
+    pthread_join(server, NULL);
+
+    close(listen_fd);
+    listen_fd = -1;
+    free(body);
+    body = NULL;
+}
+
+size_t metrics_http_render(char *buf, size_t len) {
+    struct cursor cursor = {buf, len, 0};
+    if (len) {
+        buf[0] = '\0';
+    }
+
+    int count = metrics_count();
+    for (int id = 0; id < count; ++id) {
+        struct metrics_value value;
+        if (metrics_read(id, &value)) {
+            continue;
+        }
+
+        put_help(&cursor, value.name, value.help);
+
+        switch (value.type) {
+        case METRICS_COUNTER:
+            put(&cursor, "# TYPE %s counter\n%s %llu\n", value.name,
+              value.name, (unsigned long long) value.value);
+            break;
+
+        case METRICS_GAUGE:
+            put(&cursor, "# TYPE %s gauge\n%s %lld\n", value.name,
+              value.name, (long long) value.value);
+            break;
+
+        case METRICS_HISTOGRAM:
+            put(&cursor, "# TYPE %s histogram\n", value.name);
+
+            uint64_t cumulative = 0;
+            for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS - 1; ++i) {
+                cumulative += value.buckets[i];
+                put(&cursor, "%s_bucket{le=\"%llu\"} %llu\n", value.name,
+                  (unsigned long long) metrics_bucket_bound(i),
+                  (unsigned long long) cumulative);
+            }
+
+            put(&cursor, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %llu\n"
+              "%s_count %llu\n", value.name, (unsigned long long) value.count,
+              value.name, (unsigned long long) value.value, value.name,
+              (unsigned long long) value.count);
+            break;
+        }
+    }
+
+    return cursor.pos;
+}
+
+// private
+
+static
+int open_socket(const char *address) {
+    int unix_socket = address[0] == '/';
+    int fd = socket(unix_socket ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_CLOEXEC,
+                    0);
+    if (fd < 0) {
+        LOGE("%s(): socket() failed: %s", __func__, strerror(errno));
+        return -1;
+    }
+
+    int rv;
+    if (unix_socket) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(addr.sun_path)) {
+            LOGE("%s(): path is too long: %s", __func__, address);
+            close(fd);
+            return -1;
+        }
+        strcpy(addr.sun_path, address);
+
+        // Replace a stale socket of an earlier run, but never a regular file
+        struct stat st;
+        if (!lstat(address, &st) && S_ISSOCK(st.st_mode)) {
+            unlink(address);
+        }
+
+        rv = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    } else {
+        char *end;
+        long port = strtol(address, &end, 10);
+        if (*end || port <= 0 || port > 65535) {
+            LOGE("%s(): invalid address: %s", __func__, address);
+            close(fd);
+            return -1;
+        }
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        rv = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    }
+
+    if (rv || listen(fd, 16)) {
+        LOGE("%s(): can't listen at %s: %s", __func__, address,
+          strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static
+void *server_thread(void *arg) {
+    (void) arg;
+
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;      // stopped
+        }
+
+        serve(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static
+void serve(int fd) {
+    struct timeval timeout = {
+        RECV_TIMEOUT_MS / 1000, RECV_TIMEOUT_MS % 1000 * 1000
+    };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char request[MAX_REQUEST];
+    if (read_request(fd, request, sizeof(request))) {
+        return;
+    }
+
+    char method[16], path[256];
+    if (sscanf(request, "%15s %255s", method, path) != 2) {
+        respond(fd, "400 Bad Request", "", 0);
+    } else if (strcmp(method, "GET")) {
+        respond(fd, "405 Method Not Allowed", "", 0);
+    } else if (strcmp(path, "/metrics") && strncmp(path, "/metrics?", 9)) {
+        respond(fd, "404 Not Found", "", 0);
+    } else if (render_body()) {
+        respond(fd, "500 Internal Server Error", "", 0);
+    } else {
+        respond(fd, "200 OK", body, strlen(body));
+    }
+}
+
+/*
+    Read request up to the end of headers, which is all that a GET has.
+*/
+static
+int read_request(int fd, char *request, size_t size) {
+    size_t len = 0;
+    while (len < size - 1) {
+        ssize_t n = recv(fd, request + len, size - 1 - len, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        len += n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+    Render metrics to 'body', growing it if they don't fit.
+*/
+static
+int render_body() {
+    size_t len = metrics_http_render(body, body_size);
+    if (len < body_size) {
+        return 0;
+    }
+
+    // Leave room for metrics registered meanwhile
+    size_t size = len + len / 4 + 1;
+    char *bigger = realloc(body, size);
+    if (!bigger) {
+        LOGE("%s(): out of memory", __func__);
+        return -1;
+    }
+    body = bigger;
+    body_size = size;
+
+    return metrics_http_render(body, body_size) < body_size ? 0 : -1;
+}
+
+static
+void respond(int fd, const char *status, const char *content, size_t len) {
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 %s\r\n"
+                              "Content-Type: " CONTENT_TYPE "\r\n"
+                              "Content-Length: %zu\r\n"
+                              "Connection: close\r\n"
+                              "\r\n", status, len);
+
+    if (!write_all(fd, header, header_len)) {
+        write_all(fd, content, len);
+    }
+}
+
+static
+int write_all(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+    Append to cursor like snprintf() does, counting length of what doesn't
+    fit.
+*/
+static
+void put(struct cursor *cursor, const char *fmt, ...) {
+    size_t left = cursor->pos < cursor->len ? cursor->len - cursor->pos : 0;
+
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(left ? cursor->buf + cursor->pos : NULL, left, fmt, args);
+    va_end(args);
+
+    if (n > 0) {
+        cursor->pos += n;
+    }
+}
+
+/*
+    Append HELP line, escaping backslashes and line breaks of 'help'.
+*/
+static
+void put_help(struct cursor *cursor, const char *name, const char *help) {
+    if (!help) {
+        return;
+    }
+
+    put(cursor, "# HELP %s ", name);
+    for (const char *c = help; *c; ++c) {
+        if (*c == '\\') {
+            put(cursor, "\\\\");
+        } else if (*c == '\n') {
+            put(cursor, "\\n");
+        } else {
+            put(cursor, "%c", *c);
+        }
+    }
+    put(cursor, "\n");
+}
@@ -0,0 +1,57 @@
+#ifndef METRICS_HTTP_H_INCLUDED
+#define METRICS_HTTP_H_INCLUDED
+
+#include <stddef.h>
+
+/*
+    Minimal HTTP/1.1 responder that serves metrics.h metrics at /metrics in
+    Prometheus text format, so that monitoring scrapes the process directly
+    instead of parsing its log.
+
+    It listens on loopback or on a Unix socket only, and serves one request
+    per connection from a single helper thread. Every scrape renders into the
+    same buffer, which is grown only when metrics don't fit anymore. Requests
+    for other paths get 404, and other methods 405.
+
+    Counters and gauges are rendered as they are, histograms as cumulative
+    buckets with le="1", "2", "4", ... "+Inf", plus _sum and _count:
+
+    # HELP requests_total Requests handled
+    # TYPE requests_total counter
+    requests_total 1234
+    # TYPE latency_us histogram
+    latency_us_bucket{le="1"} 0
+    ...
+    latency_us_bucket{le="+Inf"} 100
+    latency_us_sum 5230
+    latency_us_count 100
+
+    Starting the responder also registers log_dropped_total (see log.h) and
+    timer_late_us (see timer.h), so that they are served along with the
+    application's own metrics.
+*/
+
+/*
+    Start serving at 'address': a TCP port on 127.0.0.1 (e.g. "9100") or an
+    absolute path of a Unix socket (an existing socket is replaced, other files
+    are left alone and make binding fail).
+
+    Returns 0 on success and -1 on error.
+*/
+int metrics_http_start(const char *address);
+
+/*
+    Stop serving and close the socket.
+*/
+void metrics_http_stop();
+
+/*
+    Render all metrics in Prometheus text format to 'buf' of 'len' bytes,
+    NUL-terminated unless 'len' is 0.
+
+    Returns length of the whole text, which may be 'len' or more if it was
+    truncated, like snprintf() does.
+*/
+size_t metrics_http_render(char *buf, size_t len);
+
+#endif // METRICS_HTTP_H_INCLUDED
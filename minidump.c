@@ -0,0 +1,178 @@
+#define _GNU_SOURCE
+
+#include "minidump.h"
+
+#include "cfi.h"
+#include "modmap.h"
+#include "sigsafe.h"
+#include "threads.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define MAX_FRAMES 64
+#define SUSPEND_TIMEOUT_MS 1000
+#define PAGE_SIZE_MIN 4096
+
+#if defined(__x86_64__)
+# define MACHINE EM_X86_64
+#elif defined(__aarch64__)
+# define MACHINE EM_AARCH64
+#else
+# define MACHINE EM_NONE
+#endif
+
+// Everything is preallocated: the dump is written from a signal handler.
+// Only one dump is written at a time.
+static int dumping;
+static struct thread_state threads[THREADS_MAX];
+static uint8_t stack[MINIDUMP_STACK_SIZE];
+static void *frames[MAX_FRAMES];
+static char modules_text[64 * 1024];
+static char output[8192];
+
+static void write_record(struct sigsafe_buf *out, uint32_t type, pid_t tid,
+  const void *data, size_t size);
+static void write_thread(struct sigsafe_buf *out,
+  const struct thread_state *thread);
+static void write_maps(struct sigsafe_buf *out);
+
+// public
+
+void minidump_write(int fd, int sig, const siginfo_t *info,
+  const void *context) {
+    if (__atomic_exchange_n(&dumping, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    struct sigsafe_buf out;
+    sigsafe_init(&out, fd, output, sizeof(output));
+
+    pid_t tid = syscall(SYS_gettid);
+
+    struct minidump_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MINIDUMP_MAGIC, sizeof(header.magic));
+    header.version = MINIDUMP_VERSION;
+    header.machine = MACHINE;
+    header.signal = sig;
+    header.code = info->si_code;
+    header.fault_address = (uintptr_t) info->si_addr;
+    header.pid = getpid();
+    header.tid = tid;
+    sigsafe_write(&out, &header, sizeof(header));
+
+    // crashed thread goes first
+    threads_state_from_context(&threads[0], tid, context);
+    int count = threads_suspend(threads + 1, THREADS_MAX - 1,
+      SUSPEND_TIMEOUT_MS);
+    count = count < 0 ? 1 : count + 1;
+
+    for (int i = 0; i < count; ++i) {
+        write_thread(&out, &threads[i]);
+    }
+
+    struct sigsafe_buf modules;
+    sigsafe_init(&modules, -1, modules_text, sizeof(modules_text));
+    modmap_write_async(&modules, 0);
+    write_record(&out, MINIDUMP_MODULES, 0, modules.data, modules.len);
+
+    write_maps(&out);
+
+    write_record(&out, MINIDUMP_END, 0, NULL, 0);
+    sigsafe_flush(&out);
+}
+
+// private
+
+static
+void write_record(struct sigsafe_buf *out, uint32_t type, pid_t tid,
+  const void *data, size_t size) {
+    struct minidump_record record;
+    record.type = type;
+    record.size = size;
+    record.tid = tid;
+    record.reserved = 0;
+
+    sigsafe_write(out, &record, sizeof(record));
+    sigsafe_write(out, data, size);
+}
+
+/*
+    Write registers, stack window and stack trace of a thread. Stack is read
+    page by page up to the first unreadable one, i.e. up to stack top.
+*/
+static
+void write_thread(struct sigsafe_buf *out, const struct thread_state *thread) {
+    struct minidump_thread header;
+    header.captured = thread->captured;
+    header.nregs = thread->nregs;
+
+    struct minidump_record record;
+    record.type = MINIDUMP_THREAD;
+    record.size = sizeof(header) + thread->nregs * sizeof(uint64_t);
+    record.tid = thread->tid;
+    record.reserved = 0;
+
+    sigsafe_write(out, &record, sizeof(record));
+    sigsafe_write(out, &header, sizeof(header));
+    sigsafe_write(out, thread->raw_regs, thread->nregs * sizeof(uint64_t));
+
+    if (!thread->captured || !thread->regs.sp) {
+        return;
+    }
+
+    struct minidump_stack where;
+    where.address = thread->regs.sp - MINIDUMP_STACK_REDZONE;
+
+    size_t size = 0;
+    while (size < sizeof(stack)) {
+        uintptr_t addr = where.address + size;
+        size_t chunk = PAGE_SIZE_MIN - addr % PAGE_SIZE_MIN;
+        if (chunk > sizeof(stack) - size) {
+            chunk = sizeof(stack) - size;
+        }
+
+        if (sigsafe_read(addr, stack + size, chunk)) {
+            break;
+        }
+        size += chunk;
+    }
+
+    record.type = MINIDUMP_STACK;
+    record.size = sizeof(where) + size;
+    sigsafe_write(out, &record, sizeof(record));
+    sigsafe_write(out, &where, sizeof(where));
+    sigsafe_write(out, stack, size);
+
+    struct cfi_regs regs = thread->regs;
+    frames[0] = (void *) regs.pc;
+    int depth = 1 + cfi_unwind_async(&regs, sigsafe_read_word, NULL,
+      frames + 1, MAX_FRAMES - 1);
+
+    uint64_t pcs[MAX_FRAMES];
+    for (int i = 0; i < depth; ++i) {
+        pcs[i] = (uintptr_t) frames[i];
+    }
+    write_record(out, MINIDUMP_FRAMES, thread->tid, pcs,
+      depth * sizeof(uint64_t));
+}
+
+static
+void write_maps(struct sigsafe_buf *out) {
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    char chunk[4096];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+        write_record(out, MINIDUMP_MAPS, 0, chunk, n);
+    }
+
+    close(fd);
+}
@@ -0,0 +1,90 @@
+#ifndef MINIDUMP_H_INCLUDED
+#define MINIDUMP_H_INCLUDED
+
+#include <signal.h>
+#include <stdint.h>
+
+/*
+    Compact crash dump: registers of every thread, a window of each thread's
+    stack memory, stack traces unwound at crash time, module map with
+    build-ids and /proc/self/maps. It is tens or hundreds of kilobytes where a
+    core dump of a big process takes gigabytes and minutes to write.
+
+    Dump is written by crash handler (see crash_handler_set_minidump() in
+    crash.h). tools/minidump converts it to text, which tools/symbolize
+    resolves:
+
+        tools/minidump crash.dmp | tools/symbolize -p /path/to/binaries
+
+    Other threads are stopped while the dump is written (see threads.h), so
+    their stacks are consistent.
+
+    File format: minidump_header followed by records, each being
+    minidump_record followed by 'size' bytes of payload, all in host byte
+    order. Payloads of several records of the same type and thread are
+    concatenated, e.g. text of /proc/self/maps is written in chunks. Dump
+    ends with MINIDUMP_END record; a dump without it was cut short.
+*/
+
+#define MINIDUMP_MAGIC "MINIDMP1"
+#define MINIDUMP_VERSION 1
+
+// Bytes of stack saved per thread, starting a bit below stack pointer
+#define MINIDUMP_STACK_SIZE (32 * 1024)
+#define MINIDUMP_STACK_REDZONE 128
+
+enum {
+    MINIDUMP_END,
+    MINIDUMP_THREAD,    // minidump_thread
+    MINIDUMP_STACK,     // minidump_stack, then stack bytes
+    MINIDUMP_FRAMES,    // uint64_t return addresses
+    MINIDUMP_MODULES,   // module map text, see modmap.h
+    MINIDUMP_MAPS,      // text of /proc/self/maps
+};
+
+struct minidump_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t machine;       // ELF e_machine: EM_X86_64, EM_AARCH64...
+    int32_t signal;
+    int32_t code;
+    uint64_t fault_address;
+    uint32_t pid;
+    uint32_t tid;           // thread that crashed
+};
+
+struct minidump_record {
+    uint32_t type;
+    uint32_t size;          // of payload
+    uint32_t tid;           // thread the record belongs to, or 0
+    uint32_t reserved;
+};
+
+/*
+    Thread registers, as laid out in ucontext: gregs on x86-64, x0-x30, sp,
+    pc and pstate on AArch64. 'captured' is 0 if thread didn't respond, and
+    registers are unknown.
+*/
+struct minidump_thread {
+    uint32_t captured;
+    uint32_t nregs;
+    uint64_t regs[];
+};
+
+struct minidump_stack {
+    uint64_t address;       // of the first byte saved
+};
+
+/*
+    Write a dump of the process to 'fd'. Async-signal-safe; meant to be
+    called from a handler of signal 'sig' with its 'info' and 'context'.
+    Other threads stay stopped afterwards: the process is expected to
+    terminate.
+
+    threads_init() must be called in advance, otherwise only the calling
+    thread is dumped.
+*/
+void minidump_write(int fd, int sig, const siginfo_t *info,
+  const void *context);
+
+#endif // MINIDUMP_H_INCLUDED
@@ -0,0 +1,438 @@
+#define _GNU_SOURCE
+
+#include "modmap.h"
+
+#include "log.h"
+#include "sigsafe.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_MODULES 128
+#define MAX_PHDRS 32
+#define MAX_NOTES 1024
+
+struct snapshot {
+    struct modmap_entry entries[MAX_MODULES];
+    int count;
+    int truncated;
+};
+
+// Last logged map. Paths of entries point to 'logged_paths'.
+static struct snapshot logged;
+static char logged_paths[MAX_MODULES][PATH_MAX];
+static int logged_number;
+static unsigned long long logged_generation;
+static pthread_mutex_t modmap_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+struct scan_arg {
+    struct snapshot *snapshot;
+    char (*paths)[PATH_MAX];
+};
+
+static int read_generation(struct dl_phdr_info *info, size_t size, void *arg);
+static int scan(struct snapshot *snapshot, char (*paths)[PATH_MAX]);
+static int collect(struct dl_phdr_info *info, size_t size, void *arg);
+static int same_map(const struct snapshot *a, const struct snapshot *b);
+static size_t note_build_id(const uint8_t *p, size_t size, uint8_t *build_id);
+static void write_mapping(struct sigsafe_buf *out, char *line);
+static const char *parse_hex(const char *p, uintptr_t *value);
+
+// public
+
+int modmap_log(int log_level, int force) {
+    static struct snapshot current;
+    static char current_paths[MAX_MODULES][PATH_MAX];
+
+    pthread_mutex_lock(&modmap_mtx);
+
+    unsigned long long generation = 0;
+    dl_iterate_phdr(read_generation, &generation);
+
+    // Cheap check first: nothing was loaded or unloaded since last time
+    if (!force && logged_number && generation == logged_generation) {
+        int number = logged_number;
+        pthread_mutex_unlock(&modmap_mtx);
+        return number;
+    }
+
+    if (scan(&current, current_paths)) {
+        pthread_mutex_unlock(&modmap_mtx);
+        return -1;
+    }
+
+    logged_generation = generation;
+    if (!force && logged_number && same_map(&current, &logged)) {
+        int number = logged_number;
+        pthread_mutex_unlock(&modmap_mtx);
+        return number;
+    }
+
+    logged = current;
+    memcpy(logged_paths, current_paths, sizeof(logged_paths));
+    for (int i = 0; i < logged.count; ++i) {
+        logged.entries[i].path = logged_paths[i];
+    }
+    int number = ++logged_number;
+
+    LOG(log_level, "Module map %d: %d modules%s", number, logged.count,
+      logged.truncated ? " (truncated)" : "");
+
+    for (int i = 0; i < logged.count; ++i) {
+        const struct modmap_entry *entry = &logged.entries[i];
+        char id[2 * MODMAP_BUILD_ID_MAX + 1];
+        modmap_format_build_id(entry->build_id, entry->build_id_len, id);
+        LOG(log_level, "\t%#lx-%#lx bias %#lx id %s %s",
+          (unsigned long) entry->start, (unsigned long) entry->end,
+          (unsigned long) entry->bias, id, entry->path);
+    }
+
+    pthread_mutex_unlock(&modmap_mtx);
+
+    return number;
+}
+
+void modmap_write_async(struct sigsafe_buf *out, int number) {
+    sigsafe_puts(out, "Module map ");
+    sigsafe_dec(out, number);
+    sigsafe_puts(out, ": from /proc/self/maps\n");
+
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    char data[PATH_MAX + 128];
+    size_t len = 0;
+    for (;;) {
+        ssize_t n = read(fd, data + len, sizeof(data) - 1 - len);
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+        data[len] = '\0';
+
+        char *line = data;
+        char *eol;
+        while ((eol = strchr(line, '\n'))) {
+            *eol = '\0';
+            write_mapping(out, line);
+            line = eol + 1;
+        }
+
+        len -= line - data;
+        if (len == sizeof(data) - 1) {
+            len = 0;    // line is too long, drop it
+        }
+        memmove(data, line, len);
+    }
+
+    close(fd);
+}
+
+void modmap_format_build_id(const uint8_t *build_id, size_t len, char *buf) {
+    static const char digits[] = "0123456789abcdef";
+
+    if (!len) {
+        strcpy(buf, "-");
+        return;
+    }
+
+    for (size_t i = 0; i < len; ++i) {
+        buf[2 * i] = digits[build_id[i] >> 4];
+        buf[2 * i + 1] = digits[build_id[i] & 0xf];
+    }
+    buf[2 * len] = '\0';
+}
+
+int modmap_file_build_id(const char *path, uint8_t *build_id) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int result = -1;
+    ElfW(Ehdr) ehdr;
+    if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr)
+        || memcmp(ehdr.e_ident, ELFMAG, SELFMAG)
+        || ehdr.e_ident[EI_CLASS] != __ELF_NATIVE_CLASS / 32
+        || ehdr.e_phentsize != sizeof(ElfW(Phdr))) {
+        goto out;
+    }
+
+    result = 0;
+    for (unsigned i = 0; i < ehdr.e_phnum && !result; ++i) {
+        ElfW(Phdr) phdr;
+        if (pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * sizeof(phdr))
+            != sizeof(phdr)) {
+            result = -1;
+            break;
+        }
+
+        if (phdr.p_type != PT_NOTE || phdr.p_filesz > 4096) {
+            continue;
+        }
+
+        uint8_t notes[4096];
+        if (pread(fd, notes, phdr.p_filesz, phdr.p_offset)
+            != (ssize_t) phdr.p_filesz) {
+            continue;
+        }
+
+        result = note_build_id(notes, phdr.p_filesz, build_id);
+    }
+
+out:
+    close(fd);
+
+    return result;
+}
+
+// private
+
+/*
+    dl_iterate_phdr() callback. Sum of counters of loaded and unloaded modules
+    changes whenever set of modules does.
+*/
+static
+int read_generation(struct dl_phdr_info *info, size_t size, void *arg) {
+    (void) size;
+    *(unsigned long long *) arg = info->dlpi_adds + info->dlpi_subs;
+    return 1;
+}
+
+/*
+    Collect loaded modules.
+*/
+static
+int scan(struct snapshot *snapshot, char (*paths)[PATH_MAX]) {
+    snapshot->count = 0;
+    snapshot->truncated = 0;
+
+    struct scan_arg arg = {snapshot, paths};
+    dl_iterate_phdr(collect, &arg);
+
+    if (!snapshot->count) {
+        LOGE("%s(): no modules found", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    dl_iterate_phdr() callback of scan(). Main executable has empty name in
+    link map, its path is taken from /proc/self/exe.
+*/
+static
+int collect(struct dl_phdr_info *info, size_t size, void *arg) {
+    (void) size;
+    struct snapshot *snapshot = ((struct scan_arg *) arg)->snapshot;
+    char (*paths)[PATH_MAX] = ((struct scan_arg *) arg)->paths;
+
+    if (snapshot->count == MAX_MODULES) {
+        snapshot->truncated = 1;
+        return 1;
+    }
+
+    struct modmap_entry *entry = &snapshot->entries[snapshot->count];
+    entry->start = UINTPTR_MAX;
+    entry->end = 0;
+    entry->bias = info->dlpi_addr;
+    entry->build_id_len = 0;
+
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type == PT_LOAD) {
+            uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+            if (start < entry->start) {
+                entry->start = start;
+            }
+            if (start + phdr->p_memsz > entry->end) {
+                entry->end = start + phdr->p_memsz;
+            }
+        } else if (phdr->p_type == PT_NOTE && !entry->build_id_len) {
+            entry->build_id_len = note_build_id(
+              (const uint8_t *) (info->dlpi_addr + phdr->p_vaddr),
+              phdr->p_memsz, entry->build_id);
+        }
+    }
+
+    if (entry->start >= entry->end) {
+        return 0;
+    }
+
+    char *path = paths[snapshot->count];
+    path[0] = '\0';
+    if (info->dlpi_name && info->dlpi_name[0]) {
+        strncat(path, info->dlpi_name, PATH_MAX - 1);
+    } else if (!snapshot->count) {
+        ssize_t len = readlink("/proc/self/exe", path, PATH_MAX - 1);
+        path[len > 0 ? len : 0] = '\0';
+    }
+
+    // Names without a slash are not files (e.g. "linux-vdso.so.1")
+    if (!strchr(path, '/')) {
+        path[0] = '\0';
+    }
+
+    entry->path = path;
+    ++snapshot->count;
+
+    return 0;
+}
+
+static
+int same_map(const struct snapshot *a, const struct snapshot *b) {
+    if (a->count != b->count) {
+        return 0;
+    }
+
+    for (int i = 0; i < a->count; ++i) {
+        const struct modmap_entry *x = &a->entries[i];
+        const struct modmap_entry *y = &b->entries[i];
+        if (x->start != y->start || x->end != y->end || x->bias != y->bias
+            || strcmp(x->path, y->path)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+    Find NT_GNU_BUILD_ID in 'size' bytes of notes at 'p'.
+
+    Returns length of build-id or 0 if there is none.
+*/
+static
+size_t note_build_id(const uint8_t *p, size_t size, uint8_t *build_id) {
+    const uint8_t *end = p + size;
+
+    while ((size_t) (end - p) >= sizeof(ElfW(Nhdr))) {
+        const ElfW(Nhdr) *note = (const ElfW(Nhdr) *) p;
+        const uint8_t *name = p + sizeof(*note);
+        const uint8_t *desc = name + ((note->n_namesz + 3) & ~3u);
+        const uint8_t *next = desc + ((note->n_descsz + 3) & ~3u);
+        if (next > end || next < desc) {
+            break;
+        }
+
+        if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4
+            && !memcmp(name, "GNU", 4) && note->n_descsz
+            && note->n_descsz <= MODMAP_BUILD_ID_MAX) {
+            memcpy(build_id, desc, note->n_descsz);
+            return note->n_descsz;
+        }
+
+        p = next;
+    }
+
+    return 0;
+}
+
+/*
+    Write module entry for a line of /proc/self/maps, if it is the first
+    mapping of an ELF file:
+    "7f2c1e200000-7f2c1e228000 r--p 00000000 08:01 1234 /lib/libc.so.6"
+*/
+static
+void write_mapping(struct sigsafe_buf *out, char *line) {
+    uintptr_t start, end, offset;
+    const char *p = parse_hex(line, &start);
+    if (*p++ != '-') {
+        return;
+    }
+    p = parse_hex(p, &end);
+    p = strchr(p, ' ');
+    if (!p || !(p = strchr(p + 1, ' '))) {
+        return;
+    }
+    p = parse_hex(p + 1, &offset);
+
+    const char *path = strchr(p, '/');
+    if (offset || !path) {
+        return;
+    }
+
+    ElfW(Ehdr) ehdr;
+    if (sigsafe_read(start, &ehdr, sizeof(ehdr))
+        || memcmp(ehdr.e_ident, ELFMAG, SELFMAG)
+        || ehdr.e_phentsize != sizeof(ElfW(Phdr))) {
+        return;
+    }
+
+    ElfW(Phdr) phdrs[MAX_PHDRS];
+    int phnum = ehdr.e_phnum < MAX_PHDRS ? ehdr.e_phnum : MAX_PHDRS;
+    if (sigsafe_read(start + ehdr.e_phoff, phdrs, phnum * sizeof(phdrs[0]))) {
+        return;
+    }
+
+    // First PT_LOAD is the one mapped at offset 0
+    uintptr_t bias = 0;
+    int have_load = 0;
+    end = 0;
+    for (int i = 0; i < phnum; ++i) {
+        if (phdrs[i].p_type != PT_LOAD) {
+            continue;
+        }
+        if (!have_load) {
+            bias = start - (phdrs[i].p_vaddr & ~(uintptr_t) (phdrs[i].p_align
+              ? phdrs[i].p_align - 1 : 0));
+            have_load = 1;
+        }
+        if (bias + phdrs[i].p_vaddr + phdrs[i].p_memsz > end) {
+            end = bias + phdrs[i].p_vaddr + phdrs[i].p_memsz;
+        }
+    }
+
+    if (!have_load) {
+        return;
+    }
+
+    uint8_t build_id[MODMAP_BUILD_ID_MAX];
+    size_t build_id_len = 0;
+    for (int i = 0; i < phnum && !build_id_len; ++i) {
+        uint8_t notes[MAX_NOTES];
+        size_t size = phdrs[i].p_memsz < MAX_NOTES ? phdrs[i].p_memsz
+                                                   : MAX_NOTES;
+        if (phdrs[i].p_type == PT_NOTE
+            && !sigsafe_read(bias + phdrs[i].p_vaddr, notes, size)) {
+            build_id_len = note_build_id(notes, size, build_id);
+        }
+    }
+
+    char id[2 * MODMAP_BUILD_ID_MAX + 1];
+    modmap_format_build_id(build_id, build_id_len, id);
+
+    sigsafe_putc(out, '\t');
+    sigsafe_hex(out, start, 0);
+    sigsafe_putc(out, '-');
+    sigsafe_hex(out, end, 0);
+    sigsafe_puts(out, " bias ");
+    sigsafe_hex(out, bias, 0);
+    sigsafe_puts(out, " id ");
+    sigsafe_puts(out, id);
+    sigsafe_putc(out, ' ');
+    sigsafe_puts(out, path);
+    sigsafe_putc(out, '\n');
+}
+
+static
+const char *parse_hex(const char *p, uintptr_t *value) {
+    *value = 0;
+    for (;; ++p) {
+        if (*p >= '0' && *p <= '9') {
+            *value = *value << 4 | (*p - '0');
+        } else if (*p >= 'a' && *p <= 'f') {
+            *value = *value << 4 | (*p - 'a' + 10);
+        } else {
+            return p;
+        }
+    }
+}
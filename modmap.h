@@ -0,0 +1,73 @@
+#ifndef MODMAP_H_INCLUDED
+#define MODMAP_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Map of loaded modules, for deferred (offline) symbolization. Instead of
+    resolving every address on the host where it was captured, which costs
+    CPU and needs symbols there, a stack trace is logged as raw addresses
+    (see print_stack_trace_raw() in backtrace.h), and the module map is logged
+    once per process and again whenever a library is loaded or unloaded. The
+    'symbolize' tool (tools/symbolize.c) reads such a log and resolves the
+    addresses against unstripped binaries with matching build-ids, so deployed
+    binaries may be fully stripped.
+
+    Module map is logged like this:
+
+    Module map 1: 5 modules
+        0x55c0b4a00000-0x55c0b4a05018 bias 0x55c0b4a00000 id 3fd2...a1 /usr/bin/driver_manager
+        0x7f2c1e200000-0x7f2c1e3f2e50 bias 0x7f2c1e200000 id 1b9e...07 /lib/libc.so.6
+        ...
+
+    Addresses are the range covered by module's PT_LOAD segments, 'bias' is
+    what has to be subtracted from an address to get link-time address in the
+    file. 'id' is GNU build-id or '-' if module has none.
+*/
+
+#define MODMAP_BUILD_ID_MAX 20
+
+struct modmap_entry {
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t bias;
+    uint8_t build_id[MODMAP_BUILD_ID_MAX];
+    size_t build_id_len;
+    const char *path;       // "" if module has no file (e.g. vDSO)
+};
+
+/*
+    Log module map with 'log_level', unless exactly the same map was already
+    logged. Pass non-zero 'force' to log it anyway.
+
+    Returns sequential number of the map that is current now (the one which
+    raw addresses logged afterwards refer to), or -1 on error.
+*/
+int modmap_log(int log_level, int force);
+
+struct sigsafe_buf;
+
+/*
+    Async-signal-safe variant of modmap_log() for crash handlers: modules are
+    found in /proc/self/maps and their ELF headers are read from memory, as
+    dl_iterate_phdr() takes a lock. Map is written to 'out' without log
+    prefixes, as "Module map <number>: ...", followed by entries.
+*/
+void modmap_write_async(struct sigsafe_buf *out, int number);
+
+/*
+    Format 'len' bytes of build-id as hex to 'buf' of at least 2 * len + 1
+    bytes. Formats "-" if 'len' is 0.
+*/
+void modmap_format_build_id(const uint8_t *build_id, size_t len, char *buf);
+
+/*
+    Read GNU build-id of ELF file at 'path' to 'build_id' of at least
+    MODMAP_BUILD_ID_MAX bytes.
+
+    Returns length of build-id, 0 if file has none, or -1 if file can't be read.
+*/
+int modmap_file_build_id(const char *path, uint8_t *build_id);
+
+#endif // MODMAP_H_INCLUDED
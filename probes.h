@@ -0,0 +1,113 @@
+#ifndef PROBES_H_INCLUDED
+#define PROBES_H_INCLUDED
+
+/*
+    Static tracepoints in SystemTap SDT (USDT) format, which perf, bpftrace,
+    bcc and SystemTap can attach to:
+
+    bpftrace -e 'usdt:./server:dm:log_drop { @[str(arg1), arg2] = count(); }'
+
+    A probe is a single nop, plus an ELF note (.note.stapsdt) that tells
+    tracers where the nop is and where its arguments live at that point
+    (registers, stack slots or constants). Tracers replace the nop with a
+    breakpoint when they attach, so probes cost nothing but the nop while no
+    one is attached. Arguments are not computed for probes, they are values
+    the code has at hand anyway. There is no semaphore, since no probe needs
+    expensive arguments.
+
+    Probes of provider "dm" (tracers list them with e.g. 'perf list sdt' or
+    'bpftrace -l usdt:binary'):
+
+    log_entry(level, file, line)          log_log() is called
+    log_emit(level, file, line, fmt)      message passes the filter
+    log_drop(level, file, line, fmt)      message is filtered out
+    measure_start(depth)                  measure_start() pushed a start time
+    measure_get(depth, sec, nsec)         measure_get() popped it, 'sec' and
+                                          'nsec' are the measured time
+    timer_expired(timer, sec, nsec)       timer_expired() found timer
+                                          expired, once per deadline; 'sec'
+                                          and 'nsec' are its CLOCK_MONOTONIC
+                                          deadline, so lateness is current
+                                          time minus it
+    backtrace_capture(buffer, frames)     backtrace_capture() captured a trace
+
+    Arguments are integers and pointers only. Define NO_PROBES to build
+    without probes.
+*/
+
+#if !defined(NO_PROBES) && defined(__GNUC__) && defined(__ELF__)
+
+#if __SIZEOF_POINTER__ == 8
+# define PROBE_ADDR ".8byte"
+#else
+# define PROBE_ADDR ".4byte"
+#endif
+
+// Argument is described as "size@location", with size negative for signed
+// types
+#define PROBE_VALUE(x) ((x) + 0)
+#define PROBE_SIZE(x) \
+    ((__typeof__(PROBE_VALUE(x))) -1 < (__typeof__(PROBE_VALUE(x))) 1 \
+     ? -(int) sizeof(PROBE_VALUE(x)) : (int) sizeof(PROBE_VALUE(x)))
+
+#define PROBE_OPERAND(n, x) \
+    [probe_s##n] "n" (PROBE_SIZE(x)), [probe_a##n] "nor" (PROBE_VALUE(x))
+
+#define PROBE_SPEC(n) "%c[probe_s" #n "]@%[probe_a" #n "]"
+
+// Note names probe's nop, link-time address of .stapsdt.base (tracers use it
+// to find load bias of the note) and the semaphore, which is none.
+#define PROBE_ASM(provider, name, args, ...) \
+    __asm__ __volatile__ ( \
+        "990: nop\n" \
+        ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+        ".balign 4\n" \
+        ".4byte 992f-991f, 994f-993f, 3\n" \
+        "991: .asciz \"stapsdt\"\n" \
+        "992: .balign 4\n" \
+        "993: " PROBE_ADDR " 990b\n" \
+        PROBE_ADDR " _.stapsdt.base\n" \
+        PROBE_ADDR " 0\n" \
+        ".asciz \"" #provider "\"\n" \
+        ".asciz \"" #name "\"\n" \
+        ".asciz \"" args "\"\n" \
+        "994: .balign 4\n" \
+        ".popsection\n" \
+        ".ifndef _.stapsdt.base\n" \
+        ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+        ".weak _.stapsdt.base\n" \
+        ".hidden _.stapsdt.base\n" \
+        "_.stapsdt.base: .space 1\n" \
+        ".size _.stapsdt.base, 1\n" \
+        ".popsection\n" \
+        ".endif\n" \
+        : : __VA_ARGS__)
+
+#define PROBE1(provider, name, a1) \
+    PROBE_ASM(provider, name, PROBE_SPEC(1), PROBE_OPERAND(1, a1))
+
+#define PROBE2(provider, name, a1, a2) \
+    PROBE_ASM(provider, name, PROBE_SPEC(1) " " PROBE_SPEC(2), \
+      PROBE_OPERAND(1, a1), PROBE_OPERAND(2, a2))
+
+#define PROBE3(provider, name, a1, a2, a3) \
+    PROBE_ASM(provider, name, \
+      PROBE_SPEC(1) " " PROBE_SPEC(2) " " PROBE_SPEC(3), \
+      PROBE_OPERAND(1, a1), PROBE_OPERAND(2, a2), PROBE_OPERAND(3, a3))
+
+#define PROBE4(provider, name, a1, a2, a3, a4) \
+    PROBE_ASM(provider, name, \
+      PROBE_SPEC(1) " " PROBE_SPEC(2) " " PROBE_SPEC(3) " " PROBE_SPEC(4), \
+      PROBE_OPERAND(1, a1), PROBE_OPERAND(2, a2), PROBE_OPERAND(3, a3), \
+      PROBE_OPERAND(4, a4))
+
+#else
+
+#define PROBE1(provider, name, a1) ((void) 0)
+#define PROBE2(provider, name, a1, a2) ((void) 0)
+#define PROBE3(provider, name, a1, a2, a3) ((void) 0)
+#define PROBE4(provider, name, a1, a2, a3, a4) ((void) 0)
+
+#endif
+
+#endif // PROBES_H_INCLUDED
@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+
+#include "sigsafe.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// public
+
+void sigsafe_init(struct sigsafe_buf *buf, int fd, char *data, size_t size) {
+    buf->fd = fd;
+    buf->data = data;
+    buf->size = size;
+    buf->len = 0;
+}
+
+void sigsafe_flush(struct sigsafe_buf *buf) {
+    // write() may change errno, which interrupted code may be about to read
+    int saved_errno = errno;
+
+    size_t done = 0;
+    while (done < buf->len) {
+        ssize_t n = write(buf->fd, buf->data + done, buf->len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+
+    buf->len = 0;
+    errno = saved_errno;
+}
+
+void sigsafe_putc(struct sigsafe_buf *buf, char c) {
+    if (buf->len == buf->size) {
+        sigsafe_flush(buf);
+    }
+    buf->data[buf->len++] = c;
+}
+
+void sigsafe_write(struct sigsafe_buf *buf, const void *data, size_t len) {
+    const char *p = data;
+    while (len) {
+        if (buf->len == buf->size) {
+            sigsafe_flush(buf);
+        }
+
+        size_t n = buf->size - buf->len < len ? buf->size - buf->len : len;
+        memcpy(buf->data + buf->len, p, n);
+        buf->len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+void sigsafe_puts(struct sigsafe_buf *buf, const char *s) {
+    while (*s) {
+        sigsafe_putc(buf, *s++);
+    }
+}
+
+void sigsafe_dec(struct sigsafe_buf *buf, long value) {
+    char digits[24];
+    int n = 0;
+    unsigned long u = value < 0 ? -(unsigned long) value : (unsigned long) value;
+
+    do {
+        digits[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+
+    if (value < 0) {
+        sigsafe_putc(buf, '-');
+    }
+    while (n) {
+        sigsafe_putc(buf, digits[--n]);
+    }
+}
+
+void sigsafe_hex(struct sigsafe_buf *buf, uintptr_t value, int width) {
+    char digits[2 * sizeof(uintptr_t)];
+    int n = 0;
+
+    do {
+        digits[n++] = "0123456789abcdef"[value & 0xf];
+        value >>= 4;
+    } while (value);
+
+    sigsafe_puts(buf, "0x");
+    for (int i = n; i < width; ++i) {
+        sigsafe_putc(buf, '0');
+    }
+    while (n) {
+        sigsafe_putc(buf, digits[--n]);
+    }
+}
+
+int sigsafe_read(uintptr_t addr, void *dst, size_t len) {
+    int saved_errno = errno;
+
+    struct iovec local = {dst, len};
+    struct iovec remote = {(void *) addr, len};
+    ssize_t n = process_vm_readv(getpid(), &local, 1, &remote, 1, 0);
+
+    errno = saved_errno;
+
+    return n == (ssize_t) len ? 0 : -1;
+}
+
+int sigsafe_read_word(void *arg, uintptr_t addr, uintptr_t *value) {
+    (void) arg;
+    return sigsafe_read(addr, value, sizeof(*value));
+}
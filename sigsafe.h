@@ -0,0 +1,68 @@
+#ifndef SIGSAFE_H_INCLUDED
+#define SIGSAFE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Async-signal-safe primitives for code that runs in signal handlers, where
+    neither stdio nor malloc() nor any lock may be used: formatting to a
+    caller-provided buffer that is flushed with raw write(), and reading of
+    memory that may be unmapped.
+*/
+
+/*
+    Output buffer. Text is accumulated in 'data' and written to 'fd' when
+    buffer fills up or on sigsafe_flush().
+*/
+struct sigsafe_buf {
+    int fd;
+    char *data;
+    size_t size;
+    size_t len;
+};
+
+/*
+    Start output to 'fd' through 'size' bytes of 'data'.
+*/
+void sigsafe_init(struct sigsafe_buf *buf, int fd, char *data, size_t size);
+
+/*
+    Write out buffered text. Interrupted and partial writes are retried,
+    other errors are ignored: there is nothing to report them to.
+*/
+void sigsafe_flush(struct sigsafe_buf *buf);
+
+/*
+    Append 'len' bytes of binary 'data'.
+*/
+void sigsafe_write(struct sigsafe_buf *buf, const void *data, size_t len);
+
+void sigsafe_puts(struct sigsafe_buf *buf, const char *s);
+void sigsafe_putc(struct sigsafe_buf *buf, char c);
+
+/*
+    Print 'value' in decimal.
+*/
+void sigsafe_dec(struct sigsafe_buf *buf, long value);
+
+/*
+    Print 'value' in hex with "0x" prefix, padded with zeros to at least
+    'width' digits.
+*/
+void sigsafe_hex(struct sigsafe_buf *buf, uintptr_t value, int width);
+
+/*
+    Copy 'len' bytes at 'addr' of own address space to 'dst' without risking
+    a fault, using process_vm_readv().
+
+    Returns 0 on success and -1 if memory is not readable.
+*/
+int sigsafe_read(uintptr_t addr, void *dst, size_t len);
+
+/*
+    sigsafe_read() of a word, to be used as cfi_read_t. 'arg' is not used.
+*/
+int sigsafe_read_word(void *arg, uintptr_t addr, uintptr_t *value);
+
+#endif // SIGSAFE_H_INCLUDED
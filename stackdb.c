@@ -0,0 +1,320 @@
+#include "stackdb.h"
+
+#include "backtrace.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Frames of backtrace_capture() buffer that stackdb_capture() may skip
+#define MAX_SKIP 8
+
+struct entry {
+    uint64_t hash;
+    uint32_t offset;        // of frames in arena
+    uint32_t depth;
+    uint64_t hits;
+    uint64_t weight;
+};
+
+// A stack is published by storing its id to a slot, until then the entry is
+// private to the thread that allocated it. Id 0 marks empty slot.
+struct stackdb {
+    uint32_t *slots;
+    size_t slots_mask;
+    struct entry *entries;
+    uint32_t max_entries;
+    uint32_t entries_used;
+    void **arena;
+    size_t arena_size;
+    size_t arena_used;
+    uint64_t dropped;
+};
+
+struct ranked {
+    uint32_t id;
+    uint64_t key;
+};
+
+static uint64_t hash_frames(void *const *frames, int depth);
+static uint32_t allocate(struct stackdb *db, void *const *frames, int depth,
+  uint64_t hash);
+static int matches(const struct stackdb *db, uint32_t id, uint64_t hash,
+  void *const *frames, int depth);
+static int ranked_cmp(const void *a, const void *b);
+
+// public
+
+struct stackdb *stackdb_create(size_t max_stacks, size_t avg_depth) {
+    if (!max_stacks || max_stacks >= UINT32_MAX / 2 || !avg_depth
+        || max_stacks * avg_depth >= UINT32_MAX) {
+        LOGE("%s(): invalid size", __func__);
+        return NULL;
+    }
+
+    // Load factor of at most 0.5 keeps probe sequences short
+    size_t slots = 1;
+    while (slots < 2 * max_stacks) {
+        slots <<= 1;
+    }
+
+    struct stackdb *db = calloc(1, sizeof(*db));
+    if (!db) {
+        LOGE("%s(): out of memory", __func__);
+        return NULL;
+    }
+
+    db->slots_mask = slots - 1;
+    db->max_entries = max_stacks + 1;
+    db->entries_used = 1;
+    db->arena_size = max_stacks * avg_depth;
+
+    db->slots = calloc(slots, sizeof(*db->slots));
+    db->entries = calloc(db->max_entries, sizeof(*db->entries));
+    db->arena = calloc(db->arena_size, sizeof(*db->arena));
+    if (!db->slots || !db->entries || !db->arena) {
+        LOGE("%s(): out of memory", __func__);
+        stackdb_destroy(db);
+        return NULL;
+    }
+
+    return db;
+}
+
+void stackdb_destroy(struct stackdb *db) {
+    if (!db) {
+        return;
+    }
+
+    free(db->slots);
+    free(db->entries);
+    free(db->arena);
+    free(db);
+}
+
+uint32_t stackdb_intern(struct stackdb *db, void *const *frames, int depth,
+  uint64_t weight) {
+    if (depth <= 0) {
+        return 0;
+    }
+    if (depth > STACKDB_MAX_DEPTH) {
+        depth = STACKDB_MAX_DEPTH;
+    }
+
+    uint64_t hash = hash_frames(frames, depth);
+    uint32_t allocated = 0;
+
+    for (size_t probe = 0; probe <= db->slots_mask; ++probe) {
+        uint32_t *slot = &db->slots[(hash + probe) & db->slots_mask];
+        uint32_t id = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+        if (!id) {
+            if (!allocated && !(allocated = allocate(db, frames, depth, hash))) {
+                break;
+            }
+
+            if (__atomic_compare_exchange_n(slot, &id, allocated, 0,
+                  __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+                id = allocated;
+            }
+            // otherwise another thread took the slot, 'id' is its stack
+        }
+
+        // If another thread published the same stack first, entry allocated
+        // here is wasted. That's rare enough to not bother.
+        if (id == allocated || matches(db, id, hash, frames, depth)) {
+            struct entry *entry = &db->entries[id];
+            __atomic_add_fetch(&entry->hits, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&entry->weight, weight, __ATOMIC_RELAXED);
+            return id;
+        }
+    }
+
+    __atomic_add_fetch(&db->dropped, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+__attribute__((noinline))
+uint32_t stackdb_capture(struct stackdb *db, int skip, uint64_t weight) {
+    void *buffer[1 + MAX_SKIP + STACKDB_MAX_DEPTH];
+
+    if (skip < 0) {
+        skip = 0;
+    } else if (skip > MAX_SKIP) {
+        skip = MAX_SKIP;
+    }
+
+    // buffer[0] is in stackdb_capture() itself
+    int depth = backtrace_capture(buffer, sizeof(buffer) / sizeof(buffer[0]));
+    skip += 1;
+    if (depth <= skip) {
+        return 0;
+    }
+
+    return stackdb_intern(db, buffer + skip, depth - skip, weight);
+}
+
+int stackdb_get(const struct stackdb *db, uint32_t id, void *const **frames,
+  int *depth, uint64_t *hits, uint64_t *weight) {
+    if (!id || id >= db->max_entries
+        || id >= __atomic_load_n(&db->entries_used, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    const struct entry *entry = &db->entries[id];
+    if (!entry->depth) {
+        return -1;
+    }
+
+    if (frames) {
+        *frames = db->arena + entry->offset;
+    }
+    if (depth) {
+        *depth = entry->depth;
+    }
+    if (hits) {
+        *hits = __atomic_load_n(&entry->hits, __ATOMIC_RELAXED);
+    }
+    if (weight) {
+        *weight = __atomic_load_n(&entry->weight, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+uint32_t stackdb_id_limit(const struct stackdb *db) {
+    return db->max_entries;
+}
+
+void stackdb_report(const struct stackdb *db, int log_level, int top_n,
+  stackdb_order_t order) {
+    struct ranked *ranked = malloc((db->slots_mask + 1) * sizeof(*ranked));
+    if (!ranked) {
+        LOGE("%s(): out of memory", __func__);
+        return;
+    }
+
+    size_t count = 0;
+    uint64_t total_hits = 0, total_weight = 0;
+    for (size_t i = 0; i <= db->slots_mask; ++i) {
+        uint32_t id = __atomic_load_n(&db->slots[i], __ATOMIC_ACQUIRE);
+        if (!id) {
+            continue;
+        }
+
+        const struct entry *entry = &db->entries[id];
+        uint64_t hits = __atomic_load_n(&entry->hits, __ATOMIC_RELAXED);
+        uint64_t weight = __atomic_load_n(&entry->weight, __ATOMIC_RELAXED);
+        total_hits += hits;
+        total_weight += weight;
+
+        ranked[count].id = id;
+        ranked[count].key = order == STACKDB_BY_WEIGHT ? weight : hits;
+        ++count;
+    }
+
+    qsort(ranked, count, sizeof(*ranked), ranked_cmp);
+
+    LOG(log_level, "Stacks: %zu unique, %llu hits, %llu weight, %llu dropped; "
+      "top %d by %s", count, (unsigned long long) total_hits,
+      (unsigned long long) total_weight,
+      (unsigned long long) __atomic_load_n(&db->dropped, __ATOMIC_RELAXED),
+      top_n, order == STACKDB_BY_WEIGHT ? "weight" : "hits");
+
+    for (size_t i = 0; i < count && (int) i < top_n; ++i) {
+        void *const *frames;
+        int depth;
+        uint64_t hits, weight;
+        stackdb_get(db, ranked[i].id, &frames, &depth, &hits, &weight);
+
+        LOG(log_level, "Stack %u: %llu hits, %llu weight", ranked[i].id,
+          (unsigned long long) hits, (unsigned long long) weight);
+        print_stack_frames(log_level, frames, depth);
+    }
+
+    free(ranked);
+}
+
+void stackdb_reset(struct stackdb *db) {
+    uint32_t used = __atomic_load_n(&db->entries_used, __ATOMIC_ACQUIRE);
+    if (used > db->max_entries) {
+        used = db->max_entries;
+    }
+
+    for (uint32_t id = 1; id < used; ++id) {
+        __atomic_store_n(&db->entries[id].hits, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&db->entries[id].weight, 0, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&db->dropped, 0, __ATOMIC_RELAXED);
+}
+
+// private
+
+static
+uint64_t hash_frames(void *const *frames, int depth) {
+    uint64_t hash = depth;
+    for (int i = 0; i < depth; ++i) {
+        hash = (hash ^ (uintptr_t) frames[i]) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 29;
+    }
+
+    return hash;
+}
+
+/*
+    Allocate an entry and copy the stack to arena.
+
+    Returns id of the entry or 0 if table or arena is full.
+*/
+static
+uint32_t allocate(struct stackdb *db, void *const *frames, int depth,
+  uint64_t hash) {
+    // Counters stop at their limits, so that misses of a full table can't
+    // wrap them around
+    uint32_t id = __atomic_load_n(&db->entries_used, __ATOMIC_RELAXED);
+    do {
+        if (id >= db->max_entries) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&db->entries_used, &id, id + 1, 1,
+               __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    size_t offset = __atomic_load_n(&db->arena_used, __ATOMIC_RELAXED);
+    do {
+        if (offset + depth > db->arena_size) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&db->arena_used, &offset,
+               offset + depth, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    struct entry *entry = &db->entries[id];
+    entry->hash = hash;
+    entry->offset = offset;
+    entry->depth = depth;
+    memcpy(db->arena + offset, frames, depth * sizeof(*frames));
+
+    return id;
+}
+
+static
+int matches(const struct stackdb *db, uint32_t id, uint64_t hash,
+  void *const *frames, int depth) {
+    const struct entry *entry = &db->entries[id];
+
+    return entry->hash == hash && entry->depth == (uint32_t) depth
+           && !memcmp(db->arena + entry->offset, frames,
+                 depth * sizeof(*frames));
+}
+
+static
+int ranked_cmp(const void *a, const void *b) {
+    const struct ranked *x = a;
+    const struct ranked *y = b;
+
+    if (x->key != y->key) {
+        return x->key > y->key ? -1 : 1;
+    }
+
+    return x->id < y->id ? -1 : x->id > y->id;
+}
@@ -0,0 +1,88 @@
+#ifndef STACKDB_H_INCLUDED
+#define STACKDB_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Interning table of stack traces, for counting unique stacks cheaply, e.g.
+    of error paths, allocations or lock waits. A stack is an array of return
+    addresses as backtrace_capture() stores them.
+
+    Every unique stack is stored once in a preallocated arena and gets a
+    32-bit id. Each stack keeps a counter of hits and a sum of 'weight' (bytes
+    allocated, nanoseconds waited...) that callers attribute to it.
+
+    The table is lock-free: interning a known stack costs hashing, one probe
+    and two atomic additions, interning a new one a few more atomics. Memory
+    is allocated only by stackdb_create(), so interning never allocates and
+    may be done e.g. from within malloc() hooks. When table or arena is full,
+    new stacks are dropped (and counted), known ones are still counted.
+*/
+
+#define STACKDB_MAX_DEPTH 64
+
+typedef enum {
+    STACKDB_BY_HITS,
+    STACKDB_BY_WEIGHT,
+} stackdb_order_t;
+
+struct stackdb;
+
+/*
+    Create a table for at most 'max_stacks' unique stacks of 'avg_depth'
+    frames on average.
+
+    Returns NULL on error.
+*/
+struct stackdb *stackdb_create(size_t max_stacks, size_t avg_depth);
+
+/*
+    Free a table. No one may use it anymore. 'db' may be NULL.
+*/
+void stackdb_destroy(struct stackdb *db);
+
+/*
+    Count a hit of stack 'frames' of 'depth' frames with 'weight'.
+
+    Returns id of the stack, or 0 if it's new and the table is full.
+*/
+uint32_t stackdb_intern(struct stackdb *db, void *const *frames, int depth,
+  uint64_t weight);
+
+/*
+    Capture stack trace of the calling thread (see backtrace_capture()),
+    drop 'skip' innermost frames and intern it.
+
+    Returns id of the stack or 0.
+*/
+uint32_t stackdb_capture(struct stackdb *db, int skip, uint64_t weight);
+
+/*
+    Get frames and counters of stack 'id'. Any of out parameters may be NULL.
+    Frames stay valid until stackdb_destroy().
+
+    Returns 0 on success and -1 if there is no such stack.
+*/
+int stackdb_get(const struct stackdb *db, uint32_t id, void *const **frames,
+  int *depth, uint64_t *hits, uint64_t *weight);
+
+/*
+    Ids of all stacks are below this value, so it may be used to size arrays
+    of per-stack data kept outside the table.
+*/
+uint32_t stackdb_id_limit(const struct stackdb *db);
+
+/*
+    Log 'top_n' stacks with most hits or weight, symbolized.
+*/
+void stackdb_report(const struct stackdb *db, int log_level, int top_n,
+  stackdb_order_t order);
+
+/*
+    Zero counters of all stacks. Stacks themselves are kept, so ids stay
+    valid. Hits counted concurrently may be lost.
+*/
+void stackdb_reset(struct stackdb *db);
+
+#endif // STACKDB_H_INCLUDED
@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+
+#include "stackusage.h"
+
+#include "backtrace.h"
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 4096
+
+#define PATTERN ((uintptr_t) 0xfeedfacefeedfaceull)
+
+// Left unpainted below the current frame: red zone of the painting function
+// and whatever it calls
+#define MARGIN 1024
+
+// Minimal growth of depth that stackusage_check() logs
+#define RECORD_STEP 64
+
+struct thread {
+    pid_t tid;              // 0 if the slot is free
+    pthread_t handle;
+    uintptr_t lo;           // bottom of the stack
+    uintptr_t hi;           // top of the stack
+    uintptr_t painted;      // lowest painted address
+    uintptr_t mark;         // lowest address found used
+    uintptr_t reported;     // 'mark' when it was logged last time
+};
+
+struct monitor {
+    unsigned interval_ms;
+    int log_level;
+};
+
+// Slot of a thread is released by its key destructor, which runs before the
+// stack is freed. Scans hold the mutex, so they never read freed stacks.
+static struct thread threads[MAX_THREADS];
+static pthread_mutex_t threads_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static int key_error;
+
+static int trace_level;
+
+static __thread uintptr_t check_hi;
+static __thread size_t check_record;
+
+static void create_key();
+static void unregister(void *arg);
+static int stack_bounds(uintptr_t *lo, uintptr_t *hi);
+static void paint(uintptr_t lo, uintptr_t hi);
+static void scan(struct thread *thread);
+static void log_thread(int log_level, const char *prefix,
+  const struct thread *thread);
+static void *monitor_thread(void *arg);
+
+// public
+
+int stackusage_register(size_t max_depth) {
+    pthread_once(&key_once, create_key);
+    if (key_error) {
+        LOGE("%s(): pthread_key_create() failed: %s", __func__,
+          strerror(key_error));
+        return -1;
+    }
+
+    uintptr_t lo, hi;
+    if (stack_bounds(&lo, &hi)) {
+        LOGE("%s(): can't get stack bounds", __func__);
+        return -1;
+    }
+
+    uintptr_t top = ((uintptr_t) __builtin_frame_address(0) - MARGIN)
+                    & ~(uintptr_t) (sizeof(uintptr_t) - 1);
+    uintptr_t bottom = lo;
+    if (max_depth && top - lo > max_depth) {
+        bottom = (top - max_depth) & ~(uintptr_t) (sizeof(uintptr_t) - 1);
+    }
+
+    // Painting needs no lock: a new thread isn't scanned before its slot is
+    // filled, and a scan racing with re-painting only finds a mark that is
+    // reset below anyway. A thread registering again keeps its slot.
+    paint(bottom, top);
+
+    pthread_mutex_lock(&threads_mtx);
+
+    struct thread *thread = pthread_getspecific(thread_key);
+    for (int i = 0; !thread && i < MAX_THREADS; ++i) {
+        if (!threads[i].tid) {
+            thread = &threads[i];
+        }
+    }
+
+    if (!thread) {
+        pthread_mutex_unlock(&threads_mtx);
+        LOGE("%s(): too many threads", __func__);
+        return -1;
+    }
+
+    thread->tid = syscall(SYS_gettid);
+    thread->handle = pthread_self();
+    thread->lo = lo;
+    thread->hi = hi;
+    thread->painted = bottom;
+    thread->mark = top;
+    thread->reported = hi;
+
+    pthread_mutex_unlock(&threads_mtx);
+
+    pthread_setspecific(thread_key, thread);
+    return 0;
+}
+
+void stackusage_report(int log_level) {
+    pthread_mutex_lock(&threads_mtx);
+
+    int count = 0;
+    for (int i = 0; i < MAX_THREADS; ++i) {
+        count += threads[i].tid != 0;
+    }
+
+    LOG(log_level, "Stack usage: %d threads", count);
+    for (int i = 0; i < MAX_THREADS; ++i) {
+        if (threads[i].tid) {
+            scan(&threads[i]);
+            log_thread(log_level, "\t", &threads[i]);
+            threads[i].reported = threads[i].mark;
+        }
+    }
+
+    pthread_mutex_unlock(&threads_mtx);
+}
+
+int stackusage_monitor(unsigned interval_ms, int log_level) {
+    static struct monitor monitor;
+    monitor.interval_ms = interval_ms;
+    monitor.log_level = log_level;
+
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, monitor_thread, &monitor);
+    if (err) {
+        LOGE("%s(): pthread_create() failed: %s", __func__, strerror(err));
+        return -1;
+    }
+    pthread_detach(thread);
+
+    return 0;
+}
+
+void stackusage_set_trace_level(int log_level) {
+    __atomic_store_n(&trace_level, log_level, __ATOMIC_RELAXED);
+}
+
+__attribute__((noinline))
+void stackusage_check() {
+    uintptr_t sp = (uintptr_t) __builtin_frame_address(0);
+
+    if (__builtin_expect(!check_hi, 0)) {
+        uintptr_t lo;
+        if (stack_bounds(&lo, &check_hi)) {
+            return;
+        }
+    }
+
+    size_t depth = check_hi - sp;
+    if (__builtin_expect(depth < check_record + RECORD_STEP, 1)) {
+        return;
+    }
+    check_record = depth;
+
+    int log_level = __atomic_load_n(&trace_level, __ATOMIC_RELAXED);
+    if (log_level) {
+        LOG(log_level, "Stack depth record of tid %d: %zu bytes",
+          (int) syscall(SYS_gettid), depth);
+        print_stack_trace(log_level);
+    }
+}
+
+// private
+
+static
+void create_key() {
+    key_error = pthread_key_create(&thread_key, unregister);
+}
+
+static
+void unregister(void *arg) {
+    struct thread *thread = arg;
+
+    pthread_mutex_lock(&threads_mtx);
+    thread->tid = 0;
+    pthread_mutex_unlock(&threads_mtx);
+}
+
+static
+int stack_bounds(uintptr_t *lo, uintptr_t *hi) {
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr)) {
+        return -1;
+    }
+
+    void *addr;
+    size_t size;
+    int rv = pthread_attr_getstack(&attr, &addr, &size);
+    pthread_attr_destroy(&attr);
+    if (rv) {
+        return -1;
+    }
+
+    *lo = (uintptr_t) addr;
+    *hi = (uintptr_t) addr + size;
+    return 0;
+}
+
+/*
+    Fill [lo, hi) with the pattern. Volatile stores, since the compiler sees
+    nothing reading them.
+*/
+static
+void paint(uintptr_t lo, uintptr_t hi) {
+    for (volatile uintptr_t *word = (volatile uintptr_t *) lo;
+         (uintptr_t) word < hi; ++word) {
+        *word = PATTERN;
+    }
+}
+
+/*
+    Find the lowest word of painted area that doesn't hold the pattern. Words
+    below it may be unused though they are not painted anymore, e.g. a big
+    local array partially written, so the scan goes from the bottom up.
+*/
+static
+void scan(struct thread *thread) {
+    const uintptr_t *word = (const uintptr_t *) thread->painted;
+    const uintptr_t *end = (const uintptr_t *) thread->mark;
+
+    while (word < end && *word == PATTERN) {
+        ++word;
+    }
+
+    thread->mark = (uintptr_t) word;
+}
+
+static
+void log_thread(int log_level, const char *prefix,
+  const struct thread *thread) {
+    char name[16] = "";
+    pthread_getname_np(thread->handle, name, sizeof(name));
+
+    size_t size = thread->hi - thread->lo;
+    size_t used = thread->hi - thread->mark;
+    int exceeded = thread->mark == thread->painted
+                   && thread->painted > thread->lo;
+
+    LOG(log_level, "%stid %d (%s): %s%zu of %zu bytes (%d%%)%s", prefix,
+      thread->tid, name, exceeded ? "at least " : "", used, size,
+      (int) (100 * (uint64_t) used / size),
+      exceeded ? ", painted area exceeded" : "");
+}
+
+static
+void *monitor_thread(void *arg) {
+    const struct monitor *monitor = arg;
+
+    for (;;) {
+        struct timespec left;
+        left.tv_sec = monitor->interval_ms / 1000;
+        left.tv_nsec = monitor->interval_ms % 1000 * 1000000L;
+        while (nanosleep(&left, &left) && errno == EINTR) {
+        }
+
+        pthread_mutex_lock(&threads_mtx);
+        for (int i = 0; i < MAX_THREADS; ++i) {
+            struct thread *thread = &threads[i];
+            if (!thread->tid) {
+                continue;
+            }
+
+            scan(thread);
+            if (thread->mark < thread->reported) {
+                log_thread(monitor->log_level, "Stack usage record: ", thread);
+                thread->reported = thread->mark;
+            }
+        }
+        pthread_mutex_unlock(&threads_mtx);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,71 @@
+#ifndef STACKUSAGE_H_INCLUDED
+#define STACKUSAGE_H_INCLUDED
+
+#include <stddef.h>
+
+/*
+    Stack usage high-water marks of threads, for sizing thread stacks down
+    safely.
+
+    A thread registers itself with stackusage_register(), which fills unused
+    part of its stack (below the current frame) with a pattern. Later scans
+    look for the deepest word that doesn't hold the pattern anymore: that's
+    how deep the stack has ever been used, including by signal handlers and
+    code that can't be instrumented. Scanning reads only memory that the
+    scanned thread doesn't use, so threads aren't stopped.
+
+    Painting commits stack memory, so for threads with big stacks (such as
+    the main one) limit its depth.
+
+    Scans are done by stackusage_report(), or periodically by a helper thread
+    started with stackusage_monitor(), which logs only new records:
+
+    Stack usage: 2 threads
+        tid 1234 (worker): 5320 of 65536 bytes (8%)
+        tid 1235 (main): at least 1049600 of 8388608 bytes (12%), painted area exceeded
+    Stack usage record: tid 1234 (worker): 6144 of 65536 bytes (9%)
+
+    Scans don't tell what used the stack. For that, call stackusage_check()
+    at suspicious points (deep recursion, big frames): it compares current
+    depth with the deepest one seen by the calling thread and logs a stack
+    trace whenever a new record is set.
+*/
+
+/*
+    Paint stack of the calling thread, at most 'max_depth' bytes below the
+    current frame (0 for the whole stack), and track it until the thread
+    exits. Calling it again from the same thread re-paints the stack and
+    starts its high-water mark over.
+
+    Returns 0 on success and -1 on error.
+*/
+int stackusage_register(size_t max_depth);
+
+/*
+    Scan stacks of all registered threads and log their high-water marks.
+*/
+void stackusage_report(int log_level);
+
+/*
+    Start a helper thread, which scans stacks every 'interval_ms' and logs
+    threads whose high-water mark grew.
+
+    Returns 0 on success and -1 on error.
+*/
+int stackusage_monitor(unsigned interval_ms, int log_level);
+
+/*
+    Log stack traces with 'log_level' when stackusage_check() sets a record.
+    0 (default) disables them.
+*/
+void stackusage_set_trace_level(int log_level);
+
+/*
+    Record current stack depth of the calling thread, and log a stack trace if
+    it's deeper than ever before (by at least a cache line, so that tiny
+    variations don't flood the log). Costs a couple of loads unless a record is
+    set. Thread doesn't have to be registered.
+*/
+void stackusage_check();
+
+#endif // STACKUSAGE_H_INCLUDED
@@ -0,0 +1,591 @@
+#define _GNU_SOURCE
+
+#include "symbolize.h"
+
+#include "dwarfline.h"
+#include "elfsym.h"
+
+#include <dlfcn.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CACHE_SIZE 2048
+#define MAX_MODULES 128
+
+// How often lookups ask the dynamic loader whether modules changed
+#define GENERATION_CHECK_NS 100000000ull
+
+// Must be a power of two
+#define DEMANGLED_SIZE 4096
+#define INTERNED_SIZE 8192
+
+// Size of blocks that interned names are copied to
+#define NAMES_BLOCK 65536
+
+struct slot {
+    unsigned seq;       // odd while slot is being written
+    unsigned epoch;     // value of 'epoch' when slot was written
+    uintptr_t pc;
+    int found;
+    struct symbol symbol;
+};
+
+struct module {
+    uintptr_t bias;
+    char *name;
+    char *path;             // copy of dladdr()'s name, outlives the module
+    struct elfsym *symtab;  // NULL if module has no readable symbols
+    struct dwarfline *lines;    // NULL if module has no debug info
+};
+
+struct demangled {
+    unsigned epoch;
+    const char *mangled;
+    const char *name;           // interned
+    symbolize_demangle_t mode;  // 'name' was demangled with
+    size_t width;
+};
+
+typedef char *(*cxa_demangle_t)(const char *name, char *buf, size_t *len,
+  int *status);
+
+static struct slot slots[CACHE_SIZE];
+
+// Symbol tables and debug info are loaded on first symbolization of a module
+// and are never unloaded: names that cache points to live in them.
+static struct module modules[MAX_MODULES];
+static int modules_count;
+static pthread_mutex_t modules_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+// Slots written in another epoch are considered empty. Epoch starts with 1,
+// so that zero-initialized slots are empty too.
+static unsigned epoch = 1;
+static unsigned long long modules_generation;
+static uint64_t generation_checked_ns;
+
+// Mangled names are keyed by address, so the memo is emptied with the cache
+// (on epoch change). An entry reused in a later epoch for the same mangled
+// name (the usual case, as names mostly live in symbol tables that are never
+// unloaded) and mode keeps its demangled name.
+static struct demangled demangled[DEMANGLED_SIZE];
+
+// Demangled names are interned: copied once per distinct text into blocks
+// that are never freed, since other threads may hold them anyway. Memory
+// grows with the number of distinct names, not with lookups or epochs. Once
+// the table is full, new names are still copied, just not deduplicated.
+// Guarded by demangle_mtx.
+static const char *interned[INTERNED_SIZE];
+static char *names_block;
+static size_t names_used;
+static symbolize_demangle_t demangle_mode;
+static size_t demangle_width;
+static cxa_demangle_t cxa_demangle;
+static pthread_mutex_t demangle_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void check_generation();
+static int cache_get(uintptr_t pc, struct symbol *symbol, int *found);
+static void cache_put(uintptr_t pc, const struct symbol *symbol, int found);
+static int resolve(uintptr_t pc, struct symbol *symbol);
+static const struct module *find_module(const struct link_map *map,
+  const char *path);
+static const char *demangle(const char *name);
+static const char *intern(char *name);
+static void compact(char *name, size_t max_width);
+
+// public
+
+int symbolize(const void *pc, struct symbol *symbol) {
+    check_generation();
+
+    int found;
+    if (cache_get((uintptr_t) pc, symbol, &found)) {
+        found = !resolve((uintptr_t) pc, symbol);
+        cache_put((uintptr_t) pc, symbol, found);
+    }
+
+    return found ? 0 : -1;
+}
+
+int symbolize_cached(const void *pc, struct symbol *symbol) {
+    int found;
+    if (cache_get((uintptr_t) pc, symbol, &found)) {
+        return -1;
+    }
+
+    return found ? 0 : -1;
+}
+
+int symbolize_function(const void *pc, uintptr_t *start, uintptr_t *end) {
+    Dl_info info;
+    struct link_map *map = NULL;
+    if (!dladdr1((void *) pc, &info, (void **) &map, RTLD_DL_LINKMAP) || !map) {
+        return -1;
+    }
+
+    const struct module *module = find_module(map, info.dli_fname);
+    if (module && module->symtab) {
+        uintptr_t sym_addr, sym_end;
+        if (elfsym_lookup_range(module->symtab, (uintptr_t) pc - map->l_addr,
+              &sym_addr, &sym_end)) {
+            *start = sym_addr + map->l_addr;
+            *end = sym_end == UINTPTR_MAX ? UINTPTR_MAX : sym_end + map->l_addr;
+            return 0;
+        }
+    }
+
+    const ElfW(Sym) *sym = NULL;
+    if (!dladdr1((void *) pc, &info, (void **) &sym, RTLD_DL_SYMENT) || !sym
+        || !info.dli_saddr || !sym->st_size) {
+        return -1;
+    }
+
+    *start = (uintptr_t) info.dli_saddr;
+    *end = (uintptr_t) info.dli_saddr + sym->st_size;
+    return 0;
+}
+
+int symbolize_format(const void *pc, char *buf, size_t len) {
+    struct symbol symbol;
+    if (symbolize(pc, &symbol) || !symbol.module[0]) {
+        return snprintf(buf, len, "[%p]", pc);
+    }
+
+    if (!symbol.name) {
+        if (symbol.file) {
+            return snprintf(buf, len, "%s [%p] %s:%u", symbol.module, pc,
+              symbol.file, symbol.line);
+        }
+        return snprintf(buf, len, "%s [%p]", symbol.module, pc);
+    }
+
+    uintptr_t addr = (uintptr_t) pc;
+    int n = snprintf(buf, len, "%s(%s%c%#lx) [%p]", symbol.module,
+      symbol.name, addr >= symbol.address ? '+' : '-',
+      (unsigned long) (addr >= symbol.address ? addr - symbol.address
+                                              : symbol.address - addr),
+      pc);
+
+    if (symbol.file && n >= 0) {
+        n += snprintf((size_t) n < len ? buf + n : NULL,
+          (size_t) n < len ? len - n : 0, " %s:%u", symbol.file, symbol.line);
+    }
+
+    return n;
+}
+
+int symbolize_inlined(const void *pc, struct dwarfline_frame *frames,
+  int max) {
+    Dl_info info;
+    struct link_map *map = NULL;
+    if (!dladdr1((void *) ((uintptr_t) pc - 1), &info, (void **) &map,
+          RTLD_DL_LINKMAP) || !map) {
+        return 0;
+    }
+
+    const struct module *module = find_module(map, info.dli_fname);
+    if (!module || !module->lines) {
+        return 0;
+    }
+
+    return dwarfline_lookup(module->lines, (uintptr_t) pc - 1 - map->l_addr,
+      frames, max);
+}
+
+void symbolize_set_demangle(symbolize_demangle_t mode, size_t max_width) {
+    pthread_mutex_lock(&demangle_mtx);
+    demangle_mode = mode;
+    demangle_width = max_width;
+    pthread_mutex_unlock(&demangle_mtx);
+
+    symbolize_invalidate();
+}
+
+const char *symbolize_demangle(const char *name) {
+    if (!name || name[0] != '_' || name[1] != 'Z'
+        || __atomic_load_n(&demangle_mode, __ATOMIC_RELAXED)
+           == SYMBOLIZE_DEMANGLE_OFF) {
+        return name;
+    }
+
+    unsigned current = __atomic_load_n(&epoch, __ATOMIC_ACQUIRE);
+    uintptr_t hash = (uintptr_t) name * (uintptr_t) 0x9e3779b97f4a7c15ull;
+    const char *result = name;
+
+    pthread_mutex_lock(&demangle_mtx);
+
+    for (size_t probe = 0; probe < DEMANGLED_SIZE; ++probe) {
+        struct demangled *entry = &demangled[(hash + probe)
+                                             & (DEMANGLED_SIZE - 1)];
+
+        if (entry->epoch == current && entry->mangled == name) {
+            result = entry->name ? entry->name : name;
+            break;
+        }
+
+        if (entry->epoch != current) {
+            if (entry->mangled != name || entry->mode != demangle_mode
+                || entry->width != demangle_width) {
+                // failures are memoized too, as NULL
+                entry->name = demangle(name);
+                entry->mode = demangle_mode;
+                entry->width = demangle_width;
+            }
+            entry->epoch = current;
+            entry->mangled = name;
+            result = entry->name ? entry->name : name;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&demangle_mtx);
+
+    return result;
+}
+
+void symbolize_invalidate() {
+    __atomic_fetch_add(&epoch, 1, __ATOMIC_RELEASE);
+}
+
+// private
+
+static
+int read_generation(struct dl_phdr_info *info, size_t size, void *data) {
+    unsigned long long *generation = data;
+
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs)
+        + sizeof(info->dlpi_subs)) {
+        *generation = info->dlpi_adds + info->dlpi_subs;
+    }
+
+    return 1;   // counters are the same for every module, stop here
+}
+
+/*
+    Drop cached symbols if modules were loaded or unloaded. The loader is
+    asked at most every GENERATION_CHECK_NS, since dl_iterate_phdr() takes its
+    lock, and only by one thread at a time.
+*/
+static
+void check_generation() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    uint64_t now_ns = now.tv_sec * 1000000000ull + now.tv_nsec;
+
+    uint64_t checked = __atomic_load_n(&generation_checked_ns, __ATOMIC_RELAXED);
+    if (now_ns - checked < GENERATION_CHECK_NS
+        || !__atomic_compare_exchange_n(&generation_checked_ns, &checked,
+             now_ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    unsigned long long generation = 0;
+    dl_iterate_phdr(read_generation, &generation);
+
+    unsigned long long previous = __atomic_exchange_n(&modules_generation,
+      generation, __ATOMIC_ACQ_REL);
+    if (previous != generation) {
+        symbolize_invalidate();
+    }
+}
+
+static
+struct slot *slot_for(uintptr_t pc) {
+    uintptr_t hash = pc * (uintptr_t) 0x9e3779b97f4a7c15ull;
+    return &slots[(hash >> (sizeof(uintptr_t) * 8 - 16)) % CACHE_SIZE];
+}
+
+static
+int cache_get(uintptr_t pc, struct symbol *symbol, int *found) {
+    struct slot *slot = slot_for(pc);
+
+    unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+        return -1;
+    }
+
+    unsigned cached_epoch = slot->epoch;
+    uintptr_t cached_pc = slot->pc;
+    int cached_found = slot->found;
+    struct symbol cached_symbol = slot->symbol;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq
+        || cached_pc != pc
+        || cached_epoch != __atomic_load_n(&epoch, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    *found = cached_found;
+    *symbol = cached_symbol;
+    return 0;
+}
+
+static
+void cache_put(uintptr_t pc, const struct symbol *symbol, int found) {
+    struct slot *slot = slot_for(pc);
+
+    unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1,
+          0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->epoch = __atomic_load_n(&epoch, __ATOMIC_ACQUIRE);
+    slot->pc = pc;
+    slot->found = found;
+    slot->symbol = *symbol;
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static
+int resolve(uintptr_t pc, struct symbol *symbol) {
+    memset(symbol, 0, sizeof(*symbol));
+    symbol->module = "";
+
+    // Addresses are return addresses: the call before it is looked up, since
+    // a call to a noreturn function may be the last instruction of a function
+    uintptr_t call = pc - 1;
+
+    Dl_info info;
+    struct link_map *map = NULL;
+    if (!dladdr1((void *) call, &info, (void **) &map, RTLD_DL_LINKMAP)) {
+        return -1;
+    }
+
+    const struct module *module = map ? find_module(map, info.dli_fname)
+                                      : NULL;
+
+    symbol->module = module ? module->path
+                            : info.dli_fname ? info.dli_fname : "";
+    symbol->module_base = (uintptr_t) info.dli_fbase;
+
+    if (module && module->lines) {
+        struct dwarfline_frame frames[16];
+        int count = dwarfline_lookup(module->lines, call - map->l_addr,
+          frames, 16);
+        if (count) {
+            symbol->file = frames[count - 1].file;
+            symbol->line = frames[count - 1].line;
+        }
+    }
+
+    // .symtab knows static functions too, so it is more precise than dladdr()
+    if (module && module->symtab) {
+        uintptr_t address;
+        const char *name = elfsym_lookup(module->symtab, call - map->l_addr,
+          &address);
+        if (name) {
+            symbol->name = symbolize_demangle(name);
+            symbol->address = address + map->l_addr;
+            return 0;
+        }
+    }
+
+    if (info.dli_sname) {
+        symbol->name = symbolize_demangle(info.dli_sname);
+        symbol->address = (uintptr_t) info.dli_saddr;
+    }
+
+    return 0;
+}
+
+/*
+    Module's symbol table and debug info, loaded on first call. Modules are
+    told apart by name and load bias, since link_map of an unloaded module may
+    be reused. 'path' is the name dladdr() reports for it.
+*/
+static
+const struct module *find_module(const struct link_map *map,
+  const char *path) {
+    const char *name = map->l_name && map->l_name[0] ? map->l_name
+                                                     : "/proc/self/exe";
+    const struct module *found = NULL;
+
+    pthread_mutex_lock(&modules_mtx);
+
+    int i;
+    for (i = 0; i < modules_count; ++i) {
+        if (modules[i].bias == map->l_addr && !strcmp(modules[i].name, name)) {
+            found = &modules[i];
+            break;
+        }
+    }
+
+    if (i == modules_count && modules_count < MAX_MODULES) {
+        char *copy = strdup(name);
+        char *path_copy = strdup(path ? path : "");
+        if (copy && path_copy) {
+            struct module *module = &modules[modules_count++];
+            module->bias = map->l_addr;
+            module->name = copy;
+            module->path = path_copy;
+            module->symtab = elfsym_open(name);
+            module->lines = dwarfline_open(name);
+            found = module;
+        } else {
+            free(copy);
+            free(path_copy);
+        }
+    }
+
+    pthread_mutex_unlock(&modules_mtx);
+
+    return found;
+}
+
+/*
+    Demangle 'name' in the current mode, with demangle_mtx locked.
+
+    Returns interned demangled name or NULL on failure.
+*/
+static
+const char *demangle(const char *name) {
+    if (!cxa_demangle) {
+        cxa_demangle = (cxa_demangle_t) dlsym(RTLD_DEFAULT, "__cxa_demangle");
+    }
+    if (!cxa_demangle) {
+        // C program symbolizing C++ code, e.g. tools/symbolize. The library
+        // stays loaded for good.
+        void *libstdcxx = dlopen("libstdc++.so.6", RTLD_LAZY);
+        if (libstdcxx) {
+            cxa_demangle = (cxa_demangle_t) dlsym(libstdcxx, "__cxa_demangle");
+        }
+    }
+    if (!cxa_demangle) {
+        return NULL;
+    }
+
+    int status;
+    char *result = cxa_demangle(name, NULL, NULL, &status);
+    if (status || !result) {
+        free(result);
+        return NULL;
+    }
+
+    if (demangle_mode == SYMBOLIZE_DEMANGLE_COMPACT) {
+        compact(result, demangle_width);
+    }
+
+    return intern(result);
+}
+
+/*
+    Find or copy 'name' (allocated with malloc(), freed here) among interned
+    names, with demangle_mtx locked.
+
+    Returns interned name or NULL if out of memory.
+*/
+static
+const char *intern(char *name) {
+    size_t len = strlen(name) + 1;
+
+    // FNV-1a
+    uintptr_t hash = (uintptr_t) 0xcbf29ce484222325ull;
+    for (const char *c = name; *c; ++c) {
+        hash = (hash ^ (unsigned char) *c) * (uintptr_t) 0x100000001b3ull;
+    }
+
+    const char **empty = NULL;
+    for (size_t probe = 0; probe < INTERNED_SIZE; ++probe) {
+        const char **entry = &interned[(hash + probe) & (INTERNED_SIZE - 1)];
+        if (!*entry) {
+            empty = entry;
+            break;
+        }
+        if (!strcmp(*entry, name)) {
+            free(name);
+            return *entry;
+        }
+    }
+
+    if (!names_block || names_used + len > NAMES_BLOCK) {
+        // The rest of the previous block is wasted
+        char *block = malloc(len > NAMES_BLOCK ? len : NAMES_BLOCK);
+        if (!block) {
+            free(name);
+            return NULL;
+        }
+        names_block = block;
+        names_used = 0;
+    }
+
+    char *copy = names_block + names_used;
+    memcpy(copy, name, len);
+    names_used += len;
+    free(name);
+
+    if (empty) {
+        *empty = copy;
+    }
+
+    return copy;
+}
+
+/*
+    Elide template arguments and parameters of demangled 'name' in place,
+    keeping the brackets, and cut it from the front to 'max_width'.
+*/
+static
+void compact(char *name, size_t max_width) {
+    static const char operator_kw[] = "operator";
+    size_t out = 0;
+    int depth = 0;
+
+    for (size_t in = 0; name[in]; ) {
+        // operator<, operator<<= and the like are not brackets
+        if (!strncmp(name + in, operator_kw, sizeof(operator_kw) - 1)) {
+            size_t end = in + sizeof(operator_kw) - 1;
+            while (name[end] && strchr("<>=-", name[end])) {
+                ++end;
+            }
+            // "operator()" is a name too, its parameters follow
+            if (name[end] == '(' && name[end + 1] == ')') {
+                end += 2;
+            }
+            if (!depth) {
+                memmove(name + out, name + in, end - in);
+                out += end - in;
+            }
+            in = end;
+            continue;
+        }
+
+        // "(anonymous namespace)" is a scope, not parameters
+        static const char anonymous[] = "(anonymous namespace)";
+        if (!strncmp(name + in, anonymous, sizeof(anonymous) - 1)) {
+            if (!depth) {
+                memmove(name + out, name + in, sizeof(anonymous) - 1);
+                out += sizeof(anonymous) - 1;
+            }
+            in += sizeof(anonymous) - 1;
+            continue;
+        }
+
+        char c = name[in++];
+        if (c == '<' || c == '(') {
+            if (!depth++) {
+                name[out++] = c;
+            }
+        } else if (c == '>' || c == ')') {
+            if (depth && !--depth) {
+                name[out++] = c;
+            }
+        } else if (!depth) {
+            name[out++] = c;
+        }
+    }
+    name[out] = '\0';
+
+    if (max_width > 3 && out > max_width) {
+        size_t keep = max_width - 3;
+        memmove(name + 3, name + out - keep, keep + 1);
+        memcpy(name, "...", 3);
+    }
+}
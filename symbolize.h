@@ -0,0 +1,138 @@
+#ifndef SYMBOLIZE_H_INCLUDED
+#define SYMBOLIZE_H_INCLUDED
+
+#include "dwarfline.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Symbolizer with a cache, for code that symbolizes stack traces at high
+    rates (e.g. allocation or lock profiling). Every distinct PC is resolved
+    once: results are kept in a fixed-size hash table shared by all threads,
+    which is read without locks.
+
+    Function names are looked up in .symtab / .dynsym of the module's file
+    (see elfsym.h), which is loaded on first symbolization of the module. This
+    finds static functions and doesn't need -rdynamic. If the file has no
+    symbols (or is not readable), dladdr() is used.
+
+    If the module has DWARF debug info (see dwarfline.h), source file and line
+    are resolved as well. Addresses are treated as return addresses:
+    function and line of the preceding instruction (i.e. of the call) are
+    reported.
+
+    Cached entries are dropped when set of loaded modules changes: lookups
+    check load / unload counters that dl_iterate_phdr() reports, at most every
+    100 ms, since that takes the dynamic loader's lock. Until then, addresses
+    of a module that was unloaded (or loaded at the same place) may resolve
+    as before. Call symbolize_invalidate() after dlclose() where that
+    matters. Module paths of cached entries are copies and function names
+    live in symbol tables that are never unloaded, so they outlive their
+    modules, except names that come from dladdr() (when the module's file
+    can't be read).
+
+    Nothing here allocates memory, except loading of a module's symbols and
+    debug info, and demangling. Still, a lookup that misses the cache takes
+    locks of the dynamic loader and of this module; symbolize_cached() never
+    does.
+
+    C++ names are demangled if enabled with symbolize_set_demangle(), by
+    __cxa_demangle() of libstdc++ (which is loaded if the program doesn't have
+    it yet). Demangled names are memoized by mangled name, so every function
+    is demangled once, no matter how many of its PCs are symbolized.
+*/
+
+typedef enum {
+    SYMBOLIZE_DEMANGLE_OFF,
+    SYMBOLIZE_DEMANGLE_FULL,        // foo::Bar<int>::baz(char const*) const
+    SYMBOLIZE_DEMANGLE_COMPACT,     // foo::Bar<>::baz() const
+} symbolize_demangle_t;
+
+struct symbol {
+    const char *module;     // path of module, never NULL, may be ""
+    uintptr_t module_base;
+    const char *name;       // NULL if unknown
+    uintptr_t address;      // address of symbol 'name'
+    const char *file;       // NULL if unknown
+    unsigned line;
+};
+
+/*
+    Resolve 'pc' to module and symbol. Strings in 'symbol' stay valid until the
+    module is unloaded, demangled names for good (see symbolize_demangle()).
+
+    Returns 0 on success and -1 if 'pc' doesn't belong to any loaded module.
+*/
+int symbolize(const void *pc, struct symbol *symbol);
+
+/*
+    Look 'pc' up like symbolize() does, but in the cache only: nothing is
+    loaded, allocated, demangled or locked, and the dynamic loader isn't asked
+    about modules, so dlopen() and dlclose() are noticed by the next
+    symbolize() rather than here. PCs that symbolize() hasn't resolved yet (or
+    whose entries were replaced or dropped since) are not found.
+
+    Returns 0 on success and -1 if 'pc' is not in the cache or doesn't belong
+    to any loaded module.
+*/
+int symbolize_cached(const void *pc, struct symbol *symbol);
+
+/*
+    Find bounds of the function that contains 'pc': its address is stored to
+    'start' and the address next to its last byte to 'end'. Symbol tables are
+    those of symbolize() (loaded on first use), but results are not cached.
+
+    Returns 0 on success and -1 if the function or its size is unknown.
+*/
+int symbolize_function(const void *pc, uintptr_t *start, uintptr_t *end);
+
+/*
+    Format 'pc' like backtrace_symbols() does, i.e. "module(name+0x1c) [0x4005d3]",
+    "module [0x4005d3]" or "[0x4005d3]", to 'buf' of 'len' bytes. If source
+    line is known, it is appended: "module(name+0x1c) [0x4005d3] foo.c:1022".
+    Output is always null-terminated unless 'len' is 0.
+
+    Returns number of characters (excluding terminating null byte) that would
+    have been written if 'buf' was large enough, just as snprintf() does.
+*/
+int symbolize_format(const void *pc, char *buf, size_t len);
+
+/*
+    Resolve 'pc' to chain of inlined functions, see dwarfline_lookup(). The
+    last frame is the function that actually contains 'pc', and its location is
+    what symbolize() reports. Results are not cached.
+
+    Returns number of frames or 0 if there is no debug info for 'pc'.
+*/
+int symbolize_inlined(const void *pc, struct dwarfline_frame *frames,
+  int max);
+
+/*
+    Set how C++ names are demangled, SYMBOLIZE_DEMANGLE_OFF by default. In
+    compact form template arguments and parameters are elided, and names
+    longer than 'max_width' characters (if it's not 0) are cut from the
+    front, since the innermost scope tells most: "...Bar<>::baz() const".
+    Cached symbols are dropped.
+*/
+void symbolize_set_demangle(symbolize_demangle_t mode, size_t max_width);
+
+/*
+    Demangle symbol 'name' as set by symbolize_set_demangle(). symbolize()
+    does it already; this is for names from elsewhere, e.g. elfsym.h.
+
+    Returns demangled name or 'name' itself if it is not mangled or
+    demangling is off or fails. Demangled names are interned and never freed,
+    so they stay valid for good and may be shared between threads; memory
+    they take grows with the number of distinct names only.
+*/
+const char *symbolize_demangle(const char *name);
+
+/*
+    Drop all cached symbols. Changes of loaded modules are detected
+    automatically, but up to 100 ms later, so call it right after dlclose()
+    if addresses of the unloaded module may be symbolized meanwhile.
+*/
+void symbolize_invalidate();
+
+#endif // SYMBOLIZE_H_INCLUDED
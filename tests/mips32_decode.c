@@ -0,0 +1,73 @@
+#include "../backtrace.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define ADDIU_SP(n) (0x27bd0000 | (uint16_t) (n))  // addiu sp, sp, n
+#define SW_RA(n)    (0xafbf0000 | (uint16_t) (n))  // sw ra, n(sp)
+#define LUI_GP(n)   (0x3c1c0000 | (uint16_t) (n))  // lui gp, n
+#define NOP         0x00000000
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static int failures;
+
+static void expect(const char *name, const uint32_t *code, size_t len,
+  size_t max_scan, int rv, int frame_size, int ra_offset);
+
+// public
+
+int main() {
+    // Prologue found: both values, whatever order they are met in
+    const uint32_t prologue[] = {
+        LUI_GP(2), ADDIU_SP(-32), SW_RA(28), NOP, NOP
+    };
+    expect("prologue", prologue, COUNT(prologue), COUNT(prologue), 0, 32, 28);
+
+    const uint32_t swapped[] = { SW_RA(20), ADDIU_SP(-24), NOP };
+    expect("swapped", swapped, COUNT(swapped), COUNT(swapped), 0, 24, 20);
+
+    // Beginning of the function met before the prologue is complete
+    const uint32_t outermost[] = { ADDIU_SP(-32), LUI_GP(2), SW_RA(28), NOP };
+    expect("outermost", outermost, COUNT(outermost), COUNT(outermost), 1, -1,
+      -1);
+
+    // Nothing within the scan limit, though the prologue is right below it
+    const uint32_t beyond[] = { ADDIU_SP(-32), SW_RA(28), NOP, NOP };
+    expect("beyond limit", beyond, COUNT(beyond), 2, -1, -1, -1);
+
+    const uint32_t nothing[] = { NOP, NOP, NOP };
+    expect("nothing", nothing, COUNT(nothing), COUNT(nothing), -1, -1, -1);
+
+    if (failures) {
+        printf("%d failed\n", failures);
+        return 1;
+    }
+
+    printf("All passed\n");
+    return 0;
+}
+
+// private
+
+/*
+    Decode 'code' of 'len' instructions backward from its last one, and check
+    the result. -1 as 'frame_size' or 'ra_offset' means the value must be left
+    untouched.
+*/
+static
+void expect(const char *name, const uint32_t *code, size_t len,
+  size_t max_scan, int rv, int frame_size, int ra_offset) {
+    int got_frame_size = -1;
+    int got_ra_offset = -1;
+    int got = backtrace_mips32_decode(&code[len - 1], max_scan,
+      &got_frame_size, &got_ra_offset);
+
+    if (got != rv || (rv == 0 && (got_frame_size != frame_size
+                                  || got_ra_offset != ra_offset))) {
+        printf("%s: expected %d (frame size %d, ra offset %d), "
+          "got %d (frame size %d, ra offset %d)\n", name, rv, frame_size,
+          ra_offset, got, got_frame_size, got_ra_offset);
+        ++failures;
+    }
+}
@@ -0,0 +1,278 @@
+#define _GNU_SOURCE
+
+#include "threaddump.h"
+
+#include "backtrace.h"
+#include "cfi.h"
+#include "log.h"
+#include "sigsafe.h"
+#include "symbolize.h"
+#include "threads.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define MAX_FRAMES 48
+#define SUSPEND_TIMEOUT_MS 1000
+
+// Number of innermost functions that name a group
+#define SUMMARY_FRAMES 3
+
+struct trace {
+    pid_t tid;
+    int captured;
+    int depth;
+    void *frames[MAX_FRAMES];
+};
+
+struct group {
+    const struct trace *first;
+    int size;
+};
+
+static int trigger_fds[2] = {-1, -1};
+static int trigger_level;
+
+static int trace_cmp(const void *a, const void *b);
+static int group_cmp(const void *a, const void *b);
+static void log_group(int log_level, const struct group *group);
+static void on_trigger(int sig);
+static void *trigger_thread(void *arg);
+
+// public
+
+int threaddump_init(int stop_sig) {
+    return threads_init(stop_sig);
+}
+
+int threaddump_log(int log_level) {
+    // Nothing may be allocated while threads are stopped: one of them may
+    // hold malloc() lock.
+    struct thread_state *states = malloc(THREADS_MAX * sizeof(*states));
+    struct trace *traces = malloc(THREADS_MAX * sizeof(*traces));
+    struct group *groups = malloc(THREADS_MAX * sizeof(*groups));
+    if (!states || !traces || !groups) {
+        LOGE("%s(): out of memory", __func__);
+        free(states);
+        free(traces);
+        free(groups);
+        return -1;
+    }
+
+    // Stopped threads are unwound without rescanning modules
+    cfi_refresh_modules();
+
+    traces[0].tid = syscall(SYS_gettid);
+    traces[0].captured = 1;
+    traces[0].depth = backtrace_capture(traces[0].frames, MAX_FRAMES);
+
+    int count = threads_suspend(states, THREADS_MAX - 1, SUSPEND_TIMEOUT_MS);
+    if (count < 0) {
+        LOGE("%s(): can't stop threads", __func__);
+        free(states);
+        free(traces);
+        free(groups);
+        return -1;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        struct trace *trace = &traces[i + 1];
+        trace->tid = states[i].tid;
+        trace->captured = states[i].captured;
+        trace->depth = 0;
+
+        if (trace->captured) {
+            struct cfi_regs regs = states[i].regs;
+            trace->frames[0] = (void *) regs.pc;
+            trace->depth = 1 + cfi_unwind_async(&regs, sigsafe_read_word, NULL,
+              trace->frames + 1, MAX_FRAMES - 1);
+        }
+    }
+
+    threads_resume();
+    ++count;
+
+    qsort(traces, count, sizeof(*traces), trace_cmp);
+
+    int groups_count = 0;
+    for (int i = 0; i < count; ++i) {
+        if (i && !trace_cmp(&traces[i - 1], &traces[i])) {
+            ++groups[groups_count - 1].size;
+        } else {
+            groups[groups_count].first = &traces[i];
+            groups[groups_count].size = 1;
+            ++groups_count;
+        }
+    }
+
+    qsort(groups, groups_count, sizeof(*groups), group_cmp);
+
+    LOG(log_level, "Thread dump: %d threads, %d distinct stacks", count,
+      groups_count);
+    for (int i = 0; i < groups_count; ++i) {
+        log_group(log_level, &groups[i]);
+    }
+
+    free(states);
+    free(traces);
+    free(groups);
+
+    return 0;
+}
+
+int threaddump_set_trigger(int sig, int log_level) {
+    if (trigger_fds[0] >= 0) {
+        LOGE("%s(): trigger is already set", __func__);
+        return -1;
+    }
+
+    if (pipe2(trigger_fds, O_CLOEXEC)) {
+        LOGE("%s(): pipe2() failed: %m", __func__);
+        return -1;
+    }
+
+    // signal handler must never block
+    if (fcntl(trigger_fds[1], F_SETFL, O_NONBLOCK)) {
+        LOGE("%s(): fcntl() failed: %m", __func__);
+        goto fail;
+    }
+
+    trigger_level = log_level;
+
+    struct sigaction action, old_action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_trigger;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    if (sigaction(sig, &action, &old_action)) {
+        LOGE("%s(): sigaction(%d) failed: %m", __func__, sig);
+        goto fail;
+    }
+
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, trigger_thread, NULL);
+    if (err) {
+        LOGE("%s(): pthread_create() failed: %s", __func__, strerror(err));
+        sigaction(sig, &old_action, NULL);
+        goto fail;
+    }
+    pthread_detach(thread);
+
+    return 0;
+
+fail:
+    close(trigger_fds[1]);
+    close(trigger_fds[0]);
+    trigger_fds[0] = trigger_fds[1] = -1;
+    return -1;
+}
+
+// private
+
+/*
+    Order traces so that identical ones are adjacent, threads that didn't
+    respond go together too.
+*/
+static
+int trace_cmp(const void *a, const void *b) {
+    const struct trace *x = a;
+    const struct trace *y = b;
+
+    if (x->captured != y->captured) {
+        return x->captured ? -1 : 1;
+    }
+    if (x->depth != y->depth) {
+        return x->depth < y->depth ? -1 : 1;
+    }
+
+    return memcmp(x->frames, y->frames, x->depth * sizeof(x->frames[0]));
+}
+
+static
+int group_cmp(const void *a, const void *b) {
+    const struct group *x = a;
+    const struct group *y = b;
+
+    if (x->size != y->size) {
+        return x->size > y->size ? -1 : 1;
+    }
+
+    return x->first->tid < y->first->tid ? -1 : x->first->tid > y->first->tid;
+}
+
+static
+void log_group(int log_level, const struct group *group) {
+    const struct trace *trace = group->first;
+
+    char tids[256];
+    int len = 0;
+    for (int i = 0; i < group->size && len < (int) sizeof(tids); ++i) {
+        len += snprintf(tids + len, sizeof(tids) - len, i ? " %d" : "%d",
+          (int) trace[i].tid);
+    }
+    if (len >= (int) sizeof(tids)) {
+        strcpy(tids + sizeof(tids) - 4, "...");
+    }
+
+    const char *noun = group->size == 1 ? "thread" : "threads";
+
+    if (!trace->captured) {
+        LOG(log_level, "%d %s didn't respond (tids %s)", group->size, noun,
+          tids);
+        return;
+    }
+
+    // frames without names (e.g. of stripped libraries) are skipped
+    char summary[256];
+    len = 0;
+    for (int i = 0, named = 0; i < trace->depth && named < SUMMARY_FRAMES
+         && len < (int) sizeof(summary); ++i) {
+        struct symbol symbol;
+        if (symbolize(trace->frames[i], &symbol) || !symbol.name) {
+            continue;
+        }
+        len += snprintf(summary + len, sizeof(summary) - len, "%s%s",
+          named++ ? " <- " : "", symbol.name);
+    }
+
+    LOG(log_level, "%d %s in %s (tids %s)", group->size, noun,
+      len ? summary : "??", tids);
+    print_stack_frames(log_level, trace->frames, trace->depth);
+}
+
+static
+void on_trigger(int sig) {
+    (void) sig;
+
+    int saved_errno = errno;
+    char byte = 0;
+    if (write(trigger_fds[1], &byte, 1) < 0) {
+        // pipe is full, a dump is pending anyway
+    }
+    errno = saved_errno;
+}
+
+static
+void *trigger_thread(void *arg) {
+    (void) arg;
+
+    char byte;
+    ssize_t n;
+    while ((n = read(trigger_fds[0], &byte, 1)) != 0) {
+        if (n > 0) {
+            threaddump_log(trigger_level);
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,50 @@
+#ifndef THREADDUMP_H_INCLUDED
+#define THREADDUMP_H_INCLUDED
+
+/*
+    Stack traces of all threads, for diagnosis of hangs and deadlocks, where
+    print_stack_trace() of a single thread tells little.
+
+    Threads are stopped (see threads.h), their stacks are unwound while they
+    are stopped, and then they are resumed before anything is symbolized or
+    logged, so that a thread stopped while holding a lock (of malloc(), of
+    the dynamic linker or of log) can't deadlock the dump.
+
+    Threads with identical stack traces are grouped, biggest groups first,
+    which makes hundreds of pool threads readable:
+
+    Thread dump: 42 threads, 3 distinct stacks
+    37 threads in pthread_mutex_lock <- worker_wait <- worker_main (tids 101 102 ...)
+        #00 /lib/libc.so.6(pthread_mutex_lock+0x112) [0x7fd9296ab482]
+        ...
+    4 threads in epoll_wait <- io_loop <- io_main (tids 140 141 142 143)
+        ...
+*/
+
+/*
+    Install handler of 'stop_sig' (e.g. SIGRTMIN + 1), that threads are
+    stopped with. Has to be called once before threaddump_log(). If minidumps
+    are enabled too (crash.h), the same signal should be passed to both.
+
+    Returns 0 on success and -1 on error.
+*/
+int threaddump_init(int stop_sig);
+
+/*
+    Log stack traces of all threads with 'log_level'.
+
+    Returns 0 on success and -1 on error (e.g. if another dump is in progress).
+*/
+int threaddump_log(int log_level);
+
+/*
+    Dump all threads with 'log_level' whenever the process receives 'sig'
+    (e.g. SIGQUIT, like JVM does), so that a hanging process can be inspected
+    with 'kill -QUIT <pid>'. Signal handler only wakes up a helper thread,
+    which does the dump.
+
+    Returns 0 on success and -1 on error.
+*/
+int threaddump_set_trigger(int sig, int log_level);
+
+#endif // THREADDUMP_H_INCLUDED
@@ -0,0 +1,275 @@
+#define _GNU_SOURCE
+
+#include "threads.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+// Interval of polling while waiting for threads
+#define POLL_NS (100 * 1000)
+
+enum {
+    SLOT_FREE,
+    SLOT_REQUESTED,
+    SLOT_CAPTURED,
+};
+
+struct slot {
+    int state;
+    unsigned generation;
+    struct thread_state thread;
+};
+
+// Threads are stopped in "generations": a stopped thread waits until
+// 'resumed' catches up with 'generation' it was stopped in.
+static struct slot slots[THREADS_MAX];
+static unsigned generation;
+static unsigned resumed;
+static int busy;
+static int signal_number;
+
+static void capture(int sig, siginfo_t *info, void *context);
+static int list_threads(pid_t self, int max);
+static long elapsed_ms(const struct timespec *start);
+
+// public
+
+int threads_init(int sig) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = capture;
+    action.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+
+    if (sigaction(sig, &action, NULL)) {
+        LOGE("%s(): sigaction(%d) failed: %m", __func__, sig);
+        return -1;
+    }
+
+    __atomic_store_n(&signal_number, sig, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+int threads_suspend(struct thread_state *states, int max, int timeout_ms) {
+    int sig = __atomic_load_n(&signal_number, __ATOMIC_ACQUIRE);
+    if (!sig || __atomic_exchange_n(&busy, 1, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    int saved_errno = errno;
+
+    pid_t pid = getpid();
+    pid_t self = syscall(SYS_gettid);
+    if (max > THREADS_MAX) {
+        max = THREADS_MAX;
+    }
+
+    int count = list_threads(self, max);
+    if (count < 0) {
+        __atomic_store_n(&busy, 0, __ATOMIC_RELEASE);
+        errno = saved_errno;
+        return -1;
+    }
+
+    // Slots must be filled before threads may see new generation
+    unsigned current = __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < count; ++i) {
+        slots[i].generation = current;
+        __atomic_store_n(&slots[i].state, SLOT_REQUESTED, __ATOMIC_RELEASE);
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (syscall(SYS_tgkill, pid, slots[i].thread.tid, sig)) {
+            // thread has exited meanwhile
+            __atomic_store_n(&slots[i].state, SLOT_FREE, __ATOMIC_RELEASE);
+        }
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (;;) {
+        int pending = 0;
+        for (int i = 0; i < count; ++i) {
+            pending += __atomic_load_n(&slots[i].state, __ATOMIC_ACQUIRE)
+                       == SLOT_REQUESTED;
+        }
+
+        if (!pending || elapsed_ms(&start) >= timeout_ms) {
+            break;
+        }
+
+        struct timespec delay = {0, POLL_NS};
+        nanosleep(&delay, NULL);
+    }
+
+    int stored = 0;
+    for (int i = 0; i < count; ++i) {
+        int state = __atomic_load_n(&slots[i].state, __ATOMIC_ACQUIRE);
+        if (state == SLOT_FREE) {
+            continue;
+        }
+
+        states[stored] = slots[i].thread;
+        states[stored].captured = state == SLOT_CAPTURED;
+        ++stored;
+    }
+
+    errno = saved_errno;
+
+    return stored;
+}
+
+void threads_resume() {
+    for (int i = 0; i < THREADS_MAX; ++i) {
+        __atomic_store_n(&slots[i].state, SLOT_FREE, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&resumed, __atomic_load_n(&generation, __ATOMIC_RELAXED),
+      __ATOMIC_RELEASE);
+    __atomic_store_n(&busy, 0, __ATOMIC_RELEASE);
+}
+
+void threads_state_from_context(struct thread_state *state, pid_t tid,
+  const void *context) {
+    const ucontext_t *uc = context;
+
+    memset(state, 0, sizeof(*state));
+    state->tid = tid;
+    state->captured = 1;
+
+#if defined(__x86_64__)
+    state->regs.pc = uc->uc_mcontext.gregs[REG_RIP];
+    state->regs.sp = uc->uc_mcontext.gregs[REG_RSP];
+    state->regs.fp = uc->uc_mcontext.gregs[REG_RBP];
+
+    state->nregs = NGREG;
+    for (int i = 0; i < NGREG; ++i) {
+        state->raw_regs[i] = uc->uc_mcontext.gregs[i];
+    }
+#elif defined(__aarch64__)
+    state->regs.pc = uc->uc_mcontext.pc;
+    state->regs.sp = uc->uc_mcontext.sp;
+    state->regs.fp = uc->uc_mcontext.regs[29];
+    state->regs.lr = uc->uc_mcontext.regs[30];
+
+    state->nregs = 34;
+    for (int i = 0; i < 31; ++i) {
+        state->raw_regs[i] = uc->uc_mcontext.regs[i];
+    }
+    state->raw_regs[31] = uc->uc_mcontext.sp;
+    state->raw_regs[32] = uc->uc_mcontext.pc;
+    state->raw_regs[33] = uc->uc_mcontext.pstate;
+#else
+    (void) uc;
+#endif
+}
+
+// private
+
+/*
+    Handler of stop signal.
+*/
+static
+void capture(int sig, siginfo_t *info, void *context) {
+    (void) sig;
+
+    // only threads_suspend() of this process may stop a thread
+    if (info->si_code != SI_TKILL || info->si_pid != getpid()) {
+        return;
+    }
+
+    int saved_errno = errno;
+
+    pid_t tid = syscall(SYS_gettid);
+    unsigned current = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < THREADS_MAX; ++i) {
+        struct slot *slot = &slots[i];
+        if (slot->thread.tid != tid || slot->generation != current
+            || __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE)
+               != SLOT_REQUESTED) {
+            continue;
+        }
+
+        threads_state_from_context(&slot->thread, tid, context);
+        __atomic_store_n(&slot->state, SLOT_CAPTURED, __ATOMIC_RELEASE);
+
+        while ((int) (__atomic_load_n(&resumed, __ATOMIC_ACQUIRE) - current)
+               < 0) {
+            struct timespec delay = {0, POLL_NS};
+            nanosleep(&delay, NULL);
+        }
+        break;
+    }
+
+    errno = saved_errno;
+}
+
+/*
+    Store ids of all threads but 'self' to 'slots'. getdents64() is used
+    directly, as opendir() allocates memory.
+
+    Returns number of threads or -1 on error.
+*/
+static
+int list_threads(pid_t self, int max) {
+    int fd = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct dirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+
+    int count = 0;
+    char buf[4096] __attribute__((aligned(8)));
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (long offset = 0; offset < n; ) {
+            const struct dirent64 *entry = (const void *) (buf + offset);
+            offset += entry->d_reclen;
+
+            pid_t tid = 0;
+            const char *p = entry->d_name;
+            for (; *p >= '0' && *p <= '9'; ++p) {
+                tid = tid * 10 + (*p - '0');
+            }
+
+            if (*p || !tid || tid == self || count == max) {
+                continue;
+            }
+
+            memset(&slots[count].thread, 0, sizeof(slots[count].thread));
+            slots[count].thread.tid = tid;
+            ++count;
+        }
+    }
+
+    close(fd);
+
+    return n < 0 ? -1 : count;
+}
+
+static
+long elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1000
+           + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
@@ -0,0 +1,69 @@
+#ifndef THREADS_H_INCLUDED
+#define THREADS_H_INCLUDED
+
+#include "cfi.h"
+
+#include <sys/types.h>
+
+/*
+    Stopping all threads of the process to inspect them, e.g. to dump them on
+    a crash. Threads are found in /proc/self/task and are sent a real-time
+    signal with tgkill(). Handler of that signal stores registers of the
+    interrupted code to a preallocated slot and waits until the threads are
+    resumed, so their stacks don't change meanwhile.
+
+    Everything here except threads_init() is async-signal-safe: it doesn't
+    allocate memory or take locks, so threads may be stopped from a crash
+    handler.
+
+    A thread that blocks the signal or is stuck in uninterruptible sleep
+    doesn't respond. It is reported with 'captured' equal to 0.
+*/
+
+#define THREADS_MAX 512
+
+// Raw registers as they are in ucontext: gregs on x86-64, x0-x30, sp, pc and
+// pstate on AArch64.
+#define THREADS_REGS_MAX 34
+
+struct thread_state {
+    pid_t tid;
+    int captured;
+    struct cfi_regs regs;   // registers that unwinding needs
+    int nregs;
+    uint64_t raw_regs[THREADS_REGS_MAX];
+};
+
+/*
+    Install handler of signal 'sig' (usually SIGRTMIN + n), which stopped
+    threads receive.
+
+    Returns 0 on success and -1 on error.
+*/
+int threads_init(int sig);
+
+/*
+    Stop all threads except the calling one and store their states to
+    'states'. Waits at most 'timeout_ms' for threads to respond. Only one
+    caller may stop threads at a time; threads_resume() must be called in the
+    end, unless process is about to terminate.
+
+    Returns number of threads stored (at most 'max'), or -1 if threads_init()
+    wasn't called, threads are already stopped by someone else or
+    /proc/self/task can't be read.
+*/
+int threads_suspend(struct thread_state *states, int max, int timeout_ms);
+
+/*
+    Let threads stopped by threads_suspend() go.
+*/
+void threads_resume();
+
+/*
+    Fill 'state' of the calling thread from signal handler's 'context'
+    (a ucontext_t *).
+*/
+void threads_state_from_context(struct thread_state *state, pid_t tid,
+  const void *context);
+
+#endif // THREADS_H_INCLUDED
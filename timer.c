@@ -2,13 +2,24 @@
 
 #include "log.h"
 #include "measure.h"
+#include "metrics.h"
+#include "probes.h"
+#include "tracebuf.h"
 
+#include <errno.h>
+#include <signal.h>
 #include <string.h>
+#include <unistd.h>
 
 static const long int NANOSECONDS_IN_SECOND = 1000000000;
 static const long int NANOSECONDS_IN_MILLISECOND = 1000000;
 static const long int MILLISECONDS_IN_SECOND = 1000;
 
+static const uint32_t TIMER_TABLE_MAGIC = 0x544d5442; // "TMTB"
+
+// metrics.h histogram of lateness, -1 until timer_register_metrics()
+static int late_metric = -1;
+
 static void valid_set(struct timer *timer);
 static void valid_unset(struct timer *timer);
 static int valid(const struct timer *timer);
@@ -16,6 +27,19 @@ static int valid(const struct timer *timer);
 static void initialized_set(struct timer *timer);
 static int initialized(const struct timer *timer);
 
+static int fired_set(const struct timer *timer);
+static void fired_unset(struct timer *timer);
+
+static void shared_mutex_init(pthread_mutex_t *mtx);
+static int robust_lock(pthread_mutex_t *mtx, void (*repair)(void *arg),
+  void *arg);
+static int timer_lock(struct timer *timer);
+static void timer_repair(void *arg);
+static void table_repair(void *arg);
+
+static struct timer_table_entry *table_find(struct timer_table *table,
+  uint32_t id);
+
 static int64_t timespec_to_ms(const struct timespec *t);
 static int timespec_cmp(const struct timespec *a, const struct timespec *b);
 
@@ -32,6 +56,17 @@ void timer_init(struct timer *timer) {
     pthread_mutex_init(&timer->lock, NULL);
 }
 
+void timer_init_shared(struct timer *timer) {
+    if (initialized(timer)) {
+        LOGW("%s(): timer is already initialized", __func__);
+        return;
+    }
+
+    timer->status = 0;
+    initialized_set(timer);
+    shared_mutex_init(&timer->lock);
+}
+
 void timer_destroy(struct timer *timer) {
     if (!initialized(timer)) {
         LOGW("%s(): timer is already deinitialized", __func__);
@@ -60,6 +95,7 @@ void timer_set(struct timer *timer, int64_t msec) {
         timer->deadline.tv_sec += 1;
     }
 
+    fired_unset(timer);
     valid_set(timer);
 }
 
@@ -97,7 +133,27 @@ int timer_expired(const struct timer *timer) {
 
     struct timespec now;
     clock_gettime(CLOCK_MONOTONIC, &now);
-    return timespec_cmp(&now, &timer->deadline) >= 0 ? 1 : 0;
+    if (timespec_cmp(&now, &timer->deadline) < 0) {
+        return 0;
+    }
+
+    // Expiry is reported by the first check that found the deadline passed,
+    // later polls only tell how long the timer has been expired. Reporting
+    // them would also flood the trace with duplicates of a busy-polled timer.
+    if (!fired_set(timer)) {
+        return 1;
+    }
+
+    PROBE3(dm, timer_expired, timer, timer->deadline.tv_sec,
+      timer->deadline.tv_nsec);
+
+    struct timespec late;
+    measure_diff(&timer->deadline, &now, &late);
+    tracebuf_record(TRACEBUF_TIMER, (uintptr_t) timer,
+      late.tv_sec * 1000000000ull + late.tv_nsec);
+    metrics_observe(__atomic_load_n(&late_metric, __ATOMIC_RELAXED),
+      late.tv_sec * 1000000ull + late.tv_nsec / 1000);
+    return 1;
 }
 
 int timer_valid(const struct timer *timer) {
@@ -108,6 +164,12 @@ void timer_invalidate(struct timer *timer) {
     valid_unset(timer);
 }
 
+void timer_register_metrics() {
+    int id = metrics_histogram("timer_late_us",
+      "How long past the deadline timer_expired() found timers, us");
+    __atomic_store_n(&late_metric, id, __ATOMIC_RELAXED);
+}
+
 // public locked
 
 void timer_set_locked(struct timer *timer, int64_t msec) {
@@ -116,7 +178,9 @@ void timer_set_locked(struct timer *timer, int64_t msec) {
         return;
     }
 
-    pthread_mutex_lock(&timer->lock);
+    if (timer_lock(timer)) {
+        return;
+    }
     timer_set(timer, msec);
     pthread_mutex_unlock(&timer->lock);
 }
@@ -127,7 +191,9 @@ int64_t timer_remaining_locked(struct timer *timer) {
         return -1;
     }
 
-    pthread_mutex_lock(&timer->lock);
+    if (timer_lock(timer)) {
+        return -1;
+    }
     int64_t result = timer_remaining(timer);
     pthread_mutex_unlock(&timer->lock);
 
@@ -140,7 +206,9 @@ int64_t timer_elapsed_locked(struct timer *timer) {
         return -1;
     }
 
-    pthread_mutex_lock(&timer->lock);
+    if (timer_lock(timer)) {
+        return -1;
+    }
     int64_t result = timer_elapsed(timer);
     pthread_mutex_unlock(&timer->lock);
 
@@ -153,7 +221,9 @@ int timer_expired_locked(struct timer *timer) {
         return -1;
     }
 
-    pthread_mutex_lock(&timer->lock);
+    if (timer_lock(timer)) {
+        return -1;
+    }
     int result = timer_expired(timer);
     pthread_mutex_unlock(&timer->lock);
 
@@ -166,7 +236,9 @@ int timer_valid_locked(struct timer *timer) {
         return -1;
     }
 
-    pthread_mutex_lock(&timer->lock);
+    if (timer_lock(timer)) {
+        return -1;
+    }
     int result = timer_valid(timer);
     pthread_mutex_unlock(&timer->lock);
 
@@ -179,16 +251,143 @@ void timer_invalidate_locked(struct timer *timer) {
         return;
     }
 
-    pthread_mutex_lock(&timer->lock);
+    if (timer_lock(timer)) {
+        return;
+    }
     timer_invalidate(timer);
     pthread_mutex_unlock(&timer->lock);
 }
 
+// public table
+
+struct timer_table *timer_table_init(void *mem, size_t size) {
+    if (size < TIMER_TABLE_SIZE(1)) {
+        LOGE("%s(): region of %zu bytes is too small", __func__, size);
+        return NULL;
+    }
+
+    struct timer_table *table = mem;
+    memset(table, 0, size);
+    table->capacity = (size - sizeof(struct timer_table))
+                    / sizeof(struct timer_table_entry);
+    shared_mutex_init(&table->lock);
+    table->magic = TIMER_TABLE_MAGIC;
+
+    return table;
+}
+
+struct timer_table *timer_table_attach(void *mem) {
+    struct timer_table *table = mem;
+    if (table->magic != TIMER_TABLE_MAGIC) {
+        LOGE("%s(): region %p doesn't contain timer table", __func__, mem);
+        return NULL;
+    }
+
+    return table;
+}
+
+struct timer *timer_table_get(struct timer_table *table, uint32_t id) {
+    if (!id) {
+        LOGE("%s(): id 0 is reserved", __func__);
+        return NULL;
+    }
+
+    if (robust_lock(&table->lock, table_repair, table)) {
+        return NULL;
+    }
+    struct timer_table_entry *entry = table_find(table, id);
+    pthread_mutex_unlock(&table->lock);
+
+    return entry ? &entry->timer : NULL;
+}
+
+struct timer *timer_table_add(struct timer_table *table, uint32_t id) {
+    if (!id) {
+        LOGE("%s(): id 0 is reserved", __func__);
+        return NULL;
+    }
+
+    if (robust_lock(&table->lock, table_repair, table)) {
+        return NULL;
+    }
+
+    struct timer_table_entry *entry = table_find(table, id);
+    if (!entry) {
+        entry = table_find(table, 0);
+        if (entry) {
+            memset(&entry->timer, 0, sizeof(entry->timer));
+            timer_init_shared(&entry->timer);
+            entry->owner = getpid();
+            entry->id = id;
+        }
+    }
+
+    pthread_mutex_unlock(&table->lock);
+
+    if (!entry) {
+        LOGE("%s(): table is full, can't add timer %u", __func__, id);
+        return NULL;
+    }
+
+    return &entry->timer;
+}
+
+void timer_table_remove(struct timer_table *table, uint32_t id) {
+    if (!id) {
+        return;
+    }
+
+    if (robust_lock(&table->lock, table_repair, table)) {
+        return;
+    }
+
+    struct timer_table_entry *entry = table_find(table, id);
+    if (entry) {
+        // Don't destroy the mutex: another process may hold it or wait on it.
+        // timer_table_add() reinitializes the slot from scratch anyway.
+        entry->timer.status = 0;
+        entry->id = 0;
+        entry->owner = 0;
+    }
+
+    pthread_mutex_unlock(&table->lock);
+}
+
+int timer_table_reap(struct timer_table *table) {
+    int reaped = 0;
+
+    if (robust_lock(&table->lock, table_repair, table)) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < table->capacity; ++i) {
+        struct timer_table_entry *entry = &table->entries[i];
+        if (!entry->id || kill(entry->owner, 0) == 0 || errno != ESRCH) {
+            continue;
+        }
+
+        LOGW("%s(): owner %d of timer %u is dead, removing timer", __func__,
+          (int) entry->owner, entry->id);
+
+        // Dead owner might have left the mutex locked, see
+        // timer_table_remove()
+        entry->timer.status = 0;
+        entry->id = 0;
+        entry->owner = 0;
+        ++reaped;
+    }
+
+    pthread_mutex_unlock(&table->lock);
+
+    return reaped;
+}
+
 // private
 
 enum {
     STATUS_VALID =       1 << 0,
-    STATUS_INITIALIZED = 1 << 1
+    STATUS_INITIALIZED = 1 << 1,
+    STATUS_FIRED =       1 << 2     // expiry of current deadline was observed
 };
 
 static
@@ -216,6 +415,122 @@ int initialized(const struct timer *timer) {
     return timer->status & STATUS_INITIALIZED;
 }
 
+/*
+    Mark expiry of the current deadline as observed. The mark isn't part of
+    timer's value, so it's set through a const pointer, atomically, since
+    several processes may poll a shared timer at once.
+
+    Returns 1 if the calling thread is the first to observe it.
+*/
+static
+int fired_set(const struct timer *timer) {
+    volatile int *status = (volatile int *) &timer->status;
+    return !(__atomic_fetch_or(status, STATUS_FIRED, __ATOMIC_RELAXED)
+             & STATUS_FIRED);
+}
+
+static
+void fired_unset(struct timer *timer) {
+    timer->status &= ~STATUS_FIRED;
+}
+
+static
+void shared_mutex_init(pthread_mutex_t *mtx) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef EOWNERDEAD
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+    pthread_mutex_init(mtx, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/*
+    Lock 'mtx'. If its previous owner died while holding it, 'repair' is called
+    with 'arg' to bring the data it protects back to a consistent state before
+    the mutex is marked consistent.
+
+    Returns 0 if the mutex is locked, or -1 if it can't be (e.g. it was left
+    unrecoverable by an earlier failure).
+*/
+static
+int robust_lock(pthread_mutex_t *mtx, void (*repair)(void *arg), void *arg) {
+    int rv = pthread_mutex_lock(mtx);
+#ifdef EOWNERDEAD
+    if (rv == EOWNERDEAD) {
+        repair(arg);
+        rv = pthread_mutex_consistent(mtx);
+        if (rv) {
+            LOGE("%s(): can't make mutex %p consistent: %s", __func__,
+              (void *) mtx, strerror(rv));
+            pthread_mutex_unlock(mtx);
+            return -1;
+        }
+        return 0;
+    }
+#endif
+    if (rv) {
+        LOGE("%s(): can't lock mutex %p: %s", __func__, (void *) mtx,
+          strerror(rv));
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+int timer_lock(struct timer *timer) {
+    return robust_lock(&timer->lock, timer_repair, timer);
+}
+
+static
+void timer_repair(void *arg) {
+    struct timer *timer = arg;
+
+    LOGW("%s(): owner of timer %p died holding it, invalidating timer",
+      __func__, (void *) timer);
+    valid_unset(timer);
+}
+
+/*
+    Free entries that a process dying in the middle of timer_table_add(),
+    timer_table_remove() or timer_table_reap() left half-written: with an id,
+    but without an owner or an initialized timer.
+*/
+static
+void table_repair(void *arg) {
+    struct timer_table *table = arg;
+    int repaired = 0;
+
+    for (uint32_t i = 0; i < table->capacity; ++i) {
+        struct timer_table_entry *entry = &table->entries[i];
+        if (!entry->id || (entry->owner > 0 && initialized(&entry->timer))) {
+            continue;
+        }
+
+        // Same as timer_table_reap(): the timer mutex may be left locked.
+        entry->timer.status = 0;
+        entry->id = 0;
+        entry->owner = 0;
+        ++repaired;
+    }
+
+    LOGW("%s(): owner of timer table %p died holding its lock, freed %d "
+      "inconsistent entries", __func__, (void *) table, repaired);
+}
+
+static
+struct timer_table_entry *table_find(struct timer_table *table, uint32_t id) {
+    for (uint32_t i = 0; i < table->capacity; ++i) {
+        if (table->entries[i].id == id) {
+            return &table->entries[i];
+        }
+    }
+
+    return NULL;
+}
+
 static
 int timespec_cmp(const struct timespec *a, const struct timespec *b) {
     if (a->tv_sec == b->tv_sec) {
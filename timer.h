@@ -4,6 +4,8 @@
 #include <pthread.h>
 #include <time.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
 
 /*
     timer - abstraction that allows to mark a deadline in future and verify
@@ -93,6 +95,22 @@ struct timer {
 */
 void timer_init(struct timer *timer);
 
+/*
+    Same as timer_init(), but makes a timer usable from several processes.
+    'timer' must point into a memory region shared between these processes
+    (e.g. MAP_SHARED mapping or shm_open()), and it must be initialized exactly
+    once, by one process, before others use it.
+
+    Mutex of such timer is process-shared and robust: if a process dies while
+    holding it, the next locked call recovers the mutex, prints a message to
+    log and invalidates the timer, since its state may be half-written. If the
+    mutex can't be recovered, locked calls print a message to log and fail.
+    CLOCK_MONOTONIC is system-wide, so deadlines mean the same in every process.
+
+    Use only locked methods with shared timers.
+*/
+void timer_init_shared(struct timer *timer);
+
 /*
     Destroy a timer and set it to invalid state. If timer is not initialized
     (wasn't initialized at all or was destroyed already), this will print a
@@ -160,11 +178,21 @@ int timer_valid(const struct timer *timer);
 */
 void timer_invalidate(struct timer *timer);
 
+/*
+    Register timer_late_us histogram in metrics.h: the first time
+    timer_expired() (or timer_expired_locked()) finds a deadline passed, it
+    records how long ago the deadline was, in microseconds. Later checks of
+    the same deadline record nothing, until timer_set() sets a new one. Until this is called, nothing is
+    recorded. metrics_http_start() calls it.
+*/
+void timer_register_metrics();
+
 
 /*
     All methods behave as their unlocked counterparts with a little exception: if
     timer is not initialized all methods print a message to log and methods that
-    return something also return -1 in this situation.
+    return something also return -1 in this situation. The same applies if the
+    timer mutex can't be locked (see timer_init_shared()).
 */
 
 void timer_set_locked(struct timer *timer, int64_t msec);
@@ -174,4 +202,105 @@ int timer_expired_locked(struct timer *timer);
 int timer_valid_locked(struct timer *timer);
 void timer_invalidate_locked(struct timer *timer);
 
+
+/*
+    timer_table - fixed-size table of shared timers addressed by numeric id,
+    e.g. a session timeout that several processes have to inspect. The table
+    lives entirely in a caller-provided shared memory region, so it contains no
+    pointers and may be mapped at different addresses by different processes.
+
+    Usage example:
+    <code>
+        size_t size = TIMER_TABLE_SIZE(64);
+        void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        struct timer_table *table = timer_table_init(mem, size);
+
+        // fork() workers here, or map the same shm_open() object in them and
+        // call timer_table_attach()
+
+        // in any process:
+        struct timer *session = timer_table_add(table, session_id);
+        timer_set_locked(session, 30000);
+
+        // in any other process:
+        struct timer *session = timer_table_get(table, session_id);
+        if (session && timer_expired_locked(session) == 1) {
+            ...
+        }
+    </code>
+
+    Every entry remembers pid of the process that added it. If that process
+    crashes, timer_table_reap() frees its entries. Table lock is robust just as
+    locks of shared timers are: if a process dies while holding it, the next
+    call frees entries it may have left half-written and prints a message to
+    log. If the lock can't be recovered, table calls fail.
+*/
+
+struct timer_table_entry {
+    uint32_t id;    // 0 - slot is free
+    pid_t owner;
+    struct timer timer;
+};
+
+struct timer_table {
+    uint32_t magic;
+    uint32_t capacity;
+    pthread_mutex_t lock;
+    struct timer_table_entry entries[];
+};
+
+/*
+    Size in bytes of a region required to hold table with 'capacity' timers.
+*/
+#define TIMER_TABLE_SIZE(capacity) (sizeof(struct timer_table) \
+    + (size_t) (capacity) * sizeof(struct timer_table_entry))
+
+/*
+    Initialize a table in memory region 'mem' of 'size' bytes. Capacity is
+    derived from 'size'. Must be called once, by one process.
+
+    Returns pointer to the table (same address as 'mem') or NULL if region is
+    too small to hold at least one timer.
+*/
+struct timer_table *timer_table_init(void *mem, size_t size);
+
+/*
+    Get a table that was initialized by another process in region 'mem'.
+
+    Returns pointer to the table or NULL if region doesn't contain a table.
+*/
+struct timer_table *timer_table_attach(void *mem);
+
+/*
+    Find a timer by 'id'. 'id' must not be 0.
+
+    Returns pointer to the timer or NULL if there is no timer with such id or on
+    error.
+*/
+struct timer *timer_table_get(struct timer_table *table, uint32_t id);
+
+/*
+    Find a timer by 'id' or add a new one in invalid state, owned by the calling
+    process. 'id' must not be 0.
+
+    Returns pointer to the timer or NULL if table is full or on error.
+*/
+struct timer *timer_table_add(struct timer_table *table, uint32_t id);
+
+/*
+    Remove a timer by 'id'. Pointers to it obtained earlier must not be used
+    anymore. Its mutex is left as it is rather than destroyed, so a process
+    that is in a locked call on it right now finishes safely. Does nothing if
+    there is no timer with such id.
+*/
+void timer_table_remove(struct timer_table *table, uint32_t id);
+
+/*
+    Remove timers whose owner processes do not exist anymore.
+
+    Returns number of removed timers or -1 on error.
+*/
+int timer_table_reap(struct timer_table *table);
+
 #endif // TIMER_H_INCLUDED
@@ -0,0 +1,377 @@
+/*
+    Benchmark of stack trace capture and symbolization.
+
+    Usage: bench [-t ms] [-b percent]
+
+    Measures on this host:
+    * cost of capturing a stack trace 8, 32 and 64 frames deep with every
+      unwinder (frame pointers, CFI, glibc's backtrace()), per trace and per
+      frame;
+    * cost of decoding a MIPS32 prologue per frame, scanning synthetic code
+      and hitting unwind cache;
+    * cost of resolving an address with dladdr(), the symtab reader and
+      DWARF lines, cold (including loading of the file) and warm, and with
+      symbolize() cache missed and hit;
+    * cost of print_stack_trace() end to end, logging to /dev/null.
+
+    Every benchmark runs for at least 't' ms (default 200). Finally it tells
+    how many traces per second every unwinder can capture within 'b' percent
+    of one CPU (default 1), which is what a sampling profiler or an alarm
+    may afford. Unwinders that find fewer frames than CFI are marked, e.g.
+    frame pointers in code built without them.
+*/
+
+#define _GNU_SOURCE
+
+#include "../backtrace.h"
+#include "../dwarfline.h"
+#include "../elfsym.h"
+#include "../log.h"
+#include "../symbolize.h"
+#include "../unwind_cache.h"
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <link.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_FRAMES 64
+#define EXE "/proc/self/exe"
+
+// Body of synthetic MIPS32 function, in instructions
+#define MIPS32_BODY 64
+
+typedef void (*bench_fn)(void *arg);
+
+struct unwinder {
+    const char *name;
+    int (*capture)(void **buffer, int size);
+};
+
+struct result {
+    double ns;
+    int frames;
+};
+
+static int glibc_backtrace(void **buffer, int size);
+
+static const struct unwinder unwinders[] = {
+    {"fp", backtrace_fp},
+    {"cfi", backtrace_cfi},
+    {"glibc", glibc_backtrace},
+};
+
+static const int depths[] = {8, 32, 64};
+
+#define UNWINDERS ((int) (sizeof(unwinders) / sizeof(unwinders[0])))
+#define DEPTHS ((int) (sizeof(depths) / sizeof(depths[0])))
+#define CFI 1
+
+static long min_ns = 200 * 1000000L;
+
+static void *frames[MAX_FRAMES];
+static int frames_count;
+
+// Address symbolized, and what warm benchmarks use
+static void *pc;
+static uintptr_t bias;
+static struct elfsym *symtab;
+static struct dwarfline *lines;
+
+static uint64_t now_ns();
+static double measure(bench_fn fn, void *arg);
+static double at_depth(int depth, bench_fn fn, void *arg);
+static void bench_capture(void *arg);
+static void bench_mips32_scan(void *arg);
+static void bench_mips32_cached(void *arg);
+static void bench_dladdr(void *arg);
+static void bench_elfsym_cold(void *arg);
+static void bench_elfsym_warm(void *arg);
+static void bench_dwarfline_cold(void *arg);
+static void bench_dwarfline_warm(void *arg);
+static void bench_symbolize_cold(void *arg);
+static void bench_symbolize_warm(void *arg);
+static void bench_print(void *arg);
+
+int main(int argc, char **argv) {
+    double budget = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:b:h")) != -1) {
+        switch (opt) {
+            case 't':
+                min_ns = atol(optarg) * 1000000L;
+                break;
+            case 'b':
+                budget = atof(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t ms] [-b percent]\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    // Frames below at_depth(0) - traces are that much deeper than requested
+    long saved_min_ns = min_ns;
+    min_ns = 0;
+    at_depth(0, bench_capture, (void *) &unwinders[CFI]);
+    min_ns = saved_min_ns;
+    int base = frames_count;
+
+    puts("Capture, ns per trace (per frame):");
+    printf("%-8s", "depth");
+    for (int d = 0; d < DEPTHS; ++d) {
+        printf("%20d", depths[d]);
+    }
+    putchar('\n');
+
+    struct result results[UNWINDERS][DEPTHS];
+    for (int u = 0; u < UNWINDERS; ++u) {
+        printf("%-8s", unwinders[u].name);
+        for (int d = 0; d < DEPTHS; ++d) {
+            struct result *result = &results[u][d];
+            result->ns = at_depth(depths[d] - base, bench_capture,
+              (void *) &unwinders[u]);
+            result->frames = frames_count;
+
+            char cell[32];
+            snprintf(cell, sizeof(cell), "%.0f (%.1f)", result->ns,
+              result->ns / (frames_count ? frames_count : 1));
+            printf("%20s", cell);
+        }
+        putchar('\n');
+    }
+
+    uint32_t code[3 + MIPS32_BODY] = {
+        0x3c1c0042,     // lui gp, 0x42
+        0x27bdffe0,     // addiu sp, sp, -32
+        0xafbf001c,     // sw ra, 28(sp)
+    };
+    printf("\nMIPS32 prologue, ns per frame: scan of %d instructions %.1f, "
+      "cached %.1f\n", MIPS32_BODY, measure(bench_mips32_scan, code),
+      measure(bench_mips32_cached, code));
+
+    Dl_info info;
+    struct link_map *map = NULL;
+    pc = (void *) main;
+    if (!dladdr1(pc, &info, (void **) &map, RTLD_DL_LINKMAP) || !map) {
+        fprintf(stderr, "can't find module of main()\n");
+        return 1;
+    }
+    bias = map->l_addr;
+    symtab = elfsym_open(EXE);
+    lines = dwarfline_open(EXE);
+
+    puts("\nSymbolization of an address, ns:");
+    printf("%-12s%14s%14s\n", "", "cold", "warm");
+    printf("%-12s%14s%14.0f\n", "dladdr", "", measure(bench_dladdr, NULL));
+    if (symtab) {
+        printf("%-12s%14.0f%14.0f\n", "symtab",
+          measure(bench_elfsym_cold, NULL), measure(bench_elfsym_warm, NULL));
+    } else {
+        printf("%-12s%14s\n", "symtab", "no symbols");
+    }
+    if (lines) {
+        printf("%-12s%14.0f%14.0f\n", "dwarf line",
+          measure(bench_dwarfline_cold, NULL),
+          measure(bench_dwarfline_warm, NULL));
+    } else {
+        printf("%-12s%14s\n", "dwarf line", "no debug info (build with -g)");
+    }
+    printf("%-12s%14.0f%14.0f\n", "symbolize",
+      measure(bench_symbolize_cold, NULL), measure(bench_symbolize_warm, NULL));
+
+    FILE *null = fopen("/dev/null", "w");
+    log_set_sink(LOG_SINK_FILE, null);
+    log_set_level(LOG_LEVEL_INFO);
+
+    printf("\nprint_stack_trace(), us:");
+    for (int d = 0; d < DEPTHS; ++d) {
+        printf("  depth %d %.1f", depths[d],
+          at_depth(depths[d] - base, bench_print, NULL) / 1000);
+    }
+    putchar('\n');
+
+    log_set_level(LOG_DISABLED);
+    fclose(null);
+
+    printf("\nTraces per second within %g%% of a CPU:\n", budget);
+    for (int u = 0; u < UNWINDERS; ++u) {
+        printf("%-8s", unwinders[u].name);
+        for (int d = 0; d < DEPTHS; ++d) {
+            printf("%12.0f", budget / 100 * 1e9 / results[u][d].ns);
+        }
+        for (int d = 0; d < DEPTHS; ++d) {
+            if (results[u][d].frames < results[CFI][d].frames) {
+                printf("  (finds %d of %d frames at depth %d)",
+                  results[u][d].frames, results[CFI][d].frames, depths[d]);
+                break;
+            }
+        }
+        putchar('\n');
+    }
+
+    // Deepest traces are what a profiler has to afford
+    int best = CFI;
+    for (int u = 0; u < UNWINDERS; ++u) {
+        if (results[u][DEPTHS - 1].frames >= results[CFI][DEPTHS - 1].frames
+            && results[u][DEPTHS - 1].ns < results[best][DEPTHS - 1].ns) {
+            best = u;
+        }
+    }
+    printf("Cheapest unwinder that finds all frames: %s\n", unwinders[best].name);
+
+    elfsym_close(symtab);
+    dwarfline_close(lines);
+    return 0;
+}
+
+// private
+
+static
+int glibc_backtrace(void **buffer, int size) {
+    return backtrace(buffer, size);
+}
+
+static
+uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/*
+    Run 'fn' in batches of growing size until a batch takes 'min_ns'.
+
+    Returns average duration of a call in nanoseconds.
+*/
+static
+double measure(bench_fn fn, void *arg) {
+    for (long count = 1; ; count *= 2) {
+        uint64_t start = now_ns();
+        for (long i = 0; i < count; ++i) {
+            fn(arg);
+        }
+        uint64_t elapsed = now_ns() - start;
+
+        if ((long) elapsed >= min_ns) {
+            return (double) elapsed / count;
+        }
+    }
+}
+
+/*
+    Measure 'fn' called 'depth' frames deeper than the caller.
+*/
+__attribute__((noinline))
+static
+double at_depth(int depth, bench_fn fn, void *arg) {
+    if (depth <= 0) {
+        return measure(fn, arg);
+    }
+
+    double result = at_depth(depth - 1, fn, arg);
+
+    // not a tail call, so that every level keeps its frame
+    __asm__ __volatile__ ("" : : "r"(&result) : "memory");
+    return result;
+}
+
+static
+void bench_capture(void *arg) {
+    const struct unwinder *unwinder = arg;
+    frames_count = unwinder->capture(frames, MAX_FRAMES);
+}
+
+static
+void bench_mips32_scan(void *arg) {
+    const uint32_t *code = arg;
+    int frame_size, ra_offset;
+    backtrace_mips32_decode(code + 2 + MIPS32_BODY, 3 + MIPS32_BODY,
+      &frame_size, &ra_offset);
+}
+
+static
+void bench_mips32_cached(void *arg) {
+    struct cfi_row row;
+    int found;
+    if (unwind_cache_get((uintptr_t) arg, &row, &found)) {
+        memset(&row, 0, sizeof(row));
+        unwind_cache_put((uintptr_t) arg, &row);
+    }
+}
+
+static
+void bench_dladdr(void *arg) {
+    (void) arg;
+
+    Dl_info info;
+    dladdr(pc, &info);
+}
+
+static
+void bench_elfsym_cold(void *arg) {
+    (void) arg;
+
+    struct elfsym *cold = elfsym_open(EXE);
+    uintptr_t address;
+    elfsym_lookup(cold, (uintptr_t) pc - bias, &address);
+    elfsym_close(cold);
+}
+
+static
+void bench_elfsym_warm(void *arg) {
+    (void) arg;
+
+    uintptr_t address;
+    elfsym_lookup(symtab, (uintptr_t) pc - bias, &address);
+}
+
+static
+void bench_dwarfline_cold(void *arg) {
+    (void) arg;
+
+    struct dwarfline *cold = dwarfline_open(EXE);
+    struct dwarfline_frame frame;
+    dwarfline_lookup(cold, (uintptr_t) pc - bias, &frame, 1);
+    dwarfline_close(cold);
+}
+
+static
+void bench_dwarfline_warm(void *arg) {
+    (void) arg;
+
+    struct dwarfline_frame frame;
+    dwarfline_lookup(lines, (uintptr_t) pc - bias, &frame, 1);
+}
+
+static
+void bench_symbolize_cold(void *arg) {
+    (void) arg;
+
+    // modules stay loaded, only the cache is dropped
+    symbolize_invalidate();
+
+    struct symbol symbol;
+    symbolize(pc, &symbol);
+}
+
+static
+void bench_symbolize_warm(void *arg) {
+    (void) arg;
+
+    struct symbol symbol;
+    symbolize(pc, &symbol);
+}
+
+static
+void bench_print(void *arg) {
+    (void) arg;
+
+    print_stack_trace(LOG_LEVEL_INFO);
+}
@@ -0,0 +1,304 @@
+/*
+    Converter of minidumps (see minidump.h) to text.
+
+    Usage: minidump [-m] [-s] dump
+
+    Prints signal, and registers and stack trace of every thread, in format
+    that tools/symbolize understands, so that the usual way to read a dump is
+
+        minidump crash.dmp | symbolize -p /path/to/binaries
+
+    Stack traces are the ones unwound at crash time. If unwinding found
+    nothing for a thread, its saved stack is walked with frame pointers here.
+    Frame #00 is the thread's PC, marked "(exact pc)".
+
+    -m  print /proc/self/maps of the process as well
+    -s  print hex dump of saved stack of every thread
+*/
+
+#include "../minidump.h"
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_THREADS 4096
+
+struct thread {
+    uint32_t tid;
+    const struct minidump_thread *regs;
+    uint64_t stack_address;
+    const uint8_t *stack;
+    size_t stack_size;
+    const uint64_t *frames;
+    size_t frames_count;
+};
+
+struct arch {
+    uint32_t machine;
+    const char *const *names;
+    int nregs;
+    int pc;
+    int fp;
+};
+
+static const char *const x86_64_names[] = {
+    "r8 ", "r9 ", "r10", "r11", "r12", "r13", "r14", "r15", "rdi", "rsi",
+    "rbp", "rbx", "rdx", "rax", "rcx", "rsp", "rip", "efl", "csgsfs", "err",
+    "trapno", "oldmask", "cr2",
+};
+
+static const char *const aarch64_names[] = {
+    "x0 ", "x1 ", "x2 ", "x3 ", "x4 ", "x5 ", "x6 ", "x7 ", "x8 ", "x9 ",
+    "x10", "x11", "x12", "x13", "x14", "x15", "x16", "x17", "x18", "x19",
+    "x20", "x21", "x22", "x23", "x24", "x25", "x26", "x27", "x28", "x29",
+    "x30", "sp ", "pc ", "pstate",
+};
+
+static const struct arch archs[] = {
+    {EM_X86_64, x86_64_names, 23, 16, 10},
+    {EM_AARCH64, aarch64_names, 34, 32, 29},
+};
+
+static struct thread threads[MAX_THREADS];
+static int threads_count;
+
+static struct thread *get_thread(uint32_t tid);
+static void print_thread(const struct arch *arch, const struct thread *thread,
+  int crashed, int hexdump);
+static size_t walk_stack(const struct arch *arch, const struct thread *thread,
+  uint64_t *pcs, size_t max);
+
+int main(int argc, char **argv) {
+    int print_maps = 0;
+    int hexdump = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "msh")) != -1) {
+        switch (opt) {
+            case 'm':
+                print_maps = 1;
+                break;
+            case 's':
+                hexdump = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-m] [-s] dump\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-m] [-s] dump\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[optind], "rb");
+    if (!in) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    uint8_t *data = malloc(size > 0 ? size : 1);
+    if (!data || size < (long) sizeof(struct minidump_header)
+        || fread(data, 1, size, in) != (size_t) size) {
+        fprintf(stderr, "%s: can't read dump\n", argv[optind]);
+        return 1;
+    }
+    fclose(in);
+
+    const struct minidump_header *header = (const void *) data;
+    if (memcmp(header->magic, MINIDUMP_MAGIC, sizeof(header->magic))
+        || header->version != MINIDUMP_VERSION) {
+        fprintf(stderr, "%s: not a minidump\n", argv[optind]);
+        return 1;
+    }
+
+    const struct arch *arch = NULL;
+    for (size_t i = 0; i < sizeof(archs) / sizeof(archs[0]); ++i) {
+        if (archs[i].machine == header->machine) {
+            arch = &archs[i];
+        }
+    }
+
+    // Text records are concatenated, so they are collected first
+    char *modules = calloc(1, size);
+    char *maps = calloc(1, size);
+    size_t modules_len = 0, maps_len = 0;
+    int complete = 0;
+
+    size_t offset = sizeof(*header);
+    while (offset + sizeof(struct minidump_record) <= (size_t) size) {
+        const struct minidump_record *record = (const void *) (data + offset);
+        const uint8_t *payload = data + offset + sizeof(*record);
+        offset += sizeof(*record) + record->size;
+        if (offset > (size_t) size) {
+            break;
+        }
+
+        struct thread *thread = record->tid ? get_thread(record->tid) : NULL;
+
+        switch (record->type) {
+            case MINIDUMP_END:
+                complete = 1;
+                break;
+            case MINIDUMP_THREAD:
+                if (thread && record->size >= sizeof(*thread->regs)) {
+                    thread->regs = (const void *) payload;
+                }
+                break;
+            case MINIDUMP_STACK:
+                if (thread && record->size >= sizeof(struct minidump_stack)) {
+                    const struct minidump_stack *stack = (const void *) payload;
+                    thread->stack_address = stack->address;
+                    thread->stack = payload + sizeof(*stack);
+                    thread->stack_size = record->size - sizeof(*stack);
+                }
+                break;
+            case MINIDUMP_FRAMES:
+                if (thread) {
+                    thread->frames = (const void *) payload;
+                    thread->frames_count = record->size / sizeof(uint64_t);
+                }
+                break;
+            case MINIDUMP_MODULES:
+                memcpy(modules + modules_len, payload, record->size);
+                modules_len += record->size;
+                break;
+            case MINIDUMP_MAPS:
+                memcpy(maps + maps_len, payload, record->size);
+                maps_len += record->size;
+                break;
+        }
+    }
+
+    printf("*** Minidump: signal %d, code %d, fault address %#llx\n",
+      header->signal, header->code,
+      (unsigned long long) header->fault_address);
+    printf("pid %u, crashed thread %u, %d threads%s\n", header->pid,
+      header->tid, threads_count, complete ? "" : " (dump is incomplete)");
+    if (!arch) {
+        printf("Unknown machine %u: registers are not shown\n",
+          header->machine);
+    }
+
+    fwrite(modules, 1, modules_len, stdout);
+    if (print_maps) {
+        printf("Memory map:\n");
+        fwrite(maps, 1, maps_len, stdout);
+    }
+
+    for (int i = 0; i < threads_count; ++i) {
+        print_thread(arch, &threads[i], threads[i].tid == header->tid,
+          hexdump);
+    }
+
+    return complete ? 0 : 2;
+}
+
+static
+struct thread *get_thread(uint32_t tid) {
+    for (int i = 0; i < threads_count; ++i) {
+        if (threads[i].tid == tid) {
+            return &threads[i];
+        }
+    }
+
+    if (threads_count == MAX_THREADS) {
+        return NULL;
+    }
+
+    struct thread *thread = &threads[threads_count++];
+    thread->tid = tid;
+
+    return thread;
+}
+
+static
+void print_thread(const struct arch *arch, const struct thread *thread,
+  int crashed, int hexdump) {
+    printf("Thread %u%s:\n", thread->tid, crashed ? " (crashed)" : "");
+
+    if (!thread->regs || !thread->regs->captured) {
+        printf("\tdidn't respond, state unknown\n");
+        return;
+    }
+
+    if (arch && (int) thread->regs->nregs == arch->nregs) {
+        printf("Registers:\n");
+        for (int i = 0; i < arch->nregs; ++i) {
+            printf("%s%s 0x%016llx", i % 3 ? "  " : "\t", arch->names[i],
+              (unsigned long long) thread->regs->regs[i]);
+            if (i % 3 == 2 || i == arch->nregs - 1) {
+                putchar('\n');
+            }
+        }
+    }
+
+    uint64_t walked[64];
+    const uint64_t *pcs = thread->frames;
+    size_t count = thread->frames_count;
+    if (count <= 1 && arch) {
+        count = walk_stack(arch, thread, walked, 64);
+        pcs = walked;
+    }
+
+    printf("Raw stack trace: %zu frames (module map 0)\n", count);
+    for (size_t i = 0; i < count; ++i) {
+        printf("\t#%02zu %#llx%s\n", i, (unsigned long long) pcs[i],
+          i ? "" : " (exact pc)");
+    }
+
+    if (hexdump && thread->stack_size) {
+        printf("Stack:\n");
+        for (size_t i = 0; i + 8 <= thread->stack_size; i += 8) {
+            uint64_t word;
+            memcpy(&word, thread->stack + i, sizeof(word));
+            printf("\t%#llx: %016llx\n",
+              (unsigned long long) (thread->stack_address + i),
+              (unsigned long long) word);
+        }
+    }
+}
+
+/*
+    Walk frame records in saved stack, starting from frame pointer register.
+    Works if code was built with frame pointers.
+*/
+static
+size_t walk_stack(const struct arch *arch, const struct thread *thread,
+  uint64_t *pcs, size_t max) {
+    if ((int) thread->regs->nregs != arch->nregs) {
+        return 0;
+    }
+
+    size_t count = 0;
+    pcs[count++] = thread->regs->regs[arch->pc];
+
+    uint64_t fp = thread->regs->regs[arch->fp];
+    uint64_t lo = thread->stack_address;
+    uint64_t hi = lo + thread->stack_size;
+
+    while (count < max && fp >= lo && fp + 16 <= hi && !(fp & 7)) {
+        uint64_t next, ra;
+        memcpy(&next, thread->stack + (fp - lo), sizeof(next));
+        memcpy(&ra, thread->stack + (fp - lo) + 8, sizeof(ra));
+        if (!ra) {
+            break;
+        }
+
+        pcs[count++] = ra;
+        if (next <= fp) {
+            break;
+        }
+        fp = next;
+    }
+
+    return count;
+}
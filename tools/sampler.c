@@ -0,0 +1,757 @@
+/*
+    Sampling profiler and stack dumper of another process, built on cfi.h.
+
+    Usage: sampler [-C] [-f hz] [-d seconds] pid
+
+    Without -f, takes one snapshot of all threads of 'pid' and prints their
+    stack traces with function, offset and source line of every frame. With
+    -f, samples all threads 'hz' times a second for 'seconds' (default 10,
+    Ctrl-C stops earlier) and prints folded stacks, one line per unique stack
+    with the number of its samples, as flamegraph.pl takes them:
+
+    worker;start_thread;run;process;parse 42
+
+    A thread is stopped only while its registers are read and the top
+    STACK_COPY bytes of its stack are copied with process_vm_readv(): threads
+    are attached with PTRACE_SEIZE, which doesn't stop them, stopped with
+    PTRACE_INTERRUPT and resumed right after the copy is made. Unwinding and
+    symbolization are done afterwards, from the copy, with CFI and symbols
+    loaded from module files (through /proc/pid/root, so containers work).
+    Frames without CFI (e.g. of vDSO) are walked with frame pointers, and
+    unwinding stops at the end of the copy. With -C, C++ names are demangled.
+
+    Needs permission to ptrace the process (same user and ptrace_scope 0, or
+    CAP_SYS_PTRACE). Supported architectures are those of cfi.h.
+*/
+
+#define _GNU_SOURCE
+
+#include "../cfi.h"
+#include "../dwarfline.h"
+#include "../elfsym.h"
+#include "../symbolize.h"
+
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__aarch64__)
+# include <asm/ptrace.h>
+#endif
+
+#define STACK_COPY (128 * 1024)
+#define MAX_FRAMES 128
+#define MAX_THREADS 4096
+#define MAX_MODULES 1024
+#define FOLDED_BUCKETS 4096
+#define FOLDED_MAX 16384
+
+struct module {
+    char *path;             // as in /proc/pid/maps
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t bias;
+    struct cfi_image *cfi;
+    int loaded;             // symbols below were looked for
+    struct elfsym *symtab;
+    struct dwarfline *lines;
+};
+
+struct thread {
+    pid_t tid;
+    int attached;
+    char name[16];
+};
+
+// Snapshot of a stopped thread
+struct sample {
+    struct cfi_regs regs;
+    uintptr_t stack;        // address of stack[0] in the target
+    size_t stack_len;
+    uint8_t stack_copy[STACK_COPY];
+};
+
+struct folded {
+    struct folded *next;
+    unsigned long count;
+    char stack[];
+};
+
+static pid_t pid;
+
+static struct module modules[MAX_MODULES];
+static int modules_count;
+static int modules_refreshed;   // in the current round
+
+static struct thread threads[MAX_THREADS];
+static int threads_count;
+
+static struct folded *folded[FOLDED_BUCKETS];
+static int folded_count;
+
+// Source lines are needed only for snapshots
+static int with_lines;
+
+static volatile sig_atomic_t interrupted;
+
+static void on_signal(int signo);
+static int refresh_modules();
+static int file_bias(const char *path, uintptr_t start, uintptr_t offset,
+  uintptr_t *bias);
+static struct module *find_module(uintptr_t pc);
+static int find_row(void *arg, uintptr_t pc, struct cfi_row *row);
+static int read_stack(void *arg, uintptr_t addr, uintptr_t *value);
+static int list_threads();
+static int take_sample(struct thread *thread, struct sample *sample);
+static int stop_thread(pid_t tid, int *listen);
+static int get_regs(pid_t tid, struct cfi_regs *regs);
+static int unwind(struct sample *sample, void **frames);
+static void load_symbols(struct module *module);
+static void print_trace(const struct thread *thread, void **frames,
+  int count);
+static void add_folded(const struct thread *thread, void **frames,
+  int count);
+static void print_folded();
+static int folded_cmp(const void *a, const void *b);
+static uint64_t now_ns();
+
+int main(int argc, char **argv) {
+    unsigned hz = 0;
+    double duration = 10;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "Cf:d:h")) != -1) {
+        switch (opt) {
+            case 'C':
+                symbolize_set_demangle(SYMBOLIZE_DEMANGLE_FULL, 0);
+                break;
+            case 'f':
+                hz = atoi(optarg);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-C] [-f hz] [-d seconds] pid\n",
+                  argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1 || (pid = atoi(argv[optind])) <= 0) {
+        fprintf(stderr, "Usage: %s [-C] [-f hz] [-d seconds] pid\n", argv[0]);
+        return 1;
+    }
+
+    if (refresh_modules()) {
+        fprintf(stderr, "can't read modules of %d: %s\n", pid,
+          strerror(errno));
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    struct sample *sample = malloc(sizeof(struct sample));
+    if (!sample) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    with_lines = !hz;
+
+    uint64_t period_ns = hz ? 1000000000ull / hz : 0;
+    uint64_t start_ns = now_ns();
+    uint64_t end_ns = start_ns + (uint64_t) (duration * 1e9);
+    uint64_t stopped_ns = 0;
+    unsigned long samples = 0;
+    unsigned long rounds = 0;
+
+    do {
+        modules_refreshed = 0;
+        if (list_threads()) {
+            fprintf(stderr, "can't list threads of %d: %s\n", pid,
+              strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < threads_count && !interrupted; ++i) {
+            uint64_t stop_ns = now_ns();
+            if (take_sample(&threads[i], sample)) {
+                continue;
+            }
+            stopped_ns += now_ns() - stop_ns;
+            ++samples;
+
+            void *frames[MAX_FRAMES];
+            int count = unwind(sample, frames);
+            if (hz) {
+                add_folded(&threads[i], frames, count);
+            } else {
+                print_trace(&threads[i], frames, count);
+            }
+        }
+        ++rounds;
+
+        // Rounds are scheduled at fixed times, so that slow ones don't shift
+        // the rest
+        uint64_t next_ns = start_ns + rounds * period_ns;
+        if (hz && next_ns < end_ns) {
+            struct timespec next;
+            next.tv_sec = next_ns / 1000000000ull;
+            next.tv_nsec = next_ns % 1000000000ull;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        }
+    } while (hz && !interrupted && now_ns() < end_ns);
+
+    if (hz) {
+        print_folded();
+    }
+
+    if (samples) {
+        fprintf(stderr, "%lu samples in %lu rounds, threads stopped for "
+          "%.1f us per sample\n", samples, rounds,
+          (double) stopped_ns / samples / 1000);
+    }
+
+    // Exiting detaches from all threads
+    return samples ? 0 : 1;
+}
+
+// private
+
+static
+void on_signal(int signo) {
+    (void) signo;
+    interrupted = 1;
+}
+
+/*
+    Read /proc/pid/maps and add modules that aren't known yet. Modules are
+    never removed, and newer ones are looked up first, so addresses of an
+    unloaded library that are reused by another one resolve to the latter.
+*/
+static
+int refresh_modules() {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+    FILE *maps = fopen(path, "re");
+    if (!maps) {
+        return -1;
+    }
+
+    struct module *last = NULL;
+    char line[PATH_MAX + 128];
+    while (fgets(line, sizeof(line), maps)) {
+        unsigned long start, end, offset;
+        int n = 0;
+        if (sscanf(line, "%lx-%lx %*s %lx %*s %*s %n", &start, &end, &offset,
+              &n) < 3 || !n || line[n] != '/') {
+            last = NULL;
+            continue;
+        }
+
+        char *name = line + n;
+        name[strcspn(name, "\n")] = '\0';
+        if (strstr(name, " (deleted)")) {
+            last = NULL;
+            continue;
+        }
+
+        // Mappings of a module are adjacent
+        if (last && !strcmp(last->path, name)) {
+            if (end > last->end) {
+                last->end = end;
+            }
+            continue;
+        }
+
+        last = NULL;
+        for (int i = 0; i < modules_count; ++i) {
+            if (modules[i].start == start && !strcmp(modules[i].path, name)) {
+                last = &modules[i];
+                break;
+            }
+        }
+        if (last || modules_count == MAX_MODULES) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/proc/%d/root%s", pid, name);
+        uintptr_t bias;
+        if (file_bias(path, start, offset, &bias)) {
+            continue;
+        }
+
+        last = &modules[modules_count++];
+        memset(last, 0, sizeof(*last));
+        last->path = strdup(name);
+        last->start = start;
+        last->end = end;
+        last->bias = bias;
+        last->cfi = cfi_image_open(path, bias);
+    }
+
+    fclose(maps);
+    return 0;
+}
+
+/*
+    Find load bias of ELF file at 'path' from its mapping at 'start' of file
+    'offset': the PT_LOAD segment mapped there tells its link-time address.
+*/
+static
+int file_bias(const char *path, uintptr_t start, uintptr_t offset,
+  uintptr_t *bias) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ElfW(Ehdr) ehdr;
+    ElfW(Phdr) phdrs[64];
+    int rv = -1;
+
+    if (pread(fd, &ehdr, sizeof(ehdr), 0) == sizeof(ehdr)
+        && !memcmp(ehdr.e_ident, ELFMAG, SELFMAG)
+        && ehdr.e_ident[EI_CLASS] == __ELF_NATIVE_CLASS / 32
+        && ehdr.e_phentsize == sizeof(ElfW(Phdr))
+        && ehdr.e_phnum <= 64) {
+        ssize_t size = ehdr.e_phnum * sizeof(ElfW(Phdr));
+        if (pread(fd, phdrs, size, ehdr.e_phoff) == size) {
+            uintptr_t page = sysconf(_SC_PAGESIZE);
+            for (int i = 0; i < ehdr.e_phnum; ++i) {
+                if (phdrs[i].p_type == PT_LOAD
+                    && (phdrs[i].p_offset & ~(page - 1)) == offset) {
+                    *bias = start - (phdrs[i].p_vaddr & ~(page - 1));
+                    rv = 0;
+                    break;
+                }
+            }
+        }
+    }
+
+    close(fd);
+    return rv;
+}
+
+static
+struct module *find_module(uintptr_t pc) {
+    for (int i = modules_count - 1; i >= 0; --i) {
+        if (pc >= modules[i].start && pc < modules[i].end) {
+            return &modules[i];
+        }
+    }
+
+    // A library may have been loaded since, look once per round
+    if (!modules_refreshed) {
+        modules_refreshed = 1;
+        int count = modules_count;
+        refresh_modules();
+        for (int i = modules_count - 1; i >= count; --i) {
+            if (pc >= modules[i].start && pc < modules[i].end) {
+                return &modules[i];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static
+int find_row(void *arg, uintptr_t pc, struct cfi_row *row) {
+    (void) arg;
+
+    const struct module *module = find_module(pc);
+    if (!module || !module->cfi) {
+        return -1;
+    }
+
+    return cfi_image_find_row(module->cfi, pc, row);
+}
+
+static
+int read_stack(void *arg, uintptr_t addr, uintptr_t *value) {
+    const struct sample *sample = arg;
+
+    if (addr < sample->stack || addr - sample->stack > sample->stack_len
+        || sample->stack_len - (addr - sample->stack) < sizeof(uintptr_t)) {
+        return -1;
+    }
+
+    memcpy(value, sample->stack_copy + (addr - sample->stack),
+      sizeof(uintptr_t));
+    return 0;
+}
+
+/*
+    Update 'threads' from /proc/pid/task, attaching to new threads. Threads
+    that are gone are dropped.
+*/
+static
+int list_threads() {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+
+    static struct thread listed[MAX_THREADS];
+    int count = 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) && count < MAX_THREADS) {
+        pid_t tid = atoi(entry->d_name);
+        if (tid <= 0) {
+            continue;
+        }
+
+        struct thread *thread = &listed[count++];
+        memset(thread, 0, sizeof(*thread));
+        thread->tid = tid;
+        for (int i = 0; i < threads_count; ++i) {
+            if (threads[i].tid == tid) {
+                *thread = threads[i];
+                break;
+            }
+        }
+
+        // Name may change any time, it's reread every round
+        snprintf(path, sizeof(path), "/proc/%d/task/%d/comm", pid, tid);
+        FILE *comm = fopen(path, "re");
+        if (comm) {
+            if (fgets(thread->name, sizeof(thread->name), comm)) {
+                thread->name[strcspn(thread->name, "\n")] = '\0';
+            }
+            fclose(comm);
+        }
+
+        if (!thread->attached) {
+            if (ptrace(PTRACE_SEIZE, tid, NULL, NULL)) {
+                if (errno == EPERM) {
+                    closedir(dir);
+                    return -1;
+                }
+                --count;    // exited meanwhile
+                continue;
+            }
+            thread->attached = 1;
+        }
+    }
+
+    closedir(dir);
+
+    memcpy(threads, listed, count * sizeof(struct thread));
+    threads_count = count;
+    return 0;
+}
+
+/*
+    Stop thread, copy its registers and top of its stack, and resume it.
+*/
+static
+int take_sample(struct thread *thread, struct sample *sample) {
+    int listen;
+    if (stop_thread(thread->tid, &listen)) {
+        return -1;
+    }
+
+    int rv = get_regs(thread->tid, &sample->regs);
+    if (!rv) {
+        sample->stack = sample->regs.sp & ~(uintptr_t) (sizeof(uintptr_t) - 1);
+
+        struct iovec local = {sample->stack_copy, STACK_COPY};
+        struct iovec remote = {(void *) sample->stack, STACK_COPY};
+
+        // Read is partial if stack ends within STACK_COPY
+        ssize_t len = process_vm_readv(thread->tid, &local, 1, &remote, 1, 0);
+        sample->stack_len = len > 0 ? len : 0;
+    }
+
+    // Threads in group-stop (e.g. by SIGSTOP) are left stopped
+    ptrace(listen ? PTRACE_LISTEN : PTRACE_CONT, thread->tid, NULL, NULL);
+    return rv;
+}
+
+/*
+    Interrupt seized thread and wait until it stops. Signals that arrive
+    before are delivered to it. 'listen' is set if the thread has stopped for
+    group-stop, rather than for the interrupt.
+*/
+static
+int stop_thread(pid_t tid, int *listen) {
+    if (ptrace(PTRACE_INTERRUPT, tid, NULL, NULL)) {
+        return -1;
+    }
+
+    for (;;) {
+        int status;
+        if (waitpid(tid, &status, __WALL) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        if (!WIFSTOPPED(status)) {
+            return -1;      // exited
+        }
+
+        if (status >> 16 == PTRACE_EVENT_STOP) {
+            int sig = WSTOPSIG(status);
+            *listen = sig == SIGSTOP || sig == SIGTSTP || sig == SIGTTIN
+                      || sig == SIGTTOU;
+            return 0;
+        }
+
+        // Signal-delivery-stop: pass the signal, interrupt stop comes next
+        int sig = status >> 16 ? 0 : WSTOPSIG(status);
+        if (ptrace(PTRACE_CONT, tid, NULL, (void *) (uintptr_t) sig)) {
+            return -1;
+        }
+    }
+}
+
+static
+int get_regs(pid_t tid, struct cfi_regs *regs) {
+#if defined(__x86_64__)
+    struct user_regs_struct user;
+    struct iovec iov = {&user, sizeof(user)};
+    if (ptrace(PTRACE_GETREGSET, tid, (void *) NT_PRSTATUS, &iov)) {
+        return -1;
+    }
+
+    regs->pc = user.rip;
+    regs->sp = user.rsp;
+    regs->fp = user.rbp;
+    regs->lr = 0;
+    return 0;
+#elif defined(__aarch64__)
+    struct user_pt_regs user;
+    struct iovec iov = {&user, sizeof(user)};
+    if (ptrace(PTRACE_GETREGSET, tid, (void *) NT_PRSTATUS, &iov)) {
+        return -1;
+    }
+
+    regs->pc = user.pc;
+    regs->sp = user.sp;
+    regs->fp = user.regs[29];
+    regs->lr = user.regs[30];
+    return 0;
+#else
+    (void) tid;
+    (void) regs;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+    Store PC of the sampled thread and return addresses of its callers to
+    'frames'. Returns number of frames.
+*/
+static
+int unwind(struct sample *sample, void **frames) {
+    frames[0] = (void *) sample->regs.pc;
+
+    return 1 + cfi_unwind_with(&sample->regs, find_row, NULL, read_stack,
+                               sample, frames + 1, MAX_FRAMES - 1);
+}
+
+static
+void load_symbols(struct module *module) {
+    if (module->loaded) {
+        return;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/proc/%d/root%s", pid, module->path);
+    module->symtab = elfsym_open(path);
+    if (with_lines) {
+        module->lines = dwarfline_open(path);
+    }
+    module->loaded = 1;
+}
+
+static
+void print_trace(const struct thread *thread, void **frames, int count) {
+    printf("Thread %d (%s):\n", thread->tid, thread->name);
+
+    for (int i = 0; i < count; ++i) {
+        uintptr_t pc = (uintptr_t) frames[i];
+        struct module *module = find_module(pc);
+        if (!module) {
+            printf("\t#%02d %#lx\n", i, (unsigned long) pc);
+            continue;
+        }
+
+        load_symbols(module);
+
+        uintptr_t addr = pc - module->bias;
+
+        // Return addresses: function and line of the call are reported
+        uintptr_t lookup = i ? addr - 1 : addr;
+        uintptr_t sym_addr;
+        const char *name = module->symtab
+                           ? elfsym_lookup(module->symtab, lookup, &sym_addr)
+                           : NULL;
+
+        struct dwarfline_frame lines[16];
+        int lines_count = module->lines
+                          ? dwarfline_lookup(module->lines, lookup, lines, 16)
+                          : 0;
+
+        if (name) {
+            printf("\t#%02d %#lx %s(%s+%#lx)", i, (unsigned long) pc,
+              module->path, symbolize_demangle(name),
+              (unsigned long) (addr - sym_addr));
+        } else {
+            printf("\t#%02d %#lx %s(+%#lx)", i, (unsigned long) pc,
+              module->path, (unsigned long) addr);
+        }
+
+        if (lines_count) {
+            const struct dwarfline_frame *line = &lines[lines_count - 1];
+            printf(" %s:%u", line->file ? line->file : "??", line->line);
+        }
+        putchar('\n');
+
+        for (int j = 0; j < lines_count - 1; ++j) {
+            printf("\t    inlined %s at %s:%u\n",
+              lines[j].function ? lines[j].function : "??",
+              lines[j].file ? lines[j].file : "??", lines[j].line);
+        }
+    }
+
+    putchar('\n');
+}
+
+/*
+    Count stack in 'folded', as thread name followed by function names from
+    the outermost frame, separated by ';'. Frames without symbols are named
+    by module and offset.
+*/
+static
+void add_folded(const struct thread *thread, void **frames, int count) {
+    char stack[MAX_FRAMES * 64];
+    size_t len = snprintf(stack, sizeof(stack), "%s",
+                          thread->name[0] ? thread->name : "?");
+
+    for (int i = count - 1; i >= 0 && len < sizeof(stack); --i) {
+        uintptr_t pc = (uintptr_t) frames[i];
+        struct module *module = find_module(pc);
+        const char *name = NULL;
+        uintptr_t addr = pc, sym_addr;
+
+        if (module) {
+            load_symbols(module);
+            addr = pc - module->bias;
+            if (module->symtab) {
+                name = elfsym_lookup(module->symtab, i ? addr - 1 : addr,
+                                     &sym_addr);
+            }
+        }
+
+        if (name) {
+            len += snprintf(stack + len, sizeof(stack) - len, ";%s",
+                            symbolize_demangle(name));
+        } else if (module) {
+            const char *base = strrchr(module->path, '/');
+            len += snprintf(stack + len, sizeof(stack) - len, ";%s+%#lx",
+                            base + 1, (unsigned long) addr);
+        } else {
+            len += snprintf(stack + len, sizeof(stack) - len, ";%#lx",
+                            (unsigned long) pc);
+        }
+    }
+
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const char *c = stack; *c; ++c) {
+        hash = (hash ^ (uint8_t) *c) * 16777619u;
+    }
+
+    struct folded **bucket = &folded[hash % FOLDED_BUCKETS];
+    for (struct folded *entry = *bucket; entry; entry = entry->next) {
+        if (!strcmp(entry->stack, stack)) {
+            ++entry->count;
+            return;
+        }
+    }
+
+    if (folded_count == FOLDED_MAX) {
+        return;
+    }
+
+    struct folded *entry = malloc(sizeof(struct folded) + strlen(stack) + 1);
+    if (!entry) {
+        return;
+    }
+
+    strcpy(entry->stack, stack);
+    entry->count = 1;
+    entry->next = *bucket;
+    *bucket = entry;
+    ++folded_count;
+}
+
+/*
+    Print folded stacks, most frequent first.
+*/
+static
+void print_folded() {
+    struct folded **entries = malloc(folded_count * sizeof(struct folded *) + 1);
+    if (!entries) {
+        return;
+    }
+
+    int count = 0;
+    for (int i = 0; i < FOLDED_BUCKETS; ++i) {
+        for (struct folded *entry = folded[i]; entry; entry = entry->next) {
+            entries[count++] = entry;
+        }
+    }
+
+    qsort(entries, count, sizeof(struct folded *), folded_cmp);
+    for (int i = 0; i < count; ++i) {
+        printf("%s %lu\n", entries[i]->stack, entries[i]->count);
+    }
+
+    free(entries);
+}
+
+static
+int folded_cmp(const void *a, const void *b) {
+    const struct folded *x = *(const struct folded *const *) a;
+    const struct folded *y = *(const struct folded *const *) b;
+
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return strcmp(x->stack, y->stack);
+}
+
+static
+uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
@@ -0,0 +1,342 @@
+/*
+    Offline symbolizer of raw stack traces, see print_stack_trace_raw() in
+    backtrace.h and modmap.h.
+
+    Usage: symbolize [-C] [-p dir]... [-d debug_dir] [log]
+
+    Reads log (or stdin) and prints it to stdout, appending function, offset
+    and source line to every frame of raw stack traces, and listing inlined
+    functions below it. Frames are return addresses, so the call before them
+    is looked up, except frames marked "(exact pc)" (of crashes and
+    minidumps). Binaries are looked up in every 'dir' given with -p,
+    first by their full path (as in a sysroot), then by name only, and
+    finally at the path they were loaded from. A binary is used only if its
+    build-id matches the one in module map, so stale builds are never used.
+    Stripped binaries get source lines too, if their separate debug files are
+    in 'debug_dir' (default /usr/lib/debug), see dwarfline.h. With -C, C++
+    names are demangled.
+*/
+
+#define _GNU_SOURCE
+
+#include "../dwarfline.h"
+#include "../elfsym.h"
+#include "../modmap.h"
+#include "../symbolize.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_DIRS 16
+#define MAX_MAPS 64
+#define MAX_MODULES 128
+#define MAX_FILES 256
+
+struct module {
+    struct modmap_entry entry;
+    struct file *file;      // NULL until first lookup
+};
+
+struct map {
+    int number;
+    int count;
+    struct module modules[MAX_MODULES];
+};
+
+// Binary found for a module, shared by all maps that mention the module
+struct file {
+    char *path;             // as in module map
+    uint8_t build_id[MODMAP_BUILD_ID_MAX];
+    size_t build_id_len;
+    struct elfsym *symtab;
+    struct dwarfline *lines;
+};
+
+static const char *dirs[MAX_DIRS];
+static int dirs_count;
+
+static struct map *maps[MAX_MAPS];
+static int maps_count;
+
+static struct file files[MAX_FILES];
+static int files_count;
+
+static struct map *get_map(int number, int reset);
+static int parse_module(const char *s, struct modmap_entry *entry);
+static void print_frame(struct map *map, const char *line, uintptr_t pc,
+  int exact);
+static struct file *find_file(const struct modmap_entry *entry);
+static int match_file(const char *path, const struct modmap_entry *entry);
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "Cp:d:h")) != -1) {
+        switch (opt) {
+            case 'C':
+                symbolize_set_demangle(SYMBOLIZE_DEMANGLE_FULL, 0);
+                break;
+            case 'p':
+                if (dirs_count == MAX_DIRS) {
+                    fprintf(stderr, "too many -p options\n");
+                    return 1;
+                }
+                dirs[dirs_count++] = optarg;
+                break;
+            case 'd':
+                dwarfline_set_debug_dir(optarg);
+                break;
+            default:
+                fprintf(stderr,
+                  "Usage: %s [-C] [-p dir]... [-d debug_dir] [log]\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    FILE *in = stdin;
+    if (optind < argc && !(in = fopen(argv[optind], "r"))) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    struct map *map = NULL;     // map being read
+    struct map *trace = NULL;   // map of trace being read
+    char line[4096];
+    while (fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\n")] = '\0';
+
+        const char *p;
+        int number;
+        unsigned long pc;
+
+        if ((p = strstr(line, "Module map "))
+            && sscanf(p, "Module map %d:", &number) == 1) {
+            map = get_map(number, 1);
+            trace = NULL;
+        } else if ((p = strstr(line, "Raw stack trace: "))
+            && (p = strstr(p, "(module map "))
+            && sscanf(p, "(module map %d)", &number) == 1) {
+            map = NULL;
+            trace = get_map(number, 0);
+        } else if (map && (p = strstr(line, " bias "))) {
+            while (p > line && p[-1] != '\t' && p[-1] != ' ') {
+                --p;
+            }
+            if (map->count < MAX_MODULES
+                && !parse_module(p, &map->modules[map->count].entry)) {
+                map->modules[map->count++].file = NULL;
+            }
+        } else if (trace && (p = strstr(line, "\t#"))
+            && sscanf(p, "\t#%*d %lx", &pc) == 1) {
+            print_frame(trace, line, pc, strstr(p, " (exact pc)") != NULL);
+            continue;
+        } else {
+            map = NULL;
+            trace = NULL;
+        }
+
+        puts(line);
+    }
+
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    return 0;
+}
+
+/*
+    Find map by its number. A process logs maps numbered from 1, so if
+    'reset' is set (a new map is being logged), previous map with that number
+    belongs to some previous process and is replaced.
+*/
+static
+struct map *get_map(int number, int reset) {
+    for (int i = 0; i < maps_count; ++i) {
+        if (maps[i]->number == number) {
+            if (reset) {
+                maps[i]->count = 0;
+            }
+            return maps[i];
+        }
+    }
+
+    if (!reset || maps_count == MAX_MAPS) {
+        return NULL;
+    }
+
+    struct map *map = calloc(1, sizeof(*map));
+    if (!map) {
+        return NULL;
+    }
+
+    map->number = number;
+    maps[maps_count++] = map;
+
+    return map;
+}
+
+/*
+    Parse "0x1000-0x2000 bias 0x1000 id 0a1b... /path".
+*/
+static
+int parse_module(const char *s, struct modmap_entry *entry) {
+    unsigned long start, end, bias;
+    char id[2 * MODMAP_BUILD_ID_MAX + 2];
+    int n = 0;
+    if (sscanf(s, "%lx-%lx bias %lx id %41s %n", &start, &end, &bias, id, &n)
+        < 4 || !n) {
+        return -1;
+    }
+
+    entry->start = start;
+    entry->end = end;
+    entry->bias = bias;
+    entry->build_id_len = 0;
+    if (strcmp(id, "-")) {
+        size_t len = strlen(id) / 2;
+        for (size_t i = 0; i < len && i < MODMAP_BUILD_ID_MAX; ++i) {
+            unsigned byte;
+            if (sscanf(id + 2 * i, "%2x", &byte) != 1) {
+                return -1;
+            }
+            entry->build_id[entry->build_id_len++] = byte;
+        }
+    }
+
+    entry->path = strdup(s + n);
+
+    return entry->path ? 0 : -1;
+}
+
+/*
+    Print frame at 'pc', which is a return address unless it's 'exact'
+    (e.g. the faulting instruction of a crash).
+*/
+static
+void print_frame(struct map *map, const char *line, uintptr_t pc,
+  int exact) {
+    struct module *module = NULL;
+    for (int i = 0; i < map->count; ++i) {
+        if (pc >= map->modules[i].entry.start && pc < map->modules[i].entry.end) {
+            module = &map->modules[i];
+            break;
+        }
+    }
+
+    if (!module) {
+        puts(line);
+        return;
+    }
+
+    if (!module->file) {
+        module->file = find_file(&module->entry);
+    }
+    const struct file *file = module->file;
+
+    const char *path = module->entry.path[0] ? module->entry.path : "??";
+    uintptr_t addr = pc - module->entry.bias;
+
+    // For return addresses function and line of the call are reported, since
+    // a call to a noreturn function may be the last instruction of its caller
+    uintptr_t lookup = exact ? addr : addr - 1;
+    uintptr_t sym_addr;
+    const char *name = file->symtab
+                       ? elfsym_lookup(file->symtab, lookup, &sym_addr) : NULL;
+
+    struct dwarfline_frame frames[16];
+    int count = file->lines ? dwarfline_lookup(file->lines, lookup, frames, 16)
+                            : 0;
+
+    if (name) {
+        printf("%s %s(%s+%#lx)", line, path, symbolize_demangle(name),
+          (unsigned long) (addr - sym_addr));
+    } else {
+        printf("%s %s(+%#lx)", line, path, (unsigned long) addr);
+    }
+
+    if (count) {
+        printf(" %s:%u", frames[count - 1].file ? frames[count - 1].file : "??",
+          frames[count - 1].line);
+    }
+    putchar('\n');
+
+    for (int i = 0; i < count - 1; ++i) {
+        printf("\t    inlined %s at %s:%u\n",
+          frames[i].function ? frames[i].function : "??",
+          frames[i].file ? frames[i].file : "??", frames[i].line);
+    }
+}
+
+/*
+    Find and load binary of a module. Returns an empty file (without symbols)
+    if nothing matches.
+*/
+static
+struct file *find_file(const struct modmap_entry *entry) {
+    for (int i = 0; i < files_count; ++i) {
+        if (!strcmp(files[i].path, entry->path)
+            && files[i].build_id_len == entry->build_id_len
+            && !memcmp(files[i].build_id, entry->build_id, entry->build_id_len)) {
+            return &files[i];
+        }
+    }
+
+    static struct file none;
+    if (files_count == MAX_FILES || !entry->path[0]) {
+        return &none;
+    }
+
+    struct file *file = &files[files_count++];
+    file->path = strdup(entry->path);
+    memcpy(file->build_id, entry->build_id, entry->build_id_len);
+    file->build_id_len = entry->build_id_len;
+
+    const char *base = strrchr(entry->path, '/');
+    base = base ? base + 1 : entry->path;
+
+    char path[PATH_MAX];
+    int found = 0;
+    for (int i = 0; i < dirs_count && !found; ++i) {
+        snprintf(path, sizeof(path), "%s%s", dirs[i], entry->path);
+        found = match_file(path, entry);
+        if (!found) {
+            snprintf(path, sizeof(path), "%s/%s", dirs[i], base);
+            found = match_file(path, entry);
+        }
+    }
+
+    if (!found) {
+        snprintf(path, sizeof(path), "%s", entry->path);
+        found = match_file(path, entry);
+    }
+
+    if (found) {
+        file->symtab = elfsym_open(path);
+        file->lines = dwarfline_open(path);
+    } else {
+        fprintf(stderr, "no binary with matching build-id for %s\n",
+          entry->path);
+    }
+
+    return file;
+}
+
+/*
+    Check that file at 'path' exists and has build-id of the module. If
+    module had no build-id, any file will do.
+*/
+static
+int match_file(const char *path, const struct modmap_entry *entry) {
+    uint8_t build_id[MODMAP_BUILD_ID_MAX];
+    int len = modmap_file_build_id(path, build_id);
+    if (len < 0) {
+        return 0;
+    }
+
+    return !entry->build_id_len
+           || ((size_t) len == entry->build_id_len
+               && !memcmp(build_id, entry->build_id, len));
+}
@@ -0,0 +1,505 @@
+#define _GNU_SOURCE
+
+#include "tracebuf.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__has_include)
+# if __has_include(<sys/rseq.h>)
+#  include <sys/rseq.h>
+#  ifdef RSEQ_SIG
+#   define HAVE_RSEQ
+#  endif
+# endif
+#endif
+
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+#define CACHE_LINE 64
+
+// 'tail' is written by the consumer, 'head' by producers (threads of the CPU
+// or the owning thread), so they are on separate cache lines
+struct ring {
+    uint64_t tail __attribute__((aligned(CACHE_LINE)));
+    uint64_t head __attribute__((aligned(CACHE_LINE)));
+    uint64_t dropped;
+    struct ring *next;      // of per-thread rings
+    int dead;               // owning thread exited
+    int retire;             // seen dead and drained, to be freed by drain
+    struct tracebuf_event events[] __attribute__((aligned(CACHE_LINE)));
+};
+
+struct consumer {
+    unsigned interval_ms;
+    tracebuf_consumer_t fn;
+    void *arg;
+};
+
+static int enabled;
+static size_t ring_size;    // events, a power of two
+
+// Per-CPU rings, allocated once
+static struct ring **cpu_rings;
+static int cpus;
+
+// Per-thread rings, linked under 'rings_mtx'
+static struct ring *thread_rings;
+static uint64_t retired_dropped;
+static pthread_mutex_t rings_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static int key_error;
+
+static pthread_mutex_t drain_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+// Helper thread of tracebuf_consume(), one at a time. 'consumer_cond' wakes it
+// up early when it's stopped.
+static struct consumer consumer_state;
+static pthread_t consumer_handle;
+static int consuming;
+static int consumer_stopping;
+static pthread_mutex_t consumer_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t consumer_cond;
+
+static TLS struct ring *own_ring;
+static TLS pid_t own_tid;
+
+static struct ring *alloc_ring();
+#ifdef HAVE_RSEQ
+static int commit(struct rseq *rseq, uint32_t cpu, uint64_t *ring_head,
+  uint64_t head, struct tracebuf_event *slot,
+  const struct tracebuf_event *event);
+#endif
+static int record_cpu(const struct tracebuf_event *event);
+static void record_thread(const struct tracebuf_event *event);
+static struct ring *create_thread_ring();
+static void create_key();
+static void release_ring(void *arg);
+static size_t drain_ring(struct ring *ring, tracebuf_consumer_t consumer,
+  void *arg);
+static void *consumer_thread(void *arg);
+
+// public
+
+int tracebuf_start(size_t events) {
+    pthread_mutex_lock(&rings_mtx);
+
+    if (!ring_size) {
+        size_t size = 1;
+        while (size < events) {
+            size *= 2;
+        }
+        ring_size = size;
+
+#ifdef HAVE_RSEQ
+        if (__rseq_size) {
+            int count = get_nprocs_conf();
+            cpu_rings = calloc(count, sizeof(struct ring *));
+            for (int i = 0; cpu_rings && i < count; ++i) {
+                cpu_rings[i] = alloc_ring();
+                if (!cpu_rings[i]) {
+                    while (i--) {
+                        free(cpu_rings[i]);
+                    }
+                    free(cpu_rings);
+                    cpu_rings = NULL;
+                }
+            }
+
+            if (!cpu_rings) {
+                LOGW("%s(): out of memory for per-CPU buffers, using "
+                  "per-thread ones", __func__);
+            } else {
+                cpus = count;
+            }
+        }
+#endif
+    }
+
+    pthread_mutex_unlock(&rings_mtx);
+
+    __atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void tracebuf_stop() {
+    __atomic_store_n(&enabled, 0, __ATOMIC_RELAXED);
+}
+
+void tracebuf_record(uint32_t type, uint64_t arg0, uint64_t arg1) {
+    if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    if (!own_tid) {
+        own_tid = syscall(SYS_gettid);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    struct tracebuf_event event;
+    event.timestamp = now.tv_sec * 1000000000ull + now.tv_nsec;
+    event.type = type;
+    event.tid = own_tid;
+    event.args[0] = arg0;
+    event.args[1] = arg1;
+
+    if (record_cpu(&event)) {
+        record_thread(&event);
+    }
+}
+
+size_t tracebuf_drain(tracebuf_consumer_t consumer, void *arg) {
+    size_t count = 0;
+
+    pthread_mutex_lock(&drain_mtx);
+
+    for (int i = 0; i < cpus; ++i) {
+        count += drain_ring(cpu_rings[i], consumer, arg);
+    }
+
+    // Rings are linked at the head and unlinked only by drain, so rings that
+    // were there when draining started can be walked without 'rings_mtx'.
+    // Consumers run with no lock held: they may log, which records events
+    // and may create rings.
+    pthread_mutex_lock(&rings_mtx);
+    struct ring *first = thread_rings;
+    pthread_mutex_unlock(&rings_mtx);
+
+    for (struct ring *ring = first; ring; ring = ring->next) {
+        // Ring of an exited thread gets no more events once it's seen dead
+        ring->retire = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+        count += drain_ring(ring, consumer, arg);
+    }
+
+    pthread_mutex_lock(&rings_mtx);
+
+    struct ring **link = &thread_rings;
+    while (*link) {
+        struct ring *ring = *link;
+
+        if (ring->retire) {
+            *link = ring->next;
+            retired_dropped += ring->dropped;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+
+    pthread_mutex_unlock(&rings_mtx);
+    pthread_mutex_unlock(&drain_mtx);
+
+    return count;
+}
+
+int tracebuf_consume(unsigned interval_ms, tracebuf_consumer_t consumer,
+  void *arg) {
+    pthread_mutex_lock(&consumer_mtx);
+
+    if (consuming) {
+        pthread_mutex_unlock(&consumer_mtx);
+        LOGE("%s(): already started", __func__);
+        return -1;
+    }
+
+    consumer_state.interval_ms = interval_ms;
+    consumer_state.fn = consumer;
+    consumer_state.arg = arg;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&consumer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    int err = pthread_create(&consumer_handle, NULL, consumer_thread, NULL);
+    if (err) {
+        pthread_cond_destroy(&consumer_cond);
+        pthread_mutex_unlock(&consumer_mtx);
+        LOGE("%s(): pthread_create() failed: %s", __func__, strerror(err));
+        return -1;
+    }
+    consuming = 1;
+
+    pthread_mutex_unlock(&consumer_mtx);
+    return 0;
+}
+
+void tracebuf_consume_stop() {
+    pthread_mutex_lock(&consumer_mtx);
+    if (!consuming || consumer_stopping) {
+        pthread_mutex_unlock(&consumer_mtx);
+        return;
+    }
+    consumer_stopping = 1;
+    pthread_cond_signal(&consumer_cond);
+    pthread_mutex_unlock(&consumer_mtx);
+
+    pthread_join(consumer_handle, NULL);
+
+    pthread_mutex_lock(&consumer_mtx);
+    pthread_cond_destroy(&consumer_cond);
+    consumer_stopping = 0;
+    consuming = 0;
+    pthread_mutex_unlock(&consumer_mtx);
+}
+
+uint64_t tracebuf_dropped() {
+    uint64_t dropped = 0;
+
+    for (int i = 0; i < cpus; ++i) {
+        dropped += __atomic_load_n(&cpu_rings[i]->dropped, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&rings_mtx);
+    dropped += retired_dropped;
+    for (const struct ring *ring = thread_rings; ring; ring = ring->next) {
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&rings_mtx);
+
+    return dropped;
+}
+
+// private
+
+static
+struct ring *alloc_ring() {
+    size_t size = sizeof(struct ring) + ring_size * sizeof(struct tracebuf_event);
+    struct ring *ring = aligned_alloc(CACHE_LINE, size);
+    if (ring) {
+        memset(ring, 0, sizeof(struct ring));
+    }
+
+    return ring;
+}
+
+#ifdef HAVE_RSEQ
+
+/*
+    Copy 'event' to 'slot' and store 'head' + 1 to ring_head as a restartable
+    sequence, which is aborted if the thread isn't on 'cpu' anymore, ring_head
+    isn't 'head' anymore (another thread of the CPU has committed), or the
+    thread was preempted or signaled before the final store. The abort
+    handler is preceded by RSEQ_SIG, as the kernel requires.
+
+    Returns 0 if committed and -1 if aborted.
+*/
+static
+int commit(struct rseq *rseq, uint32_t cpu, uint64_t *ring_head,
+  uint64_t head, struct tracebuf_event *slot,
+  const struct tracebuf_event *event) {
+    __asm__ __volatile__ goto (
+        ".pushsection __rseq_cs, \"aw\"\n"
+        ".balign 32\n"
+        "3:\n"
+        ".long 0, 0\n"                      // version, flags
+        ".quad 1f, 2f - 1f, 4f\n"           // start, length, abort handler
+        ".popsection\n"
+        "leaq 3b(%%rip), %%rax\n"
+        "movq %%rax, %[rseq_cs]\n"
+        "1:\n"
+        "cmpl %[cpu], %[cpu_id]\n"
+        "jnz %l[aborted]\n"
+        "cmpq %[head], %[ring_head]\n"
+        "jnz %l[aborted]\n"
+        "movq 0(%[event]), %%rax\n"
+        "movq %%rax, 0(%[slot])\n"
+        "movq 8(%[event]), %%rax\n"
+        "movq %%rax, 8(%[slot])\n"
+        "movq 16(%[event]), %%rax\n"
+        "movq %%rax, 16(%[slot])\n"
+        "movq 24(%[event]), %%rax\n"
+        "movq %%rax, 24(%[slot])\n"
+        "movq %[next], %[ring_head]\n"      // commit
+        "2:\n"
+        ".pushsection __rseq_failure, \"ax\"\n"
+        ".byte 0x0f, 0xb9, 0x3d\n"
+        ".long %c[sig]\n"
+        "4:\n"
+        "jmp %l[aborted]\n"
+        ".popsection\n"
+        :
+        : [rseq_cs] "m" (rseq->rseq_cs), [cpu_id] "m" (rseq->cpu_id),
+          [cpu] "r" (cpu), [ring_head] "m" (*ring_head), [head] "r" (head),
+          [next] "r" (head + 1), [event] "r" (event), [slot] "r" (slot),
+          [sig] "i" (RSEQ_SIG)
+        : "rax", "cc", "memory"
+        : aborted);
+
+    return 0;
+
+aborted:
+    return -1;
+}
+
+/*
+    Store event to the ring of the current CPU. Returns -1 if there are no
+    per-CPU rings or the thread has no rseq registered.
+*/
+static
+int record_cpu(const struct tracebuf_event *event) {
+    if (!cpus) {
+        return -1;
+    }
+
+    struct rseq *rseq = (struct rseq *) ((char *) __builtin_thread_pointer()
+                                         + __rseq_offset);
+    if ((int32_t) __atomic_load_n(&rseq->cpu_id, __ATOMIC_RELAXED) < 0) {
+        return -1;
+    }
+
+    for (;;) {
+        uint32_t cpu = __atomic_load_n(&rseq->cpu_id_start, __ATOMIC_RELAXED);
+        if (cpu >= (uint32_t) cpus) {
+            return -1;
+        }
+
+        struct ring *ring = cpu_rings[cpu];
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - tail >= ring_size) {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+
+        if (!commit(rseq, cpu, &ring->head, head,
+              &ring->events[head & (ring_size - 1)], event)) {
+            return 0;
+        }
+    }
+}
+
+#else
+
+static
+int record_cpu(const struct tracebuf_event *event) {
+    (void) event;
+    return -1;
+}
+
+#endif // HAVE_RSEQ
+
+/*
+    Store event to the calling thread's own ring, which only this thread
+    writes to.
+*/
+static
+void record_thread(const struct tracebuf_event *event) {
+    struct ring *ring = own_ring;
+    if (__builtin_expect(!ring, 0)) {
+        ring = create_thread_ring();
+        if (!ring) {
+            return;
+        }
+    }
+
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ring_size) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    ring->events[head & (ring_size - 1)] = *event;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static
+struct ring *create_thread_ring() {
+    pthread_once(&key_once, create_key);
+    if (key_error) {
+        return NULL;
+    }
+
+    struct ring *ring = alloc_ring();
+    if (!ring) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&rings_mtx);
+    ring->next = thread_rings;
+    thread_rings = ring;
+    pthread_mutex_unlock(&rings_mtx);
+
+    pthread_setspecific(ring_key, ring);
+    own_ring = ring;
+    return ring;
+}
+
+static
+void create_key() {
+    key_error = pthread_key_create(&ring_key, release_ring);
+}
+
+/*
+    Key destructor: the ring is freed by tracebuf_drain() once its events are
+    consumed.
+*/
+static
+void release_ring(void *arg) {
+    struct ring *ring = arg;
+
+    own_ring = NULL;
+    __atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static
+size_t drain_ring(struct ring *ring, tracebuf_consumer_t consumer,
+  void *arg) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+
+    for (uint64_t i = tail; i != head; ++i) {
+        consumer(arg, &ring->events[i & (ring_size - 1)]);
+    }
+
+    __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+    return head - tail;
+}
+
+/*
+    Drain every 'interval_ms' until stopped, and once more when stopped, so
+    that nothing recorded before tracebuf_consume_stop() is left behind.
+*/
+static
+void *consumer_thread(void *arg) {
+    (void) arg;
+    const struct consumer *state = &consumer_state;
+
+    pthread_mutex_lock(&consumer_mtx);
+
+    int stopping = 0;
+    while (!stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += state->interval_ms / 1000;
+        deadline.tv_nsec += state->interval_ms % 1000 * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_nsec -= 1000000000L;
+            ++deadline.tv_sec;
+        }
+
+        while (!consumer_stopping
+               && pthread_cond_timedwait(&consumer_cond, &consumer_mtx,
+                    &deadline) != ETIMEDOUT) {
+        }
+        stopping = consumer_stopping;
+
+        pthread_mutex_unlock(&consumer_mtx);
+        tracebuf_drain(state->fn, state->arg);
+        pthread_mutex_lock(&consumer_mtx);
+    }
+
+    pthread_mutex_unlock(&consumer_mtx);
+    return NULL;
+}
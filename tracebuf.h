@@ -0,0 +1,102 @@
+#ifndef TRACEBUF_H_INCLUDED
+#define TRACEBUF_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Low-overhead event tracer that may stay on permanently: log records,
+    measure.h regions and timer expirations (and events of the caller's own
+    types) are stored to ring buffers in memory, to be drained by a consumer
+    thread instead of being formatted and written on the spot.
+
+    Buffers are private memory of the process, so external tools can't read
+    them directly: to get events out, the consumer writes them somewhere (a
+    file, a pipe, a socket) for a tool to pick up.
+
+    Buffers are per CPU. An event is committed to the buffer of the CPU the
+    thread runs on within a restartable sequence (rseq): if the thread is
+    preempted, migrated or gets a signal in the middle, the kernel restarts
+    the sequence, so threads of the same CPU never interleave and no atomic
+    instructions are needed. rseq is registered by glibc 2.35 and later;
+    where it isn't available (other architectures than x86-64, older glibc,
+    kernels before 4.18), every thread gets a buffer of its own instead.
+
+    When a buffer is full, new events are dropped and counted (see
+    tracebuf_dropped()), so the consumer has to keep up. Events of different
+    buffers are delivered in no particular order; sort them by timestamp if
+    order matters.
+*/
+
+enum {
+    TRACEBUF_LOG,           // log_log() call, filtered out or not: level,
+                            // line in args[0] (high, low 32 bits), fmt
+    TRACEBUF_REGION_BEGIN,  // measure_start(): depth, span id (tracectx.h)
+    TRACEBUF_REGION_END,    // measure_get(): depth, duration in ns
+    TRACEBUF_TIMER,         // timer_expired() first found deadline passed:
+                            // timer, lateness in ns
+    TRACEBUF_USER = 256,    // first type for the caller's events
+};
+
+struct tracebuf_event {
+    uint64_t timestamp;     // CLOCK_MONOTONIC, ns
+    uint32_t type;
+    int32_t tid;
+    uint64_t args[2];
+};
+
+/*
+    Called by tracebuf_drain() for every event.
+*/
+typedef void (*tracebuf_consumer_t)(void *arg,
+  const struct tracebuf_event *event);
+
+/*
+    Allocate buffers of 'events' events each (rounded up to a power of two),
+    and start tracing.
+
+    Returns 0 on success and -1 on error.
+*/
+int tracebuf_start(size_t events);
+
+/*
+    Stop tracing. Events that are in buffers may still be drained.
+*/
+void tracebuf_stop();
+
+/*
+    Record an event of 'type' with arguments, if tracing is on.
+*/
+void tracebuf_record(uint32_t type, uint64_t arg0, uint64_t arg1);
+
+/*
+    Pass all events that are in buffers to 'consumer', buffer by buffer, and
+    free their space. Only one thread drains at a time. 'consumer' is called
+    with no lock of this module held, so it may log or record events, but it
+    must not drain.
+
+    Returns number of events consumed.
+*/
+size_t tracebuf_drain(tracebuf_consumer_t consumer, void *arg);
+
+/*
+    Start a helper thread that drains buffers to 'consumer' every
+    'interval_ms'. Only one such thread may run at a time.
+
+    Returns 0 on success and -1 on error.
+*/
+int tracebuf_consume(unsigned interval_ms, tracebuf_consumer_t consumer,
+  void *arg);
+
+/*
+    Stop the thread started by tracebuf_consume(), after it drains buffers one
+    last time, and wait for it to exit. Must not be called by the consumer.
+*/
+void tracebuf_consume_stop();
+
+/*
+    Number of events dropped since tracing started because buffers were full.
+*/
+uint64_t tracebuf_dropped();
+
+#endif // TRACEBUF_H_INCLUDED
@@ -0,0 +1,136 @@
+#include "tracectx.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+
+// Ids are mixed from 'base' plus thread number (high 32 bits) and thread's
+// counter (low ones). Mixing is a bijection, so ids don't repeat until a
+// thread generates 2^32 of them. A forked child would repeat parent's ids, so
+// it takes a new 'base'.
+static uint64_t base;
+static pthread_once_t base_once = PTHREAD_ONCE_INIT;
+static uint32_t threads;
+
+static TLS struct tracectx current;
+static TLS uint64_t next_id;
+
+static uint64_t new_id();
+static void init_base();
+static void seed_base();
+static void reseed_child();
+static uint64_t mix(uint64_t x);
+
+// public
+
+void tracectx_start(struct tracectx *prev) {
+    if (prev) {
+        *prev = current;
+    }
+
+    current.trace_id = new_id();
+    current.span_id = new_id();
+}
+
+void tracectx_set(const struct tracectx *ctx, struct tracectx *prev) {
+    if (prev) {
+        *prev = current;
+    }
+
+    if (ctx) {
+        current = *ctx;
+    } else {
+        current.trace_id = 0;
+        current.span_id = 0;
+    }
+}
+
+void tracectx_get(struct tracectx *ctx) {
+    *ctx = current;
+}
+
+void tracectx_span_begin(struct tracectx *parent) {
+    *parent = current;
+
+    if (current.trace_id) {
+        current.span_id = new_id();
+    }
+}
+
+void tracectx_span_end(const struct tracectx *parent) {
+    current = *parent;
+}
+
+int tracectx_format(char *buf, size_t len) {
+    if (!current.trace_id) {
+        if (len) {
+            buf[0] = '\0';
+        }
+        return 0;
+    }
+
+    return snprintf(buf, len, "%016llx/%016llx",
+      (unsigned long long) current.trace_id,
+      (unsigned long long) current.span_id);
+}
+
+// private
+
+static
+uint64_t new_id() {
+    if (__builtin_expect(!next_id, 0)) {
+        pthread_once(&base_once, init_base);
+        uint64_t thread = __atomic_add_fetch(&threads, 1, __ATOMIC_RELAXED);
+        next_id = thread << 32;
+    }
+
+    uint64_t id;
+    do {
+        id = mix(base + next_id++);
+    } while (!id);
+
+    return id;
+}
+
+static
+void init_base() {
+    seed_base();
+    pthread_atfork(NULL, NULL, reseed_child);
+}
+
+/*
+    Seed, so that ids of different processes differ.
+*/
+static
+void seed_base() {
+    if (getrandom(&base, sizeof(base), GRND_NONBLOCK) != sizeof(base)) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        base = (uint64_t) now.tv_sec << 32 ^ now.tv_nsec ^ getpid();
+    }
+}
+
+/*
+    Child of fork(): only the forking thread is left, and it starts numbering
+    over from a new seed.
+*/
+static
+void reseed_child() {
+    seed_base();
+    threads = 0;
+    next_id = 0;
+}
+
+/*
+    splitmix64 finalizer.
+*/
+static
+uint64_t mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
@@ -0,0 +1,90 @@
+#ifndef TRACECTX_H_INCLUDED
+#define TRACECTX_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Per-thread trace context: ids of the trace (e.g. a request being handled)
+    and of the span (a part of its handling) the thread is working on. While
+    a thread has a context, it's stamped into what the thread reports, so
+    that offline tools can join records by ids instead of matching text:
+
+    * log.h records get "[trace/span]" after the ident:
+      2007-01-01 00:00:00.000 [INFO ] [server] [3f1c.../9a07...] server.c:10: ...
+      stack traces printed to log (backtrace.h, check.h) get it the same way;
+    * measure_start() opens a child span, measure_get() closes it, and
+      measure_print() logs id of the closed span: "... took 0.1 seconds
+      (span 9a07...)";
+    * tracebuf.h region events carry id of the span that measure_start()
+      opened in args[1];
+    * crash.h report names trace and span of the crashed thread.
+
+    Ids are 64-bit, printed as 16 hex digits, and 0 means none. They are
+    unique within the process and random across processes, forked children
+    included, and generating one is a few arithmetic instructions on thread's
+    own state.
+
+    Context doesn't follow work to other threads by itself. Hand it off
+    explicitly along with the work item:
+    <code>
+        // producer
+        tracectx_get(&item->ctx);
+        queue_push(queue, item);
+
+        // consumer
+        struct tracectx prev;
+        tracectx_set(&item->ctx, &prev);
+        handle(item);
+        tracectx_set(&prev, NULL);
+    </code>
+
+    Context is thread-local storage, so reading it is async-signal-safe.
+*/
+
+struct tracectx {
+    uint64_t trace_id;
+    uint64_t span_id;
+};
+
+/*
+    Start a new trace in the calling thread: both ids are new. Previous
+    context is stored to 'prev', unless it's NULL.
+*/
+void tracectx_start(struct tracectx *prev);
+
+/*
+    Replace context of the calling thread with 'ctx' (e.g. handed off by
+    another thread), or clear it if 'ctx' is NULL. Previous context is stored
+    to 'prev', unless it's NULL.
+*/
+void tracectx_set(const struct tracectx *ctx, struct tracectx *prev);
+
+/*
+    Store context of the calling thread to 'ctx'. Both ids are 0 if there is
+    none.
+*/
+void tracectx_get(struct tracectx *ctx);
+
+/*
+    Open a child span of the current one: span id of the calling thread is
+    replaced with a new one, and current context is stored to 'parent'.
+    Without a trace, nothing is opened and 'parent' is cleared.
+*/
+void tracectx_span_begin(struct tracectx *parent);
+
+/*
+    Close the span opened by tracectx_span_begin(), restoring 'parent'.
+*/
+void tracectx_span_end(const struct tracectx *parent);
+
+/*
+    Format context of the calling thread as "trace/span" to 'buf' of 'len'
+    bytes, or as empty string if there is none.
+
+    Returns number of characters that would have been written if 'buf' was
+    large enough, just as snprintf() does.
+*/
+int tracectx_format(char *buf, size_t len);
+
+#endif // TRACECTX_H_INCLUDED
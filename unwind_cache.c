@@ -0,0 +1,89 @@
+#include "unwind_cache.h"
+
+#include <string.h>
+
+#if UNWIND_CACHE_SIZE & (UNWIND_CACHE_SIZE - 1)
+# error "UNWIND_CACHE_SIZE must be a power of two"
+#endif
+
+struct slot {
+    unsigned seq;   // odd while slot is being written
+    int found;
+    uintptr_t pc;
+    struct cfi_row row;
+};
+
+static struct slot slots[UNWIND_CACHE_SIZE];
+
+static struct slot *slot_for(uintptr_t pc);
+
+// public
+
+int unwind_cache_get(uintptr_t pc, struct cfi_row *row, int *found) {
+    struct slot *slot = slot_for(pc);
+
+    unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+        return -1;
+    }
+
+    uintptr_t cached_pc = slot->pc;
+    int cached_found = slot->found;
+    struct cfi_row cached_row = slot->row;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq
+        || cached_pc != pc || !seq) {
+        return -1;
+    }
+
+    *found = cached_found;
+    if (cached_found) {
+        *row = cached_row;
+    }
+
+    return 0;
+}
+
+void unwind_cache_put(uintptr_t pc, const struct cfi_row *row) {
+    struct slot *slot = slot_for(pc);
+
+    unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1,
+          0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->pc = pc;
+    slot->found = row != NULL;
+    if (row) {
+        slot->row = *row;
+    }
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void unwind_cache_clear() {
+    for (int i = 0; i < UNWIND_CACHE_SIZE; ++i) {
+        struct slot *slot = &slots[i];
+
+        unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        if ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq,
+              seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;   // being rewritten right now anyway
+        }
+
+        slot->pc = 0;
+        __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    }
+}
+
+// private
+
+static
+struct slot *slot_for(uintptr_t pc) {
+    uintptr_t hash = pc * (uintptr_t) 0x9e3779b97f4a7c15ull;
+    return &slots[(hash >> (sizeof(uintptr_t) * 8 - 16)) % UNWIND_CACHE_SIZE];
+}
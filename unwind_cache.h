@@ -0,0 +1,55 @@
+#ifndef UNWIND_CACHE_H_INCLUDED
+#define UNWIND_CACHE_H_INCLUDED
+
+#include "cfi.h"
+
+#include <stdint.h>
+
+/*
+    Cache of unwinding rules keyed by PC (in practice - by return address), so
+    that repeated stack traces from the same call sites cost one table lookup
+    per frame instead of decoding unwind info again. Every unwinder stores its
+    rules as 'struct cfi_row': backtrace_cfi() caches rows it computed from
+    .eh_frame, backtrace_mips32() caches frame size and offset of saved $ra it
+    found by scanning code as CFA = $sp + frame size, $ra at CFA + offset - frame
+    size.
+
+    The cache is a fixed-size, direct-mapped hash table shared by all threads.
+    It takes no locks and never allocates: every slot is guarded by its own
+    sequence counter, readers retry nothing and treat a slot that is being
+    written as a miss, writers skip a slot that is being written by someone
+    else. So it is safe to use from signal handlers.
+
+    Colliding PCs just evict each other. Define UNWIND_CACHE_SIZE (must be
+    a power of two) when building to change number of slots.
+
+    Rows of an unloaded module must not outlive it, since another module may
+    be loaded at its addresses: cfi.c clears the cache when its module scan
+    sees an unload, backtrace_mips32() checks for unloads on every walk.
+*/
+
+#ifndef UNWIND_CACHE_SIZE
+# define UNWIND_CACHE_SIZE 4096
+#endif
+
+/*
+    Look up rules for 'pc'. On hit '*found' is set to 0 if it was cached that
+    'pc' has no unwind info, and 1 (and '*row' is filled) otherwise.
+
+    Returns 0 on hit and -1 on miss.
+*/
+int unwind_cache_get(uintptr_t pc, struct cfi_row *row, int *found);
+
+/*
+    Store rules for 'pc'. Pass NULL 'row' to remember that 'pc' has no unwind
+    info.
+*/
+void unwind_cache_put(uintptr_t pc, const struct cfi_row *row);
+
+/*
+    Drop all cached rules, e.g. after a module was unloaded and its addresses
+    may be reused by another one.
+*/
+void unwind_cache_clear();
+
+#endif // UNWIND_CACHE_H_INCLUDED